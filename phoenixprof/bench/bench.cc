@@ -0,0 +1,316 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "chrome_tracing_generator.h"
+#include "trace_writer.h"
+
+// Drives ClApiCollector::Callback with synthetic callback data (no OpenCL
+// device is required) and prints results as JSON to track tool overhead
+
+#define DEFAULT_EVENT_COUNT 1000000
+#define PAGE_SIZE_DEFAULT 4096
+
+struct SyntheticCall {
+  cl_function_id id;
+  const char* name;
+};
+
+static const SyntheticCall kSyntheticCalls[] = {
+    {CL_FUNCTION_clSetKernelArg, "clSetKernelArg"},
+    {CL_FUNCTION_clEnqueueWriteBuffer, "clEnqueueWriteBuffer"},
+    {CL_FUNCTION_clEnqueueNDRangeKernel, "clEnqueueNDRangeKernel"},
+    {CL_FUNCTION_clGetEventInfo, "clGetEventInfo"},
+    {CL_FUNCTION_clFinish, "clFinish"},
+};
+
+static const size_t kSyntheticCallCount =
+    sizeof(kSyntheticCalls) / sizeof(kSyntheticCalls[0]);
+
+static uint64_t GetResidentMemory() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+  statm >> size >> resident;
+  long page_size = sysconf(_SC_PAGESIZE);
+  return resident * (page_size > 0 ? page_size : PAGE_SIZE_DEFAULT);
+}
+
+// Wall time of every enter and exit callback pair goes to latencies if
+// they are given
+static void GenerateEvents(ClApiCollector* collector, uint64_t event_count,
+                           std::vector<uint64_t>* latencies = nullptr) {
+  ASSERT(collector != nullptr);
+  cl_tracing_callback callback = ClApiCollector::GetCallback();
+
+  cl_command_queue queue = nullptr;
+  cl_mem buffer = nullptr;
+  cl_bool blocking = CL_FALSE;
+  size_t offset = 0, size = 0;
+  const void* ptr = nullptr;
+  cl_uint event_count_in_wait_list = 0;
+  const cl_event* event_wait_list = nullptr;
+  cl_event* event = nullptr;
+  cl_params_clEnqueueWriteBuffer write_params{
+      &queue, &buffer, &blocking, &offset, &size, &ptr,
+      &event_count_in_wait_list, &event_wait_list, &event};
+
+  uint64_t correlation_data = 0;
+  cl_callback_data callback_data{};
+  callback_data.correlationData =
+      reinterpret_cast<decltype(callback_data.correlationData)>(
+          &correlation_data);
+  callback_data.functionParams = &write_params;
+
+  for (uint64_t i = 0; i < event_count; ++i) {
+    const SyntheticCall& call = kSyntheticCalls[i % kSyntheticCallCount];
+    callback_data.functionName = call.name;
+    std::chrono::steady_clock::time_point start;
+    if (latencies != nullptr) {
+      start = std::chrono::steady_clock::now();
+    }
+    callback_data.site = CL_CALLBACK_SITE_ENTER;
+    callback(call.id, &callback_data, collector);
+    callback_data.site = CL_CALLBACK_SITE_EXIT;
+    callback(call.id, &callback_data, collector);
+    if (latencies != nullptr) {
+      std::chrono::duration<uint64_t, std::nano> time =
+          std::chrono::steady_clock::now() - start;
+      latencies->push_back(time.count());
+    }
+  }
+}
+
+static std::string RunCallbackBenchmark(uint64_t event_count,
+                                        unsigned thread_count) {
+  ClApiCollector* collector = ClApiCollector::CreateDetached();
+  uint64_t events_per_thread = event_count / thread_count;
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < thread_count; ++i) {
+    threads.push_back(
+        std::thread(GenerateEvents, collector, events_per_thread, nullptr));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double, std::nano> time =
+      std::chrono::steady_clock::now() - start;
+
+  uint64_t total_events = collector->GetEventCount();
+  ASSERT(total_events == events_per_thread * thread_count);
+  delete collector;
+
+  std::stringstream result;
+  result << "{\"threads\":" << thread_count << ",\"events\":" << total_events
+         << ",\"ns_per_event\":" << time.count() / events_per_thread
+         << ",\"events_per_sec\":" << total_events * 1.0e9 / time.count()
+         << "}";
+  return result.str();
+}
+
+static std::string RunMemoryBenchmark(uint64_t event_count) {
+  uint64_t before = GetResidentMemory();
+  ClApiCollector* collector = ClApiCollector::CreateDetached();
+  GenerateEvents(collector, event_count);
+  uint64_t after = GetResidentMemory();
+  delete collector;
+
+  std::stringstream result;
+  result << "{\"events\":" << event_count << ",\"bytes_per_event\":"
+         << static_cast<double>(after - before) / event_count
+         << ",\"record_size\":" << sizeof(TraceCallRecord) << "}";
+  return result.str();
+}
+
+// Tail of the per-call cost: chunk allocation and page faults hit single
+// calls, so they show up in the top percentiles rather than the mean
+static std::string RunLatencyBenchmark(const std::string& storage,
+                                       uint64_t event_count) {
+  std::string filename = "phoenixprof_bench_latency.bin";
+  ClApiCollector* collector = nullptr;
+  if (storage == "file") {
+    TraceWriter* writer = TraceWriter::Create(filename);
+    ASSERT(writer != nullptr);
+    collector = ClApiCollector::Create(writer);
+  } else {
+    collector = ClApiCollector::CreateDetached(
+        false, storage == "memory_huge_pages");
+  }
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(event_count);
+  GenerateEvents(collector, event_count, &latencies);
+  delete collector;
+  if (storage == "file") {
+    remove(filename.c_str());
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto quantile = [&latencies](double value) {
+    size_t index = static_cast<size_t>(value * (latencies.size() - 1));
+    return latencies[index];
+  };
+  std::stringstream result;
+  result << "{\"storage\":\"" << storage << "\",\"events\":" << event_count
+         << ",\"p50_ns\":" << quantile(0.5) << ",\"p99_ns\":"
+         << quantile(0.99) << ",\"p999_ns\":" << quantile(0.999)
+         << ",\"p9999_ns\":" << quantile(0.9999)
+         << ",\"max_ns\":" << latencies.back() << "}";
+  return result.str();
+}
+
+typedef std::function<void(const std::vector<ClFunctionCall>&,
+                           const std::string&)>
+    Exporter;
+
+static std::string RunExporterBenchmark(const std::string& format,
+                                        const Exporter& exporter,
+                                        const std::vector<ClFunctionCall>& calls,
+                                        const std::string& filename) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  exporter(calls, filename);
+  std::chrono::duration<double> time =
+      std::chrono::steady_clock::now() - start;
+
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  uint64_t bytes = file.is_open() ? static_cast<uint64_t>(file.tellg()) : 0;
+  file.close();
+  remove(filename.c_str());
+
+  std::stringstream result;
+  result << "{\"format\":\"" << format << "\",\"events\":" << calls.size()
+         << ",\"bytes\":" << bytes << ",\"seconds\":" << time.count()
+         << ",\"mb_per_sec\":" << bytes / time.count() / 1.0e6
+         << ",\"events_per_sec\":" << calls.size() / time.count() << "}";
+  return result.str();
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t event_count = DEFAULT_EVENT_COUNT;
+  if (argc > 1) {
+    event_count = std::stoull(argv[1]);
+  }
+
+  unsigned max_thread_count = std::thread::hardware_concurrency();
+  if (argc > 2) {
+    max_thread_count = std::stoul(argv[2]);
+  }
+  if (max_thread_count == 0) {
+    max_thread_count = 1;
+  }
+
+  // Memory is measured first, while the heap is not yet populated
+  std::string memory = RunMemoryBenchmark(event_count);
+
+  std::vector<std::string> callback;
+  unsigned thread_count = 1;
+  while (true) {
+    callback.push_back(RunCallbackBenchmark(event_count, thread_count));
+    if (thread_count == max_thread_count) {
+      break;
+    }
+    thread_count = std::min(thread_count * 2, max_thread_count);
+  }
+
+  std::vector<std::string> latency;
+  latency.push_back(RunLatencyBenchmark("memory", event_count));
+  latency.push_back(RunLatencyBenchmark("memory_huge_pages", event_count));
+  latency.push_back(RunLatencyBenchmark("file", event_count));
+
+  ClApiCollector* collector = ClApiCollector::CreateDetached();
+  GenerateEvents(collector, event_count);
+  std::vector<ClFunctionCall> calls = collector->GetFunctionCalls();
+  delete collector;
+
+  std::vector<std::string> exporters;
+  exporters.push_back(RunExporterBenchmark(
+      "chrome_json",
+      [](const std::vector<ClFunctionCall>& calls,
+         const std::string& filename) {
+        std::streambuf* output = std::cout.rdbuf(nullptr);  // Mute messages
+        ChromeTracingGenerator::ExportToFile(calls, filename, {}, {}, {}, {},
+                                             {}, {}, 1);
+        std::cout.rdbuf(output);
+      },
+      calls, "phoenixprof_bench_trace.json"));
+  exporters.push_back(RunExporterBenchmark(
+      "chrome_json_parallel",
+      [](const std::vector<ClFunctionCall>& calls,
+         const std::string& filename) {
+        std::streambuf* output = std::cout.rdbuf(nullptr);
+        ChromeTracingGenerator::ExportToFile(calls, filename);
+        std::cout.rdbuf(output);
+      },
+      calls, "phoenixprof_bench_trace.json"));
+  exporters.push_back(RunExporterBenchmark(
+      "binary",
+      [](const std::vector<ClFunctionCall>& calls,
+         const std::string& filename) {
+        TraceWriter* writer = TraceWriter::Create(filename);
+        ASSERT(writer != nullptr);
+        // Function names go first, as the tool writes them
+        std::map<uint32_t, std::string> strings;
+        for (const auto& call : calls) {
+          strings.emplace(call.function_id, call.function_name);
+        }
+        writer->WriteStrings(strings);
+
+        TraceCallChunk* chunk = nullptr;
+        for (const auto& call : calls) {
+          if (chunk == nullptr) {
+            chunk = writer->AcquireCallChunk();
+            ASSERT(chunk != nullptr);
+          }
+          uint16_t flags = call.blocking ? TRACE_CALL_FLAG_BLOCKING : 0;
+          uint16_t collapsed_count = 0, collapsed_mean = 0;
+          if (call.count > 1) {
+            flags |= TRACE_CALL_FLAG_COLLAPSED;
+            collapsed_count = static_cast<uint16_t>(call.count);
+            collapsed_mean = static_cast<uint16_t>(call.busy_time / call.count);
+          }
+          chunk->records[chunk->count++] = TraceCallRecord{
+              call.start_time, call.end_time, call.thread_id,
+              static_cast<uint16_t>(call.function_id), flags, call.stack_id,
+              collapsed_count, collapsed_mean};
+          if (chunk->count == TRACE_CHUNK_CAPACITY) {
+            writer->CommitCallChunk(chunk);
+            chunk = nullptr;
+          }
+        }
+        if (chunk != nullptr) {
+          writer->CommitCallChunk(chunk);
+        }
+        delete writer;
+      },
+      calls, "phoenixprof_bench_trace.bin"));
+
+  std::cout << "{\"version\":\"" << TOSTRING(PHPROF_VERSION) << "\","
+            << "\"callback\":[";
+  for (size_t i = 0; i < callback.size(); ++i) {
+    std::cout << (i > 0 ? "," : "") << callback[i];
+  }
+  std::cout << "],\"latency\":[";
+  for (size_t i = 0; i < latency.size(); ++i) {
+    std::cout << (i > 0 ? "," : "") << latency[i];
+  }
+  std::cout << "],\"memory\":" << memory << ",\"exporters\":[";
+  for (size_t i = 0; i < exporters.size(); ++i) {
+    std::cout << (i > 0 ? "," : "") << exporters[i];
+  }
+  std::cout << "]}" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,648 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "cl_call_site_profile.h"
+#include "cl_clock_correlation.h"
+#include "cl_counter_tracks.h"
+#include "cl_memory_profile.h"
+#include "cl_sample_profile.h"
+#include "cl_sync_analyzer.h"
+#include "chrome_tracing_generator.h"
+#include "elf_symbolizer.h"
+#include "trace_columns.h"
+#include "trace_reader.h"
+#include "trace_writer.h"
+
+// Converts binary traces written by the tool into Chrome Tracing JSON,
+// runs out of process so the profiled application exits fast. Traces of
+// crashed processes are converted as far as they were recorded. Sample and
+// call site addresses are symbolized here, at no cost for the target
+
+static void ShowHelp() {
+  std::cout << "Usage: ./phoenixprof_convert [options] <trace.bin> "
+            << "[output]" << std::endl;
+  std::cout << "       ./phoenixprof_convert [options] <trace.cols> "
+            << "[output]" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "--sync-analysis          "
+            << "Report synchronization anti-patterns over all call traces "
+            << "of the run" << std::endl;
+  std::cout << "--finish-batch <count>   "
+            << "Report clFinish after up to the given number of enqueues ("
+            << SYNC_DEFAULT_FINISH_BATCH << " by default)" << std::endl;
+  std::cout << "--dump                   "
+            << "Print every recorded call to the console" << std::endl;
+  std::cout << "--samples <samples.bin>  "
+            << "Attribute host CPU samples to the API calls of the trace"
+            << std::endl;
+  std::cout << "--stacks <stacks.bin>    "
+            << "Report API time by application call site" << std::endl;
+  std::cout << "--memory <memory.bin>    "
+            << "Add device memory usage track and report its peak"
+            << std::endl;
+  std::cout << "--threads <count>        "
+            << "Format JSON on the given number of threads (all cores by "
+            << "default)" << std::endl;
+  std::cout << "--recover                "
+            << "Write a valid binary trace from an incomplete one instead "
+            << "of JSON" << std::endl;
+  std::cout << "--columnar               "
+            << "Write a column store with a time and function index "
+            << "instead of JSON" << std::endl;
+  std::cout << "--range <from>:<to>      "
+            << "Convert only the calls in the time range, ms since the "
+            << "first call" << std::endl;
+  std::cout << "--functions <names>      "
+            << "Convert only the calls of the comma separated functions"
+            << std::endl;
+}
+
+// Warns about traces left behind by a crashed process
+static void CheckComplete(const TraceReader& reader,
+                          const std::string& input) {
+  if (reader.IsComplete()) {
+    return;
+  }
+  std::cerr << "[WARNING] Trace " << input << " is incomplete (";
+  if (reader.GetState() == TRACE_STATE_CRASHED) {
+    std::cerr << "process terminated by signal " << reader.GetSignal();
+  } else if (reader.GetState() == TRACE_STATE_OPEN) {
+    std::cerr << "process did not exit normally";
+  } else {
+    std::cerr << "damaged chunks";
+  }
+  std::cerr << "), " << reader.GetRecoveredCount()
+            << " calls recovered from " << reader.GetUncommittedCount()
+            << " uncommitted chunks" << std::endl;
+}
+
+// Parses "<from>:<to>" in milliseconds, either end may be left out
+static bool ParseRange(const std::string& range, double& from, double& to) {
+  size_t colon = range.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  char* end = nullptr;
+  std::string first = range.substr(0, colon);
+  std::string second = range.substr(colon + 1);
+  from = first.empty() ? 0 : strtod(first.c_str(), &end);
+  if (!first.empty() && *end != '\0') {
+    return false;
+  }
+  to = second.empty() ? -1 : strtod(second.c_str(), &end);
+  if (!second.empty() && *end != '\0') {
+    return false;
+  }
+  return from >= 0 && (second.empty() || to >= from);
+}
+
+// Time range is given relative to the first call of the trace. Returns
+// false if none of the functions is in the trace
+static bool GetFilter(bool has_range, double from, double to,
+                      uint64_t start_time, const std::string& function_names,
+                      const std::map<uint32_t, std::string>& strings,
+                      TraceColumnFilter& filter) {
+  if (has_range) {
+    filter.start_time = start_time + static_cast<uint64_t>(from * 1e6);
+    if (to >= 0) {
+      filter.end_time = start_time + static_cast<uint64_t>(to * 1e6);
+    }
+  }
+
+  std::stringstream stream(function_names);
+  std::string name;
+  while (std::getline(stream, name, ',')) {
+    bool found = false;
+    for (const auto& item : strings) {
+      if (item.second == name && item.first <= TRACE_ANNOTATION_ID_MAX) {
+        filter.functions.push_back(static_cast<uint16_t>(item.first));
+        found = true;
+      }
+    }
+    if (!found) {
+      std::cerr << "[WARNING] Function " << name << " is not in the trace"
+                << std::endl;
+    }
+  }
+  return function_names.empty() || !filter.functions.empty();
+}
+
+// Positive decimal number, the whole string
+static bool ParseCount(const char* value, unsigned long& count) {
+  char* end = nullptr;
+  errno = 0;
+  count = strtoul(value, &end, 10);
+  return value[0] >= '0' && value[0] <= '9' && *end == '\0' &&
+         errno == 0 && count > 0;
+}
+
+static bool IsSelected(const TraceCallRecord& record,
+                       const TraceColumnFilter& filter) {
+  if (record.start_time > filter.end_time ||
+      record.end_time < filter.start_time) {
+    return false;
+  }
+  return filter.functions.empty() ||
+         std::find(filter.functions.begin(), filter.functions.end(),
+                   record.function_id) != filter.functions.end();
+}
+
+// Calls are streamed chunk by chunk into the store, names and metadata are
+// written once the whole trace is read
+static bool WriteColumnStore(const std::string& filename, TraceReader& reader,
+                             uint64_t& record_count) {
+  TraceColumnWriter* writer = TraceColumnWriter::Create(filename);
+  if (writer == nullptr) {
+    return false;
+  }
+
+  std::map<uint32_t, std::string> strings;
+  std::map<std::string, std::string> metadata;
+  std::vector<TraceCallRecord> records;
+  TraceChunkHeader header{};
+  std::vector<char> payload;
+  bool written = true;
+  while (written && reader.ReadChunk(header, payload)) {
+    if (header.type == TRACE_CHUNK_CALLS) {
+      records.clear();
+      reader.ParseCalls(payload, header.commit == TRACE_CHUNK_COMMITTED,
+                        records);
+      for (const TraceCallRecord& record : records) {
+        if (!writer->Append(record)) {
+          written = false;
+          break;
+        }
+      }
+    } else if (header.type == TRACE_CHUNK_STRINGS) {
+      TraceReader::ParseStrings(payload, strings);
+    } else if (header.type == TRACE_CHUNK_METADATA) {
+      TraceReader::ParseMetadata(payload, metadata);
+    }
+  }
+
+  if (!reader.IsComplete()) {
+    metadata["recovered"] = "true";
+    if (reader.GetState() == TRACE_STATE_CRASHED) {
+      metadata["terminating_signal"] = std::to_string(reader.GetSignal());
+    }
+  }
+  writer->SetStrings(strings);
+  writer->SetMetadata(metadata);
+  written = written && writer->Close();
+  record_count = writer->GetRecordCount();
+  delete writer;
+  return written;
+}
+
+// Queue calls go to the trace of their device and the rest to the host
+// trace, so the other call traces of the run (same directory and segment
+// index, named by the tool) are found next to the given one
+static std::vector<std::string> GetRunTraces(const std::string& input) {
+  size_t name_pos = input.rfind('/') + 1;  // 0 if there is no directory
+  size_t pos = input.find("_trace", name_pos);
+  if (pos == std::string::npos ||
+      input.compare(input.size() - 4, 4, ".bin") != 0) {
+    return std::vector<std::string>();
+  }
+  std::string directory = input.substr(0, name_pos);
+  std::string suffix = input.substr(pos);  // _trace[.<index>].bin
+
+  std::vector<std::string> traces;
+  std::vector<std::string> names{"host"};
+  for (const char* prefix : {"cpu", "gpu", "acc"}) {
+    // Devices of a type are numbered from 0 without gaps
+    for (int index = 0;; ++index) {
+      std::string name = prefix + std::to_string(index);
+      if (access((directory + name + suffix).c_str(), F_OK) != 0) {
+        break;
+      }
+      names.push_back(name);
+    }
+  }
+  for (const std::string& name : names) {
+    std::string trace = directory + name + suffix;
+    if (trace != input && access(trace.c_str(), F_OK) == 0) {
+      traces.push_back(trace);
+    }
+  }
+  return traces;
+}
+
+// Calls of another trace of the run selected by time and function names
+static void ReadRunCalls(const std::string& trace,
+                         const TraceColumnFilter& filter,
+                         const std::set<std::string>& functions,
+                         std::vector<ClFunctionCall>& calls) {
+  TraceReader* reader = TraceReader::Create(trace);
+  if (reader == nullptr) {
+    std::cerr << "[WARNING] Unable to read trace " << trace
+              << ", it is not analyzed" << std::endl;
+    return;
+  }
+  std::vector<TraceCallRecord> records;
+  std::map<uint32_t, std::string> strings;
+  std::map<std::string, std::string> metadata;
+  reader->ReadAll(records, strings, metadata);
+  CheckComplete(*reader, trace);
+  delete reader;
+
+  TraceColumnFilter range = filter;
+  range.functions.clear();
+  for (const TraceCallRecord& record : records) {
+    const std::string& name = strings[record.function_id];
+    if (IsSelected(record, range) &&
+        (functions.empty() || functions.count(name) > 0)) {
+      calls.push_back(DecodeFunctionCall(record, name));
+    }
+  }
+}
+
+static std::string GetOutputName(const std::string& input,
+                                 const std::string& extension) {
+  size_t pos = input.rfind(".bin");
+  if (pos != std::string::npos && pos + 4 == input.size()) {
+    return input.substr(0, pos) + extension;
+  }
+  return input + extension;
+}
+
+// Rewrites everything that was recovered into a closed trace
+// with all chunks committed
+static bool WriteRecoveredTrace(const std::string& filename,
+                                const std::vector<TraceCallRecord>& records,
+                                const std::map<uint32_t, std::string>& strings,
+                                std::map<std::string, std::string> metadata,
+                                const TraceReader& reader) {
+  TraceWriter* writer = TraceWriter::Create(filename);
+  if (writer == nullptr) {
+    return false;
+  }
+
+  metadata["recovered"] = "true";
+  if (reader.GetState() == TRACE_STATE_CRASHED) {
+    metadata["terminating_signal"] = std::to_string(reader.GetSignal());
+  }
+  writer->WriteStrings(strings);
+  writer->WriteMetadata(metadata);
+
+  TraceCallChunk* chunk = nullptr;
+  for (const TraceCallRecord& record : records) {
+    if (chunk == nullptr) {
+      chunk = writer->AcquireCallChunk();
+      if (chunk == nullptr) {
+        delete writer;
+        return false;
+      }
+    }
+    chunk->records[chunk->count++] = record;
+    if (chunk->count == TRACE_CHUNK_CAPACITY) {
+      writer->CommitCallChunk(chunk);
+      chunk = nullptr;
+    }
+  }
+  if (chunk != nullptr) {
+    writer->CommitCallChunk(chunk);
+  }
+
+  delete writer;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  bool sync_analysis = false, dump = false, recover = false;
+  bool columnar = false, has_range = false;
+  double range_from = 0, range_to = -1;
+  unsigned thread_count = 0;
+  unsigned long finish_batch = SYNC_DEFAULT_FINISH_BATCH;
+  std::string samples_file, stacks_file, memory_file, function_names;
+  int index = 1;
+  for (; index < argc && argv[index][0] == '-'; ++index) {
+    if (strcmp(argv[index], "--sync-analysis") == 0) {
+      sync_analysis = true;
+    } else if (strcmp(argv[index], "--finish-batch") == 0 &&
+               index + 1 < argc) {
+      if (!ParseCount(argv[++index], finish_batch)) {
+        std::cout << "[ERROR] Invalid enqueue count " << argv[index]
+                  << std::endl;
+        ShowHelp();
+        return 1;
+      }
+    } else if (strcmp(argv[index], "--dump") == 0) {
+      dump = true;
+    } else if (strcmp(argv[index], "--recover") == 0) {
+      recover = true;
+    } else if (strcmp(argv[index], "--columnar") == 0) {
+      columnar = true;
+    } else if (strcmp(argv[index], "--range") == 0 && index + 1 < argc) {
+      has_range = true;
+      if (!ParseRange(argv[++index], range_from, range_to)) {
+        std::cout << "[ERROR] Invalid time range " << argv[index]
+                  << std::endl;
+        return 1;
+      }
+    } else if (strcmp(argv[index], "--functions") == 0 && index + 1 < argc) {
+      function_names = argv[++index];
+    } else if (strcmp(argv[index], "--samples") == 0 && index + 1 < argc) {
+      samples_file = argv[++index];
+    } else if (strcmp(argv[index], "--stacks") == 0 && index + 1 < argc) {
+      stacks_file = argv[++index];
+    } else if (strcmp(argv[index], "--memory") == 0 && index + 1 < argc) {
+      memory_file = argv[++index];
+    } else if (strcmp(argv[index], "--threads") == 0 && index + 1 < argc) {
+      unsigned long count = 0;
+      if (!ParseCount(argv[++index], count) || count > UINT_MAX) {
+        std::cout << "[ERROR] Invalid thread count " << argv[index]
+                  << std::endl;
+        ShowHelp();
+        return 1;
+      }
+      thread_count = static_cast<unsigned>(count);
+    } else {
+      std::cout << "[ERROR] Unknown option " << argv[index] << std::endl;
+      ShowHelp();
+      return 1;
+    }
+  }
+  if (index >= argc) {
+    ShowHelp();
+    return 1;
+  }
+
+  std::string input = argv[index];
+  bool from_store = TraceColumnStore::IsColumnStore(input);
+  if (from_store && (recover || columnar)) {
+    std::cout << "[ERROR] " << input << " is a column store, not a binary "
+              << "trace" << std::endl;
+    return 1;
+  }
+  if ((recover || columnar) && (has_range || !function_names.empty())) {
+    std::cout << "[ERROR] --range and --functions select calls for JSON "
+              << "conversion only" << std::endl;
+    return 1;
+  }
+  std::string output =
+      (index + 1 < argc)
+          ? argv[index + 1]
+          : GetOutputName(input, recover    ? ".recovered.bin"
+                                 : columnar ? ".cols"
+                                            : ".json");
+
+  std::vector<TraceCallRecord> records;
+  std::map<uint32_t, std::string> strings;
+  std::map<std::string, std::string> metadata;
+  std::vector<TraceClockRecord> clocks;
+  std::vector<TraceCommandRecord> device_commands;
+  TraceColumnFilter filter;
+  if (from_store) {
+    // Only the blocks of the selected range and functions are read,
+    // device commands are not kept in the store
+    TraceColumnStore* store = TraceColumnStore::Open(input);
+    if (store == nullptr) {
+      std::cout << "[ERROR] Unable to read column store " << input
+                << " (incomplete or damaged)" << std::endl;
+      return 1;
+    }
+    store->GetStrings(strings);
+    store->GetMetadata(metadata);
+    bool selected = GetFilter(has_range, range_from, range_to,
+                              store->GetStartTime(), function_names, strings,
+                              filter);
+    if (selected) {
+      store->Read(filter, records);
+    }
+    delete store;
+    if (!selected) {
+      std::cout << "[ERROR] No calls of " << function_names << " in "
+                << input << std::endl;
+      return 1;
+    }
+  } else {
+    TraceReader* reader = TraceReader::Create(input);
+    if (reader == nullptr) {
+      std::cout << "[ERROR] Unable to read trace " << input << std::endl;
+      return 1;
+    }
+
+    if (columnar) {
+      uint64_t record_count = 0;
+      bool written = WriteColumnStore(output, *reader, record_count);
+      CheckComplete(*reader, input);
+      delete reader;
+      if (!written) {
+        std::cout << "[ERROR] Unable to write column store " << output
+                  << std::endl;
+        return 1;
+      }
+      std::cout << "Column store of " << record_count
+                << " calls saved to: " << output << std::endl;
+      return 0;
+    }
+
+    reader->ReadAll(records, strings, metadata, nullptr, nullptr, nullptr,
+                    nullptr, &clocks, &device_commands);
+    CheckComplete(*reader, input);
+
+    if (recover) {
+      bool written =
+          WriteRecoveredTrace(output, records, strings, metadata, *reader);
+      delete reader;
+      if (!written) {
+        std::cout << "[ERROR] Unable to write trace " << output << std::endl;
+        return 1;
+      }
+      std::cout << "Trace saved to: " << output << std::endl;
+      return 0;
+    }
+    delete reader;
+
+    if (has_range || !function_names.empty()) {
+      uint64_t start_time = UINT64_MAX;
+      for (const TraceCallRecord& record : records) {
+        start_time = std::min(start_time, record.start_time);
+      }
+      if (!GetFilter(has_range, range_from, range_to, start_time,
+                     function_names, strings, filter)) {
+        std::cout << "[ERROR] No calls of " << function_names << " in "
+                  << input << std::endl;
+        return 1;
+      }
+      records.erase(std::remove_if(records.begin(), records.end(),
+                                   [&filter](const TraceCallRecord& record) {
+                                     return !IsSelected(record, filter);
+                                   }),
+                    records.end());
+    }
+  }
+
+  std::vector<ClFunctionCall> calls;
+  calls.reserve(records.size());
+  for (const TraceCallRecord& record : records) {
+    calls.push_back(DecodeFunctionCall(record, strings[record.function_id]));
+  }
+
+  if (dump) {
+    for (const auto& call : calls) {
+      std::cout << call.function_name << " " << call.start_time << " "
+                << call.end_time;
+      if (call.count > 1) {
+        std::cout << " x" << call.count << " " << call.busy_time;
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  if (sync_analysis) {
+    std::vector<std::string> run_traces;
+    if (!from_store) {
+      run_traces = GetRunTraces(input);
+    }
+    if (run_traces.empty()) {
+      ClSyncAnalyzer::PrintReport(calls, input, std::cout, finish_batch);
+    } else {
+      std::set<std::string> functions;
+      for (uint16_t function_id : filter.functions) {
+        functions.insert(strings[function_id]);
+      }
+      std::vector<ClFunctionCall> run_calls = calls;
+      std::string title = input;
+      for (const std::string& trace : run_traces) {
+        ReadRunCalls(trace, filter, functions, run_calls);
+        title += ", " + trace;
+      }
+      ClSyncAnalyzer::PrintReport(run_calls, title, std::cout, finish_batch);
+    }
+  }
+
+  // Addresses are symbolized with the module snapshots stored along with
+  // the samples and call stacks
+  std::vector<TraceModule> modules;
+  std::vector<TraceSample> samples;
+  uint64_t sampling_period = 0;
+  if (!samples_file.empty()) {
+    TraceReader* sample_reader = TraceReader::Create(samples_file);
+    if (sample_reader == nullptr) {
+      std::cout << "[ERROR] Unable to read samples " << samples_file
+                << std::endl;
+      return 1;
+    }
+    std::vector<TraceCallRecord> unused;
+    std::map<uint32_t, std::string> sample_strings;
+    std::map<std::string, std::string> sample_metadata;
+    sample_reader->ReadAll(unused, sample_strings, sample_metadata, &samples,
+                           nullptr, &modules);
+    delete sample_reader;
+
+    if (sample_metadata.count("sampling_period_ns") > 0) {
+      sampling_period = std::stoull(sample_metadata["sampling_period_ns"]);
+    }
+  }
+
+  TraceStackMap stacks;
+  if (!stacks_file.empty()) {
+    TraceReader* stack_reader = TraceReader::Create(stacks_file);
+    if (stack_reader == nullptr) {
+      std::cout << "[ERROR] Unable to read call stacks " << stacks_file
+                << std::endl;
+      return 1;
+    }
+    std::vector<TraceCallRecord> unused;
+    std::map<uint32_t, std::string> stack_strings;
+    std::map<std::string, std::string> stack_metadata;
+    stack_reader->ReadAll(unused, stack_strings, stack_metadata, nullptr,
+                          &stacks, &modules);
+    delete stack_reader;
+  }
+
+  std::vector<TraceMemoryRecord> memory;
+  if (!memory_file.empty()) {
+    TraceReader* memory_reader = TraceReader::Create(memory_file);
+    if (memory_reader == nullptr) {
+      std::cout << "[ERROR] Unable to read memory usage " << memory_file
+                << std::endl;
+      return 1;
+    }
+    std::vector<TraceCallRecord> unused;
+    std::map<uint32_t, std::string> memory_strings;
+    std::map<std::string, std::string> memory_metadata;
+    memory_reader->ReadAll(unused, memory_strings, memory_metadata, nullptr,
+                           nullptr, nullptr, &memory);
+    delete memory_reader;
+    ClMemoryProfile::Sort(memory);
+  }
+
+  std::vector<ClSampleAttribution> attribution;
+  std::vector<const TraceSample*> attributed_samples;
+  std::vector<uint64_t> addresses;
+  if (!samples_file.empty()) {
+    attribution = ClSampleProfile::Attribute(calls, samples);
+    for (const auto& item : attribution) {
+      attributed_samples.push_back(item.sample);
+      if (!item.sample->stack.empty()) {
+        addresses.push_back(item.sample->stack.front());
+      }
+    }
+  }
+  for (const auto& item : stacks) {
+    addresses.insert(addresses.end(), item.second.begin(), item.second.end());
+  }
+
+  TraceSymbolMap symbols;
+  if (!modules.empty() && !addresses.empty()) {
+    ElfSymbolizer symbolizer(modules);
+    symbolizer.Symbolize(std::move(addresses), symbols);
+  }
+
+  if (!samples_file.empty()) {
+    ClSampleProfile::PrintReport(attribution, samples.size(),
+                                 sampling_period, input, std::cout, symbols);
+  }
+  if (!stacks_file.empty()) {
+    ClCallSiteProfile::PrintReport(calls, stacks, input, std::cout, symbols);
+  }
+
+  std::vector<TraceCounter> counters = ClCounterTracks::Compute(calls);
+  if (!memory_file.empty()) {
+    ClMemoryProfile::PrintReport(memory, stacks, memory_file, std::cout,
+                                 symbols);
+    std::vector<TraceCounter> usage = ClMemoryProfile::GetUsage(memory);
+    counters.insert(counters.end(), usage.begin(), usage.end());
+  }
+
+  // Device commands are placed on the host time base of the calls
+  std::vector<ClDeviceCommand> commands;
+  if (!device_commands.empty()) {
+    if (clocks.empty()) {
+      std::cerr << "[WARNING] No clock samples in " << input
+                << ", device commands are not converted" << std::endl;
+    } else {
+      ClClockMapping mapping = ClClockCorrelation::Fit(clocks);
+      commands =
+          ClClockCorrelation::Convert(device_commands, mapping, strings);
+      commands.erase(
+          std::remove_if(commands.begin(), commands.end(),
+                         [&filter](const ClDeviceCommand& command) {
+                           return command.start > filter.end_time ||
+                                  command.end < filter.start_time;
+                         }),
+          commands.end());
+      ClClockCorrelation::PrintReport(mapping, commands, input, std::cout);
+    }
+  }
+
+  ChromeTracingGenerator::ExportToFile(calls, output, metadata,
+                                       attributed_samples, stacks, symbols,
+                                       counters, commands, thread_count);
+  return 0;
+}
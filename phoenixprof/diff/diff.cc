@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cl_trace_diff.h"
+
+// Compares latency distributions of the API calls of two runs, e.g. before
+// and after a driver update, and fails if any function got significantly
+// slower. Both inputs are read at the same time, chunk by chunk
+
+#define DEFAULT_THRESHOLD_PERCENT 5.0
+#define DEFAULT_MIN_CHANGE_NS 100
+#define DEFAULT_ALPHA 0.01
+
+// Exit code if regressions are found, errors exit with 1
+#define EXIT_REGRESSION 2
+
+static void ShowHelp() {
+  std::cout << "Usage: ./phoenixprof_diff [options] <baseline> <current>"
+            << std::endl;
+  std::cout << "       ./phoenixprof_diff --save-summary <summary> <trace>"
+            << std::endl;
+  std::cout << "Inputs are binary traces or summaries, several files of one "
+            << "run are given as a comma separated list" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "--threshold <percent>    "
+            << "Smallest p50 or p99 growth reported as a regression "
+            << "(default 5)" << std::endl;
+  std::cout << "--min-change <ns>        "
+            << "Smallest absolute p50 or p99 growth reported as a "
+            << "regression (default 100)" << std::endl;
+  std::cout << "--alpha <p-value>        "
+            << "Significance level of the tests (default 0.01)" << std::endl;
+  std::cout << "--save-summary <file>    "
+            << "Save latency distributions of the input to compare later"
+            << std::endl;
+}
+
+static bool LoadProfile(const std::string& inputs, ClLatencyProfile& profile) {
+  std::stringstream stream(inputs);
+  std::string filename;
+  while (std::getline(stream, filename, ',')) {
+    if (!ClTraceDiff::Load(filename, profile)) {
+      std::cout << "[ERROR] Unable to read " << filename << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  double threshold_percent = DEFAULT_THRESHOLD_PERCENT;
+  ClDiffThreshold threshold{0, DEFAULT_MIN_CHANGE_NS, DEFAULT_ALPHA};
+  std::string summary_file;
+  int index = 1;
+  for (; index < argc && argv[index][0] == '-'; ++index) {
+    if (strcmp(argv[index], "--threshold") == 0 && index + 1 < argc) {
+      threshold_percent = atof(argv[++index]);
+    } else if (strcmp(argv[index], "--min-change") == 0 &&
+               index + 1 < argc) {
+      threshold.absolute = strtoull(argv[++index], nullptr, 10);
+    } else if (strcmp(argv[index], "--alpha") == 0 && index + 1 < argc) {
+      threshold.alpha = atof(argv[++index]);
+    } else if (strcmp(argv[index], "--save-summary") == 0 &&
+               index + 1 < argc) {
+      summary_file = argv[++index];
+    } else {
+      std::cout << "[ERROR] Unknown option " << argv[index] << std::endl;
+      ShowHelp();
+      return 1;
+    }
+  }
+
+  if (!summary_file.empty()) {
+    if (index + 1 != argc) {
+      ShowHelp();
+      return 1;
+    }
+    ClLatencyProfile profile;
+    if (!LoadProfile(argv[index], profile)) {
+      return 1;
+    }
+    if (!ClTraceDiff::SaveSummary(summary_file, profile)) {
+      std::cout << "[ERROR] Unable to write " << summary_file << std::endl;
+      return 1;
+    }
+    std::cout << "Summary saved to: " << summary_file << std::endl;
+    return 0;
+  }
+
+  threshold.relative = threshold_percent / 100;
+  if (index + 2 != argc || threshold.relative < 0 || threshold.alpha <= 0 ||
+      threshold.alpha >= 1) {
+    ShowHelp();
+    return 1;
+  }
+
+  ClLatencyProfile baseline, current;
+  bool baseline_loaded = false;
+  std::thread loader([&]() {
+    baseline_loaded = LoadProfile(argv[index], baseline);
+  });
+  bool current_loaded = LoadProfile(argv[index + 1], current);
+  loader.join();
+  if (!baseline_loaded || !current_loaded) {
+    return 1;
+  }
+
+  std::vector<ClLatencyChange> changes =
+      ClTraceDiff::Compare(baseline, current, threshold);
+  ClTraceDiff::PrintReport(
+      changes, std::string(argv[index]) + " -> " + argv[index + 1],
+      threshold, std::cout);
+
+  for (const ClLatencyChange& change : changes) {
+    if (change.verdict == LATENCY_REGRESSION) {
+      return EXIT_REGRESSION;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <CL/tracing_api.h>
+
+#include "json_sax_reader.h"
+#include "trace_columns.h"
+#include "trace_format.h"
+#include "trace_writer.h"
+
+// Imports Chrome Tracing JSON, written by phoenixprof_convert or by other
+// tools, into a binary trace or a column store, so the converter, the
+// analyses and phoenixprof_diff can work on it. The JSON is streamed, calls
+// are written out chunk by chunk as they are read
+
+enum ImportTimeUnit {
+  IMPORT_TIME_AUTO = 0,  // Nanoseconds for traces of the tool, else us
+  IMPORT_TIME_NS,
+  IMPORT_TIME_US,
+};
+
+// Functions the analyses recognize by their tracing id, other OpenCL
+// functions get ids of their own past the tracing ones
+struct KnownFunction {
+  const char* name;
+  cl_function_id id;
+};
+
+static const KnownFunction kKnownFunctions[] = {
+    {"clFinish", CL_FUNCTION_clFinish},
+    {"clWaitForEvents", CL_FUNCTION_clWaitForEvents},
+    {"clCreateBuffer", CL_FUNCTION_clCreateBuffer},
+    {"clReleaseMemObject", CL_FUNCTION_clReleaseMemObject},
+    {"clEnqueueReadBuffer", CL_FUNCTION_clEnqueueReadBuffer},
+    {"clEnqueueWriteBuffer", CL_FUNCTION_clEnqueueWriteBuffer},
+};
+
+static void ShowHelp() {
+  std::cout << "Usage: ./phoenixprof_import [options] <trace.json> [output]"
+            << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "--columnar               "
+            << "Write a column store instead of a binary trace" << std::endl;
+  std::cout << "--time-unit <ns|us>      "
+            << "Unit of event times (ns for traces converted by the tool, "
+            << "us otherwise by default)" << std::endl;
+}
+
+static std::string GetOutputName(const std::string& input,
+                                 const std::string& extension) {
+  size_t pos = input.rfind(".json");
+  if (pos != std::string::npos && pos + 5 == input.size()) {
+    return input.substr(0, pos) + extension;
+  }
+  return input + extension;
+}
+
+// Calls go either into a binary trace or into a column store
+class ImportOutput {
+ public:
+  static ImportOutput* Create(const std::string& filename, bool columnar) {
+    ImportOutput* output = new ImportOutput;
+    ASSERT(output != nullptr);
+    if (columnar) {
+      output->columns_ = TraceColumnWriter::Create(filename);
+    } else {
+      output->writer_ = TraceWriter::Create(filename);
+    }
+    if (output->columns_ == nullptr && output->writer_ == nullptr) {
+      delete output;
+      return nullptr;
+    }
+    return output;
+  }
+
+  ~ImportOutput() {
+    delete columns_;
+    delete writer_;
+  }
+
+  ImportOutput(const ImportOutput& copy) = delete;
+  ImportOutput& operator=(const ImportOutput& copy) = delete;
+
+  bool Append(const TraceCallRecord& record) {
+    if (columns_ != nullptr) {
+      return columns_->Append(record);
+    }
+    if (chunk_ == nullptr) {
+      chunk_ = writer_->AcquireCallChunk();
+      if (chunk_ == nullptr) {
+        return false;
+      }
+    }
+    chunk_->records[chunk_->count++] = record;
+    if (chunk_->count == TRACE_CHUNK_CAPACITY) {
+      writer_->CommitCallChunk(chunk_);
+      chunk_ = nullptr;
+    }
+    return true;
+  }
+
+  bool Close(const std::map<uint32_t, std::string>& strings,
+             const std::map<std::string, std::string>& metadata) {
+    if (columns_ != nullptr) {
+      columns_->SetStrings(strings);
+      columns_->SetMetadata(metadata);
+      return columns_->Close();
+    }
+    if (chunk_ != nullptr) {
+      writer_->CommitCallChunk(chunk_);
+      chunk_ = nullptr;
+    }
+    writer_->WriteStrings(strings);
+    writer_->WriteMetadata(metadata);
+    writer_->Close();
+    return true;
+  }
+
+ private:
+  ImportOutput() {}
+
+  TraceColumnWriter* columns_ = nullptr;
+  TraceWriter* writer_ = nullptr;
+  TraceCallChunk* chunk_ = nullptr;
+};
+
+// Handler of the JSON reader, takes the object (with "traceEvents" and
+// "otherData") and the array forms of Chrome traces. Complete events and
+// pairs of begin and end events become calls, named by the event; events
+// the tool writes for OpenCL calls keep their function, any other event is
+// imported like an ITT task. The "Nx name" slices of collapsed runs become
+// collapsed records again. Values of "otherData" are kept as metadata.
+// Instant events (samples), counters and device commands are derived or
+// side data and are skipped, as are events of other kinds
+class ChromeTraceImporter {
+ public:
+  ChromeTraceImporter(ImportOutput* output, ImportTimeUnit unit)
+      : output_(output), unit_(unit) {
+    ASSERT(output_ != nullptr);
+  }
+
+  void StartObject() {
+    ++depth_;
+    if (events_depth_ > 0 && depth_ == events_depth_ + 1) {
+      StartEvent();
+    } else if (events_depth_ > 0 && depth_ == events_depth_ + 2 &&
+               key_ == KEY_ARGS) {
+      in_args_ = true;
+    } else if (depth_ == 2 && key_ == KEY_OTHER_DATA) {
+      other_data_ = true;
+    } else if (other_data_ && depth_ > 2) {
+      StartCapture('{');
+    }
+  }
+
+  void EndObject() {
+    if (events_depth_ > 0 && depth_ == events_depth_ + 1) {
+      EndEvent();
+    } else if (events_depth_ > 0 && depth_ == events_depth_ + 2) {
+      in_args_ = false;
+    } else if (other_data_ && depth_ == 2) {
+      other_data_ = false;
+    } else if (other_data_ && depth_ > 2) {
+      EndCapture('}');
+    }
+    --depth_;
+  }
+
+  void StartArray() {
+    ++depth_;
+    if (depth_ == 1 || (depth_ == 2 && key_ == KEY_TRACE_EVENTS)) {
+      events_depth_ = depth_;
+    } else if (other_data_ && depth_ > 2) {
+      StartCapture('[');
+    }
+  }
+
+  void EndArray() {
+    if (depth_ == events_depth_) {
+      events_depth_ = 0;
+    } else if (other_data_ && depth_ > 2) {
+      EndCapture(']');
+    }
+    --depth_;
+  }
+
+  void Key(const char* data, size_t size) {
+    if (other_data_ && depth_ > 2) {
+      AppendSeparator();
+      capture_ += utils::GetJsonString(std::string(data, size));
+      capture_ += ':';
+      first_in_capture_ = true;  // No separator before the value
+      return;
+    }
+    key_ = KEY_OTHER;
+    if (depth_ == 1) {
+      if (IsKey(data, size, "traceEvents")) {
+        key_ = KEY_TRACE_EVENTS;
+      } else if (IsKey(data, size, "otherData")) {
+        key_ = KEY_OTHER_DATA;
+      }
+    } else if (other_data_ && depth_ == 2) {
+      metadata_key_.assign(data, size);
+      capture_.clear();
+      first_in_capture_ = true;
+    } else if (events_depth_ > 0 && depth_ == events_depth_ + 1) {
+      key_ = GetEventKey(data, size);
+    } else if (in_args_ && depth_ == events_depth_ + 2) {
+      key_ = GetArgsKey(data, size);
+    }
+  }
+
+  void String(const char* data, size_t size) {
+    if (other_data_ && depth_ >= 2) {
+      AppendSeparator();
+      capture_ += utils::GetJsonString(std::string(data, size));
+      EndMetadataValue();
+      return;
+    }
+    switch (key_) {
+      case KEY_NAME:
+        event_.name.assign(data, size);
+        break;
+      case KEY_CAT:
+        event_.category.assign(data, size);
+        break;
+      case KEY_PH:
+        event_.phase = (size > 0) ? data[0] : '\0';
+        break;
+      case KEY_ARGS_NAME:
+        event_.args_name.assign(data, size);
+        break;
+      default:
+        break;
+    }
+    key_ = KEY_OTHER;
+  }
+
+  void Number(const char* data, size_t size) {
+    if (other_data_ && depth_ >= 2) {
+      AppendSeparator();
+      capture_.append(data, size);
+      EndMetadataValue();
+      return;
+    }
+    switch (key_) {
+      case KEY_TS:
+        event_.time.assign(data, size);
+        break;
+      case KEY_DUR:
+        event_.duration.assign(data, size);
+        break;
+      case KEY_PID:
+        event_.pid = ParseInteger(data, size);
+        break;
+      case KEY_TID:
+        event_.tid = ParseInteger(data, size);
+        break;
+      case KEY_ARGS_COUNT:
+        event_.count = ParseInteger(data, size);
+        break;
+      case KEY_ARGS_BUSY_TIME:
+        event_.busy_time = ParseInteger(data, size);
+        break;
+      default:
+        break;
+    }
+    key_ = KEY_OTHER;
+  }
+
+  void Bool(bool value) {
+    if (other_data_ && depth_ >= 2) {
+      AppendSeparator();
+      capture_ += value ? "true" : "false";
+      EndMetadataValue();
+      return;
+    }
+    if (key_ == KEY_ARGS_BLOCKING) {
+      event_.blocking = value;
+    }
+    key_ = KEY_OTHER;
+  }
+
+  void Null() {
+    if (other_data_ && depth_ >= 2) {
+      AppendSeparator();
+      capture_ += "null";
+      EndMetadataValue();
+      return;
+    }
+    key_ = KEY_OTHER;
+  }
+
+  // Writes names and metadata, returns false if the output failed
+  bool Finish() {
+    if (!failed_ && !output_->Close(strings_, metadata_)) {
+      failed_ = true;
+    }
+    return !failed_;
+  }
+
+  bool IsFailed() const { return failed_; }
+
+  uint64_t GetCallCount() const { return call_count_; }
+
+  uint64_t GetSkippedCount() const { return skipped_count_; }
+
+  uint64_t GetUnmatchedCount() const {
+    uint64_t count = unmatched_count_;
+    for (const auto& item : open_events_) {
+      count += item.second.size();
+    }
+    return count;
+  }
+
+  bool HasSeveralProcesses() const { return several_processes_; }
+
+ private:  // Implementation Details
+  enum EventKey {
+    KEY_OTHER = 0,
+    KEY_TRACE_EVENTS,
+    KEY_OTHER_DATA,
+    KEY_NAME,
+    KEY_CAT,
+    KEY_PH,
+    KEY_TS,
+    KEY_DUR,
+    KEY_PID,
+    KEY_TID,
+    KEY_ARGS,
+    KEY_ARGS_NAME,
+    KEY_ARGS_COUNT,
+    KEY_ARGS_BUSY_TIME,
+    KEY_ARGS_BLOCKING,
+  };
+
+  // Fields are kept as text until the whole event is read, the unit of
+  // times may depend on its category
+  struct Event {
+    std::string name;
+    std::string category;
+    char phase;
+    std::string time;
+    std::string duration;
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t count;
+    uint64_t busy_time;
+    bool blocking;
+    std::string args_name;
+  };
+
+  // Begin event waiting for its end
+  struct OpenEvent {
+    std::string name;
+    std::string category;
+    uint64_t time;
+  };
+
+  static bool IsKey(const char* data, size_t size, const char* key) {
+    return strlen(key) == size && memcmp(data, key, size) == 0;
+  }
+
+  // Keys are told apart by their size first, this runs for every key of
+  // every event
+  static EventKey GetEventKey(const char* data, size_t size) {
+    switch (size) {
+      case 2:
+        if (data[0] == 't' && data[1] == 's') return KEY_TS;
+        if (data[0] == 'p' && data[1] == 'h') return KEY_PH;
+        break;
+      case 3:
+        if (memcmp(data, "dur", 3) == 0) return KEY_DUR;
+        if (memcmp(data, "pid", 3) == 0) return KEY_PID;
+        if (memcmp(data, "tid", 3) == 0) return KEY_TID;
+        if (memcmp(data, "cat", 3) == 0) return KEY_CAT;
+        break;
+      case 4:
+        if (memcmp(data, "name", 4) == 0) return KEY_NAME;
+        if (memcmp(data, "args", 4) == 0) return KEY_ARGS;
+        break;
+      default:
+        break;
+    }
+    return KEY_OTHER;
+  }
+
+  static EventKey GetArgsKey(const char* data, size_t size) {
+    switch (size) {
+      case 4:
+        if (memcmp(data, "name", 4) == 0) return KEY_ARGS_NAME;
+        break;
+      case 5:
+        if (memcmp(data, "count", 5) == 0) return KEY_ARGS_COUNT;
+        break;
+      case 8:
+        if (memcmp(data, "blocking", 8) == 0) return KEY_ARGS_BLOCKING;
+        break;
+      case 12:
+        if (memcmp(data, "busy_time_ns", 12) == 0) return KEY_ARGS_BUSY_TIME;
+        break;
+      default:
+        break;
+    }
+    return KEY_OTHER;
+  }
+
+  static uint64_t ParseInteger(const char* data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size && data[i] >= '0' && data[i] <= '9'; ++i) {
+      value = value * 10 + (data[i] - '0');
+    }
+    return value;
+  }
+
+  // Times are read exactly to the nanosecond, negative ones are clamped
+  static uint64_t ParseTime(const std::string& text, ImportTimeUnit unit) {
+    uint64_t scale = (unit == IMPORT_TIME_US) ? 1000 : 1;
+    uint64_t value = 0;
+    size_t i = 0;
+    for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; ++i) {
+      value = value * 10 + (text[i] - '0');
+    }
+    if (i == text.size()) {
+      return value * scale;
+    }
+    if (text[i] == '-' || text.find_first_of("eE", i) != std::string::npos) {
+      double time = strtod(text.c_str(), nullptr);
+      return (time > 0) ? static_cast<uint64_t>(time * scale + 0.5) : 0;
+    }
+
+    value *= scale;
+    if (text[i] == '.') {
+      uint64_t digit_scale = scale;
+      for (++i; i < text.size() && digit_scale > 1; ++i) {
+        digit_scale /= 10;
+        value += (text[i] - '0') * digit_scale;
+      }
+      if (i < text.size() && text[i] >= '5') {
+        ++value;  // Rounded to the nearest nanosecond
+      }
+    }
+    return value;
+  }
+
+  void StartEvent() {
+    event_.name.clear();
+    event_.category.clear();
+    event_.phase = '\0';
+    event_.time.clear();
+    event_.duration.clear();
+    event_.pid = 0;
+    event_.tid = 0;
+    event_.count = 0;
+    event_.busy_time = 0;
+    event_.blocking = false;
+    event_.args_name.clear();
+    key_ = KEY_OTHER;
+  }
+
+  void EndEvent() {
+    if (failed_) {
+      return;
+    }
+    const Event& event = event_;
+    if (event.phase == 'M') {
+      if (event.name == "process_name" && !event.args_name.empty() &&
+          metadata_.count("track_name") == 0) {
+        metadata_["track_name"] = utils::GetJsonString(event.args_name);
+      }
+      return;
+    }
+    if ((event.phase != 'X' && event.phase != 'B' && event.phase != 'E') ||
+        event.category == "device") {
+      ++skipped_count_;
+      return;
+    }
+
+    if (!has_pid_) {
+      pid_ = event.pid;
+      has_pid_ = true;
+    } else if (event.pid != pid_) {
+      several_processes_ = true;
+    }
+    if (unit_ == IMPORT_TIME_AUTO) {
+      unit_ = (event.category == "cl" || event.category == "itt" ||
+               event.category == "kernel")
+                  ? IMPORT_TIME_NS
+                  : IMPORT_TIME_US;
+    }
+
+    uint64_t time = ParseTime(event.time, unit_);
+    uint64_t thread = (event.pid << 32) | (event.tid & 0xFFFFFFFF);
+    if (event.phase == 'B') {
+      open_events_[thread].push_back(
+          OpenEvent{event.name, event.category, time});
+      return;
+    }
+    if (event.phase == 'E') {
+      auto it = open_events_.find(thread);
+      if (it == open_events_.end() || it->second.empty()) {
+        ++unmatched_count_;
+        return;
+      }
+      const OpenEvent& begin = it->second.back();
+      AddCall(begin.name, begin.category, begin.time, time, event.tid, 0, 0,
+              false);
+      it->second.pop_back();
+      return;
+    }
+    AddCall(event.name, event.category, time,
+            time + ParseTime(event.duration, unit_), event.tid, event.count,
+            event.busy_time, event.blocking);
+  }
+
+  void AddCall(const std::string& name, const std::string& category,
+               uint64_t start_time, uint64_t end_time, uint64_t tid,
+               uint64_t count, uint64_t busy_time, bool blocking) {
+    TraceCallRecord record{start_time, end_time,
+                           static_cast<uint32_t>(tid), 0, 0, 0, 0, 0};
+
+    // Slices of collapsed runs are named "<count>x <function>"
+    const std::string* function = &name;
+    if (count > 1) {
+      std::string prefix = std::to_string(count) + "x ";
+      if (name.compare(0, prefix.size(), prefix) == 0) {
+        function_name_.assign(name, prefix.size(), std::string::npos);
+        function = &function_name_;
+      }
+      uint64_t mean = busy_time / count;
+      if (count <= TRACE_COLLAPSE_MAX_COUNT &&
+          mean <= TRACE_COLLAPSE_MAX_DURATION) {
+        record.flags |= TRACE_CALL_FLAG_COLLAPSED;
+        record.collapsed_count = static_cast<uint16_t>(count);
+        record.collapsed_mean = static_cast<uint16_t>(mean);
+      }
+    }
+
+    record.function_id = GetFunctionId(*function, category);
+    if (record.function_id >= TRACE_ANNOTATION_ID_BASE) {
+      record.flags |= TRACE_CALL_FLAG_ANNOTATION;
+    }
+    if (blocking) {
+      record.flags |= TRACE_CALL_FLAG_BLOCKING;
+    }
+    if (!output_->Append(record)) {
+      failed_ = true;
+      return;
+    }
+    ++call_count_;
+  }
+
+  static bool IsClFunction(const std::string& name,
+                           const std::string& category) {
+    if (category == "cl") {
+      return true;
+    }
+    return category.empty() && name.size() > 2 && name[0] == 'c' &&
+           name[1] == 'l' && name[2] >= 'A' && name[2] <= 'Z';
+  }
+
+  // Names beyond the id space share the last annotation id below the
+  // kernels, slices of the "kernel" category get kernel ids
+  uint16_t GetFunctionId(const std::string& name,
+                         const std::string& category) {
+    auto it = function_ids_.find(name);
+    if (it != function_ids_.end()) {
+      return it->second;
+    }
+
+    for (const KnownFunction& function : kKnownFunctions) {
+      if (name == function.name) {
+        AddFunction(name, static_cast<uint16_t>(function.id));
+        return static_cast<uint16_t>(function.id);
+      }
+    }
+
+    const uint32_t other_id = TRACE_KERNEL_ID_BASE - 1;
+    uint32_t id = 0;
+    if (IsClFunction(name, category) &&
+        next_function_id_ < TRACE_ANNOTATION_ID_BASE) {
+      id = next_function_id_++;
+    } else if (category == "kernel" &&
+               next_kernel_id_ <= TRACE_ANNOTATION_ID_MAX) {
+      id = next_kernel_id_++;
+    } else if (category != "kernel" && next_annotation_id_ < other_id) {
+      id = next_annotation_id_++;
+    } else {
+      if (strings_.count(other_id) == 0) {
+        std::cerr << "[WARNING] Too many distinct event names, the rest "
+                  << "are imported as \"other\"" << std::endl;
+        strings_[other_id] = "other";
+      }
+      return static_cast<uint16_t>(other_id);
+    }
+    AddFunction(name, static_cast<uint16_t>(id));
+    return static_cast<uint16_t>(id);
+  }
+
+  void AddFunction(const std::string& name, uint16_t id) {
+    function_ids_[name] = id;
+    strings_[id] = name;
+  }
+
+  void AppendSeparator() {
+    if (!first_in_capture_) {
+      capture_ += ',';
+    }
+    first_in_capture_ = false;
+  }
+
+  void StartCapture(char bracket) {
+    AppendSeparator();
+    capture_ += bracket;
+    first_in_capture_ = true;
+  }
+
+  void EndCapture(char bracket) {
+    capture_ += bracket;
+    first_in_capture_ = false;
+    if (depth_ == 3) {
+      metadata_[metadata_key_] = capture_;
+    }
+  }
+
+  // Scalars directly under "otherData" are complete values
+  void EndMetadataValue() {
+    if (depth_ == 2) {
+      metadata_[metadata_key_] = capture_;
+    }
+  }
+
+  ImportOutput* output_ = nullptr;
+  ImportTimeUnit unit_ = IMPORT_TIME_AUTO;
+  bool failed_ = false;
+
+  int depth_ = 0;
+  int events_depth_ = 0;  // Depth of the events array, 0 outside of it
+  bool in_args_ = false;
+  bool other_data_ = false;
+  EventKey key_ = KEY_OTHER;
+  Event event_{};
+
+  std::string metadata_key_;
+  std::string capture_;  // JSON text of the metadata value being read
+  bool first_in_capture_ = true;
+
+  std::unordered_map<uint64_t, std::vector<OpenEvent>> open_events_;
+  std::unordered_map<std::string, uint16_t> function_ids_;
+  std::string function_name_;
+  uint32_t next_function_id_ = CL_FUNCTION_COUNT;
+  uint32_t next_annotation_id_ = TRACE_ANNOTATION_ID_BASE;
+  uint32_t next_kernel_id_ = TRACE_KERNEL_ID_BASE;
+
+  std::map<uint32_t, std::string> strings_;
+  std::map<std::string, std::string> metadata_;
+
+  uint64_t pid_ = 0;
+  bool has_pid_ = false;
+  bool several_processes_ = false;
+  uint64_t call_count_ = 0;
+  uint64_t skipped_count_ = 0;
+  uint64_t unmatched_count_ = 0;
+};
+
+int main(int argc, char* argv[]) {
+  bool columnar = false;
+  ImportTimeUnit unit = IMPORT_TIME_AUTO;
+  int index = 1;
+  for (; index < argc && argv[index][0] == '-'; ++index) {
+    if (strcmp(argv[index], "--columnar") == 0) {
+      columnar = true;
+    } else if (strcmp(argv[index], "--time-unit") == 0 && index + 1 < argc) {
+      ++index;
+      if (strcmp(argv[index], "ns") == 0) {
+        unit = IMPORT_TIME_NS;
+      } else if (strcmp(argv[index], "us") == 0) {
+        unit = IMPORT_TIME_US;
+      } else {
+        std::cout << "[ERROR] Unknown time unit " << argv[index] << std::endl;
+        return 1;
+      }
+    } else {
+      std::cout << "[ERROR] Unknown option " << argv[index] << std::endl;
+      ShowHelp();
+      return 1;
+    }
+  }
+  if (index >= argc) {
+    ShowHelp();
+    return 1;
+  }
+
+  std::string input = argv[index];
+  std::string output = (index + 1 < argc)
+                           ? argv[index + 1]
+                           : GetOutputName(input, columnar ? ".cols" : ".bin");
+
+  FILE* file = fopen(input.c_str(), "rb");
+  if (file == nullptr) {
+    std::cout << "[ERROR] Unable to read " << input << std::endl;
+    return 1;
+  }
+  // The reader takes large blocks at a time, the stream buffer only adds
+  // a copy
+  setvbuf(file, nullptr, _IONBF, 0);
+
+  ImportOutput* trace = ImportOutput::Create(output, columnar);
+  if (trace == nullptr) {
+    std::cout << "[ERROR] Unable to write " << output << std::endl;
+    fclose(file);
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  ChromeTraceImporter importer(trace, unit);
+  JsonSaxReader reader(file);
+  bool parsed = reader.Parse(importer);
+  uint64_t size = reader.GetReadSize();
+  fclose(file);
+
+  // A truncated trace is imported as far as it goes
+  if (!parsed && !reader.IsTruncated()) {
+    std::cout << "[ERROR] " << input << " is not valid JSON: "
+              << reader.GetError() << std::endl;
+    delete trace;
+    remove(output.c_str());
+    return 1;
+  }
+  if (!parsed) {
+    std::cerr << "[WARNING] " << input << " is truncated ("
+              << reader.GetError() << "), events up to it are imported"
+              << std::endl;
+  }
+  bool written = importer.Finish();
+  delete trace;
+  if (!written) {
+    std::cout << "[ERROR] Unable to write " << output << std::endl;
+    remove(output.c_str());
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  if (importer.HasSeveralProcesses()) {
+    std::cerr << "[WARNING] Events of several processes are imported into "
+              << "one trace, threads are told apart by their ids only"
+              << std::endl;
+  }
+  if (importer.GetUnmatchedCount() > 0) {
+    std::cerr << "[WARNING] " << importer.GetUnmatchedCount()
+              << " begin and end events without a pair are skipped"
+              << std::endl;
+  }
+  std::cout << "Imported " << importer.GetCallCount() << " calls from "
+            << size / 1000000.0 << " MB in " << seconds << " s ("
+            << ((seconds > 0) ? size / 1000000.0 / seconds : 0) << " MB/s), "
+            << importer.GetSkippedCount() << " other events skipped"
+            << std::endl;
+  std::cout << (columnar ? "Column store" : "Trace") << " saved to: "
+            << output << std::endl;
+  return 0;
+}
@@ -0,0 +1,568 @@
+#ifndef PHPROF_JSON_SAX_READER_H_
+#define PHPROF_JSON_SAX_READER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+// Input is read this much at a time, the buffer only grows for a single
+// value that does not fit into it
+#define JSON_READER_BUFFER_SIZE (1ull << 20)
+#define JSON_READER_BLOCK_SIZE 64
+#define JSON_READER_MAX_BUFFER_SIZE (1ull << 31)
+
+// Streaming JSON reader that reports every value to a handler as it is read
+// (SAX), so memory does not depend on the input size: it is bounded by the
+// buffer, the longest value and the nesting depth.
+// Every buffer is read in two passes. The first one looks at 64 bytes at a
+// time with SIMD compares and builds bit masks of quotes, backslashes,
+// operators and whitespace, from which it finds the positions of the
+// structural characters outside of strings, the quotes around strings and
+// the first characters of numbers and literals. The second pass walks these
+// positions only, so string contents and whitespace are never looked at
+// byte by byte.
+// The handler is expected to have the following methods:
+//   void StartObject();
+//   void EndObject();
+//   void StartArray();
+//   void EndArray();
+//   void Key(const char* data, size_t size);     // Unescaped
+//   void String(const char* data, size_t size);  // Unescaped
+//   void Number(const char* data, size_t size);  // As written
+//   void Bool(bool value);
+//   void Null();
+// A top-level array left open at the end of the input is closed, as Chrome
+// does for traces of processes that did not finish writing them
+class JsonSaxReader {
+ public:
+  explicit JsonSaxReader(FILE* file)
+      : file_(file),
+        capacity_(JSON_READER_BUFFER_SIZE),
+        buffer_(JSON_READER_BUFFER_SIZE + JSON_READER_BLOCK_SIZE),
+        indexes_(JSON_READER_BUFFER_SIZE + JSON_READER_BLOCK_SIZE) {
+    ASSERT(file_ != nullptr);
+  }
+
+  JsonSaxReader(const JsonSaxReader& copy) = delete;
+  JsonSaxReader& operator=(const JsonSaxReader& copy) = delete;
+
+  // Returns false if the input is not valid JSON, the reason is kept in
+  // the error
+  template <typename Handler>
+  bool Parse(Handler& handler) {
+    while (true) {
+      size_t kept = size_;
+      if (!Read()) {
+        return false;
+      }
+      Index();
+      if (!Walk(handler)) {
+        return false;
+      }
+      if (eof_) {
+        return Finish(handler);
+      }
+      if (!Compact() && kept == size_) {
+        if (!Grow()) {
+          return false;
+        }
+      }
+    }
+  }
+
+  const std::string& GetError() const { return error_; }
+
+  // The input ended in the middle of a value, everything before it was
+  // reported to the handler
+  bool IsTruncated() const { return truncated_; }
+
+  // Bytes read from the input so far
+  uint64_t GetReadSize() const { return base_ + size_; }
+
+ private:  // Implementation Details
+  enum Expectation {
+    EXPECT_VALUE,
+    EXPECT_VALUE_OR_END,  // After '['
+    EXPECT_KEY,           // After ',' in an object
+    EXPECT_KEY_OR_END,    // After '{'
+    EXPECT_COLON,
+    EXPECT_COMMA_OR_END,
+    EXPECT_NOTHING,  // After the top-level value
+  };
+
+  bool Read() {
+    while (!eof_ && size_ < capacity_) {
+      size_t count = fread(buffer_.data() + size_, 1, capacity_ - size_,
+                           file_);
+      size_ += count;
+      if (count == 0) {
+        if (ferror(file_)) {
+          error_ = "unable to read input";
+          return false;
+        }
+        eof_ = true;
+      }
+    }
+    return true;
+  }
+
+  // Indexes whole blocks only, the tail is indexed with the next buffer or
+  // padded with spaces at the end of the input
+  void Index() {
+    while (size_ - scanned_ >= JSON_READER_BLOCK_SIZE) {
+      IndexBlock(scanned_);
+      scanned_ += JSON_READER_BLOCK_SIZE;
+    }
+    if (eof_ && scanned_ < size_) {
+      memset(buffer_.data() + size_, ' ',
+             JSON_READER_BLOCK_SIZE - (size_ - scanned_));
+      IndexBlock(scanned_);
+      scanned_ = size_;
+    }
+  }
+
+  void IndexBlock(size_t offset) {
+    const char* data = buffer_.data() + offset;
+    uint64_t quote = 0, backslash = 0, op = 0, space = 0;
+#if defined(__SSE2__)
+    const __m128i quote_char = _mm_set1_epi8('"');
+    const __m128i backslash_char = _mm_set1_epi8('\\');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i brace_open = _mm_set1_epi8('{');  // '[' with the case bit
+    const __m128i brace_close = _mm_set1_epi8('}');  // ']' with the case bit
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i line_feed = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    for (int i = 0; i < JSON_READER_BLOCK_SIZE; i += 16) {
+      __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+      __m128i folded = _mm_or_si128(bytes, case_bit);
+      quote |= GetMask(_mm_cmpeq_epi8(bytes, quote_char), i);
+      backslash |= GetMask(_mm_cmpeq_epi8(bytes, backslash_char), i);
+      op |= GetMask(
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, brace_open),
+                                    _mm_cmpeq_epi8(folded, brace_close)),
+                       _mm_or_si128(_mm_cmpeq_epi8(bytes, colon),
+                                    _mm_cmpeq_epi8(bytes, comma))),
+          i);
+      space |= GetMask(
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, blank),
+                                    _mm_cmpeq_epi8(bytes, tab)),
+                       _mm_or_si128(_mm_cmpeq_epi8(bytes, line_feed),
+                                    _mm_cmpeq_epi8(bytes, carriage_return))),
+          i);
+    }
+#else
+    for (int i = 0; i < JSON_READER_BLOCK_SIZE; ++i) {
+      uint64_t bit = 1ull << i;
+      switch (data[i]) {
+        case '"':
+          quote |= bit;
+          break;
+        case '\\':
+          backslash |= bit;
+          break;
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+        case ':':
+        case ',':
+          op |= bit;
+          break;
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+          space |= bit;
+          break;
+        default:
+          break;
+      }
+    }
+#endif
+
+    quote &= ~GetEscaped(backslash);
+    // Opening quotes and the characters inside strings are set
+    uint64_t inside = GetPrefixXor(quote) ^ in_string_;
+    in_string_ = static_cast<uint64_t>(static_cast<int64_t>(inside) >> 63);
+    uint64_t scalar = ~(op | space | quote | inside);
+    uint64_t scalar_start = scalar & ~((scalar << 1) | in_scalar_);
+    in_scalar_ = scalar >> 63;
+
+    uint64_t structural = (op & ~inside) | quote | scalar_start;
+    uint32_t* index = indexes_.data() + index_count_;
+    index_count_ += __builtin_popcountll(structural);
+    while (structural != 0) {
+      *index++ = static_cast<uint32_t>(offset + __builtin_ctzll(structural));
+      structural &= structural - 1;
+    }
+  }
+
+#if defined(__SSE2__)
+  static uint64_t GetMask(__m128i compare, int shift) {
+    return static_cast<uint64_t>(
+               static_cast<uint32_t>(_mm_movemask_epi8(compare)))
+           << shift;
+  }
+#endif
+
+  // Characters preceded by a backslash that is not escaped itself.
+  // Backslashes are rare in traces, so they are resolved one by one
+  uint64_t GetEscaped(uint64_t backslash) {
+    uint64_t escaped = escape_next_ ? 1 : 0;
+    escape_next_ = false;
+    backslash &= ~escaped;
+    while (backslash != 0) {
+      int bit = __builtin_ctzll(backslash);
+      if (bit == JSON_READER_BLOCK_SIZE - 1) {
+        escape_next_ = true;
+        break;
+      }
+      escaped |= 1ull << (bit + 1);
+      backslash &= ~(3ull << bit);
+    }
+    return escaped;
+  }
+
+  // Every bit is the parity of the bits up to it, so the ranges between
+  // pairs of quotes are set
+  static uint64_t GetPrefixXor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+  }
+
+  // Stops at a string whose closing quote or a scalar whose end is not
+  // indexed yet, it is walked again with the next buffer
+  template <typename Handler>
+  bool Walk(Handler& handler) {
+    const char* data = buffer_.data();
+    size_t count = index_count_;
+    while (next_ < count) {
+      uint32_t position = indexes_[next_];
+      char c = data[position];
+      switch (c) {
+        case '{':
+        case '[':
+          if (expect_ != EXPECT_VALUE && expect_ != EXPECT_VALUE_OR_END) {
+            return Fail(position, "unexpected container");
+          }
+          containers_.push_back(c);
+          if (c == '{') {
+            handler.StartObject();
+            expect_ = EXPECT_KEY_OR_END;
+          } else {
+            handler.StartArray();
+            expect_ = EXPECT_VALUE_OR_END;
+          }
+          break;
+        case '}':
+          if ((expect_ != EXPECT_KEY_OR_END &&
+               expect_ != EXPECT_COMMA_OR_END) ||
+              containers_.empty() || containers_.back() != '{') {
+            return Fail(position, "unexpected '}'");
+          }
+          containers_.pop_back();
+          handler.EndObject();
+          EndValue();
+          break;
+        case ']':
+          if ((expect_ != EXPECT_VALUE_OR_END &&
+               expect_ != EXPECT_COMMA_OR_END) ||
+              containers_.empty() || containers_.back() != '[') {
+            return Fail(position, "unexpected ']'");
+          }
+          containers_.pop_back();
+          handler.EndArray();
+          EndValue();
+          break;
+        case ':':
+          if (expect_ != EXPECT_COLON) {
+            return Fail(position, "unexpected ':'");
+          }
+          expect_ = EXPECT_VALUE;
+          break;
+        case ',':
+          if (expect_ != EXPECT_COMMA_OR_END) {
+            return Fail(position, "unexpected ','");
+          }
+          expect_ = (containers_.back() == '{') ? EXPECT_KEY : EXPECT_VALUE;
+          break;
+        case '"': {
+          if (next_ + 1 >= count) {
+            return true;
+          }
+          uint32_t end = indexes_[next_ + 1];
+          ASSERT(data[end] == '"');
+          const char* text = data + position + 1;
+          size_t size = end - position - 1;
+          if (memchr(text, '\\', size) != nullptr) {
+            if (!Unescape(text, size)) {
+              return Fail(position, "invalid escape sequence");
+            }
+            text = text_.data();
+            size = text_.size();
+          }
+          if (expect_ == EXPECT_KEY || expect_ == EXPECT_KEY_OR_END) {
+            handler.Key(text, size);
+            expect_ = EXPECT_COLON;
+          } else if (expect_ == EXPECT_VALUE ||
+                     expect_ == EXPECT_VALUE_OR_END) {
+            handler.String(text, size);
+            EndValue();
+          } else {
+            return Fail(position, "unexpected string");
+          }
+          ++next_;
+          break;
+        }
+        default: {
+          size_t end = 0;
+          if (next_ + 1 < count) {
+            end = indexes_[next_ + 1];
+          } else if (eof_) {
+            end = size_;
+          } else {
+            return true;
+          }
+          while (end > position && IsSpace(data[end - 1])) {
+            --end;
+          }
+          if (expect_ != EXPECT_VALUE && expect_ != EXPECT_VALUE_OR_END) {
+            return Fail(position, "unexpected value");
+          }
+          if (!Scalar(handler, data + position, end - position)) {
+            return Fail(position, "invalid value");
+          }
+          EndValue();
+          break;
+        }
+      }
+      ++next_;
+    }
+    return true;
+  }
+
+  void EndValue() {
+    expect_ = containers_.empty() ? EXPECT_NOTHING : EXPECT_COMMA_OR_END;
+  }
+
+  template <typename Handler>
+  static bool Scalar(Handler& handler, const char* text, size_t size) {
+    if (text[0] == '-' || (text[0] >= '0' && text[0] <= '9')) {
+      handler.Number(text, size);
+    } else if (size == 4 && memcmp(text, "true", 4) == 0) {
+      handler.Bool(true);
+    } else if (size == 5 && memcmp(text, "false", 5) == 0) {
+      handler.Bool(false);
+    } else if (size == 4 && memcmp(text, "null", 4) == 0) {
+      handler.Null();
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  bool Unescape(const char* text, size_t size) {
+    text_.clear();
+    for (size_t i = 0; i < size; ++i) {
+      if (text[i] != '\\') {
+        text_.push_back(text[i]);
+        continue;
+      }
+      if (++i == size) {
+        return false;
+      }
+      switch (text[i]) {
+        case '"':
+        case '\\':
+        case '/':
+          text_.push_back(text[i]);
+          break;
+        case 'b':
+          text_.push_back('\b');
+          break;
+        case 'f':
+          text_.push_back('\f');
+          break;
+        case 'n':
+          text_.push_back('\n');
+          break;
+        case 'r':
+          text_.push_back('\r');
+          break;
+        case 't':
+          text_.push_back('\t');
+          break;
+        case 'u': {
+          uint32_t code = 0;
+          if (!ParseHex(text, size, i + 1, code)) {
+            return false;
+          }
+          i += 4;
+          // Characters beyond the basic plane come as surrogate pairs
+          if (code >= 0xD800 && code < 0xDC00 && i + 6 < size &&
+              text[i + 1] == '\\' && text[i + 2] == 'u') {
+            uint32_t low = 0;
+            if (ParseHex(text, size, i + 3, low) && low >= 0xDC00 &&
+                low < 0xE000) {
+              code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+              i += 6;
+            }
+          }
+          AppendUtf8(code);
+          break;
+        }
+        default:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  static bool ParseHex(const char* text, size_t size, size_t offset,
+                       uint32_t& code) {
+    if (offset + 4 > size) {
+      return false;
+    }
+    code = 0;
+    for (size_t i = offset; i < offset + 4; ++i) {
+      char c = text[i];
+      code <<= 4;
+      if (c >= '0' && c <= '9') {
+        code |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        code |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        code |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void AppendUtf8(uint32_t code) {
+    if (code < 0x80) {
+      text_.push_back(static_cast<char>(code));
+    } else if (code < 0x800) {
+      text_.push_back(static_cast<char>(0xC0 | (code >> 6)));
+      text_.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+      text_.push_back(static_cast<char>(0xE0 | (code >> 12)));
+      text_.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      text_.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    } else {
+      text_.push_back(static_cast<char>(0xF0 | (code >> 18)));
+      text_.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+      text_.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+      text_.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+    }
+  }
+
+  // Drops what was walked, the value being read and the bytes not indexed
+  // yet are moved to the start of the buffer. Returns false if nothing
+  // could be dropped
+  bool Compact() {
+    size_t from = (next_ < index_count_) ? indexes_[next_] : scanned_;
+    if (from == 0) {
+      return false;
+    }
+    memmove(buffer_.data(), buffer_.data() + from, size_ - from);
+    size_ -= from;
+    scanned_ -= from;
+    base_ += from;
+    index_count_ -= next_;
+    for (size_t i = 0; i < index_count_; ++i) {
+      indexes_[i] = indexes_[next_ + i] - static_cast<uint32_t>(from);
+    }
+    next_ = 0;
+    return true;
+  }
+
+  bool Grow() {
+    if (capacity_ * 2 > JSON_READER_MAX_BUFFER_SIZE) {
+      error_ = "value at offset " + std::to_string(base_) + " is too long";
+      return false;
+    }
+    capacity_ *= 2;
+    buffer_.resize(capacity_ + JSON_READER_BLOCK_SIZE);
+    indexes_.resize(capacity_ + JSON_READER_BLOCK_SIZE);
+    return true;
+  }
+
+  template <typename Handler>
+  bool Finish(Handler& handler) {
+    if (next_ < index_count_) {
+      truncated_ = true;
+      return Fail(indexes_[next_], "unterminated string");
+    }
+    if (containers_.size() == 1 && containers_.back() == '[' &&
+        (expect_ == EXPECT_COMMA_OR_END || expect_ == EXPECT_VALUE)) {
+      containers_.pop_back();
+      handler.EndArray();
+      expect_ = EXPECT_NOTHING;
+    }
+    if (expect_ != EXPECT_NOTHING) {
+      truncated_ = true;
+      error_ = "unexpected end of input";
+      return false;
+    }
+    return true;
+  }
+
+  bool Fail(size_t position, const char* reason) {
+    error_ = std::string(reason) + " at offset " +
+             std::to_string(base_ + position);
+    return false;
+  }
+
+  FILE* file_ = nullptr;
+  size_t capacity_ = 0;
+  std::vector<char> buffer_;  // Padded to a whole block at the end
+  size_t size_ = 0;
+  size_t scanned_ = 0;  // Bytes indexed
+  uint64_t base_ = 0;   // Input offset of the buffer
+  bool eof_ = false;
+  bool truncated_ = false;
+
+  // State of the first pass at the end of the last block
+  uint64_t in_string_ = 0;  // All bits set inside of a string
+  uint64_t in_scalar_ = 0;
+  bool escape_next_ = false;
+
+  // Structural positions in the buffer, at most one per byte
+  std::vector<uint32_t> indexes_;
+  size_t index_count_ = 0;
+  size_t next_ = 0;  // Next position to walk
+
+  std::vector<char> containers_;  // Open '{' and '['
+  Expectation expect_ = EXPECT_VALUE;
+  std::string text_;  // Unescaped string
+
+  std::string error_;
+};
+
+#endif  // PHPROF_JSON_SAX_READER_H_
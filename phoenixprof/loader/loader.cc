@@ -1,15 +1,33 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <chrono>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #ifndef TOOL_NAME
 #error "TOOL_NAME is not defined"
 #endif
 
+#include "cl_run_statistics.h"
+#include "process_injector.h"
 #include "shared_library.h"
 #include "tool.h"
+#include "tool_control.h"
+#include "trace_collector.h"
+
+extern char **environ;
+
+// Time the injected library is given to open its control channel
+#define ATTACH_WAIT_MS 5000
+#define ATTACH_POLL_MS 10
 
 static std::string GetLibFileName() {
   return std::string("lib") + TOSTRING(TOOL_NAME) + ".so";
@@ -26,6 +44,296 @@ static bool IsFileExists(const char *file_name) {
   return false;
 }
 
+// Decimal number up to max_value, the whole string
+static bool ParseNumber(const char *value, unsigned long max_value,
+                        unsigned long &number) {
+  char *end = nullptr;
+  errno = 0;
+  number = strtoul(value, &end, 10);
+  return value[0] >= '0' && value[0] <= '9' && *end == '\0' &&
+         errno == 0 && number <= max_value;
+}
+
+// Loader options come first and are not passed to the tool,
+// returns false if a value is missing or malformed
+static bool TakeLoaderArgs(int argc, char *argv[], uint32_t &repeat_count,
+                           uint32_t &warmup_count, pid_t &attach_pid,
+                           pid_t &detach_pid,
+                           std::vector<char *> &tool_args) {
+  tool_args.push_back(argv[0]);
+  int i = 1;
+  for (; i < argc; ++i) {
+    unsigned long number = 0;
+    if (strcmp(argv[i], "--repeat") == 0 ||
+        strcmp(argv[i], "--warmup") == 0) {
+      if (i + 1 >= argc || !ParseNumber(argv[i + 1], UINT32_MAX, number)) {
+        return false;
+      }
+      uint32_t &count = (argv[i][2] == 'r') ? repeat_count : warmup_count;
+      count = static_cast<uint32_t>(number);
+      ++i;
+    } else if (strcmp(argv[i], "--attach") == 0 ||
+               strcmp(argv[i], "--detach") == 0) {
+      if (i + 1 >= argc || !ParseNumber(argv[i + 1], INT_MAX, number) ||
+          number == 0) {
+        return false;
+      }
+      pid_t &pid = (argv[i][2] == 'a') ? attach_pid : detach_pid;
+      pid = static_cast<pid_t>(number);
+      ++i;
+    } else {
+      break;
+    }
+  }
+  for (; i < argc; ++i) {
+    tool_args.push_back(argv[i]);
+  }
+  return true;
+}
+
+// Waits for the child and writes out its traces meanwhile. Interrupts
+// from the terminal reach the child as well, the collector stays to write
+// what the child published before it was gone
+static int CollectTraces(pid_t child, TraceCollector *collector) {
+  struct sigaction ignore{}, previous_int{}, previous_term{};
+  ignore.sa_handler = SIG_IGN;
+  sigemptyset(&ignore.sa_mask);
+  sigaction(SIGINT, &ignore, &previous_int);
+  sigaction(SIGTERM, &ignore, &previous_term);
+
+  int status = 0;
+  while (true) {
+    uint32_t count = collector->Drain();
+    pid_t result = waitpid(child, &status, WNOHANG);
+    if (result == child || result < 0) {
+      break;
+    }
+    if (count == 0) {
+      usleep(TRACE_COLLECTOR_POLL_US);
+    }
+  }
+  collector->Finalize(WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+
+  sigaction(SIGINT, &previous_int, nullptr);
+  sigaction(SIGTERM, &previous_term, nullptr);
+  return status;
+}
+
+// Runs the target in a child process, returns false if it did not exit
+// normally with zero status. Exit code is set as the shell would report it
+static bool RunOnce(std::vector<char *> &app_args, TraceCollector *collector,
+                    double &wall_time, int &exit_code) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  pid_t child = fork();
+  if (child < 0) {
+    std::cout << "[ERROR] Failed to fork the loader" << std::endl;
+    exit_code = 1;
+    return false;
+  }
+  if (child == 0) {
+    execvp(app_args[0], app_args.data());
+    std::cout << "[ERROR] Failed to launch the target application: "
+              << app_args[0] << std::endl;
+    _exit(127);
+  }
+
+  int status = 0;
+  if (collector != nullptr) {
+    status = CollectTraces(child, collector);
+  } else if (waitpid(child, &status, 0) != child) {
+    exit_code = 1;
+    return false;
+  }
+  std::chrono::duration<double, std::nano> time =
+      std::chrono::steady_clock::now() - start;
+  wall_time = time.count();
+
+  if (WIFSIGNALED(status)) {
+    std::cout << "[ERROR] Target application terminated by signal "
+              << WTERMSIG(status) << std::endl;
+    exit_code = 128 + WTERMSIG(status);
+    return false;
+  }
+  exit_code = WEXITSTATUS(status);
+  if (exit_code != 0) {
+    std::cout << "[ERROR] Target application exited with status "
+              << exit_code << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Single run with traces written by the loader, the loader exits with
+// the status of the application
+static int RunCollected(std::vector<char *> &app_args) {
+  TraceCollector *collector = TraceCollector::Create();
+  if (collector == nullptr) {
+    std::cout << "[ERROR] Failed to create trace collector" << std::endl;
+    return 1;
+  }
+  double wall_time = 0;
+  int exit_code = 0;
+  RunOnce(app_args, collector, wall_time, exit_code);
+  std::cout << "Trace data written by the collector: "
+            << collector->GetWrittenSize() << " bytes" << std::endl;
+  delete collector;
+  return exit_code;
+}
+
+// Runs the target warmup + repeat times, each run writes its latency
+// summary for the loader to compare the runs, or the loader summarizes the
+// traces itself if it collects them. Traces of the last run are left on
+// disk
+static int RunRepeated(std::vector<char *> &app_args, uint32_t repeat_count,
+                       uint32_t warmup_count, bool collect) {
+  char summary_file[] = "/tmp/phoenixprof_run_XXXXXX";
+  int file = mkstemp(summary_file);
+  if (file < 0) {
+    std::cout << "[ERROR] Failed to create run summary file" << std::endl;
+    return 1;
+  }
+  close(file);
+  if (!collect) {
+    utils::SetEnv("PHPROF_RunSummary", summary_file);
+  }
+
+  std::vector<ClLatencyProfile> runs;
+  std::vector<double> wall_times;
+  for (uint32_t i = 0; i < warmup_count + repeat_count; ++i) {
+    bool warmup = i < warmup_count;
+    std::cout << "== " << (warmup ? "Warmup" : "Run") << " "
+              << (warmup ? i + 1 : i - warmup_count + 1) << " of "
+              << (warmup ? warmup_count : repeat_count) << " ==" << std::endl;
+
+    // The traces are complete only once the collector is done with them,
+    // so the loader reads them instead of the application
+    TraceCollector *collector = nullptr;
+    if (collect) {
+      collector = TraceCollector::Create();
+      if (collector == nullptr) {
+        std::cout << "[ERROR] Failed to create trace collector" << std::endl;
+        unlink(summary_file);
+        return 1;
+      }
+    }
+
+    double wall_time = 0;
+    int exit_code = 0;
+    bool succeeded = RunOnce(app_args, collector, wall_time, exit_code);
+    std::vector<std::string> files;
+    if (collector != nullptr) {
+      files = collector->GetFiles();
+      delete collector;
+    }
+    if (!succeeded) {
+      unlink(summary_file);
+      return 1;
+    }
+    if (warmup) {
+      continue;
+    }
+
+    ClLatencyProfile profile;
+    for (const std::string &trace : files) {
+      ClTraceDiff::Load(trace, profile);
+    }
+    if (!collect && !ClTraceDiff::Load(summary_file, profile)) {
+      std::cout << "[WARNING] Run summary is not found, tracing was not "
+                << "enabled in the run" << std::endl;
+    }
+    runs.push_back(std::move(profile));
+    wall_times.push_back(wall_time);
+    truncate(summary_file, 0);
+  }
+  unlink(summary_file);
+
+  ClRunStatistics::PrintReport(runs, wall_times, warmup_count, std::cout);
+  return 0;
+}
+
+static void PrintReply(const std::vector<std::string> &messages,
+                       bool succeeded) {
+  for (const std::string &message : messages) {
+    std::cout << (succeeded ? "" : "[ERROR] ") << message << std::endl;
+  }
+}
+
+// Injects the tool library into the process unless it is there already,
+// then starts tracing with the options given to the loader. Traces are
+// written into the working directory of the process
+static int AttachProcess(pid_t pid, const std::string &library,
+                         void *entry) {
+  if (utils::GetEnv("PHPROF_Collector") == "1") {
+    std::cout << "[ERROR] --collector can not be used with --attach"
+              << std::endl;
+    return 1;
+  }
+  if (utils::GetEnv("PHPROF_Itt") == "1") {
+    std::cerr << "[WARNING] ITT tasks are recorded only if the process "
+              << "was started with the tool library as its ITT collector"
+              << std::endl;
+  }
+
+  if (!ToolControl::IsListening(pid)) {
+    char path[PATH_MAX] = {0};
+    if (realpath(library.c_str(), path) == nullptr) {
+      std::cout << "[ERROR] Failed to locate " << library << std::endl;
+      return 1;
+    }
+    std::string error;
+    if (!ProcessInjector::Inject(pid, path, entry, error)) {
+      std::cout << "[ERROR] Failed to attach to process " << pid << ": "
+                << error << std::endl;
+      return 1;
+    }
+    int waited = 0;
+    while (!ToolControl::IsListening(pid) && waited < ATTACH_WAIT_MS) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(ATTACH_POLL_MS));
+      waited += ATTACH_POLL_MS;
+    }
+  }
+
+  // Tool options are passed the same way as through the environment
+  ToolControlRequest request{TOOL_CONTROL_START, {}};
+  for (char **variable = environ; *variable != nullptr; ++variable) {
+    if (strncmp(*variable, "PHPROF_", 7) == 0) {
+      request.options.push_back(*variable);
+    }
+  }
+  std::vector<std::string> messages;
+  bool started = ToolControl::Send(pid, request, messages);
+  if (!started) {
+    std::cout << "[ERROR] Failed to start tracing in process " << pid
+              << std::endl;
+    PrintReply(messages, started);
+    return 1;
+  }
+  std::cout << "Tracing started in process " << pid << ", traces are "
+            << "written to " << (messages.empty() ? "?" : messages.back())
+            << std::endl;
+  return 0;
+}
+
+// Stops tracing and writes out the traces, the library stays loaded, so
+// the process may be attached to again
+static int DetachProcess(pid_t pid) {
+  std::vector<std::string> messages;
+  bool stopped =
+      ToolControl::Send(pid, ToolControlRequest{TOOL_CONTROL_STOP, {}},
+                        messages);
+  if (!stopped) {
+    std::cout << "[ERROR] Failed to stop tracing in process " << pid
+              << std::endl;
+    PrintReply(messages, stopped);
+    return 1;
+  }
+  std::cout << "Tracing stopped in process " << pid << ", traces are saved "
+            << "to " << (messages.empty() ? "?" : messages.back())
+            << std::endl;
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   // Loading tool library via LD_PRELOAD
   std::string library_file_name = GetLibFileName();
@@ -83,7 +391,39 @@ int main(int argc, char *argv[]) {
 
   // Processing tool args and target app args
 
+  uint32_t repeat_count = 0, warmup_count = 0;
+  pid_t attach_pid = 0, detach_pid = 0;
+  std::vector<char *> tool_args;
+  if (!TakeLoaderArgs(argc, argv, repeat_count, warmup_count, attach_pid,
+                      detach_pid, tool_args)) {
+    std::cout << "[ERROR] Invalid command line" << std::endl;
+    show_help();
+    delete lib;
+    return 0;
+  }
+  argc = static_cast<int>(tool_args.size());
+  argv = tool_args.data();
+
   int app_index = process_args(argc, argv);
+  if (attach_pid > 0 || detach_pid > 0) {
+    if (app_index != argc) {
+      std::cout << "[ERROR] Target application is not expected with "
+                << "--attach or --detach" << std::endl;
+      show_help();
+      delete lib;
+      return 0;
+    }
+    int status = 0;
+    if (detach_pid > 0) {
+      status = DetachProcess(detach_pid);
+    } else {
+      status = AttachProcess(
+          attach_pid, library_file_path,
+          lib->GetSym<void *>("StartControl"));
+    }
+    delete lib;
+    return status;
+  }
   if (app_index <= 0 || app_index >= argc) {
     if (app_index >= argc) {
       std::cout << "[ERROR] Target application to run is not specified"
@@ -103,6 +443,18 @@ int main(int argc, char *argv[]) {
   }
   app_args.push_back(nullptr);
 
+  bool collect = (utils::GetEnv("PHPROF_Collector") == "1");
+  if (repeat_count > 0) {
+    int status = RunRepeated(app_args, repeat_count, warmup_count, collect);
+    delete lib;
+    return status;
+  }
+  if (collect) {
+    int status = RunCollected(app_args);
+    delete lib;
+    return status;
+  }
+
   // Running the target application
   if (execvp(app_args[0], app_args.data())) {
     std::cout << "[ERROR] Failed to launch the target application: "
@@ -0,0 +1,470 @@
+#ifndef PHPROF_PROCESS_INJECTOR_H_
+#define PHPROF_PROCESS_INJECTOR_H_
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "utils.h"
+
+// Bytes below the stack pointer the interrupted code may still use
+#define INJECTOR_RED_ZONE 128
+// Mode flag __libc_dlopen_mode() expects from dlopen() callers
+#define INJECTOR_LIBC_DLOPEN_FLAG 0x80000000
+// Time the thread is given to enter a safe system call
+#define INJECTOR_SAFE_POINT_MS 2000
+// Time an injected call is given to return
+#define INJECTOR_CALL_TIMEOUT_MS 10000
+// Time a running thread is given to stop once interrupted
+#define INJECTOR_STOP_TIMEOUT_MS 1000
+#define INJECTOR_POLL_NS 1000000
+
+// Loads a shared library into a running process and calls its entry
+// function: the main thread of the process is stopped with ptrace, made to
+// call dlopen() and the entry on its own stack, and resumed where it was
+// stopped, other threads keep running meanwhile. Functions are located in
+// the process through the same files mapped into the loader, so both are
+// expected to use the same C library.
+// The thread is taken at a safe point if it reaches one in time: inside or
+// on entry to a system call the C library does not make while holding its
+// own locks (sleeps, waits for I/O). Otherwise it is taken where it is, and
+// if it holds a lock dlopen() needs (e.g. the allocator lock), the call
+// does not return: it is abandoned after a timeout, the thread is put back
+// where it was stopped and released, but the process may not be able to
+// load libraries anymore
+class ProcessInjector {
+ public:  // User Interface
+  // The library path should be absolute, entry is the function address in
+  // the copy of the library the loader has loaded
+  static bool Inject(pid_t pid, const std::string& library, void* entry,
+                     std::string& error) {
+#if defined(__x86_64__)
+    ProcessInjector injector(pid);
+    if (!injector.Attach(error)) {
+      return false;
+    }
+    bool injected = injector.Load(library, entry, error);
+    injector.Detach();
+    return injected;
+#else
+    error = "attaching is supported on x86-64 only";
+    return false;
+#endif
+  }
+
+ private:  // Implementation Details
+  explicit ProcessInjector(pid_t pid) : pid_(pid) {}
+
+#if defined(__x86_64__)
+  // Any stop will do, a signal that stopped the thread is passed on when
+  // the thread is released
+  bool Attach(std::string& error) {
+    if (ptrace(PTRACE_SEIZE, pid_, nullptr,
+               reinterpret_cast<void*>(PTRACE_O_TRACESYSGOOD)) != 0) {
+      error = std::string("ptrace failed: ") + strerror(errno);
+      if (errno == EPERM) {
+        error += " (the process should belong to the same user and "
+                 "kernel.yama.ptrace_scope should be 0, or the loader "
+                 "needs CAP_SYS_PTRACE)";
+      }
+      return false;
+    }
+    int status = 0;
+    if (ptrace(PTRACE_INTERRUPT, pid_, nullptr, nullptr) != 0 ||
+        !WaitStop(status)) {
+      error = "process did not stop";
+      ptrace(PTRACE_DETACH, pid_, nullptr, nullptr);
+      return false;
+    }
+    if ((status >> 16) == 0 && WSTOPSIG(status) != SIGTRAP) {
+      pending_signal_ = WSTOPSIG(status);
+    }
+    if (ptrace(PTRACE_GETREGS, pid_, nullptr, &saved_) != 0) {
+      error = std::string("unable to read registers: ") + strerror(errno);
+      Detach();
+      return false;
+    }
+    if (!WaitSafePoint()) {
+      error = exited_ ? "process exited" : "process did not stop again";
+      Detach();
+      return false;
+    }
+    return true;
+  }
+
+  // System calls a thread blocks in while it holds no lock of the C
+  // library, so dlopen() can run on top of them
+  static bool IsSafeSystemCall(uint64_t number) {
+    switch (number) {
+      case SYS_read:
+      case SYS_nanosleep:
+      case SYS_clock_nanosleep:
+      case SYS_poll:
+      case SYS_ppoll:
+      case SYS_select:
+      case SYS_pselect6:
+      case SYS_epoll_wait:
+      case SYS_epoll_pwait:
+      case SYS_wait4:
+      case SYS_waitid:
+      case SYS_accept:
+      case SYS_accept4:
+      case SYS_recvfrom:
+      case SYS_recvmsg:
+      case SYS_pause:
+      case SYS_rt_sigsuspend:
+      case SYS_rt_sigtimedwait:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // Lets the thread run until it enters a safe system call, saved
+  // registers then repeat the call once the thread is released. Keeps the
+  // thread stopped where it is if it is already blocked in one, and stops
+  // it anywhere if it does not reach one in time. Returns false if the
+  // thread could not be stopped
+  bool WaitSafePoint() {
+    if (IsSafeSystemCall(saved_.orig_rax)) {
+      return true;
+    }
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(INJECTOR_SAFE_POINT_MS);
+    int signal = 0;
+    while (true) {
+      int status = 0;
+      if (ptrace(PTRACE_SYSCALL, pid_, nullptr,
+                 reinterpret_cast<void*>(static_cast<intptr_t>(signal))) !=
+          0) {
+        return false;
+      }
+      signal = 0;
+      if (!WaitStop(status, deadline)) {
+        return !exited_ && Interrupt();
+      }
+      int stop = WSTOPSIG(status);
+      if ((status >> 16) == 0 && stop == (SIGTRAP | 0x80)) {
+        user_regs_struct regs{};
+        if (ptrace(PTRACE_GETREGS, pid_, nullptr, &regs) != 0) {
+          return false;
+        }
+        if (IsSyscallEntry(regs) && IsSafeSystemCall(regs.orig_rax)) {
+          SaveSyscallStop(regs);
+          return true;
+        }
+      } else if ((status >> 16) == 0 && stop != SIGTRAP) {
+        signal = stop;  // Delivered right away
+      }
+    }
+  }
+
+  // Entry stops are told from exit ones by the result not yet set
+  static bool IsSyscallEntry(const user_regs_struct& regs) {
+    return static_cast<int64_t>(regs.rax) == -ENOSYS;
+  }
+
+  // Registers of a system call stop to put back once the thread is
+  // released: a call stopped on entry is made again from the start, one
+  // stopped on exit keeps its result (or restarts as an interrupted call)
+  void SaveSyscallStop(const user_regs_struct& regs) {
+    saved_ = regs;
+    if (IsSyscallEntry(regs)) {
+      saved_.rip -= 2;  // Size of the syscall instruction
+      saved_.rax = regs.orig_rax;
+      saved_.orig_rax = -1;
+    }
+  }
+
+  // Stops the running thread wherever it is and saves its registers.
+  // System call stops met on the way will do, signals are passed on
+  bool Interrupt() {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(INJECTOR_STOP_TIMEOUT_MS);
+    while (true) {
+      int status = 0;
+      if (ptrace(PTRACE_INTERRUPT, pid_, nullptr, nullptr) != 0) {
+        return false;
+      }
+      if (!WaitStop(status, deadline)) {
+        abandoned_ = !exited_;
+        return false;
+      }
+      int signal = WSTOPSIG(status);
+      if ((status >> 16) == PTRACE_EVENT_STOP) {
+        return ptrace(PTRACE_GETREGS, pid_, nullptr, &saved_) == 0;
+      }
+      if ((status >> 16) == 0 && signal == (SIGTRAP | 0x80)) {
+        user_regs_struct regs{};
+        if (ptrace(PTRACE_GETREGS, pid_, nullptr, &regs) != 0) {
+          return false;
+        }
+        SaveSyscallStop(regs);
+        return true;
+      }
+      if ((status >> 16) != 0 || signal == SIGTRAP) {
+        signal = 0;
+      }
+      if (ptrace(PTRACE_CONT, pid_, nullptr,
+                 reinterpret_cast<void*>(static_cast<intptr_t>(signal))) !=
+          0) {
+        return false;
+      }
+    }
+  }
+
+  // A thread that could not be stopped is released by the exit of the
+  // loader
+  void Detach() {
+    if (exited_ || abandoned_) {
+      return;
+    }
+    ptrace(PTRACE_DETACH, pid_, nullptr,
+           reinterpret_cast<void*>(static_cast<intptr_t>(pending_signal_)));
+  }
+
+  bool Load(const std::string& library, void* entry, std::string& error) {
+    // Older C libraries keep dlopen() in libdl, which the process may not
+    // have loaded, the C library has its own variant then
+    uint64_t function = 0;
+    uint64_t mode = RTLD_NOW;
+    if (!GetRemoteAddress(dlsym(RTLD_DEFAULT, "dlopen"), function)) {
+      if (!GetRemoteAddress(dlsym(RTLD_DEFAULT, "__libc_dlopen_mode"),
+                            function)) {
+        error = "dlopen() is not found in the process";
+        return false;
+      }
+      mode |= INJECTOR_LIBC_DLOPEN_FLAG;
+    }
+
+    uint64_t handle = 0;
+    if (!Call(function, library.c_str(), library.size() + 1, mode, handle,
+              error)) {
+      return false;
+    }
+    if (handle == 0) {
+      error = "dlopen() failed in the process for " + library;
+      return false;
+    }
+
+    uint64_t address = 0;
+    if (!GetRemoteAddress(entry, address)) {
+      error = "library is not found in the process after dlopen()";
+      return false;
+    }
+    uint64_t result = 0;
+    return Call(address, nullptr, 0, 0, result, error);
+  }
+
+  // Waits for the thread to stop, false if it is gone or the deadline
+  // has passed
+  bool WaitStop(int& status,
+                std::chrono::steady_clock::time_point deadline =
+                    std::chrono::steady_clock::time_point::max()) {
+    bool bounded = deadline != std::chrono::steady_clock::time_point::max();
+    const struct timespec delay = {0, INJECTOR_POLL_NS};
+    while (true) {
+      pid_t result = waitpid(pid_, &status, __WALL | (bounded ? WNOHANG : 0));
+      if (result == 0) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+          return false;
+        }
+        nanosleep(&delay, nullptr);
+        continue;
+      }
+      if (result != pid_) {
+        if (errno == EINTR) {
+          continue;
+        }
+        exited_ = true;
+        return false;
+      }
+      if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        exited_ = true;
+        return false;
+      }
+      if (WIFSTOPPED(status)) {
+        return true;
+      }
+    }
+  }
+
+  // Calls the function with the data copied below the stack of the thread
+  // as the first argument. The return address is zero, so the thread faults
+  // once the function returns and is stopped there again. A call that does
+  // not return in time is abandoned and the thread is put back
+  bool Call(uint64_t function, const void* data, size_t size, uint64_t arg,
+            uint64_t& result, std::string& error) {
+    user_regs_struct regs = saved_;
+    uint64_t stack = (saved_.rsp - INJECTOR_RED_ZONE - size) & ~15ull;
+    uint64_t data_address = 0;
+    if (size > 0) {
+      if (!Write(stack, data, size)) {
+        error = std::string("unable to write process memory: ") +
+                strerror(errno);
+        return false;
+      }
+      data_address = stack;
+    }
+    uint64_t return_address = 0;
+    stack -= sizeof(return_address);
+    if (!Write(stack, &return_address, sizeof(return_address))) {
+      error = std::string("unable to write process memory: ") +
+              strerror(errno);
+      return false;
+    }
+
+    regs.rsp = stack;
+    regs.rip = function;
+    regs.rdi = data_address;
+    regs.rsi = arg;
+    regs.rax = 0;
+    regs.orig_rax = -1;  // No system call restart on the way out
+    if (ptrace(PTRACE_SETREGS, pid_, nullptr, &regs) != 0) {
+      error = std::string("unable to set registers: ") + strerror(errno);
+      return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(INJECTOR_CALL_TIMEOUT_MS);
+    while (true) {
+      int status = 0;
+      if (ptrace(PTRACE_CONT, pid_, nullptr, nullptr) != 0) {
+        error = "process exited during the call";
+        return false;
+      }
+      if (!WaitStop(status, deadline)) {
+        if (exited_) {
+          error = "process exited during the call";
+          return false;
+        }
+        error = "call did not return in " +
+                std::to_string(INJECTOR_CALL_TIMEOUT_MS) +
+                " ms, the main thread likely holds a lock it needs";
+        user_regs_struct stopped = saved_;
+        if (!Interrupt() ||
+            ptrace(PTRACE_SETREGS, pid_, nullptr, &stopped) != 0) {
+          error += "; the thread could not be put back";
+          return false;
+        }
+        saved_ = stopped;
+        error += "; the thread is put back, but the process may not be "
+                 "able to load libraries anymore";
+        return false;
+      }
+      int signal = WSTOPSIG(status);
+      if ((status >> 16) != 0 || signal == SIGTRAP) {
+        continue;  // Interrupt or event stop
+      }
+      if (signal != SIGSEGV) {
+        pending_signal_ = signal;  // Delivered once the thread is released
+        continue;
+      }
+      if (ptrace(PTRACE_GETREGS, pid_, nullptr, &regs) != 0) {
+        error = std::string("unable to read registers: ") + strerror(errno);
+        return false;
+      }
+      if (regs.rip != return_address) {
+        error = "process crashed during the call";
+        ptrace(PTRACE_SETREGS, pid_, nullptr, &saved_);
+        return false;
+      }
+      result = regs.rax;
+      break;
+    }
+    if (ptrace(PTRACE_SETREGS, pid_, nullptr, &saved_) != 0) {
+      error = std::string("unable to restore registers: ") + strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool Write(uint64_t address, const void* data, size_t size) {
+    const char* bytes = reinterpret_cast<const char*>(data);
+    for (size_t i = 0; i < size; i += sizeof(long)) {
+      long word = 0;
+      size_t count = std::min(sizeof(long), size - i);
+      if (count < sizeof(long)) {
+        errno = 0;
+        word = ptrace(PTRACE_PEEKDATA, pid_, address + i, nullptr);
+        if (errno != 0) {
+          return false;
+        }
+      }
+      memcpy(&word, bytes + i, count);
+      if (ptrace(PTRACE_POKEDATA, pid_, address + i, word) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Same offset in the same file mapped into the process, the file is
+  // matched by its inode, with the device or name to tell files apart
+  bool GetRemoteAddress(void* local, uint64_t& remote) const {
+    Dl_info info{};
+    if (local == nullptr || dladdr(local, &info) == 0 ||
+        info.dli_fname == nullptr || info.dli_fbase == nullptr) {
+      return false;
+    }
+    struct stat file{};
+    if (stat(info.dli_fname, &file) != 0) {
+      return false;
+    }
+    std::string name = GetBaseName(info.dli_fname);
+
+    std::ifstream maps("/proc/" + std::to_string(pid_) + "/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+      std::stringstream stream(line);
+      std::string range, permissions, offset, device, path;
+      uint64_t inode = 0;
+      stream >> range >> permissions >> offset >> device >> inode >> path;
+      if (inode != file.st_ino || std::stoull(offset, nullptr, 16) != 0) {
+        continue;
+      }
+      unsigned int major_id = 0, minor_id = 0;
+      sscanf(device.c_str(), "%x:%x", &major_id, &minor_id);
+      if ((major_id != major(file.st_dev) || minor_id != minor(file.st_dev)) &&
+          GetBaseName(path) != name) {
+        continue;
+      }
+      uint64_t base = std::stoull(range, nullptr, 16);
+      remote = base + (reinterpret_cast<uint64_t>(local) -
+                       reinterpret_cast<uint64_t>(info.dli_fbase));
+      return true;
+    }
+    return false;
+  }
+
+  static std::string GetBaseName(const std::string& path) {
+    size_t pos = path.find_last_of('/');
+    return (pos == std::string::npos) ? path : path.substr(pos + 1);
+  }
+
+  user_regs_struct saved_{};
+#endif
+
+  pid_t pid_ = 0;
+  int pending_signal_ = 0;
+  bool exited_ = false;
+  bool abandoned_ = false;  // Thread left running, not in a ptrace stop
+};
+
+#endif  // PHPROF_PROCESS_INJECTOR_H_
@@ -0,0 +1,239 @@
+#ifndef PHPROF_TRACE_COLLECTOR_H_
+#define PHPROF_TRACE_COLLECTOR_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace_ring.h"
+
+// Pause of the collector when nothing is published
+#define TRACE_COLLECTOR_POLL_US 1000
+
+// Runs in the loader process next to the traced application and writes
+// the chunks it publishes into the trace ring, so file I/O is done outside
+// of the application. Files are created as their first chunks arrive and
+// get their final header once the application closes them, or once the
+// application is gone
+class TraceCollector {
+ public:  // User Interface
+  // Should be created before the application is started, it inherits the
+  // ring through the environment
+  static TraceCollector* Create() {
+    TraceRing* ring = TraceRing::Create();
+    if (ring == nullptr) {
+      return nullptr;
+    }
+    TraceCollector* collector = new TraceCollector(ring);
+    ASSERT(collector != nullptr);
+    return collector;
+  }
+
+  ~TraceCollector() {
+    for (auto& item : files_) {
+      if (item.second.fd >= 0) {
+        close(item.second.fd);
+      }
+    }
+    delete ring_;
+  }
+
+  TraceCollector(const TraceCollector& copy) = delete;
+  TraceCollector& operator=(const TraceCollector& copy) = delete;
+
+  // Writes out everything published so far, returns the number of entries
+  // processed
+  uint32_t Drain() {
+    uint32_t count = 0;
+    TraceRingEntryKind kind = TRACE_RING_ENTRY_DATA;
+    uint32_t index = 0;
+    while (ring_->PopEntry(kind, index)) {
+      switch (kind) {
+        case TRACE_RING_ENTRY_DATA:
+          WriteSlot(index);
+          ring_->ReleaseSlot(index);
+          break;
+        case TRACE_RING_ENTRY_CLOSE:
+          CloseFile(index);
+          break;
+        case TRACE_RING_ENTRY_REMOVE:
+          RemoveFile(index);
+          break;
+        case TRACE_RING_ENTRY_RELEASE:
+          ReleaseFile(index);
+          break;
+        default:
+          ASSERT(0);
+          break;
+      }
+      ++count;
+    }
+    return count;
+  }
+
+  // Called once the application is gone: chunks it was still filling are
+  // written as they are, files it did not close keep their open state or
+  // are marked crashed if the application was killed by a signal
+  void Finalize(int signal) {
+    Drain();
+    for (uint32_t i = 0; i < TRACE_RING_SLOT_COUNT; ++i) {
+      if (ring_->GetSlot(i).state.load(std::memory_order_acquire) ==
+          TRACE_RING_SLOT_FILLING) {
+        WriteSlot(i);
+      }
+    }
+    for (uint32_t i = 0; i < ring_->GetStreamCount(); ++i) {
+      if (!ring_->IsStreamOpen(i)) {
+        continue;  // Released
+      }
+      auto it = files_.find(i);
+      if (it != files_.end() && it->second.fd < 0) {
+        continue;  // Closed or removed
+      }
+      TraceFileHeader* header = ring_->GetFileHeader(i);
+      if (signal != 0 && header->state == TRACE_STATE_OPEN) {
+        header->state = TRACE_STATE_CRASHED;
+        header->signal = static_cast<uint32_t>(signal);
+      }
+      CloseFile(i);
+    }
+    if (ring_->GetWaitCount() > 0) {
+      std::cerr << "[WARNING] Application waited for the trace collector "
+                << ring_->GetWaitCount() << " times" << std::endl;
+    }
+  }
+
+  // Trace files that were written and not removed
+  std::vector<std::string> GetFiles() const {
+    std::vector<std::string> files = released_files_;
+    for (const auto& item : files_) {
+      if (!item.second.removed) {
+        files.push_back(item.second.filename);
+      }
+    }
+    return files;
+  }
+
+  uint64_t GetWrittenSize() const { return written_size_; }
+
+ private:  // Implementation Details
+  struct File {
+    std::string filename;
+    int fd = -1;
+    uint64_t end = 0;  // End of the last chunk
+    bool removed = false;
+  };
+
+  explicit TraceCollector(TraceRing* ring) : ring_(ring) {}
+
+  // The file is created with the header the stream has at the moment
+  File* GetFile(uint32_t stream) {
+    auto it = files_.find(stream);
+    if (it != files_.end()) {
+      return (it->second.fd >= 0) ? &it->second : nullptr;
+    }
+
+    File& file = files_[stream];
+    file.filename = ring_->GetFilename(stream);
+    file.fd = open(file.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file.fd < 0) {
+      std::cerr << "[WARNING] Unable to create trace file "
+                << file.filename << std::endl;
+      file.removed = true;
+      return nullptr;
+    }
+    Write(file, ring_->GetFileHeader(stream), sizeof(TraceFileHeader), 0);
+    return &file;
+  }
+
+  void WriteSlot(uint32_t index) {
+    const TraceRingSlot& slot = ring_->GetSlot(index);
+    File* file = GetFile(slot.stream);
+    if (file != nullptr) {
+      Write(*file, ring_->GetSlotData(index), slot.size, slot.offset);
+    }
+  }
+
+  void Write(File& file, const void* data, uint64_t size, uint64_t offset) {
+    const char* bytes = reinterpret_cast<const char*>(data);
+    uint64_t done = 0;
+    while (done < size) {
+      ssize_t result = pwrite(file.fd, bytes + done, size - done,
+                              static_cast<off_t>(offset + done));
+      if (result <= 0) {
+        if (!failed_) {
+          std::cerr << "[WARNING] Unable to write trace file "
+                    << file.filename << std::endl;
+          failed_ = true;
+        }
+        return;
+      }
+      done += result;
+    }
+    file.end = std::max(file.end, offset + size);
+    written_size_ += size;
+  }
+
+  // Stores the final header and pads the last chunk to the alignment, as
+  // if the file was written by the application itself
+  void CloseFile(uint32_t stream) {
+    File* file = GetFile(stream);
+    if (file == nullptr) {
+      return;
+    }
+    const TraceFileHeader* header = ring_->GetFileHeader(stream);
+    Write(*file, header, sizeof(TraceFileHeader), 0);
+    if (header->alignment > 0) {
+      uint64_t size = (file->end + header->alignment - 1) / header->alignment *
+                      header->alignment;
+      if (ftruncate(file->fd, static_cast<off_t>(size)) != 0) {
+        failed_ = true;
+      }
+    }
+    close(file->fd);
+    file->fd = -1;
+  }
+
+  void RemoveFile(uint32_t stream) {
+    auto it = files_.find(stream);
+    if (it == files_.end()) {
+      return;
+    }
+    if (it->second.fd >= 0) {
+      close(it->second.fd);
+      it->second.fd = -1;
+    }
+    unlink(it->second.filename.c_str());
+    it->second.removed = true;
+  }
+
+  // Stream is closed or removed by the application, so it may be handed
+  // out for another file
+  void ReleaseFile(uint32_t stream) {
+    auto it = files_.find(stream);
+    if (it != files_.end()) {
+      if (it->second.fd >= 0) {
+        close(it->second.fd);
+      }
+      if (!it->second.removed) {
+        released_files_.push_back(it->second.filename);
+      }
+      files_.erase(it);
+    }
+    ring_->RecycleStream(stream);
+  }
+
+ private:  // Data
+  TraceRing* ring_ = nullptr;
+  std::map<uint32_t, File> files_;  // By stream
+  std::vector<std::string> released_files_;
+  uint64_t written_size_ = 0;
+  bool failed_ = false;
+};
+
+#endif  // PHPROF_TRACE_COLLECTOR_H_
@@ -0,0 +1,77 @@
+# Runs a mock workload under the tool and checks the findings of the
+# synchronization analysis of its traces, so changes to the heuristics show
+# up as changed counts. Expects LOADER, WORKLOAD, CONVERTER, SCRIPT and
+# WORK_DIR to be set, e.g. by the test of the build:
+#   cmake -DLOADER=... -DWORKLOAD=... -DCONVERTER=... -DSCRIPT=... \
+#         -DWORK_DIR=... -P check_sync_analysis.cmake
+# mock/workloads/gemm_like.txt runs 10000 iterations on one thread, each
+# with a clFinish right before a blocking read and a buffer created and
+# released. Idle device gaps depend on the timing of the host and are not
+# checked
+
+foreach(variable LOADER WORKLOAD CONVERTER SCRIPT WORK_DIR)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "${variable} is not set")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+execute_process(
+  COMMAND "${LOADER}" "${WORKLOAD}" "${SCRIPT}"
+  WORKING_DIRECTORY "${WORK_DIR}"
+  RESULT_VARIABLE result
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "Workload failed (${result}):\n${output}")
+endif()
+
+# Queue calls go to the device trace and the rest to the host trace, the
+# analysis merges the sibling traces of the run
+execute_process(
+  COMMAND "${CONVERTER}" --sync-analysis gpu0_trace.bin report.json
+  WORKING_DIRECTORY "${WORK_DIR}"
+  RESULT_VARIABLE result
+  OUTPUT_VARIABLE report
+  ERROR_VARIABLE report)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "Conversion failed (${result}):\n${report}")
+endif()
+
+set(failed FALSE)
+
+# Report row: rank, saving, % time, count and the pattern
+function(expect_finding pattern count)
+  string(REGEX MATCH " ([0-9]+)  ${pattern}\n" match "${report}")
+  if(NOT match)
+    message(SEND_ERROR "Not reported: ${pattern}")
+    set(failed TRUE PARENT_SCOPE)
+  elseif(NOT CMAKE_MATCH_1 EQUAL count)
+    message(SEND_ERROR
+      "${pattern}: ${CMAKE_MATCH_1} found, ${count} expected")
+    set(failed TRUE PARENT_SCOPE)
+  endif()
+endfunction()
+
+function(expect_no_finding pattern)
+  string(FIND "${report}" "  ${pattern}\n" position)
+  if(NOT position EQUAL -1)
+    message(SEND_ERROR "Reported: ${pattern}")
+    set(failed TRUE PARENT_SCOPE)
+  endif()
+endfunction()
+
+# Every clFinish is followed by the blocking read, so it is reported there
+# and not as a clFinish after a few enqueues. The last read is not
+# followed by a submission, so it does not delay one
+expect_finding("clFinish before a blocking transfer" 10000)
+expect_finding("Blocking clEnqueueReadBuffer/WriteBuffer" 9999)
+expect_finding("clCreateBuffer/clReleaseMemObject churn" 9999)
+expect_no_finding("clFinish after every few enqueues")
+
+if(failed)
+  message(FATAL_ERROR "Unexpected findings:\n${report}")
+endif()
+message(STATUS "${report}")
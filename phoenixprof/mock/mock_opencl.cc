@@ -0,0 +1,1169 @@
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CL/tracing_api.h>
+
+#include "utils.h"
+
+// Mock OpenCL runtime: exposes one Intel platform with one CPU and
+// PHPROF_MOCK_GPU_COUNT (default 2) GPU devices, implements Intel tracing
+// extension and a subset of OpenCL API enough for tracing stress tests.
+// Commands are not executed, device time is simulated per queue:
+// kernels take MOCK_NS_PER_WORK_ITEM per work item, transfers
+// take size / MOCK_BYTES_PER_NS nanoseconds.
+
+#define MAX_TRACING_HANDLE_COUNT 16
+#define MAX_DEVICE_COUNT 16
+#define DEFAULT_GPU_COUNT 2
+#define MOCK_NS_PER_WORK_ITEM 1
+#define MOCK_BYTES_PER_NS 10
+#define MOCK_DEVICE_DRIFT_PPM 50
+
+// Object Model
+
+struct _cl_platform_id {
+  const char* name;
+  const char* vendor;
+};
+
+struct _cl_device_id {
+  cl_device_type type;
+  std::string name;
+  cl_platform_id platform;
+  uint64_t timer_offset;
+  uint64_t timer_drift_ppm;
+};
+
+struct _cl_context {
+  std::atomic<int> ref_count;
+  cl_device_id device;
+};
+
+struct _cl_command_queue {
+  std::atomic<int> ref_count;
+  cl_context context;
+  cl_device_id device;
+  std::mutex lock;
+  uint64_t busy_until;  // Host time when the last command completes
+};
+
+struct _cl_mem {
+  std::atomic<int> ref_count;
+  cl_context context;
+  size_t size;
+};
+
+struct _cl_program {
+  std::atomic<int> ref_count;
+  cl_context context;
+};
+
+struct _cl_kernel {
+  std::atomic<int> ref_count;
+  cl_program program;
+  std::string name;
+};
+
+struct _cl_event {
+  std::atomic<int> ref_count;
+  cl_command_queue queue;
+  cl_device_id device;  // Kept for profiling info after the queue is gone
+  uint64_t queued;  // Host time
+  uint64_t start;
+  uint64_t end;
+};
+
+struct _cl_tracing_handle {
+  cl_device_id device;
+  cl_tracing_callback callback;
+  void* user_data;
+  std::atomic<bool> points[CL_FUNCTION_COUNT];
+  std::atomic<int> active{0};  // Traced calls in flight
+};
+
+// Runtime State
+
+static _cl_platform_id platform = {"Intel(R) OpenCL Mock Platform",
+                                   "Intel(R) Corporation"};
+
+static std::vector<_cl_device_id*> CreateDevices() {
+  std::vector<_cl_device_id*> devices;
+  devices.push_back(new _cl_device_id{CL_DEVICE_TYPE_CPU,
+                                      "Intel(R) Mock CPU", &platform, 0, 0});
+
+  int gpu_count = DEFAULT_GPU_COUNT;
+  std::string value = utils::GetEnv("PHPROF_MOCK_GPU_COUNT");
+  if (!value.empty()) {
+    gpu_count = std::stoi(value);
+  }
+  for (int i = 0; i < gpu_count && devices.size() < MAX_DEVICE_COUNT; ++i) {
+    // Device clocks start at different points and run slightly faster
+    // than the host clock to mimic real timer domains
+    devices.push_back(new _cl_device_id{
+        CL_DEVICE_TYPE_GPU, "Intel(R) Mock GPU " + std::to_string(i),
+        &platform, 1000000000ull * (i + 1),
+        static_cast<uint64_t>(MOCK_DEVICE_DRIFT_PPM) * (i + 1)});
+  }
+  return devices;
+}
+
+static const std::vector<_cl_device_id*>& GetDevices() {
+  static std::vector<_cl_device_id*> devices = CreateDevices();
+  return devices;
+}
+
+static uint64_t GetHostTime() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint64_t GetDeviceTime(cl_device_id device, uint64_t host_time) {
+  return host_time + host_time / 1000000 * device->timer_drift_ppm +
+         device->timer_offset;
+}
+
+static void WaitUntil(uint64_t host_time) {
+  while (GetHostTime() < host_time) {
+    std::this_thread::yield();
+  }
+}
+
+static cl_int ReturnInfo(const void* value, size_t size,
+                         size_t param_value_size, void* param_value,
+                         size_t* param_value_size_ret) {
+  if (param_value != nullptr) {
+    if (param_value_size < size) {
+      return CL_INVALID_VALUE;
+    }
+    memcpy(param_value, value, size);
+  }
+  if (param_value_size_ret != nullptr) {
+    *param_value_size_ret = size;
+  }
+  return CL_SUCCESS;
+}
+
+static cl_int ReturnString(const char* value, size_t param_value_size,
+                           void* param_value, size_t* param_value_size_ret) {
+  return ReturnInfo(value, strlen(value) + 1, param_value_size, param_value,
+                    param_value_size_ret);
+}
+
+static void SetError(cl_int* errcode_ret, cl_int status) {
+  if (errcode_ret != nullptr) {
+    *errcode_ret = status;
+  }
+}
+
+// Schedules the command on the simulated device and creates its event
+static cl_int Submit(cl_command_queue queue, uint64_t duration,
+                     bool blocking, cl_event* event) {
+  if (queue == nullptr) {
+    return CL_INVALID_COMMAND_QUEUE;
+  }
+
+  uint64_t queued = GetHostTime();
+  uint64_t start = 0, end = 0;
+  {
+    const std::lock_guard<std::mutex> lock(queue->lock);
+    start = std::max(queued, queue->busy_until);
+    end = start + duration;
+    queue->busy_until = end;
+  }
+
+  if (event != nullptr) {
+    *event = new _cl_event{{1}, queue, queue->device, queued, start, end};
+  }
+  if (blocking) {
+    WaitUntil(end);
+  }
+  return CL_SUCCESS;
+}
+
+// Tracing
+
+static std::atomic<cl_tracing_handle>
+    tracing_handles[MAX_TRACING_HANDLE_COUNT];
+static std::atomic<cl_uint> correlation_id(0);
+static thread_local bool inside_callback = false;
+
+// Calls enter callbacks of all enabled handles on construction and exit
+// callbacks on destruction, so the return value is already set by then
+class TracingScope {
+ public:
+  TracingScope(cl_function_id function, const char* name, const void* params,
+               void* return_value)
+      : function_(function) {
+    if (inside_callback) {
+      return;
+    }
+
+    // A handle is held for the whole call, so disabling it waits for the
+    // exit callbacks, as the tracing extension guarantees
+    for (int i = 0; i < MAX_TRACING_HANDLE_COUNT; ++i) {
+      cl_tracing_handle handle = tracing_handles[i].load();
+      if (handle == nullptr ||
+          !handle->points[function].load(std::memory_order_relaxed)) {
+        continue;
+      }
+      ++handle->active;
+      if (tracing_handles[i].load() != handle) {
+        --handle->active;
+        continue;
+      }
+      handles_[handle_count_++] = handle;
+    }
+    if (handle_count_ == 0) {
+      return;
+    }
+
+    data_.site = CL_CALLBACK_SITE_ENTER;
+    data_.correlationId = correlation_id.fetch_add(1);
+    data_.functionName = name;
+    data_.functionParams = params;
+    data_.functionReturnValue = return_value;
+    Notify();
+  }
+
+  ~TracingScope() {
+    if (handle_count_ == 0) {
+      return;
+    }
+    data_.site = CL_CALLBACK_SITE_EXIT;
+    Notify();
+    for (int i = 0; i < handle_count_; ++i) {
+      --handles_[i]->active;
+    }
+  }
+
+  TracingScope(const TracingScope& copy) = delete;
+  TracingScope& operator=(const TracingScope& copy) = delete;
+
+ private:
+  void Notify() {
+    inside_callback = true;
+    for (int i = 0; i < handle_count_; ++i) {
+      data_.correlationData = &correlation_data_[i];
+      handles_[i]->callback(function_, &data_, handles_[i]->user_data);
+    }
+    inside_callback = false;
+  }
+
+  cl_function_id function_;
+  cl_callback_data data_{};
+  cl_tracing_handle handles_[MAX_TRACING_HANDLE_COUNT];
+  int handle_count_ = 0;
+  cl_ulong correlation_data_[MAX_TRACING_HANDLE_COUNT] = {0};
+};
+
+static cl_int CL_API_CALL MockCreateTracingHandle(cl_device_id device,
+                                                  cl_tracing_callback callback,
+                                                  void* user_data,
+                                                  cl_tracing_handle* handle) {
+  if (device == nullptr || callback == nullptr || handle == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  cl_tracing_handle result = new _cl_tracing_handle;
+  result->device = device;
+  result->callback = callback;
+  result->user_data = user_data;
+  for (int i = 0; i < CL_FUNCTION_COUNT; ++i) {
+    result->points[i] = false;
+  }
+  *handle = result;
+  return CL_SUCCESS;
+}
+
+static cl_int CL_API_CALL MockSetTracingPoint(cl_tracing_handle handle,
+                                              cl_function_id function,
+                                              cl_bool enable) {
+  if (handle == nullptr || static_cast<int>(function) < 0 ||
+      static_cast<int>(function) >= CL_FUNCTION_COUNT) {
+    return CL_INVALID_VALUE;
+  }
+  handle->points[function] = (enable == CL_TRUE);
+  return CL_SUCCESS;
+}
+
+static cl_int CL_API_CALL MockEnableTracing(cl_tracing_handle handle) {
+  if (handle == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  for (int i = 0; i < MAX_TRACING_HANDLE_COUNT; ++i) {
+    cl_tracing_handle expected = nullptr;
+    if (tracing_handles[i].compare_exchange_strong(expected, handle)) {
+      return CL_SUCCESS;
+    }
+  }
+  return CL_INVALID_OPERATION;
+}
+
+static cl_int CL_API_CALL MockDisableTracing(cl_tracing_handle handle) {
+  if (handle == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  for (int i = 0; i < MAX_TRACING_HANDLE_COUNT; ++i) {
+    cl_tracing_handle expected = handle;
+    if (tracing_handles[i].compare_exchange_strong(expected, nullptr)) {
+      while (handle->active.load() > 0) {
+        std::this_thread::yield();
+      }
+      return CL_SUCCESS;
+    }
+  }
+  return CL_INVALID_VALUE;
+}
+
+static cl_int CL_API_CALL MockGetTracingState(cl_tracing_handle handle,
+                                              cl_bool* enable) {
+  if (handle == nullptr || enable == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  *enable = CL_FALSE;
+  for (int i = 0; i < MAX_TRACING_HANDLE_COUNT; ++i) {
+    if (tracing_handles[i].load() == handle) {
+      *enable = CL_TRUE;
+    }
+  }
+  return CL_SUCCESS;
+}
+
+static cl_int CL_API_CALL MockDestroyTracingHandle(cl_tracing_handle handle) {
+  if (handle == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  cl_bool enabled = CL_FALSE;
+  MockGetTracingState(handle, &enabled);
+  if (enabled == CL_TRUE) {
+    return CL_INVALID_OPERATION;
+  }
+  delete handle;
+  return CL_SUCCESS;
+}
+
+// Unified Shared Memory API, reachable through the extension function
+// lookup only and not covered by tracing
+
+static void* CL_API_CALL MockHostMemAlloc(cl_context context,
+                                          const cl_ulong* /* properties */,
+                                          size_t size, cl_uint /* alignment */,
+                                          cl_int* errcode_ret) {
+  if (context == nullptr || size == 0) {
+    SetError(errcode_ret, CL_INVALID_VALUE);
+    return nullptr;
+  }
+  SetError(errcode_ret, CL_SUCCESS);
+  return new char[size];
+}
+
+static void* CL_API_CALL MockDeviceMemAlloc(cl_context context,
+                                            cl_device_id /* device */,
+                                            const cl_ulong* properties,
+                                            size_t size, cl_uint alignment,
+                                            cl_int* errcode_ret) {
+  return MockHostMemAlloc(context, properties, size, alignment, errcode_ret);
+}
+
+static cl_int CL_API_CALL MockMemFree(cl_context context, void* pointer) {
+  if (context == nullptr) {
+    return CL_INVALID_CONTEXT;
+  }
+  delete[] static_cast<char*>(pointer);
+  return CL_SUCCESS;
+}
+
+// Platform and Device API
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms,
+                 cl_uint* num_platforms) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetPlatformIDs params{&num_entries, &platforms, &num_platforms};
+  TracingScope scope(CL_FUNCTION_clGetPlatformIDs, "clGetPlatformIDs",
+                     &params, &result);
+
+  if ((platforms == nullptr && num_platforms == nullptr) ||
+      (platforms != nullptr && num_entries == 0)) {
+    result = CL_INVALID_VALUE;
+    return result;
+  }
+  if (platforms != nullptr) {
+    platforms[0] = &platform;
+  }
+  if (num_platforms != nullptr) {
+    *num_platforms = 1;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetPlatformInfo(cl_platform_id platform_id, cl_platform_info param_name,
+                  size_t param_value_size, void* param_value,
+                  size_t* param_value_size_ret) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetPlatformInfo params{&platform_id, &param_name,
+                                     &param_value_size, &param_value,
+                                     &param_value_size_ret};
+  TracingScope scope(CL_FUNCTION_clGetPlatformInfo, "clGetPlatformInfo",
+                     &params, &result);
+
+  if (platform_id != &platform) {
+    result = CL_INVALID_PLATFORM;
+    return result;
+  }
+
+  const char* value = nullptr;
+  switch (param_name) {
+    case CL_PLATFORM_PROFILE:
+      value = "FULL_PROFILE";
+      break;
+    case CL_PLATFORM_VERSION:
+      value = "OpenCL 3.0 Mock";
+      break;
+    case CL_PLATFORM_NAME:
+      value = platform.name;
+      break;
+    case CL_PLATFORM_VENDOR:
+      value = platform.vendor;
+      break;
+    case CL_PLATFORM_EXTENSIONS:
+      value = "";
+      break;
+    default:
+      result = CL_INVALID_VALUE;
+      return result;
+  }
+  result = ReturnString(value, param_value_size, param_value,
+                        param_value_size_ret);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetDeviceIDs(cl_platform_id platform_id, cl_device_type device_type,
+               cl_uint num_entries, cl_device_id* devices,
+               cl_uint* num_devices) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetDeviceIDs params{&platform_id, &device_type, &num_entries,
+                                  &devices, &num_devices};
+  TracingScope scope(CL_FUNCTION_clGetDeviceIDs, "clGetDeviceIDs", &params,
+                     &result);
+
+  if (platform_id != &platform) {
+    result = CL_INVALID_PLATFORM;
+    return result;
+  }
+
+  cl_uint count = 0;
+  for (cl_device_id device : GetDevices()) {
+    if ((device->type & device_type) == 0) {
+      continue;
+    }
+    if (devices != nullptr && count < num_entries) {
+      devices[count] = device;
+    }
+    ++count;
+  }
+
+  if (count == 0) {
+    result = CL_DEVICE_NOT_FOUND;
+    return result;
+  }
+  if (num_devices != nullptr) {
+    *num_devices = count;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetDeviceInfo(cl_device_id device, cl_device_info param_name,
+                size_t param_value_size, void* param_value,
+                size_t* param_value_size_ret) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetDeviceInfo params{&device, &param_name, &param_value_size,
+                                   &param_value, &param_value_size_ret};
+  TracingScope scope(CL_FUNCTION_clGetDeviceInfo, "clGetDeviceInfo", &params,
+                     &result);
+
+  if (device == nullptr) {
+    result = CL_INVALID_DEVICE;
+    return result;
+  }
+
+  size_t resolution = 1;
+  switch (param_name) {
+    case CL_DEVICE_TYPE:
+      result = ReturnInfo(&device->type, sizeof(device->type),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    case CL_DEVICE_NAME:
+      result = ReturnString(device->name.c_str(), param_value_size,
+                            param_value, param_value_size_ret);
+      break;
+    case CL_DEVICE_VENDOR:
+      result = ReturnString(device->platform->vendor, param_value_size,
+                            param_value, param_value_size_ret);
+      break;
+    case CL_DEVICE_VERSION:
+      result = ReturnString("OpenCL 3.0 Mock", param_value_size, param_value,
+                            param_value_size_ret);
+      break;
+    case CL_DRIVER_VERSION:
+      result = ReturnString(TOSTRING(PHPROF_VERSION), param_value_size,
+                            param_value, param_value_size_ret);
+      break;
+    case CL_DEVICE_PLATFORM:
+      result = ReturnInfo(&device->platform, sizeof(device->platform),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    case CL_DEVICE_PROFILING_TIMER_RESOLUTION:
+      result = ReturnInfo(&resolution, sizeof(resolution), param_value_size,
+                          param_value, param_value_size_ret);
+      break;
+    default:
+      result = CL_INVALID_VALUE;
+      break;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetDeviceAndHostTimer(cl_device_id device, cl_ulong* device_timestamp,
+                        cl_ulong* host_timestamp) {
+  if (device == nullptr) {
+    return CL_INVALID_DEVICE;
+  }
+  if (device_timestamp == nullptr || host_timestamp == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  *host_timestamp = GetHostTime();
+  *device_timestamp = GetDeviceTime(device, *host_timestamp);
+  return CL_SUCCESS;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetHostTimer(cl_device_id device, cl_ulong* host_timestamp) {
+  if (device == nullptr) {
+    return CL_INVALID_DEVICE;
+  }
+  if (host_timestamp == nullptr) {
+    return CL_INVALID_VALUE;
+  }
+  *host_timestamp = GetHostTime();
+  return CL_SUCCESS;
+}
+
+extern "C" PHPROF_EXPORT void* CL_API_CALL
+clGetExtensionFunctionAddressForPlatform(cl_platform_id platform_id,
+                                         const char* func_name) {
+  if (platform_id != &platform || func_name == nullptr) {
+    return nullptr;
+  }
+
+  static const struct {
+    const char* name;
+    void* address;
+  } functions[] = {
+      {"clCreateTracingHandleINTEL",
+       reinterpret_cast<void*>(MockCreateTracingHandle)},
+      {"clSetTracingPointINTEL", reinterpret_cast<void*>(MockSetTracingPoint)},
+      {"clDestroyTracingHandleINTEL",
+       reinterpret_cast<void*>(MockDestroyTracingHandle)},
+      {"clEnableTracingINTEL", reinterpret_cast<void*>(MockEnableTracing)},
+      {"clDisableTracingINTEL", reinterpret_cast<void*>(MockDisableTracing)},
+      {"clGetTracingStateINTEL", reinterpret_cast<void*>(MockGetTracingState)},
+      {"clHostMemAllocINTEL", reinterpret_cast<void*>(MockHostMemAlloc)},
+      {"clDeviceMemAllocINTEL", reinterpret_cast<void*>(MockDeviceMemAlloc)},
+      {"clSharedMemAllocINTEL", reinterpret_cast<void*>(MockDeviceMemAlloc)},
+      {"clMemFreeINTEL", reinterpret_cast<void*>(MockMemFree)},
+      {"clMemBlockingFreeINTEL", reinterpret_cast<void*>(MockMemFree)},
+  };
+  for (const auto& function : functions) {
+    if (strcmp(function.name, func_name) == 0) {
+      return function.address;
+    }
+  }
+  return nullptr;
+}
+
+// Context, Queue and Program API
+
+extern "C" PHPROF_EXPORT cl_context CL_API_CALL clCreateContext(
+    const cl_context_properties* properties, cl_uint num_devices,
+    const cl_device_id* devices,
+    void(CL_CALLBACK* pfn_notify)(const char*, const void*, size_t, void*),
+    void* user_data, cl_int* errcode_ret) {
+  cl_context result = nullptr;
+  cl_params_clCreateContext params{&properties, &num_devices, &devices,
+                                   &pfn_notify, &user_data, &errcode_ret};
+  TracingScope scope(CL_FUNCTION_clCreateContext, "clCreateContext", &params,
+                     &result);
+
+  if (num_devices == 0 || devices == nullptr || devices[0] == nullptr) {
+    SetError(errcode_ret, CL_INVALID_VALUE);
+    return result;
+  }
+  result = new _cl_context{{1}, devices[0]};
+  SetError(errcode_ret, CL_SUCCESS);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clReleaseContext(cl_context context) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clReleaseContext params{&context};
+  TracingScope scope(CL_FUNCTION_clReleaseContext, "clReleaseContext",
+                     &params, &result);
+
+  if (context == nullptr) {
+    result = CL_INVALID_CONTEXT;
+    return result;
+  }
+  if (--context->ref_count == 0) {
+    delete context;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_command_queue CL_API_CALL
+clCreateCommandQueueWithProperties(cl_context context, cl_device_id device,
+                                   const cl_queue_properties* properties,
+                                   cl_int* errcode_ret) {
+  cl_command_queue result = nullptr;
+  cl_params_clCreateCommandQueueWithProperties params{
+      &context, &device, &properties, &errcode_ret};
+  TracingScope scope(CL_FUNCTION_clCreateCommandQueueWithProperties,
+                     "clCreateCommandQueueWithProperties", &params, &result);
+
+  if (context == nullptr || device == nullptr) {
+    SetError(errcode_ret, CL_INVALID_VALUE);
+    return result;
+  }
+  result = new _cl_command_queue;
+  result->ref_count = 1;
+  result->context = context;
+  result->device = device;
+  result->busy_until = 0;
+  SetError(errcode_ret, CL_SUCCESS);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clReleaseCommandQueue(cl_command_queue command_queue) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clReleaseCommandQueue params{&command_queue};
+  TracingScope scope(CL_FUNCTION_clReleaseCommandQueue,
+                     "clReleaseCommandQueue", &params, &result);
+
+  if (command_queue == nullptr) {
+    result = CL_INVALID_COMMAND_QUEUE;
+    return result;
+  }
+  if (--command_queue->ref_count == 0) {
+    WaitUntil(command_queue->busy_until);
+    delete command_queue;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_program CL_API_CALL
+clCreateProgramWithSource(cl_context context, cl_uint count,
+                          const char** strings, const size_t* lengths,
+                          cl_int* errcode_ret) {
+  cl_program result = nullptr;
+  cl_params_clCreateProgramWithSource params{&context, &count, &strings,
+                                             &lengths, &errcode_ret};
+  TracingScope scope(CL_FUNCTION_clCreateProgramWithSource,
+                     "clCreateProgramWithSource", &params, &result);
+
+  if (context == nullptr) {
+    SetError(errcode_ret, CL_INVALID_CONTEXT);
+    return result;
+  }
+  result = new _cl_program{{1}, context};
+  SetError(errcode_ret, CL_SUCCESS);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clBuildProgram(
+    cl_program program, cl_uint num_devices, const cl_device_id* device_list,
+    const char* options,
+    void(CL_CALLBACK* pfn_notify)(cl_program program, void* user_data),
+    void* user_data) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clBuildProgram params{&program, &num_devices, &device_list,
+                                  &options,  &pfn_notify,  &user_data};
+  TracingScope scope(CL_FUNCTION_clBuildProgram, "clBuildProgram", &params,
+                     &result);
+
+  if (program == nullptr) {
+    result = CL_INVALID_VALUE;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clReleaseProgram(cl_program program) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clReleaseProgram params{&program};
+  TracingScope scope(CL_FUNCTION_clReleaseProgram, "clReleaseProgram",
+                     &params, &result);
+
+  if (program == nullptr) {
+    result = CL_INVALID_VALUE;
+    return result;
+  }
+  if (--program->ref_count == 0) {
+    delete program;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_kernel CL_API_CALL
+clCreateKernel(cl_program program, const char* kernel_name,
+               cl_int* errcode_ret) {
+  cl_kernel result = nullptr;
+  cl_params_clCreateKernel params{&program, &kernel_name, &errcode_ret};
+  TracingScope scope(CL_FUNCTION_clCreateKernel, "clCreateKernel", &params,
+                     &result);
+
+  if (program == nullptr || kernel_name == nullptr) {
+    SetError(errcode_ret, CL_INVALID_VALUE);
+    return result;
+  }
+  result = new _cl_kernel{{1}, program, kernel_name};
+  SetError(errcode_ret, CL_SUCCESS);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
+               const void* arg_value) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clSetKernelArg params{&kernel, &arg_index, &arg_size, &arg_value};
+  TracingScope scope(CL_FUNCTION_clSetKernelArg, "clSetKernelArg", &params,
+                     &result);
+
+  if (kernel == nullptr) {
+    result = CL_INVALID_KERNEL;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetKernelInfo(cl_kernel kernel, cl_kernel_info param_name,
+                size_t param_value_size, void* param_value,
+                size_t* param_value_size_ret) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetKernelInfo params{&kernel, &param_name, &param_value_size,
+                                   &param_value, &param_value_size_ret};
+  TracingScope scope(CL_FUNCTION_clGetKernelInfo, "clGetKernelInfo", &params,
+                     &result);
+
+  if (kernel == nullptr) {
+    result = CL_INVALID_KERNEL;
+    return result;
+  }
+
+  switch (param_name) {
+    case CL_KERNEL_FUNCTION_NAME:
+      result = ReturnString(kernel->name.c_str(), param_value_size,
+                            param_value, param_value_size_ret);
+      break;
+    case CL_KERNEL_CONTEXT:
+      result = ReturnInfo(&kernel->program->context, sizeof(cl_context),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    case CL_KERNEL_PROGRAM:
+      result = ReturnInfo(&kernel->program, sizeof(cl_program),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    default:
+      result = CL_INVALID_VALUE;
+      break;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clReleaseKernel(cl_kernel kernel) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clReleaseKernel params{&kernel};
+  TracingScope scope(CL_FUNCTION_clReleaseKernel, "clReleaseKernel", &params,
+                     &result);
+
+  if (kernel == nullptr) {
+    result = CL_INVALID_KERNEL;
+    return result;
+  }
+  if (--kernel->ref_count == 0) {
+    delete kernel;
+  }
+  return result;
+}
+
+// Memory API
+
+extern "C" PHPROF_EXPORT cl_mem CL_API_CALL
+clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
+               void* host_ptr, cl_int* errcode_ret) {
+  cl_mem result = nullptr;
+  cl_params_clCreateBuffer params{&context, &flags, &size, &host_ptr,
+                                  &errcode_ret};
+  TracingScope scope(CL_FUNCTION_clCreateBuffer, "clCreateBuffer", &params,
+                     &result);
+
+  if (context == nullptr) {
+    SetError(errcode_ret, CL_INVALID_CONTEXT);
+    return result;
+  }
+  result = new _cl_mem{{1}, context, size};
+  SetError(errcode_ret, CL_SUCCESS);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clReleaseMemObject(cl_mem memobj) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clReleaseMemObject params{&memobj};
+  TracingScope scope(CL_FUNCTION_clReleaseMemObject, "clReleaseMemObject",
+                     &params, &result);
+
+  if (memobj == nullptr) {
+    result = CL_INVALID_MEM_OBJECT;
+    return result;
+  }
+  if (--memobj->ref_count == 0) {
+    delete memobj;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clRetainMemObject(cl_mem memobj) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clRetainMemObject params{&memobj};
+  TracingScope scope(CL_FUNCTION_clRetainMemObject, "clRetainMemObject",
+                     &params, &result);
+
+  if (memobj == nullptr) {
+    result = CL_INVALID_MEM_OBJECT;
+    return result;
+  }
+  ++memobj->ref_count;
+  return result;
+}
+
+extern "C" PHPROF_EXPORT void* CL_API_CALL
+clSVMAlloc(cl_context context, cl_svm_mem_flags flags, size_t size,
+           cl_uint alignment) {
+  void* result = nullptr;
+  cl_params_clSVMAlloc params{&context, &flags, &size, &alignment};
+  TracingScope scope(CL_FUNCTION_clSVMAlloc, "clSVMAlloc", &params, &result);
+
+  if (context == nullptr || size == 0) {
+    return result;
+  }
+  result = new char[size];
+  return result;
+}
+
+extern "C" PHPROF_EXPORT void CL_API_CALL clSVMFree(cl_context context,
+                                                    void* svm_pointer) {
+  cl_params_clSVMFree params{&context, &svm_pointer};
+  TracingScope scope(CL_FUNCTION_clSVMFree, "clSVMFree", &params, nullptr);
+
+  if (context != nullptr) {
+    delete[] static_cast<char*>(svm_pointer);
+  }
+}
+
+// Enqueue API
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clEnqueueReadBuffer(
+    cl_command_queue command_queue, cl_mem buffer, cl_bool blocking_read,
+    size_t offset, size_t size, void* ptr, cl_uint num_events_in_wait_list,
+    const cl_event* event_wait_list, cl_event* event) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clEnqueueReadBuffer params{
+      &command_queue, &buffer, &blocking_read,           &offset, &size,
+      &ptr,           &num_events_in_wait_list, &event_wait_list, &event};
+  TracingScope scope(CL_FUNCTION_clEnqueueReadBuffer, "clEnqueueReadBuffer",
+                     &params, &result);
+
+  if (buffer == nullptr) {
+    result = CL_INVALID_MEM_OBJECT;
+    return result;
+  }
+  result = Submit(command_queue, size / MOCK_BYTES_PER_NS,
+                  blocking_read == CL_TRUE, event);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clEnqueueWriteBuffer(
+    cl_command_queue command_queue, cl_mem buffer, cl_bool blocking_write,
+    size_t offset, size_t size, const void* ptr,
+    cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+    cl_event* event) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clEnqueueWriteBuffer params{
+      &command_queue, &buffer, &blocking_write,          &offset, &size,
+      &ptr,           &num_events_in_wait_list, &event_wait_list, &event};
+  TracingScope scope(CL_FUNCTION_clEnqueueWriteBuffer, "clEnqueueWriteBuffer",
+                     &params, &result);
+
+  if (buffer == nullptr) {
+    result = CL_INVALID_MEM_OBJECT;
+    return result;
+  }
+  result = Submit(command_queue, size / MOCK_BYTES_PER_NS,
+                  blocking_write == CL_TRUE, event);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clEnqueueNDRangeKernel(
+    cl_command_queue command_queue, cl_kernel kernel, cl_uint work_dim,
+    const size_t* global_work_offset, const size_t* global_work_size,
+    const size_t* local_work_size, cl_uint num_events_in_wait_list,
+    const cl_event* event_wait_list, cl_event* event) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clEnqueueNDRangeKernel params{&command_queue,
+                                          &kernel,
+                                          &work_dim,
+                                          &global_work_offset,
+                                          &global_work_size,
+                                          &local_work_size,
+                                          &num_events_in_wait_list,
+                                          &event_wait_list,
+                                          &event};
+  TracingScope scope(CL_FUNCTION_clEnqueueNDRangeKernel,
+                     "clEnqueueNDRangeKernel", &params, &result);
+
+  if (kernel == nullptr) {
+    result = CL_INVALID_KERNEL;
+    return result;
+  }
+  if (work_dim == 0 || global_work_size == nullptr) {
+    result = CL_INVALID_VALUE;
+    return result;
+  }
+
+  uint64_t work_item_count = 1;
+  for (cl_uint i = 0; i < work_dim; ++i) {
+    work_item_count *= global_work_size[i];
+  }
+  result = Submit(command_queue, work_item_count * MOCK_NS_PER_WORK_ITEM,
+                  false, event);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clFlush(cl_command_queue command_queue) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clFlush params{&command_queue};
+  TracingScope scope(CL_FUNCTION_clFlush, "clFlush", &params, &result);
+
+  if (command_queue == nullptr) {
+    result = CL_INVALID_COMMAND_QUEUE;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clFinish(cl_command_queue command_queue) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clFinish params{&command_queue};
+  TracingScope scope(CL_FUNCTION_clFinish, "clFinish", &params, &result);
+
+  if (command_queue == nullptr) {
+    result = CL_INVALID_COMMAND_QUEUE;
+    return result;
+  }
+
+  uint64_t busy_until = 0;
+  {
+    const std::lock_guard<std::mutex> lock(command_queue->lock);
+    busy_until = command_queue->busy_until;
+  }
+  WaitUntil(busy_until);
+  return result;
+}
+
+// Event API
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clWaitForEvents(cl_uint num_events, const cl_event* event_list) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clWaitForEvents params{&num_events, &event_list};
+  TracingScope scope(CL_FUNCTION_clWaitForEvents, "clWaitForEvents", &params,
+                     &result);
+
+  if (num_events == 0 || event_list == nullptr) {
+    result = CL_INVALID_VALUE;
+    return result;
+  }
+  for (cl_uint i = 0; i < num_events; ++i) {
+    if (event_list[i] == nullptr) {
+      result = CL_INVALID_EVENT;
+      return result;
+    }
+    WaitUntil(event_list[i]->end);
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetCommandQueueInfo(cl_command_queue command_queue,
+                      cl_command_queue_info param_name,
+                      size_t param_value_size, void* param_value,
+                      size_t* param_value_size_ret) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetCommandQueueInfo params{&command_queue, &param_name,
+                                         &param_value_size, &param_value,
+                                         &param_value_size_ret};
+  TracingScope scope(CL_FUNCTION_clGetCommandQueueInfo,
+                     "clGetCommandQueueInfo", &params, &result);
+
+  if (command_queue == nullptr) {
+    result = CL_INVALID_COMMAND_QUEUE;
+    return result;
+  }
+
+  switch (param_name) {
+    case CL_QUEUE_CONTEXT:
+      result = ReturnInfo(&command_queue->context, sizeof(cl_context),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    case CL_QUEUE_DEVICE:
+      result = ReturnInfo(&command_queue->device, sizeof(cl_device_id),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    default:
+      result = CL_INVALID_VALUE;
+      break;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetEventInfo(cl_event event, cl_event_info param_name,
+               size_t param_value_size, void* param_value,
+               size_t* param_value_size_ret) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetEventInfo params{&event, &param_name, &param_value_size,
+                                  &param_value, &param_value_size_ret};
+  TracingScope scope(CL_FUNCTION_clGetEventInfo, "clGetEventInfo", &params,
+                     &result);
+
+  if (event == nullptr) {
+    result = CL_INVALID_EVENT;
+    return result;
+  }
+
+  cl_int status = CL_COMPLETE;
+  cl_uint ref_count = event->ref_count;
+  switch (param_name) {
+    case CL_EVENT_COMMAND_QUEUE:
+      result = ReturnInfo(&event->queue, sizeof(cl_command_queue),
+                          param_value_size, param_value, param_value_size_ret);
+      break;
+    case CL_EVENT_REFERENCE_COUNT:
+      result = ReturnInfo(&ref_count, sizeof(ref_count), param_value_size,
+                          param_value, param_value_size_ret);
+      break;
+    case CL_EVENT_COMMAND_EXECUTION_STATUS: {
+      uint64_t now = GetHostTime();
+      if (now < event->start) {
+        status = CL_QUEUED;
+      } else if (now < event->end) {
+        status = CL_RUNNING;
+      }
+      result = ReturnInfo(&status, sizeof(status), param_value_size,
+                          param_value, param_value_size_ret);
+      break;
+    }
+    default:
+      result = CL_INVALID_VALUE;
+      break;
+  }
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetEventProfilingInfo(cl_event event, cl_profiling_info param_name,
+                        size_t param_value_size, void* param_value,
+                        size_t* param_value_size_ret) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clGetEventProfilingInfo params{&event, &param_name,
+                                           &param_value_size, &param_value,
+                                           &param_value_size_ret};
+  TracingScope scope(CL_FUNCTION_clGetEventProfilingInfo,
+                     "clGetEventProfilingInfo", &params, &result);
+
+  if (event == nullptr) {
+    result = CL_INVALID_EVENT;
+    return result;
+  }
+  if (GetHostTime() < event->end) {
+    result = CL_PROFILING_INFO_NOT_AVAILABLE;
+    return result;
+  }
+
+  uint64_t host_time = 0;
+  switch (param_name) {
+    case CL_PROFILING_COMMAND_QUEUED:
+    case CL_PROFILING_COMMAND_SUBMIT:
+      host_time = event->queued;
+      break;
+    case CL_PROFILING_COMMAND_START:
+      host_time = event->start;
+      break;
+    case CL_PROFILING_COMMAND_END:
+      host_time = event->end;
+      break;
+    default:
+      result = CL_INVALID_VALUE;
+      return result;
+  }
+
+  cl_ulong device_time = GetDeviceTime(event->device, host_time);
+  result = ReturnInfo(&device_time, sizeof(device_time), param_value_size,
+                      param_value, param_value_size_ret);
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clRetainEvent(cl_event event) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clRetainEvent params{&event};
+  TracingScope scope(CL_FUNCTION_clRetainEvent, "clRetainEvent", &params,
+                     &result);
+
+  if (event == nullptr) {
+    result = CL_INVALID_EVENT;
+    return result;
+  }
+  ++event->ref_count;
+  return result;
+}
+
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL clReleaseEvent(cl_event event) {
+  cl_int result = CL_SUCCESS;
+  cl_params_clReleaseEvent params{&event};
+  TracingScope scope(CL_FUNCTION_clReleaseEvent, "clReleaseEvent", &params,
+                     &result);
+
+  if (event == nullptr) {
+    result = CL_INVALID_EVENT;
+    return result;
+  }
+  if (--event->ref_count == 0) {
+    delete event;
+  }
+  return result;
+}
@@ -0,0 +1,565 @@
+#include <dlfcn.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CL/cl.h>
+
+#include "utils.h"
+
+// Scriptable OpenCL workload: every thread creates its own queue and runs
+// the list of operations from the script the given number of iterations.
+//
+// Script syntax (one statement per line, '#' starts a comment):
+//   threads <count>
+//   iterations <count>
+//   device cpu|gpu [index]
+//   clCreateBuffer <size>           - replaces the current thread buffer
+//   clEnqueueWriteBuffer [blocking]
+//   clEnqueueReadBuffer [blocking]
+//   clEnqueueNDRangeKernel <work items> [kernel name]
+//                                   - kernels are created by name once,
+//                                     "Mock" if not given
+//   clSetKernelArg                  - sets the argument of every kernel
+//   clGetEventInfo <count>          - polls status of the last command
+//   clWaitForEvents
+//   clFlush
+//   clFinish
+//   clReleaseMemObject
+//   clSVMAlloc <size>               - replaces the current thread SVM buffer
+//   clSVMFree
+//   clDeviceMemAllocINTEL <size>    - replaces the current thread USM buffer
+//   clMemFreeINTEL
+//   itt_task_begin <name>           - ITT task around the following
+//   itt_task_end                      operations, needs INTEL_LIBITTNOTIFY64
+//   terminate exit|abort|segv       - ends the process abnormally after the
+//                                     workload, to check crash safe capture
+
+#define DEFAULT_BUFFER_SIZE 4096
+
+static const char* kDefaultScript =
+    "threads 4\n"
+    "iterations 250000\n"
+    "device gpu 0\n"
+    "clCreateBuffer 4096\n"
+    "clEnqueueWriteBuffer\n"
+    "clSetKernelArg\n"
+    "clEnqueueNDRangeKernel 256\n"
+    "clGetEventInfo 4\n"
+    "clEnqueueReadBuffer blocking\n"
+    "clReleaseMemObject\n";
+
+enum OperationType {
+  OPERATION_CREATE_BUFFER,
+  OPERATION_WRITE_BUFFER,
+  OPERATION_READ_BUFFER,
+  OPERATION_NDRANGE_KERNEL,
+  OPERATION_SET_KERNEL_ARG,
+  OPERATION_GET_EVENT_INFO,
+  OPERATION_WAIT_FOR_EVENTS,
+  OPERATION_FLUSH,
+  OPERATION_FINISH,
+  OPERATION_RELEASE_BUFFER,
+  OPERATION_SVM_ALLOC,
+  OPERATION_SVM_FREE,
+  OPERATION_USM_ALLOC,
+  OPERATION_USM_FREE,
+  OPERATION_TASK_BEGIN,
+  OPERATION_TASK_END
+};
+
+struct Operation {
+  OperationType type;
+  uint64_t value;
+  size_t kernel = 0;  // Index into kernel names for a kernel enqueue
+};
+
+struct Workload {
+  unsigned thread_count = 1;
+  uint64_t iteration_count = 1;
+  cl_device_type device_type = CL_DEVICE_TYPE_GPU;
+  unsigned device_index = 0;
+  std::string termination;
+  std::vector<Operation> operations;
+  std::vector<std::string> task_names;
+  std::vector<std::string> kernel_names;
+};
+
+// Minimal stand-in for the ITT static part an application links with:
+// loads the collector named by INTEL_LIBITTNOTIFY64 and resolves the task
+// API by name, layouts follow ittnotify.h
+struct IttId {
+  unsigned long long d1, d2, d3;
+};
+
+struct IttApi {
+  void* (*domain_create)(const char*) = nullptr;
+  void* (*string_handle_create)(const char*) = nullptr;
+  void (*task_begin)(const void*, IttId, IttId, void*) = nullptr;
+  void (*task_end)(const void*) = nullptr;
+  void* domain = nullptr;
+  std::vector<void*> names;
+};
+
+static IttApi LoadIttApi(const Workload& workload) {
+  IttApi api;
+  std::string path = utils::GetEnv("INTEL_LIBITTNOTIFY64");
+  if (workload.task_names.empty() || path.empty()) {
+    return api;
+  }
+
+  void* library = dlopen(path.c_str(), RTLD_LAZY);
+  if (library == nullptr) {
+    std::cerr << "[WARNING] Unable to load ITT collector " << path
+              << std::endl;
+    return api;
+  }
+  api.domain_create = reinterpret_cast<decltype(api.domain_create)>(
+      dlsym(library, "__itt_domain_create"));
+  api.string_handle_create =
+      reinterpret_cast<decltype(api.string_handle_create)>(
+          dlsym(library, "__itt_string_handle_create"));
+  api.task_begin = reinterpret_cast<decltype(api.task_begin)>(
+      dlsym(library, "__itt_task_begin"));
+  api.task_end = reinterpret_cast<decltype(api.task_end)>(
+      dlsym(library, "__itt_task_end"));
+  if (api.domain_create == nullptr || api.string_handle_create == nullptr ||
+      api.task_begin == nullptr || api.task_end == nullptr) {
+    std::cerr << "[WARNING] ITT task API is not found in " << path
+              << std::endl;
+    return IttApi();
+  }
+
+  api.domain = api.domain_create("phoenixprof.mock");
+  for (const std::string& name : workload.task_names) {
+    api.names.push_back(api.string_handle_create(name.c_str()));
+  }
+  return api;
+}
+
+// USM functions are extension functions, resolved for the platform of the
+// device like an application does
+struct UsmApi {
+  void*(CL_API_CALL* device_mem_alloc)(cl_context, cl_device_id,
+                                       const cl_ulong*, size_t, cl_uint,
+                                       cl_int*) = nullptr;
+  cl_int(CL_API_CALL* mem_free)(cl_context, void*) = nullptr;
+};
+
+static UsmApi LoadUsmApi() {
+  UsmApi api;
+  cl_platform_id platform = nullptr;
+  if (clGetPlatformIDs(1, &platform, nullptr) != CL_SUCCESS) {
+    return api;
+  }
+  api.device_mem_alloc = reinterpret_cast<decltype(api.device_mem_alloc)>(
+      clGetExtensionFunctionAddressForPlatform(platform,
+                                               "clDeviceMemAllocINTEL"));
+  api.mem_free = reinterpret_cast<decltype(api.mem_free)>(
+      clGetExtensionFunctionAddressForPlatform(platform, "clMemFreeINTEL"));
+  if (api.device_mem_alloc == nullptr || api.mem_free == nullptr) {
+    std::cerr << "[WARNING] USM functions are not found" << std::endl;
+    return UsmApi();
+  }
+  return api;
+}
+
+static bool ParseScript(std::istream& script, Workload& workload) {
+  std::string line;
+  int line_number = 0;
+  while (std::getline(script, line)) {
+    ++line_number;
+    size_t comment = line.find('#');
+    if (comment != std::string::npos) {
+      line = line.substr(0, comment);
+    }
+
+    std::stringstream stream(line);
+    std::string statement, argument;
+    if (!(stream >> statement)) {
+      continue;
+    }
+    stream >> argument;
+    uint64_t value = 0;
+    if (!argument.empty() && isdigit(argument[0])) {
+      value = std::stoull(argument);
+    }
+
+    if (statement == "threads") {
+      workload.thread_count = value > 0 ? value : 1;
+    } else if (statement == "iterations") {
+      workload.iteration_count = value;
+    } else if (statement == "device") {
+      workload.device_type =
+          (argument == "cpu") ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU;
+      stream >> workload.device_index;
+    } else if (statement == "itt_task_begin") {
+      workload.operations.push_back(
+          Operation{OPERATION_TASK_BEGIN, workload.task_names.size()});
+      workload.task_names.push_back(argument.empty() ? "task" : argument);
+    } else if (statement == "itt_task_end") {
+      workload.operations.push_back(Operation{OPERATION_TASK_END, 0});
+    } else if (statement == "terminate") {
+      workload.termination = argument;
+    } else if (statement == "clCreateBuffer") {
+      workload.operations.push_back(Operation{
+          OPERATION_CREATE_BUFFER, value > 0 ? value : DEFAULT_BUFFER_SIZE});
+    } else if (statement == "clEnqueueWriteBuffer") {
+      workload.operations.push_back(
+          Operation{OPERATION_WRITE_BUFFER, argument == "blocking"});
+    } else if (statement == "clEnqueueReadBuffer") {
+      workload.operations.push_back(
+          Operation{OPERATION_READ_BUFFER, argument == "blocking"});
+    } else if (statement == "clEnqueueNDRangeKernel") {
+      std::string kernel_name;
+      if (!(stream >> kernel_name)) {
+        kernel_name = "Mock";
+      }
+      std::vector<std::string>& names = workload.kernel_names;
+      size_t kernel =
+          std::find(names.begin(), names.end(), kernel_name) - names.begin();
+      if (kernel == names.size()) {
+        names.push_back(kernel_name);
+      }
+      workload.operations.push_back(
+          Operation{OPERATION_NDRANGE_KERNEL, value > 0 ? value : 1, kernel});
+    } else if (statement == "clSetKernelArg") {
+      workload.operations.push_back(Operation{OPERATION_SET_KERNEL_ARG, 0});
+    } else if (statement == "clGetEventInfo") {
+      workload.operations.push_back(
+          Operation{OPERATION_GET_EVENT_INFO, value > 0 ? value : 1});
+    } else if (statement == "clWaitForEvents") {
+      workload.operations.push_back(Operation{OPERATION_WAIT_FOR_EVENTS, 0});
+    } else if (statement == "clFlush") {
+      workload.operations.push_back(Operation{OPERATION_FLUSH, 0});
+    } else if (statement == "clFinish") {
+      workload.operations.push_back(Operation{OPERATION_FINISH, 0});
+    } else if (statement == "clReleaseMemObject") {
+      workload.operations.push_back(Operation{OPERATION_RELEASE_BUFFER, 0});
+    } else if (statement == "clSVMAlloc") {
+      workload.operations.push_back(Operation{
+          OPERATION_SVM_ALLOC, value > 0 ? value : DEFAULT_BUFFER_SIZE});
+    } else if (statement == "clSVMFree") {
+      workload.operations.push_back(Operation{OPERATION_SVM_FREE, 0});
+    } else if (statement == "clDeviceMemAllocINTEL") {
+      workload.operations.push_back(Operation{
+          OPERATION_USM_ALLOC, value > 0 ? value : DEFAULT_BUFFER_SIZE});
+    } else if (statement == "clMemFreeINTEL") {
+      workload.operations.push_back(Operation{OPERATION_USM_FREE, 0});
+    } else {
+      std::cerr << "[ERROR] Unknown statement at line " << line_number << ": "
+                << statement << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+static cl_device_id GetDevice(cl_device_type type, unsigned index) {
+  cl_platform_id platform = nullptr;
+  cl_int status = clGetPlatformIDs(1, &platform, nullptr);
+  if (status != CL_SUCCESS) {
+    return nullptr;
+  }
+
+  cl_uint device_count = 0;
+  status = clGetDeviceIDs(platform, type, 0, nullptr, &device_count);
+  if (status != CL_SUCCESS || index >= device_count) {
+    return nullptr;
+  }
+
+  std::vector<cl_device_id> devices(device_count, nullptr);
+  status = clGetDeviceIDs(platform, type, device_count, devices.data(),
+                          nullptr);
+  ASSERT(status == CL_SUCCESS);
+  return devices[index];
+}
+
+// Returns the number of OpenCL calls issued by the thread
+static uint64_t Run(const Workload* workload, const IttApi* itt,
+                    const UsmApi* usm, cl_context context,
+                    cl_device_id device,
+                    const std::vector<cl_kernel>* kernels) {
+  cl_int status = CL_SUCCESS;
+  uint64_t call_count = 0;
+
+  cl_command_queue queue = clCreateCommandQueueWithProperties(
+      context, device, nullptr, &status);
+  ASSERT(status == CL_SUCCESS && queue != nullptr);
+
+  cl_mem buffer = nullptr;
+  size_t buffer_size = 0;
+  std::vector<char> host_data;
+  cl_event event = nullptr;
+  void* svm_buffer = nullptr;
+  void* usm_buffer = nullptr;
+
+  for (uint64_t i = 0; i < workload->iteration_count; ++i) {
+    for (const Operation& operation : workload->operations) {
+      cl_event* last_event = nullptr;
+      if (operation.type == OPERATION_WRITE_BUFFER ||
+          operation.type == OPERATION_READ_BUFFER ||
+          operation.type == OPERATION_NDRANGE_KERNEL) {
+        if (event != nullptr) {
+          status = clReleaseEvent(event);
+          ASSERT(status == CL_SUCCESS);
+          ++call_count;
+          event = nullptr;
+        }
+        last_event = &event;
+      }
+
+      switch (operation.type) {
+        case OPERATION_CREATE_BUFFER:
+          if (buffer != nullptr) {
+            status = clReleaseMemObject(buffer);
+            ASSERT(status == CL_SUCCESS);
+            ++call_count;
+          }
+          buffer_size = operation.value;
+          host_data.resize(buffer_size);
+          buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, buffer_size,
+                                  nullptr, &status);
+          ASSERT(status == CL_SUCCESS && buffer != nullptr);
+          ++call_count;
+          break;
+        case OPERATION_WRITE_BUFFER:
+          status = clEnqueueWriteBuffer(
+              queue, buffer, operation.value ? CL_TRUE : CL_FALSE, 0,
+              buffer_size, host_data.data(), 0, nullptr, last_event);
+          ASSERT(status == CL_SUCCESS);
+          ++call_count;
+          break;
+        case OPERATION_READ_BUFFER:
+          status = clEnqueueReadBuffer(
+              queue, buffer, operation.value ? CL_TRUE : CL_FALSE, 0,
+              buffer_size, host_data.data(), 0, nullptr, last_event);
+          ASSERT(status == CL_SUCCESS);
+          ++call_count;
+          break;
+        case OPERATION_NDRANGE_KERNEL: {
+          size_t global_work_size[] = {operation.value};
+          status = clEnqueueNDRangeKernel(
+              queue, (*kernels)[operation.kernel], 1, nullptr,
+              global_work_size, nullptr, 0, nullptr, last_event);
+          ASSERT(status == CL_SUCCESS);
+          ++call_count;
+          break;
+        }
+        case OPERATION_SET_KERNEL_ARG:
+          for (cl_kernel kernel : *kernels) {
+            status = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+            ASSERT(status == CL_SUCCESS);
+            ++call_count;
+          }
+          break;
+        case OPERATION_GET_EVENT_INFO:
+          for (uint64_t j = 0; j < operation.value && event != nullptr; ++j) {
+            cl_int execution_status = CL_COMPLETE;
+            status = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                    sizeof(cl_int), &execution_status,
+                                    nullptr);
+            ASSERT(status == CL_SUCCESS);
+            ++call_count;
+          }
+          break;
+        case OPERATION_WAIT_FOR_EVENTS:
+          if (event != nullptr) {
+            status = clWaitForEvents(1, &event);
+            ASSERT(status == CL_SUCCESS);
+            ++call_count;
+          }
+          break;
+        case OPERATION_FLUSH:
+          status = clFlush(queue);
+          ASSERT(status == CL_SUCCESS);
+          ++call_count;
+          break;
+        case OPERATION_FINISH:
+          status = clFinish(queue);
+          ASSERT(status == CL_SUCCESS);
+          ++call_count;
+          break;
+        case OPERATION_RELEASE_BUFFER:
+          if (buffer != nullptr) {
+            status = clReleaseMemObject(buffer);
+            ASSERT(status == CL_SUCCESS);
+            ++call_count;
+            buffer = nullptr;
+          }
+          break;
+        case OPERATION_SVM_ALLOC:
+          if (svm_buffer != nullptr) {
+            clSVMFree(context, svm_buffer);
+            ++call_count;
+          }
+          svm_buffer = clSVMAlloc(context, CL_MEM_READ_WRITE,
+                                  operation.value, 0);
+          ASSERT(svm_buffer != nullptr);
+          ++call_count;
+          break;
+        case OPERATION_SVM_FREE:
+          if (svm_buffer != nullptr) {
+            clSVMFree(context, svm_buffer);
+            ++call_count;
+            svm_buffer = nullptr;
+          }
+          break;
+        case OPERATION_USM_ALLOC:
+          if (usm->device_mem_alloc == nullptr) {
+            break;
+          }
+          if (usm_buffer != nullptr) {
+            status = usm->mem_free(context, usm_buffer);
+            ASSERT(status == CL_SUCCESS);
+          }
+          usm_buffer = usm->device_mem_alloc(context, device, nullptr,
+                                             operation.value, 0, &status);
+          ASSERT(status == CL_SUCCESS && usm_buffer != nullptr);
+          break;
+        case OPERATION_USM_FREE:
+          if (usm_buffer != nullptr) {
+            status = usm->mem_free(context, usm_buffer);
+            ASSERT(status == CL_SUCCESS);
+            usm_buffer = nullptr;
+          }
+          break;
+        case OPERATION_TASK_BEGIN:
+          if (itt->task_begin != nullptr) {
+            itt->task_begin(itt->domain, IttId{}, IttId{},
+                            itt->names[operation.value]);
+          }
+          break;
+        case OPERATION_TASK_END:
+          if (itt->task_end != nullptr) {
+            itt->task_end(itt->domain);
+          }
+          break;
+      }
+    }
+  }
+
+  if (event != nullptr) {
+    status = clReleaseEvent(event);
+    ASSERT(status == CL_SUCCESS);
+  }
+  if (buffer != nullptr) {
+    status = clReleaseMemObject(buffer);
+    ASSERT(status == CL_SUCCESS);
+  }
+  if (svm_buffer != nullptr) {
+    clSVMFree(context, svm_buffer);
+  }
+  if (usm_buffer != nullptr) {
+    status = usm->mem_free(context, usm_buffer);
+    ASSERT(status == CL_SUCCESS);
+  }
+  status = clFinish(queue);
+  ASSERT(status == CL_SUCCESS);
+  status = clReleaseCommandQueue(queue);
+  ASSERT(status == CL_SUCCESS);
+
+  return call_count;
+}
+
+int main(int argc, char* argv[]) {
+  Workload workload;
+  bool parsed = false;
+  if (argc > 1) {
+    std::ifstream script(argv[1]);
+    if (!script.is_open()) {
+      std::cerr << "[ERROR] Unable to open script " << argv[1] << std::endl;
+      return 1;
+    }
+    parsed = ParseScript(script, workload);
+  } else {
+    std::stringstream script(kDefaultScript);
+    parsed = ParseScript(script, workload);
+  }
+  if (!parsed) {
+    return 1;
+  }
+
+  cl_device_id device =
+      GetDevice(workload.device_type, workload.device_index);
+  if (device == nullptr) {
+    std::cerr << "[ERROR] Unable to find target device" << std::endl;
+    return 1;
+  }
+
+  cl_int status = CL_SUCCESS;
+  cl_context context =
+      clCreateContext(nullptr, 1, &device, nullptr, nullptr, &status);
+  ASSERT(status == CL_SUCCESS && context != nullptr);
+
+  const char* source = "__kernel void Mock(__global char* data) {}";
+  cl_program program =
+      clCreateProgramWithSource(context, 1, &source, nullptr, &status);
+  ASSERT(status == CL_SUCCESS && program != nullptr);
+  status = clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr);
+  ASSERT(status == CL_SUCCESS);
+  if (workload.kernel_names.empty()) {
+    workload.kernel_names.push_back("Mock");
+  }
+  std::vector<cl_kernel> kernels;
+  for (const std::string& name : workload.kernel_names) {
+    cl_kernel kernel = clCreateKernel(program, name.c_str(), &status);
+    ASSERT(status == CL_SUCCESS && kernel != nullptr);
+    kernels.push_back(kernel);
+  }
+
+  IttApi itt = LoadIttApi(workload);
+  UsmApi usm = LoadUsmApi();
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> call_counts(workload.thread_count, 0);
+  for (unsigned i = 0; i < workload.thread_count; ++i) {
+    threads.push_back(std::thread([&workload, &itt, &usm, &call_counts,
+                                   &kernels, context, device, i]() {
+      call_counts[i] = Run(&workload, &itt, &usm, context, device, &kernels);
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> time =
+      std::chrono::steady_clock::now() - start;
+
+  uint64_t call_count = 0;
+  for (uint64_t count : call_counts) {
+    call_count += count;
+  }
+  std::cout << "Workload: " << workload.thread_count << " threads, "
+            << call_count << " calls in " << time.count() << " sec ("
+            << call_count / time.count() << " calls/sec)" << std::endl;
+
+  if (workload.termination == "exit") {
+    _exit(0);
+  } else if (workload.termination == "abort") {
+    abort();
+  } else if (workload.termination == "segv") {
+    raise(SIGSEGV);
+  }
+
+  for (cl_kernel kernel : kernels) {
+    status = clReleaseKernel(kernel);
+    ASSERT(status == CL_SUCCESS);
+  }
+  status = clReleaseProgram(program);
+  ASSERT(status == CL_SUCCESS);
+  status = clReleaseContext(context);
+  ASSERT(status == CL_SUCCESS);
+
+  return 0;
+}
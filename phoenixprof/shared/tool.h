@@ -6,9 +6,10 @@
 extern "C" void ShowHelp();
 extern "C" int ProcessArgs(int argc, char *argv[]);
 extern "C" void PrepareEnv();
+extern "C" void StartControl();
 
 // Internal Tool Interface
-void StartProfiling();
+bool StartProfiling();
 void StopProfiling();
 
 #endif  // PHPROF_TOOL_H_
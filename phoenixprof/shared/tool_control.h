@@ -0,0 +1,277 @@
+#ifndef PHPROF_TOOL_CONTROL_H_
+#define PHPROF_TOOL_CONTROL_H_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+// Control channel of a process the tool library was injected into: a Unix
+// socket in the abstract namespace the tool listens on, named after the
+// process ID. Any local user may bind such a name, so both sides check the
+// credentials of the other one: the client talks only to the process
+// itself running as its owner, the tool serves only its owner and root.
+// A request is a command line followed by NAME=value option lines, the
+// client ends it by shutting down its side. The reply is "OK" or "ERROR"
+// followed by message lines, the tool closes the connection once it is sent
+#define TOOL_CONTROL_NAME_FORMAT "phoenixprof-%d"
+#define TOOL_CONTROL_START "start"
+#define TOOL_CONTROL_STOP "stop"
+#define TOOL_CONTROL_OK "OK"
+#define TOOL_CONTROL_ERROR "ERROR"
+#define TOOL_CONTROL_MAX_REQUEST_SIZE 65536
+#define TOOL_CONTROL_TIMEOUT_SEC 60
+
+struct ToolControlRequest {
+  std::string command;
+  std::vector<std::string> options;  // NAME=value
+};
+
+class ToolControl {
+ public:  // Client Interface
+  static std::string GetSocketName(pid_t pid) {
+    char name[MAX_STR_SIZE] = {0};
+    snprintf(name, sizeof(name), TOOL_CONTROL_NAME_FORMAT,
+             static_cast<int>(pid));
+    return name;
+  }
+
+  // Returns true if the tool in the process answers on its channel
+  static bool IsListening(pid_t pid) {
+    int fd = Connect(pid);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }
+
+  // Sends the request and returns the reply messages, false if the
+  // channel is not available or the tool reports an error
+  static bool Send(pid_t pid, const ToolControlRequest& request,
+                   std::vector<std::string>& messages) {
+    int fd = Connect(pid);
+    if (fd < 0) {
+      messages.push_back("control channel of the process is not available");
+      return false;
+    }
+
+    std::string data = request.command + "\n";
+    for (const std::string& option : request.options) {
+      data += option + "\n";
+    }
+    bool sent = WriteAll(fd, data) && shutdown(fd, SHUT_WR) == 0;
+    std::string reply;
+    if (sent) {
+      ReadAll(fd, reply);
+    }
+    close(fd);
+
+    std::vector<std::string> lines = SplitLines(reply);
+    if (lines.empty()) {
+      messages.push_back("no reply from the process");
+      return false;
+    }
+    messages.insert(messages.end(), lines.begin() + 1, lines.end());
+    return lines.front() == TOOL_CONTROL_OK;
+  }
+
+ public:  // Server Interface
+  // Returns false and fills the messages if the request failed
+  typedef bool (*Handler)(const ToolControlRequest& request,
+                          std::vector<std::string>& messages);
+
+  // Starts listening on the channel of the current process, the handler is
+  // called on a thread of the tool for one request at a time. Only the
+  // owner of the process and root may connect
+  static bool Listen(Handler handler) {
+    ASSERT(handler != nullptr);
+    static std::mutex lock;
+    const std::lock_guard<std::mutex> guard(lock);
+    if (GetServer() >= 0) {
+      return true;
+    }
+
+    std::string name = GetSocketName(getpid());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return false;
+    }
+    sockaddr_un address{};
+    socklen_t size = GetAddress(name, address);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), size) != 0 ||
+        listen(fd, 1) != 0) {
+      std::cerr << "[WARNING] Unable to create control channel @" << name
+                << " (" << strerror(errno) << ")" << std::endl;
+      close(fd);
+      return false;
+    }
+    GetServer() = fd;
+    std::thread(Serve, fd, handler).detach();
+    return true;
+  }
+
+  // Stops serving the channel, its name is released once the socket is
+  // closed. Called on process exit
+  static void Remove() {
+    if (GetServer() >= 0) {
+      shutdown(GetServer(), SHUT_RDWR);
+    }
+  }
+
+ private:  // Implementation Details
+  static int& GetServer() {
+    static int server = -1;
+    return server;
+  }
+
+  // Abstract names start with a zero byte and are not terminated, the
+  // size of the address tells where they end
+  static socklen_t GetAddress(const std::string& name, sockaddr_un& address) {
+    address.sun_family = AF_UNIX;
+    ASSERT(name.size() + 1 < sizeof(address.sun_path));
+    address.sun_path[0] = '\0';
+    memcpy(address.sun_path + 1, name.data(), name.size());
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 +
+                                  name.size());
+  }
+
+  // Fails unless the listening side is the process itself running as the
+  // owner of the process, so nothing is sent to a socket bound by another
+  // user under its name
+  static int Connect(pid_t pid) {
+    struct stat process{};
+    std::string path = "/proc/" + std::to_string(pid);
+    if (stat(path.c_str(), &process) != 0) {
+      return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    sockaddr_un address{};
+    socklen_t size = GetAddress(GetSocketName(pid), address);
+    ucred peer{};
+    socklen_t peer_size = sizeof(peer);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), size) != 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) != 0 ||
+        peer.pid != pid || peer.uid != process.st_uid) {
+      close(fd);
+      return -1;
+    }
+    SetTimeout(fd);
+    return fd;
+  }
+
+  static void SetTimeout(int fd) {
+    timeval timeout{TOOL_CONTROL_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  static bool WriteAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t result = send(fd, data.data() + written, data.size() - written,
+                            MSG_NOSIGNAL);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        return false;
+      }
+      written += result;
+    }
+    return true;
+  }
+
+  static bool ReadAll(int fd, std::string& data) {
+    char buffer[4096];
+    while (data.size() < TOOL_CONTROL_MAX_REQUEST_SIZE) {
+      ssize_t result = recv(fd, buffer, sizeof(buffer), 0);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result < 0) {
+        return false;
+      }
+      if (result == 0) {
+        return true;
+      }
+      data.append(buffer, result);
+    }
+    return false;
+  }
+
+  static std::vector<std::string> SplitLines(const std::string& data) {
+    std::vector<std::string> lines;
+    std::stringstream stream(data);
+    std::string line;
+    while (std::getline(stream, line)) {
+      if (!line.empty()) {
+        lines.push_back(line);
+      }
+    }
+    return lines;
+  }
+
+  static bool IsPeerAllowed(int fd) {
+    ucred peer{};
+    socklen_t size = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) != 0) {
+      return false;
+    }
+    return peer.uid == 0 || peer.uid == geteuid();
+  }
+
+  static void Serve(int server, Handler handler) {
+    while (true) {
+      int fd = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        close(server);
+        return;
+      }
+      SetTimeout(fd);
+
+      std::string data;
+      if (IsPeerAllowed(fd) && ReadAll(fd, data)) {
+        std::vector<std::string> lines = SplitLines(data);
+        std::vector<std::string> messages;
+        bool succeeded = false;
+        if (!lines.empty()) {
+          ToolControlRequest request{lines.front(),
+                                     std::vector<std::string>(
+                                         lines.begin() + 1, lines.end())};
+          succeeded = handler(request, messages);
+        }
+        std::string reply = succeeded ? TOOL_CONTROL_OK : TOOL_CONTROL_ERROR;
+        reply += "\n";
+        for (const std::string& message : messages) {
+          reply += message + "\n";
+        }
+        WriteAll(fd, reply);
+      }
+      close(fd);
+    }
+  }
+};
+
+#endif  // PHPROF_TOOL_CONTROL_H_
@@ -0,0 +1,153 @@
+#ifndef PHPROF_TRACE_ARENA_H_
+#define PHPROF_TRACE_ARENA_H_
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "utils.h"
+
+// Memory reserved at once, a multiple of the huge page size
+#define TRACE_ARENA_REGION_SIZE (2ull << 20)
+#define TRACE_ARENA_HUGE_PAGE_SIZE (2ull << 20)
+
+// Hands out fixed-size chunks from large regions that are mapped and
+// faulted in up front, so filling a chunk never takes a page fault and
+// growing the arena never moves chunks already handed out. Regions go back
+// to the system all at once, only when the arena is released.
+// Not thread-safe, the owner is expected to serialize the calls
+class TraceArena {
+ public:  // User Interface
+  // Regions are backed by transparent huge pages if huge_pages is set and
+  // the system allows it
+  TraceArena(size_t chunk_size, bool huge_pages = false,
+             size_t region_size = TRACE_ARENA_REGION_SIZE)
+      : chunk_size_(Align(chunk_size, alignof(std::max_align_t))),
+        huge_pages_(huge_pages) {
+    region_size_ = Align(std::max(region_size, chunk_size_),
+                         huge_pages ? TRACE_ARENA_HUGE_PAGE_SIZE
+                                    : GetPageSize());
+    chunks_per_region_ = region_size_ / chunk_size_;
+  }
+
+  ~TraceArena() { Release(); }
+
+  TraceArena(const TraceArena& copy) = delete;
+  TraceArena& operator=(const TraceArena& copy) = delete;
+
+  // Returns nullptr if no more memory can be reserved
+  void* Allocate() {
+    if (regions_.empty() || used_ == chunks_per_region_) {
+      char* region = Reserve();
+      if (region == nullptr) {
+        return nullptr;
+      }
+      regions_.push_back(region);
+      used_ = 0;
+    }
+    void* chunk = regions_.back() + used_ * chunk_size_;
+    ++used_;
+    return chunk;
+  }
+
+  // Chunks in the order they were allocated
+  size_t GetChunkCount() const {
+    return regions_.empty()
+               ? 0
+               : (regions_.size() - 1) * chunks_per_region_ + used_;
+  }
+
+  void* GetChunk(size_t index) const {
+    ASSERT(index < GetChunkCount());
+    return regions_[index / chunks_per_region_] +
+           (index % chunks_per_region_) * chunk_size_;
+  }
+
+  uint64_t GetReservedSize() const {
+    return static_cast<uint64_t>(regions_.size()) * region_size_;
+  }
+
+  // All chunks handed out become invalid
+  void Release() {
+    for (char* region : regions_) {
+      munmap(region, region_size_);
+    }
+    regions_.clear();
+    used_ = 0;
+  }
+
+  // Faults in the pages of a writable mapping, so the first store to each
+  // of them does not stop the thread that makes it. Only memory that holds
+  // nothing yet is expected here, pages are written with zeros if the
+  // kernel can not populate them for write
+  static void Prefault(void* data, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+      return;
+    }
+#endif
+    size_t page_size = GetPageSize();
+    volatile char* page = reinterpret_cast<volatile char*>(data);
+    for (size_t offset = 0; offset < size; offset += page_size) {
+      page[offset] = 0;
+    }
+  }
+
+ private:  // Implementation Details
+  static size_t GetPageSize() {
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+  }
+
+  static size_t Align(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+  }
+
+  // Huge pages need the region aligned to their size, the mapping is
+  // over-allocated and trimmed for that
+  char* Reserve() {
+    size_t size = region_size_ + (huge_pages_ ? TRACE_ARENA_HUGE_PAGE_SIZE : 0);
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      if (!failed_) {
+        std::cerr << "[WARNING] Unable to reserve " << region_size_
+                  << " bytes for trace records" << std::endl;
+        failed_ = true;
+      }
+      return nullptr;
+    }
+
+    char* region = reinterpret_cast<char*>(data);
+    if (huge_pages_) {
+      uintptr_t address = reinterpret_cast<uintptr_t>(region);
+      size_t head = Align(address, TRACE_ARENA_HUGE_PAGE_SIZE) - address;
+      if (head > 0) {
+        munmap(region, head);
+      }
+      munmap(region + head + region_size_, size - head - region_size_);
+      region += head;
+#ifdef MADV_HUGEPAGE
+      madvise(region, region_size_, MADV_HUGEPAGE);
+#endif
+    }
+    Prefault(region, region_size_);
+    return region;
+  }
+
+  size_t chunk_size_ = 0;
+  size_t region_size_ = 0;
+  size_t chunks_per_region_ = 0;
+  bool huge_pages_ = false;
+  bool failed_ = false;
+
+  std::vector<char*> regions_;
+  size_t used_ = 0;  // Chunks handed out from the last region
+};
+
+#endif  // PHPROF_TRACE_ARENA_H_
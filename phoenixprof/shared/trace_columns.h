@@ -0,0 +1,561 @@
+#ifndef PHPROF_TRACE_COLUMNS_H_
+#define PHPROF_TRACE_COLUMNS_H_
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace_format.h"
+#include "trace_reader.h"
+#include "trace_writer.h"
+#include "utils.h"
+
+// Column store of call records for traces too large to be read as a whole.
+// Records are split into blocks of a fixed capacity, a block keeps every
+// field of its records in a separate column, one after another, each column
+// starting on a page boundary. An index at the end of the file holds the
+// time span of every block and a bitmap of the functions called in it, so a
+// time range or a set of functions is read by mapping the file and touching
+// the pages of the matching blocks and columns only.
+// The header is written last: a store whose conversion did not finish
+// stays open and is not read
+
+#define TRACE_COLUMN_MAGIC 0x4E4D4C4F43584850ull  // "PHXCOLMN"
+#define TRACE_COLUMN_VERSION 1
+
+// Records of one block, keeps every column a multiple of the page size
+#define TRACE_COLUMN_BLOCK_CAPACITY 4096
+// Blocks start at this offset, the header takes the page before them
+#define TRACE_COLUMN_DATA_OFFSET 4096
+
+// Columns hold the fields of TraceCallRecord. Call arguments are not
+// recorded by the tool, so there are no argument columns: the flags, call
+// site and collapsed run fields are the per-call values kept instead
+enum TraceColumn : uint32_t {
+  TRACE_COLUMN_START_TIME = 0,  // uint64_t
+  TRACE_COLUMN_DURATION,        // uint64_t, ns
+  TRACE_COLUMN_FUNCTION_ID,     // uint16_t
+  TRACE_COLUMN_THREAD_ID,       // uint32_t
+  TRACE_COLUMN_FLAGS,           // uint16_t
+  TRACE_COLUMN_STACK_ID,        // uint32_t
+  TRACE_COLUMN_COLLAPSED_COUNT,  // uint16_t
+  TRACE_COLUMN_COLLAPSED_MEAN,   // uint16_t
+  TRACE_COLUMN_COUNT
+};
+
+struct TraceColumnHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t state;  // TraceFileState, closed once the index is written
+  uint32_t block_capacity;
+  uint32_t function_count;
+  uint64_t block_count;
+  uint64_t record_count;
+  uint64_t start_time;  // Earliest start of a call
+  uint64_t end_time;    // Latest end of a call
+  // TraceColumnBlock per block followed by the function bitmaps of the
+  // blocks, one after another
+  uint64_t index_offset;
+  uint64_t functions_offset;  // Sorted uint16_t function ids, bitmap order
+  uint64_t strings_offset;    // Payload of a strings chunk
+  uint64_t strings_size;
+  uint64_t metadata_offset;  // Payload of a metadata chunk
+  uint64_t metadata_size;
+};
+
+struct TraceColumnBlock {
+  uint64_t start_time;  // Earliest start of its calls
+  uint64_t end_time;    // Latest end of its calls
+  uint32_t count;
+  uint32_t reserved;
+};
+
+// Calls selected from a store, an empty set of functions selects all
+struct TraceColumnFilter {
+  uint64_t start_time = 0;
+  uint64_t end_time = UINT64_MAX;
+  std::vector<uint16_t> functions;
+};
+
+inline size_t GetColumnWidth(uint32_t column) {
+  static const size_t widths[TRACE_COLUMN_COUNT] = {
+      sizeof(uint64_t), sizeof(uint64_t), sizeof(uint16_t), sizeof(uint32_t),
+      sizeof(uint16_t), sizeof(uint32_t), sizeof(uint16_t), sizeof(uint16_t)};
+  ASSERT(column < TRACE_COLUMN_COUNT);
+  return widths[column];
+}
+
+// Offset of the column in a block
+inline uint64_t GetColumnOffset(uint32_t column) {
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < column; ++i) {
+    offset += GetColumnWidth(i) * TRACE_COLUMN_BLOCK_CAPACITY;
+  }
+  return offset;
+}
+
+inline uint64_t GetColumnBlockSize() {
+  return GetColumnOffset(TRACE_COLUMN_COUNT);
+}
+
+// Appends records one by one, a block is written out once it is full, so
+// only one block and the index are kept in memory
+class TraceColumnWriter {
+ public:
+  static TraceColumnWriter* Create(const std::string& filename) {
+    int file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+      return nullptr;
+    }
+    TraceColumnWriter* writer = new TraceColumnWriter(file);
+    ASSERT(writer != nullptr);
+    if (!writer->WriteHeader(TRACE_STATE_OPEN)) {
+      delete writer;
+      return nullptr;
+    }
+    return writer;
+  }
+
+  ~TraceColumnWriter() {
+    if (file_ >= 0) {
+      close(file_);
+    }
+  }
+
+  TraceColumnWriter(const TraceColumnWriter& copy) = delete;
+  TraceColumnWriter& operator=(const TraceColumnWriter& copy) = delete;
+
+  bool Append(const TraceCallRecord& record) {
+    uint32_t index = count_;
+    uint64_t duration = (record.end_time > record.start_time)
+                            ? record.end_time - record.start_time
+                            : 0;
+    Store(TRACE_COLUMN_START_TIME, index, record.start_time);
+    Store(TRACE_COLUMN_DURATION, index, duration);
+    Store(TRACE_COLUMN_FUNCTION_ID, index, record.function_id);
+    Store(TRACE_COLUMN_THREAD_ID, index, record.thread_id);
+    Store(TRACE_COLUMN_FLAGS, index, record.flags);
+    Store(TRACE_COLUMN_STACK_ID, index, record.stack_id);
+    Store(TRACE_COLUMN_COLLAPSED_COUNT, index, record.collapsed_count);
+    Store(TRACE_COLUMN_COLLAPSED_MEAN, index, record.collapsed_mean);
+
+    uint64_t end_time = record.start_time + duration;
+    if (count_ == 0) {
+      block_ = TraceColumnBlock{record.start_time, end_time, 0, 0};
+    } else {
+      block_.start_time = std::min(block_.start_time, record.start_time);
+      block_.end_time = std::max(block_.end_time, end_time);
+    }
+    functions_[record.function_id / 64] |= 1ull << (record.function_id % 64);
+    ++count_;
+
+    if (count_ == TRACE_COLUMN_BLOCK_CAPACITY) {
+      return Flush();
+    }
+    return true;
+  }
+
+  void SetStrings(const std::map<uint32_t, std::string>& strings) {
+    strings_ = strings;
+  }
+
+  void SetMetadata(const std::map<std::string, std::string>& metadata) {
+    metadata_ = metadata;
+  }
+
+  uint64_t GetRecordCount() const { return record_count_ + count_; }
+
+  // Writes the last block, the index, names and metadata, then marks the
+  // store closed
+  bool Close() {
+    if (!Flush()) {
+      return false;
+    }
+
+    std::vector<uint16_t> functions;
+    for (const std::vector<uint16_t>& block : block_functions_) {
+      functions.insert(functions.end(), block.begin(), block.end());
+    }
+    std::sort(functions.begin(), functions.end());
+    functions.erase(std::unique(functions.begin(), functions.end()),
+                    functions.end());
+
+    uint64_t word_count = (functions.size() + 63) / 64;
+    std::vector<uint64_t> bitmaps(blocks_.size() * word_count, 0);
+    for (size_t i = 0; i < block_functions_.size(); ++i) {
+      for (uint16_t function : block_functions_[i]) {
+        size_t bit = std::lower_bound(functions.begin(), functions.end(),
+                                      function) -
+                     functions.begin();
+        bitmaps[i * word_count + bit / 64] |= 1ull << (bit % 64);
+      }
+    }
+
+    header_.index_offset = offset_;
+    if (!Write(blocks_.data(), blocks_.size() * sizeof(TraceColumnBlock)) ||
+        !Write(bitmaps.data(), bitmaps.size() * sizeof(uint64_t))) {
+      return false;
+    }
+    header_.functions_offset = offset_;
+    header_.function_count = static_cast<uint32_t>(functions.size());
+    if (!Write(functions.data(), functions.size() * sizeof(uint16_t))) {
+      return false;
+    }
+
+    std::string strings = TraceWriter::PackStrings(strings_);
+    header_.strings_offset = offset_;
+    header_.strings_size = strings.size();
+    std::string metadata = TraceWriter::PackMetadata(metadata_);
+    header_.metadata_offset = offset_ + strings.size();
+    header_.metadata_size = metadata.size();
+    if (!Write(strings.data(), strings.size()) ||
+        !Write(metadata.data(), metadata.size())) {
+      return false;
+    }
+
+    header_.block_count = blocks_.size();
+    header_.record_count = record_count_;
+    if (fsync(file_) != 0 || !WriteHeader(TRACE_STATE_CLOSED)) {
+      return false;
+    }
+    int result = close(file_);
+    file_ = -1;
+    return result == 0;
+  }
+
+ private:
+  explicit TraceColumnWriter(int file)
+      : file_(file),
+        block_data_(GetColumnBlockSize(), 0),
+        functions_(TRACE_ANNOTATION_ID_MAX / 64 + 1, 0),
+        offset_(TRACE_COLUMN_DATA_OFFSET) {
+    header_.magic = TRACE_COLUMN_MAGIC;
+    header_.version = TRACE_COLUMN_VERSION;
+    header_.block_capacity = TRACE_COLUMN_BLOCK_CAPACITY;
+    header_.start_time = UINT64_MAX;
+  }
+
+  template <typename T>
+  void Store(uint32_t column, uint32_t index, T value) {
+    ASSERT(sizeof(T) == GetColumnWidth(column));
+    memcpy(block_data_.data() + GetColumnOffset(column) + index * sizeof(T),
+           &value, sizeof(T));
+  }
+
+  // Blocks are written at their full size, so every block and column
+  // offset follows from the block index
+  bool Flush() {
+    if (count_ == 0) {
+      return true;
+    }
+    block_.count = count_;
+    if (!Write(block_data_.data(), block_data_.size())) {
+      return false;
+    }
+    blocks_.push_back(block_);
+    header_.start_time = std::min(header_.start_time, block_.start_time);
+    header_.end_time = std::max(header_.end_time, block_.end_time);
+
+    std::vector<uint16_t> functions;
+    for (size_t i = 0; i < functions_.size(); ++i) {
+      for (uint64_t word = functions_[i]; word != 0; word &= word - 1) {
+        functions.push_back(
+            static_cast<uint16_t>(i * 64 + __builtin_ctzll(word)));
+      }
+      functions_[i] = 0;
+    }
+    block_functions_.push_back(std::move(functions));
+
+    record_count_ += count_;
+    count_ = 0;
+    return true;
+  }
+
+  bool Write(const void* data, size_t size) {
+    const char* bytes = reinterpret_cast<const char*>(data);
+    size_t written = 0;
+    while (written < size) {
+      ssize_t result = pwrite(file_, bytes + written, size - written,
+                              offset_ + written);
+      if (result <= 0) {
+        return false;
+      }
+      written += result;
+    }
+    offset_ += size;
+    return true;
+  }
+
+  bool WriteHeader(uint32_t state) {
+    header_.state = state;
+    return pwrite(file_, &header_, sizeof(header_), 0) ==
+           static_cast<ssize_t>(sizeof(header_));
+  }
+
+  int file_ = -1;
+  TraceColumnHeader header_{};
+  uint64_t record_count_ = 0;
+
+  std::vector<char> block_data_;
+  TraceColumnBlock block_{};
+  uint32_t count_ = 0;
+  std::vector<uint64_t> functions_;  // Bit per function id, current block
+
+  std::vector<TraceColumnBlock> blocks_;
+  std::vector<std::vector<uint16_t>> block_functions_;
+  uint64_t offset_ = 0;
+
+  std::map<uint32_t, std::string> strings_;
+  std::map<std::string, std::string> metadata_;
+};
+
+// Read-only view of a closed column store mapped into memory, pages are
+// read from the file as the columns are touched
+class TraceColumnStore {
+ public:
+  static bool IsColumnStore(const std::string& filename) {
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0) {
+      return false;
+    }
+    uint64_t magic = 0;
+    bool matched = read(file, &magic, sizeof(magic)) ==
+                       static_cast<ssize_t>(sizeof(magic)) &&
+                   magic == TRACE_COLUMN_MAGIC;
+    close(file);
+    return matched;
+  }
+
+  static TraceColumnStore* Open(const std::string& filename) {
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0) {
+      return nullptr;
+    }
+    struct stat info{};
+    if (fstat(file, &info) != 0 ||
+        static_cast<uint64_t>(info.st_size) < TRACE_COLUMN_DATA_OFFSET) {
+      close(file);
+      return nullptr;
+    }
+    uint64_t size = info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    // Blocks are picked through the index, read-ahead beyond the touched
+    // pages would bring in columns that are not asked for
+    madvise(data, size, MADV_RANDOM);
+
+    TraceColumnStore* store =
+        new TraceColumnStore(reinterpret_cast<const char*>(data), size);
+    ASSERT(store != nullptr);
+    if (!store->IsValid()) {
+      delete store;
+      return nullptr;
+    }
+    return store;
+  }
+
+  ~TraceColumnStore() { munmap(const_cast<char*>(data_), size_); }
+
+  TraceColumnStore(const TraceColumnStore& copy) = delete;
+  TraceColumnStore& operator=(const TraceColumnStore& copy) = delete;
+
+  uint64_t GetRecordCount() const { return header_->record_count; }
+
+  uint64_t GetBlockCount() const { return header_->block_count; }
+
+  uint64_t GetStartTime() const { return header_->start_time; }
+
+  uint64_t GetEndTime() const { return header_->end_time; }
+
+  const TraceColumnBlock& GetBlock(uint64_t block) const {
+    ASSERT(block < header_->block_count);
+    return blocks_[block];
+  }
+
+  // Values of the column in the block, GetBlock(block).count of them
+  template <typename T>
+  const T* GetColumn(uint64_t block, uint32_t column) const {
+    ASSERT(block < header_->block_count);
+    ASSERT(sizeof(T) == GetColumnWidth(column));
+    return reinterpret_cast<const T*>(data_ + TRACE_COLUMN_DATA_OFFSET +
+                                      block * GetColumnBlockSize() +
+                                      GetColumnOffset(column));
+  }
+
+  void GetStrings(std::map<uint32_t, std::string>& strings) const {
+    TraceReader::ParseStrings(
+        std::vector<char>(data_ + header_->strings_offset,
+                          data_ + header_->strings_offset +
+                              header_->strings_size),
+        strings);
+  }
+
+  void GetMetadata(std::map<std::string, std::string>& metadata) const {
+    TraceReader::ParseMetadata(
+        std::vector<char>(data_ + header_->metadata_offset,
+                          data_ + header_->metadata_offset +
+                              header_->metadata_size),
+        metadata);
+  }
+
+  // Blocks that may hold calls overlapping the time range of the filter
+  // and calling any of its functions, only the index is read here
+  std::vector<uint64_t> FindBlocks(const TraceColumnFilter& filter) const {
+    std::vector<uint64_t> mask;
+    if (!filter.functions.empty()) {
+      mask.assign(word_count_, 0);
+      for (uint16_t function : filter.functions) {
+        const uint16_t* end = functions_ + header_->function_count;
+        const uint16_t* it = std::lower_bound(functions_, end, function);
+        if (it != end && *it == function) {
+          size_t bit = it - functions_;
+          mask[bit / 64] |= 1ull << (bit % 64);
+        }
+      }
+    }
+
+    std::vector<uint64_t> blocks;
+    for (uint64_t i = 0; i < header_->block_count; ++i) {
+      if (blocks_[i].start_time > filter.end_time ||
+          blocks_[i].end_time < filter.start_time) {
+        continue;
+      }
+      if (!mask.empty()) {
+        const uint64_t* bitmap = bitmaps_ + i * word_count_;
+        bool matched = false;
+        for (uint64_t word = 0; word < word_count_ && !matched; ++word) {
+          matched = (bitmap[word] & mask[word]) != 0;
+        }
+        if (!matched) {
+          continue;
+        }
+      }
+      blocks.push_back(i);
+    }
+    return blocks;
+  }
+
+  // Calls overlapping the time range of the filter, in the order they were
+  // stored. Only the time and function columns of the selected blocks are
+  // read to match the calls, the other columns for the matching ones only
+  void Read(const TraceColumnFilter& filter,
+            std::vector<TraceCallRecord>& calls) const {
+    std::vector<uint16_t> functions = filter.functions;
+    std::sort(functions.begin(), functions.end());
+    std::vector<uint32_t> selected;
+    for (uint64_t block : FindBlocks(filter)) {
+      uint32_t count = blocks_[block].count;
+      const uint64_t* start = GetColumn<uint64_t>(block,
+                                                  TRACE_COLUMN_START_TIME);
+      const uint64_t* duration = GetColumn<uint64_t>(block,
+                                                     TRACE_COLUMN_DURATION);
+      const uint16_t* function = GetColumn<uint16_t>(block,
+                                                     TRACE_COLUMN_FUNCTION_ID);
+      selected.clear();
+      for (uint32_t i = 0; i < count; ++i) {
+        if (start[i] > filter.end_time ||
+            start[i] + duration[i] < filter.start_time) {
+          continue;
+        }
+        if (!functions.empty() &&
+            !std::binary_search(functions.begin(), functions.end(),
+                                function[i])) {
+          continue;
+        }
+        selected.push_back(i);
+      }
+      if (selected.empty()) {
+        continue;
+      }
+
+      const uint32_t* thread = GetColumn<uint32_t>(block,
+                                                   TRACE_COLUMN_THREAD_ID);
+      const uint16_t* flags = GetColumn<uint16_t>(block, TRACE_COLUMN_FLAGS);
+      const uint32_t* stack = GetColumn<uint32_t>(block,
+                                                  TRACE_COLUMN_STACK_ID);
+      const uint16_t* collapsed_count =
+          GetColumn<uint16_t>(block, TRACE_COLUMN_COLLAPSED_COUNT);
+      const uint16_t* collapsed_mean =
+          GetColumn<uint16_t>(block, TRACE_COLUMN_COLLAPSED_MEAN);
+      for (uint32_t i : selected) {
+        calls.push_back(TraceCallRecord{start[i], start[i] + duration[i],
+                                        thread[i], function[i], flags[i],
+                                        stack[i], collapsed_count[i],
+                                        collapsed_mean[i]});
+      }
+    }
+  }
+
+ private:
+  TraceColumnStore(const char* data, uint64_t size)
+      : data_(data),
+        size_(size),
+        header_(reinterpret_cast<const TraceColumnHeader*>(data)) {}
+
+  // Every part the header points to is checked to be in the file, so the
+  // accessors do not need to
+  bool IsValid() {
+    if (header_->magic != TRACE_COLUMN_MAGIC ||
+        header_->version != TRACE_COLUMN_VERSION ||
+        header_->state != TRACE_STATE_CLOSED ||
+        header_->block_capacity != TRACE_COLUMN_BLOCK_CAPACITY ||
+        header_->block_count >
+            (size_ - TRACE_COLUMN_DATA_OFFSET) / GetColumnBlockSize()) {
+      return false;
+    }
+    word_count_ = (header_->function_count + 63) / 64;
+    uint64_t index_size =
+        header_->block_count *
+        (sizeof(TraceColumnBlock) + word_count_ * sizeof(uint64_t));
+    uint64_t data_end = TRACE_COLUMN_DATA_OFFSET +
+                        header_->block_count * GetColumnBlockSize();
+    if (header_->index_offset < data_end ||
+        !IsInFile(header_->index_offset, index_size) ||
+        !IsInFile(header_->functions_offset,
+                  header_->function_count * sizeof(uint16_t)) ||
+        !IsInFile(header_->strings_offset, header_->strings_size) ||
+        !IsInFile(header_->metadata_offset, header_->metadata_size)) {
+      return false;
+    }
+
+    blocks_ = reinterpret_cast<const TraceColumnBlock*>(
+        data_ + header_->index_offset);
+    bitmaps_ = reinterpret_cast<const uint64_t*>(
+        data_ + header_->index_offset +
+        header_->block_count * sizeof(TraceColumnBlock));
+    functions_ =
+        reinterpret_cast<const uint16_t*>(data_ + header_->functions_offset);
+    for (uint64_t i = 0; i < header_->block_count; ++i) {
+      if (blocks_[i].count > TRACE_COLUMN_BLOCK_CAPACITY) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool IsInFile(uint64_t offset, uint64_t size) const {
+    return offset <= size_ && size <= size_ - offset;
+  }
+
+  const char* data_ = nullptr;
+  uint64_t size_ = 0;
+  const TraceColumnHeader* header_ = nullptr;
+  const TraceColumnBlock* blocks_ = nullptr;
+  const uint64_t* bitmaps_ = nullptr;
+  const uint16_t* functions_ = nullptr;
+  uint64_t word_count_ = 0;
+};
+
+#endif  // PHPROF_TRACE_COLUMNS_H_
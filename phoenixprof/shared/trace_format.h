@@ -0,0 +1,167 @@
+#ifndef PHPROF_TRACE_FORMAT_H_
+#define PHPROF_TRACE_FORMAT_H_
+
+#include <cstdint>
+
+// Binary trace is a file header followed by a sequence of chunks,
+// each chunk is a chunk header and a payload of the given size. The file
+// header and every chunk start at a multiple of the alignment stored in the
+// file header, so the tool can map them into memory one by one. A chunk is
+// complete only once its commit marker is set, the file is complete only
+// once its state is closed
+
+#define TRACE_FILE_MAGIC 0x4543415254584850ull  // "PHXTRACE"
+#define TRACE_CHUNK_MAGIC 0x4B4E4843u           // "CHNK"
+#define TRACE_CHUNK_COMMITTED 0x54494D43u       // "CMIT"
+#define TRACE_FORMAT_VERSION 3
+
+// Number of call records in one calls chunk
+#define TRACE_CHUNK_CAPACITY 4096
+
+#define TRACE_CALL_FLAG_BLOCKING 0x1
+#define TRACE_CALL_FLAG_ANNOTATION 0x2  // User annotated region, e.g. ITT task
+#define TRACE_CALL_FLAG_COLLAPSED 0x4   // Run of repeated short calls
+
+// Limits of a collapsed run, its count and mean duration are 16-bit
+#define TRACE_COLLAPSE_MAX_COUNT 0xFFFF
+#define TRACE_COLLAPSE_MAX_DURATION 0xFFFF  // ns
+
+// Function ids starting from this one name user annotated regions
+#define TRACE_ANNOTATION_ID_BASE 0x8000
+#define TRACE_ANNOTATION_ID_MAX 0xFFFF
+
+// Annotations starting from this id name the kernel of the
+// clEnqueueNDRangeKernel call of the thread they span, regions of the user
+// stay below
+#define TRACE_KERNEL_ID_BASE 0xC000
+
+enum TraceChunkType : uint32_t {
+  TRACE_CHUNK_CALLS = 1,     // TraceCallChunk
+  TRACE_CHUNK_STRINGS = 2,   // TraceStringRecord followed by chars, repeated
+  TRACE_CHUNK_METADATA = 3,  // Null-terminated key and JSON value, repeated
+  TRACE_CHUNK_SAMPLES = 4,   // TraceSampleRecord followed by its stack
+  TRACE_CHUNK_STACKS = 5,    // TraceStackRecord followed by its stack
+  TRACE_CHUNK_MODULES = 6,   // TraceModuleRecord, path and build ID, repeated
+  TRACE_CHUNK_MEMORY = 7,    // TraceMemoryRecord, repeated
+  TRACE_CHUNK_CLOCKS = 8,    // TraceClockRecord, repeated
+  TRACE_CHUNK_COMMANDS = 9,  // TraceCommandRecord, repeated
+};
+
+enum TraceMemoryKind : uint16_t {
+  TRACE_MEMORY_BUFFER = 1,
+  TRACE_MEMORY_IMAGE = 2,
+  TRACE_MEMORY_SVM = 3,
+  TRACE_MEMORY_USM_HOST = 4,  // Host memory, not counted as device memory
+  TRACE_MEMORY_USM_DEVICE = 5,
+  TRACE_MEMORY_USM_SHARED = 6,
+};
+
+#define TRACE_MEMORY_FLAG_RELEASE 0x1  // Allocation is gone
+
+enum TraceFileState : uint32_t {
+  TRACE_STATE_OPEN = 0,     // Being written, or the process died silently
+  TRACE_STATE_CLOSED = 1,   // Finalized at normal exit
+  TRACE_STATE_CRASHED = 2,  // Marked by a fatal signal handler
+};
+
+struct TraceFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t alignment;
+  uint32_t state;
+  uint32_t signal;  // Fatal signal number for crashed traces
+  uint32_t reserved;
+};
+
+struct TraceChunkHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t size;
+  uint32_t commit;  // TRACE_CHUNK_COMMITTED once the payload is complete
+  uint32_t reserved;
+};
+
+struct TraceCallRecord {
+  uint64_t start_time;
+  uint64_t end_time;
+  uint32_t thread_id;
+  uint16_t function_id;
+  uint16_t flags;
+  uint32_t stack_id;  // Call site in the stacks trace, 0 if not captured
+  // Collapsed runs span from the first start to the last end of the calls
+  uint16_t collapsed_count;  // Calls in a collapsed run, 0 otherwise
+  uint16_t collapsed_mean;   // Their mean duration, ns
+};
+
+// Host CPU sample, followed by depth return addresses, innermost first
+struct TraceSampleRecord {
+  uint64_t time;
+  uint32_t thread_id;
+  uint32_t depth;
+};
+
+// Call site stack definition, followed by depth return addresses,
+// innermost first
+struct TraceStackRecord {
+  uint32_t id;
+  uint32_t depth;
+};
+
+// Executable mapping of the traced process, followed by the module path
+// and its raw GNU build ID
+struct TraceModuleRecord {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t offset;  // File offset of the mapping
+  uint32_t path_length;
+  uint32_t build_id_length;
+};
+
+// Allocation or release of device memory, the size of a release is the
+// size of the allocation it ends
+struct TraceMemoryRecord {
+  uint64_t time;
+  uint64_t handle;  // cl_mem or pointer
+  uint64_t size;
+  uint32_t thread_id;
+  uint32_t stack_id;  // Call site, 0 if not captured
+  uint16_t kind;      // TraceMemoryKind
+  uint16_t flags;
+  uint32_t reserved;
+};
+
+// Host and device timers read at the same moment: the host time is the
+// middle of the window the device timer was read in, on the call time base
+struct TraceClockRecord {
+  uint64_t host_time;
+  uint64_t device_time;
+  uint64_t window;  // Host time the reading took, ns
+};
+
+// Command executed on the device, times are taken from its event profiling
+// info and are on the device timer
+struct TraceCommandRecord {
+  uint64_t queued;
+  uint64_t submit;
+  uint64_t start;
+  uint64_t end;
+  uint32_t thread_id;  // Thread that enqueued the command
+  uint16_t function_id;
+  uint16_t reserved;
+};
+
+struct TraceStringRecord {
+  uint32_t id;
+  uint32_t length;
+};
+
+// Payload of a calls chunk, count is advanced after each record is stored,
+// so the records of an uncommitted chunk are still usable up to it
+struct TraceCallChunk {
+  uint32_t count;
+  uint32_t reserved;
+  TraceCallRecord records[TRACE_CHUNK_CAPACITY];
+};
+
+#endif  // PHPROF_TRACE_FORMAT_H_
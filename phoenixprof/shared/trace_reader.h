@@ -0,0 +1,343 @@
+#ifndef PHPROF_TRACE_READER_H_
+#define PHPROF_TRACE_READER_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace_format.h"
+#include "utils.h"
+
+struct TraceSample {
+  uint64_t time;
+  uint32_t thread_id;
+  std::vector<uint64_t> stack;  // Innermost first
+};
+
+// Value of a counter track computed from the records at export time
+struct TraceCounter {
+  std::string name;
+  uint64_t time;
+  uint64_t value;
+};
+
+// Call site stacks by id, innermost first
+typedef std::map<uint32_t, std::vector<uint64_t>> TraceStackMap;
+
+// Names of symbolized addresses
+typedef std::map<uint64_t, std::string> TraceSymbolMap;
+
+inline std::string FormatAddress(uint64_t address,
+                                 const TraceSymbolMap& symbols) {
+  auto it = symbols.find(address);
+  if (it != symbols.end()) {
+    return it->second;
+  }
+  char hex[2 + 2 * sizeof(uint64_t) + 1] = {0};
+  snprintf(hex, sizeof(hex), "0x%llx",
+           static_cast<unsigned long long>(address));
+  return hex;
+}
+
+struct TraceModule {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t offset;
+  std::string path;
+  std::string build_id;  // Raw bytes
+};
+
+// Sequential reader of binary trace chunks, tolerates traces left behind by
+// a crashed process: uncommitted chunks are recovered as far as their
+// content is complete, reading stops at the first damaged chunk
+class TraceReader {
+ public:
+  static TraceReader* Create(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+      return nullptr;
+    }
+
+    TraceFileHeader header{};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file || header.magic != TRACE_FILE_MAGIC ||
+        header.version != TRACE_FORMAT_VERSION ||
+        header.record_size != sizeof(TraceCallRecord) ||
+        header.alignment < sizeof(TraceFileHeader)) {
+      return nullptr;
+    }
+
+    file.seekg(0, std::ios::end);
+    uint64_t file_size = static_cast<uint64_t>(file.tellg());
+    return new TraceReader(std::move(file), header, file_size);
+  }
+
+  TraceReader(const TraceReader& copy) = delete;
+  TraceReader& operator=(const TraceReader& copy) = delete;
+
+  // Returns false at the end of the trace or if the next chunk is damaged,
+  // the payload of a truncated last chunk is cut to the available data
+  bool ReadChunk(TraceChunkHeader& header, std::vector<char>& payload) {
+    file_.seekg(offset_);
+    file_.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file_ || header.magic != TRACE_CHUNK_MAGIC) {
+      return false;
+    }
+
+    // Only a calls chunk may be cut short with the file, any other size
+    // beyond the end of the file is a damaged header
+    uint64_t available = file_size_ - std::min(file_size_,
+                                               offset_ + sizeof(header));
+    if (header.size > available &&
+        (header.type != TRACE_CHUNK_CALLS ||
+         header.size != sizeof(TraceCallChunk))) {
+      return false;
+    }
+
+    payload.resize(header.size);
+    file_.read(payload.data(), header.size);
+    payload.resize(file_.gcount());
+    if (payload.size() < header.size) {
+      file_.clear();
+      header.commit = 0;
+    }
+
+    uint64_t size = sizeof(header) + header.size;
+    offset_ += (size + header_.alignment - 1) / header_.alignment *
+               header_.alignment;
+    if (header.commit != TRACE_CHUNK_COMMITTED) {
+      ++uncommitted_count_;
+    }
+    return true;
+  }
+
+  // Reads the whole trace, string and metadata chunks are merged,
+  // samples, call stacks, module snapshots (in the order they were taken),
+  // memory records, clock samples and device commands are only collected
+  // if requested
+  void ReadAll(std::vector<TraceCallRecord>& calls,
+               std::map<uint32_t, std::string>& strings,
+               std::map<std::string, std::string>& metadata,
+               std::vector<TraceSample>* samples = nullptr,
+               TraceStackMap* stacks = nullptr,
+               std::vector<TraceModule>* modules = nullptr,
+               std::vector<TraceMemoryRecord>* memory = nullptr,
+               std::vector<TraceClockRecord>* clocks = nullptr,
+               std::vector<TraceCommandRecord>* commands = nullptr) {
+    TraceChunkHeader header{};
+    std::vector<char> payload;
+    while (ReadChunk(header, payload)) {
+      switch (header.type) {
+        case TRACE_CHUNK_CALLS:
+          ParseCalls(payload, header.commit == TRACE_CHUNK_COMMITTED, calls);
+          break;
+        case TRACE_CHUNK_STRINGS:
+          ParseStrings(payload, strings);
+          break;
+        case TRACE_CHUNK_METADATA:
+          ParseMetadata(payload, metadata);
+          break;
+        case TRACE_CHUNK_SAMPLES:
+          if (samples != nullptr) {
+            ParseSamples(payload, *samples);
+          }
+          break;
+        case TRACE_CHUNK_STACKS:
+          if (stacks != nullptr) {
+            ParseStacks(payload, *stacks);
+          }
+          break;
+        case TRACE_CHUNK_MODULES:
+          if (modules != nullptr) {
+            ParseModules(payload, *modules);
+          }
+          break;
+        case TRACE_CHUNK_MEMORY:
+          if (memory != nullptr) {
+            ParseRecords(payload, *memory);
+          }
+          break;
+        case TRACE_CHUNK_CLOCKS:
+          if (clocks != nullptr) {
+            ParseRecords(payload, *clocks);
+          }
+          break;
+        case TRACE_CHUNK_COMMANDS:
+          if (commands != nullptr) {
+            ParseRecords(payload, *commands);
+          }
+          break;
+        default:
+          break;  // Unknown chunks are skipped
+      }
+    }
+  }
+
+  // Trace was closed at normal exit and all its chunks were committed
+  bool IsComplete() const {
+    return header_.state == TRACE_STATE_CLOSED && uncommitted_count_ == 0;
+  }
+
+  uint32_t GetState() const { return header_.state; }
+
+  uint32_t GetSignal() const { return header_.signal; }
+
+  uint64_t GetUncommittedCount() const { return uncommitted_count_; }
+
+  uint64_t GetRecoveredCount() const { return recovered_count_; }
+
+  void ParseCalls(const std::vector<char>& payload, bool committed,
+                  std::vector<TraceCallRecord>& calls) {
+    const size_t offset = offsetof(TraceCallChunk, records);
+    if (payload.size() < offset) {
+      return;
+    }
+
+    uint32_t count = 0;
+    memcpy(&count, payload.data(), sizeof(count));
+    count = std::min<uint64_t>(
+        std::min<uint32_t>(count, TRACE_CHUNK_CAPACITY),
+        (payload.size() - offset) / sizeof(TraceCallRecord));
+
+    const TraceCallRecord* records =
+        reinterpret_cast<const TraceCallRecord*>(payload.data() + offset);
+    calls.insert(calls.end(), records, records + count);
+    if (!committed) {
+      recovered_count_ += count;
+    }
+  }
+
+  static void ParseSamples(const std::vector<char>& payload,
+                           std::vector<TraceSample>& samples) {
+    size_t offset = 0;
+    while (offset + sizeof(TraceSampleRecord) <= payload.size()) {
+      TraceSampleRecord record{};
+      memcpy(&record, payload.data() + offset, sizeof(record));
+      offset += sizeof(record);
+      size_t size = record.depth * sizeof(uint64_t);
+      if (offset + size > payload.size()) {
+        break;
+      }
+      TraceSample sample{record.time, record.thread_id,
+                         std::vector<uint64_t>(record.depth)};
+      memcpy(sample.stack.data(), payload.data() + offset, size);
+      samples.push_back(std::move(sample));
+      offset += size;
+    }
+  }
+
+  static void ParseStacks(const std::vector<char>& payload,
+                          TraceStackMap& stacks) {
+    size_t offset = 0;
+    while (offset + sizeof(TraceStackRecord) <= payload.size()) {
+      TraceStackRecord record{};
+      memcpy(&record, payload.data() + offset, sizeof(record));
+      offset += sizeof(record);
+      size_t size = record.depth * sizeof(uint64_t);
+      if (offset + size > payload.size()) {
+        break;
+      }
+      std::vector<uint64_t>& stack = stacks[record.id];
+      stack.resize(record.depth);
+      memcpy(stack.data(), payload.data() + offset, size);
+      offset += size;
+    }
+  }
+
+  static void ParseModules(const std::vector<char>& payload,
+                           std::vector<TraceModule>& modules) {
+    size_t offset = 0;
+    while (offset + sizeof(TraceModuleRecord) <= payload.size()) {
+      TraceModuleRecord record{};
+      memcpy(&record, payload.data() + offset, sizeof(record));
+      offset += sizeof(record);
+      size_t size = static_cast<size_t>(record.path_length) +
+                    record.build_id_length;
+      if (offset + size > payload.size()) {
+        break;
+      }
+      const char* data = payload.data() + offset;
+      modules.push_back(TraceModule{
+          record.begin, record.end, record.offset,
+          std::string(data, record.path_length),
+          std::string(data + record.path_length, record.build_id_length)});
+      offset += size;
+    }
+  }
+
+  // Chunks of fixed size records, e.g. memory records
+  template <typename Record>
+  static void ParseRecords(const std::vector<char>& payload,
+                           std::vector<Record>& records) {
+    size_t count = payload.size() / sizeof(Record);
+    size_t offset = records.size();
+    records.resize(offset + count);
+    memcpy(records.data() + offset, payload.data(), count * sizeof(Record));
+  }
+
+  static void ParseStrings(const std::vector<char>& payload,
+                           std::map<uint32_t, std::string>& strings) {
+    size_t offset = 0;
+    while (offset + sizeof(TraceStringRecord) <= payload.size()) {
+      TraceStringRecord record{};
+      memcpy(&record, payload.data() + offset, sizeof(record));
+      offset += sizeof(record);
+      if (offset + record.length > payload.size()) {
+        break;
+      }
+      strings[record.id] = std::string(payload.data() + offset, record.length);
+      offset += record.length;
+    }
+  }
+
+  static void ParseMetadata(const std::vector<char>& payload,
+                            std::map<std::string, std::string>& metadata) {
+    size_t offset = 0;
+    while (offset < payload.size()) {
+      const char* begin = payload.data() + offset;
+      const char* end = reinterpret_cast<const char*>(
+          memchr(begin, '\0', payload.size() - offset));
+      if (end == nullptr) {
+        break;
+      }
+      std::string key(begin, end);
+      offset += key.size() + 1;
+      if (offset >= payload.size()) {
+        break;
+      }
+
+      begin = payload.data() + offset;
+      end = reinterpret_cast<const char*>(
+          memchr(begin, '\0', payload.size() - offset));
+      if (end == nullptr) {
+        break;
+      }
+      std::string value(begin, end);
+      offset += value.size() + 1;
+      metadata[key] = value;
+    }
+  }
+
+ private:
+  TraceReader(std::ifstream&& file, const TraceFileHeader& header,
+              uint64_t file_size)
+      : file_(std::move(file)),
+        header_(header),
+        file_size_(file_size),
+        offset_(header.alignment) {}
+
+  std::ifstream file_;
+  TraceFileHeader header_;
+  uint64_t file_size_ = 0;
+  uint64_t offset_ = 0;
+  uint64_t uncommitted_count_ = 0;
+  uint64_t recovered_count_ = 0;
+};
+
+#endif  // PHPROF_TRACE_READER_H_
@@ -0,0 +1,426 @@
+#ifndef PHPROF_TRACE_RING_H_
+#define PHPROF_TRACE_RING_H_
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "trace_format.h"
+#include "utils.h"
+
+#define TRACE_RING_MAGIC 0x474E495258484850ull  // "PHXRING"
+
+// Every slot holds a full calls chunk, larger chunks are split into
+// fragments of the slot size
+#define TRACE_RING_SLOT_SIZE \
+  (sizeof(TraceChunkHeader) + sizeof(TraceCallChunk))
+#define TRACE_RING_SLOT_COUNT 128
+#define TRACE_RING_QUEUE_SIZE 1024  // Power of two
+#define TRACE_RING_STREAM_COUNT 1024  // Not above the queue size
+#define TRACE_RING_PATH_MAX 512
+
+// Waits of a traced thread for a free slot before the collector is checked
+// to be alive
+#define TRACE_RING_WAIT_COUNT 1000
+#define TRACE_RING_WAIT_NS 100000
+
+enum TraceRingSlotState : uint32_t {
+  TRACE_RING_SLOT_FREE = 0,
+  TRACE_RING_SLOT_FILLING = 1,  // Acquired by the traced process
+  TRACE_RING_SLOT_READY = 2,    // Published, waits for the collector
+};
+
+// Entries of the ready queue, the kind is kept in the upper half
+enum TraceRingEntryKind : uint32_t {
+  TRACE_RING_ENTRY_DATA = 1,    // Slot to write into its file
+  TRACE_RING_ENTRY_CLOSE = 2,   // Stream is complete, store its header
+  TRACE_RING_ENTRY_REMOVE = 3,  // Stream is dropped by rotation
+  TRACE_RING_ENTRY_RELEASE = 4,  // Stream is not referred to anymore
+};
+
+// Bytes to write at the given offset of the stream file
+struct TraceRingSlot {
+  std::atomic<uint32_t> state;
+  uint32_t stream;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// One trace file, the header is kept here and stored into the file by the
+// collector, so the traced process may mark it crashed until its last
+// moment. Streams are reused once the collector is done with their file
+struct TraceRingStream {
+  char filename[TRACE_RING_PATH_MAX];
+  TraceFileHeader header;
+  std::atomic<uint32_t> open;  // Claimed by the traced process
+};
+
+// Bounded multi-producer multi-consumer queue, every cell carries the
+// position it is expected to be written or read at
+struct TraceRingQueue {
+  struct Cell {
+    std::atomic<uint64_t> sequence;
+    uint64_t value;
+  };
+
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  Cell cells[TRACE_RING_QUEUE_SIZE];
+
+  void Init() {
+    for (uint64_t i = 0; i < TRACE_RING_QUEUE_SIZE; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+  }
+
+  bool Push(uint64_t value) {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    Cell* cell = nullptr;
+    while (true) {
+      cell = &cells[position & (TRACE_RING_QUEUE_SIZE - 1)];
+      uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+      int64_t difference = static_cast<int64_t>(sequence - position);
+      if (difference == 0) {
+        if (head.compare_exchange_weak(position, position + 1,
+                                       std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;  // Full
+      } else {
+        position = head.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Pop(uint64_t& value) {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    Cell* cell = nullptr;
+    while (true) {
+      cell = &cells[position & (TRACE_RING_QUEUE_SIZE - 1)];
+      uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+      int64_t difference = static_cast<int64_t>(sequence - (position + 1));
+      if (difference == 0) {
+        if (tail.compare_exchange_weak(position, position + 1,
+                                       std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;  // Empty
+      } else {
+        position = tail.load(std::memory_order_relaxed);
+      }
+    }
+    value = cell->value;
+    cell->sequence.store(position + TRACE_RING_QUEUE_SIZE,
+                         std::memory_order_release);
+    return true;
+  }
+};
+
+struct TraceRingHeader {
+  uint64_t magic;
+  uint32_t collector_pid;
+  std::atomic<uint32_t> stream_count;
+  std::atomic<uint64_t> wait_count;  // Slot acquisitions that had to wait
+  TraceRingQueue free;               // Slot indices
+  TraceRingQueue ready;              // Entries for the collector
+  TraceRingQueue free_streams;       // Released stream indices
+  TraceRingStream streams[TRACE_RING_STREAM_COUNT];
+  TraceRingSlot slots[TRACE_RING_SLOT_COUNT];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Trace ring needs address-free atomics");
+
+// Shared memory between the traced process, which fills chunks, and the
+// collector process, which writes them to disk. Traced threads take free
+// slots, fill them in place and publish them in the order the writer
+// produced them; the collector writes every published slot at its offset
+// in the trace file and hands the slot back. Slots in flight stay in the
+// shared memory if the traced process dies, so the collector still writes
+// them out
+class TraceRing {
+ public:  // User Interface
+  // Collector side, the memory is inherited by the traced process through
+  // the descriptor given in PHPROF_TraceRing
+  static TraceRing* Create() {
+    int fd = memfd_create("phoenixprof_ring", 0);
+    if (fd < 0) {
+      return nullptr;
+    }
+    if (ftruncate(fd, GetMappingSize()) != 0) {
+      close(fd);
+      return nullptr;
+    }
+    TraceRing* ring = Map(fd);
+    if (ring == nullptr) {
+      close(fd);
+      return nullptr;
+    }
+
+    TraceRingHeader* header = new (ring->header_) TraceRingHeader();
+    header->magic = TRACE_RING_MAGIC;
+    header->collector_pid = static_cast<uint32_t>(getpid());
+    header->free.Init();
+    header->ready.Init();
+    header->free_streams.Init();
+    for (uint32_t i = 0; i < TRACE_RING_SLOT_COUNT; ++i) {
+      header->free.Push(i);
+    }
+    ring->owner_ = true;
+    utils::SetEnv("PHPROF_TraceRing", std::to_string(fd).c_str());
+    return ring;
+  }
+
+  // Traced process side, the ring of the collector if there is one
+  static TraceRing* GetInstance() {
+    static TraceRing* instance = Attach();
+    return instance;
+  }
+
+  ~TraceRing() {
+    munmap(header_, GetMappingSize());
+    if (owner_) {
+      close(fd_);
+    }
+  }
+
+  TraceRing(const TraceRing& copy) = delete;
+  TraceRing& operator=(const TraceRing& copy) = delete;
+
+  // Claims an entry for the trace file, released streams are taken first.
+  // Returns false if all are in use
+  bool OpenStream(const std::string& filename, uint32_t& stream) {
+    if (filename.size() >= TRACE_RING_PATH_MAX) {
+      return false;
+    }
+    uint64_t index = 0;
+    if (header_->free_streams.Pop(index)) {
+      stream = static_cast<uint32_t>(index);
+    } else {
+      stream = header_->stream_count.load(std::memory_order_relaxed);
+      do {
+        if (stream >= TRACE_RING_STREAM_COUNT) {
+          return false;
+        }
+      } while (!header_->stream_count.compare_exchange_weak(stream,
+                                                            stream + 1));
+    }
+    strcpy(header_->streams[stream].filename, filename.c_str());
+    header_->streams[stream].open.store(1, std::memory_order_release);
+    return true;
+  }
+
+  bool IsStreamOpen(uint32_t stream) const {
+    ASSERT(stream < TRACE_RING_STREAM_COUNT);
+    return header_->streams[stream].open.load(std::memory_order_acquire) != 0;
+  }
+
+  TraceFileHeader* GetFileHeader(uint32_t stream) {
+    ASSERT(stream < TRACE_RING_STREAM_COUNT);
+    return &header_->streams[stream].header;
+  }
+
+  const char* GetFilename(uint32_t stream) const {
+    ASSERT(stream < TRACE_RING_STREAM_COUNT);
+    return header_->streams[stream].filename;
+  }
+
+  // Returns the data of a free slot bound to the given range of the stream
+  // file, waits while the collector is busy. Returns nullptr once the
+  // collector is gone
+  char* AcquireSlot(uint32_t stream, uint64_t offset, uint64_t size) {
+    ASSERT(size <= TRACE_RING_SLOT_SIZE);
+    uint64_t index = 0;
+    if (!Wait([this, &index]() { return header_->free.Pop(index); })) {
+      return nullptr;
+    }
+    TraceRingSlot& slot = header_->slots[index];
+    slot.stream = stream;
+    slot.offset = offset;
+    slot.size = size;
+    slot.state.store(TRACE_RING_SLOT_FILLING, std::memory_order_release);
+    return GetSlotData(static_cast<uint32_t>(index));
+  }
+
+  // Hands the filled slot over to the collector
+  void PublishSlot(char* data) {
+    uint32_t index = GetSlotIndex(data);
+    header_->slots[index].state.store(TRACE_RING_SLOT_READY,
+                                      std::memory_order_release);
+    PushEntry(TRACE_RING_ENTRY_DATA, index);
+  }
+
+  void CloseStream(uint32_t stream) {
+    PushEntry(TRACE_RING_ENTRY_CLOSE, stream);
+  }
+
+  void RemoveStream(uint32_t stream) {
+    PushEntry(TRACE_RING_ENTRY_REMOVE, stream);
+  }
+
+  // The stream is closed or removed and is not referred to anymore, the
+  // collector recycles it once it is done with its file
+  void ReleaseStream(uint32_t stream) {
+    PushEntry(TRACE_RING_ENTRY_RELEASE, stream);
+  }
+
+  // Collector side, the stream may be claimed again
+  void RecycleStream(uint32_t stream) {
+    ASSERT(stream < TRACE_RING_STREAM_COUNT);
+    header_->streams[stream].open.store(0, std::memory_order_release);
+    bool pushed = header_->free_streams.Push(stream);
+    ASSERT(pushed);
+  }
+
+  // Collector side, returns false if nothing is published
+  bool PopEntry(TraceRingEntryKind& kind, uint32_t& index) {
+    uint64_t value = 0;
+    if (!header_->ready.Pop(value)) {
+      return false;
+    }
+    kind = static_cast<TraceRingEntryKind>(value >> 32);
+    index = static_cast<uint32_t>(value);
+    return true;
+  }
+
+  const TraceRingSlot& GetSlot(uint32_t index) const {
+    ASSERT(index < TRACE_RING_SLOT_COUNT);
+    return header_->slots[index];
+  }
+
+  char* GetSlotData(uint32_t index) {
+    ASSERT(index < TRACE_RING_SLOT_COUNT);
+    return reinterpret_cast<char*>(header_) + GetHeaderSize() +
+           index * TRACE_RING_SLOT_SIZE;
+  }
+
+  // Collector side, the slot is written out and may be reused
+  void ReleaseSlot(uint32_t index) {
+    ASSERT(index < TRACE_RING_SLOT_COUNT);
+    header_->slots[index].state.store(TRACE_RING_SLOT_FREE,
+                                      std::memory_order_release);
+    bool pushed = header_->free.Push(index);
+    ASSERT(pushed);
+  }
+
+  uint32_t GetStreamCount() const {
+    return std::min<uint32_t>(
+        header_->stream_count.load(std::memory_order_acquire),
+        TRACE_RING_STREAM_COUNT);
+  }
+
+  uint64_t GetWaitCount() const {
+    return header_->wait_count.load(std::memory_order_relaxed);
+  }
+
+ private:  // Implementation Details
+  TraceRing(TraceRingHeader* header, int fd) : header_(header), fd_(fd) {}
+
+  static uint64_t GetHeaderSize() {
+    uint64_t alignment = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    return (sizeof(TraceRingHeader) + alignment - 1) / alignment * alignment;
+  }
+
+  static uint64_t GetMappingSize() {
+    return GetHeaderSize() + TRACE_RING_SLOT_COUNT * TRACE_RING_SLOT_SIZE;
+  }
+
+  static TraceRing* Map(int fd) {
+    void* data = mmap(nullptr, GetMappingSize(), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    TraceRing* ring =
+        new TraceRing(reinterpret_cast<TraceRingHeader*>(data), fd);
+    ASSERT(ring != nullptr);
+    return ring;
+  }
+
+  // The descriptor is needed for the mapping only, it is closed and the
+  // variable is dropped, so child processes do not inherit the ring
+  static TraceRing* Attach() {
+    std::string value = utils::GetEnv("PHPROF_TraceRing");
+    if (value.empty()) {
+      return nullptr;
+    }
+    int fd = std::stoi(value);
+    TraceRing* ring = Map(fd);
+    close(fd);
+    unsetenv("PHPROF_TraceRing");
+    if (ring == nullptr || ring->header_->magic != TRACE_RING_MAGIC) {
+      std::cerr << "[WARNING] Unable to attach to trace collector, "
+                << "traces will not be written" << std::endl;
+      delete ring;
+      return nullptr;
+    }
+    return ring;
+  }
+
+  uint32_t GetSlotIndex(const char* data) const {
+    uint64_t offset = data - (reinterpret_cast<const char*>(header_) +
+                              GetHeaderSize());
+    ASSERT(offset % TRACE_RING_SLOT_SIZE == 0);
+    ASSERT(offset / TRACE_RING_SLOT_SIZE < TRACE_RING_SLOT_COUNT);
+    return static_cast<uint32_t>(offset / TRACE_RING_SLOT_SIZE);
+  }
+
+  void PushEntry(TraceRingEntryKind kind, uint32_t index) {
+    uint64_t value = (static_cast<uint64_t>(kind) << 32) | index;
+    Wait([this, value]() { return header_->ready.Push(value); });
+  }
+
+  // Retries the operation until it succeeds or the collector is gone
+  template <typename Operation>
+  bool Wait(Operation operation) {
+    if (operation()) {
+      return true;
+    }
+    if (collector_lost_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    header_->wait_count.fetch_add(1, std::memory_order_relaxed);
+    const struct timespec delay = {0, TRACE_RING_WAIT_NS};
+    while (true) {
+      for (uint32_t i = 0; i < TRACE_RING_WAIT_COUNT; ++i) {
+        if (operation()) {
+          return true;
+        }
+        nanosleep(&delay, nullptr);
+      }
+      if (kill(header_->collector_pid, 0) != 0 && errno == ESRCH) {
+        if (!collector_lost_.exchange(true)) {
+          std::cerr << "[WARNING] Trace collector is gone, "
+                    << "traces are incomplete" << std::endl;
+        }
+        return false;
+      }
+    }
+  }
+
+ private:  // Data
+  TraceRingHeader* header_ = nullptr;
+  int fd_ = -1;
+  bool owner_ = false;
+  std::atomic<bool> collector_lost_{false};
+};
+
+#endif  // PHPROF_TRACE_RING_H_
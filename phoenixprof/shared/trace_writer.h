@@ -0,0 +1,775 @@
+#ifndef PHPROF_TRACE_WRITER_H_
+#define PHPROF_TRACE_WRITER_H_
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "trace_arena.h"
+#include "trace_format.h"
+#include "trace_ring.h"
+#include "utils.h"
+
+#define TRACE_WRITER_MAX_COUNT 16
+
+// File is extended and mapped this much at a time, chunk slots are handed
+// out from the mapped region
+#define TRACE_WRITER_REGION_SIZE (2ull << 20)
+
+// Runs region reservations and releases of all writers on one background
+// thread, so extending the file, faulting in the next region and unmapping
+// a full one does not stop the thread that records calls. The thread is
+// started on the first job and runs until the process exits
+class TraceRegionReserver {
+ public:  // User Interface
+  static void Run(std::function<void()> job) {
+    // Never deleted, the thread may still wait for jobs at exit
+    static TraceRegionReserver* reserver = new TraceRegionReserver();
+    reserver->Push(std::move(job));
+  }
+
+ private:  // Implementation Details
+  TraceRegionReserver() {
+    std::thread(&TraceRegionReserver::Serve, this).detach();
+  }
+
+  void Push(std::function<void()> job) {
+    {
+      const std::lock_guard<std::mutex> guard(lock_);
+      jobs_.push_back(std::move(job));
+    }
+    wakeup_.notify_one();
+  }
+
+  void Serve() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(lock_);
+      wakeup_.wait(lock, [this] { return !jobs_.empty(); });
+      std::function<void()> job = std::move(jobs_.front());
+      jobs_.pop_front();
+      lock.unlock();
+      job();
+    }
+  }
+
+  std::deque<std::function<void()>> jobs_;
+  std::mutex lock_;
+  std::condition_variable wakeup_;
+};
+
+// Limits of one trace segment, zero means no limit. Once a limit is reached
+// the writer moves on to the next segment file, at most max_segments newest
+// segments are kept
+struct TraceRotation {
+  uint64_t max_size = 0;      // Bytes
+  uint64_t max_duration = 0;  // Nanoseconds
+  uint32_t max_segments = 0;
+
+  bool IsEnabled() const { return max_size > 0 || max_duration > 0; }
+};
+
+// Writes binary trace chunks directly into memory mapped file regions:
+// recorded data lives in the page cache from the start, so it survives
+// a crash or _exit() of the traced process, and closing the trace only
+// has to set the commit markers. The file grows by large regions that are
+// faulted in once they are mapped, so acquiring and filling a chunk does
+// not make a system call or take a page fault in the traced thread; a
+// region is unmapped once all of its chunks are committed. The next region
+// is reserved in the background once half of the current one is handed
+// out, the traced thread only switches over to it.
+// With rotation every segment is a complete trace on its own: strings and
+// metadata written so far are repeated at its start, together with a clock
+// anchor to place its timestamps in wall time.
+// If the process runs under a trace collector, chunks are filled in its
+// shared memory ring instead and the collector writes them at the same
+// offsets, so the file layout does not change
+class TraceWriter {
+ public:
+  static TraceWriter* Create(const std::string& filename,
+                             const TraceRotation& rotation = TraceRotation()) {
+    TraceWriter* writer = new TraceWriter(filename, rotation);
+    ASSERT(writer != nullptr);
+    if (!writer->OpenSegment()) {
+      delete writer;
+      return nullptr;
+    }
+    if (rotation.IsEnabled()) {
+      writer->WriteSegmentMetadata();
+    }
+    writer->Register();
+    return writer;
+  }
+
+  ~TraceWriter() { Close(); }
+
+  // Name of the given segment of a rotated trace, e.g. gpu0_trace.0001.bin
+  // for gpu0_trace.bin
+  static std::string GetSegmentName(const std::string& filename,
+                                    const std::string& index) {
+    size_t pos = filename.rfind(".bin");
+    if (pos != std::string::npos && pos + 4 == filename.size()) {
+      return filename.substr(0, pos) + "." + index + ".bin";
+    }
+    return filename + "." + index;
+  }
+
+  static std::string GetSegmentName(const std::string& filename,
+                                    uint32_t index) {
+    char number[16] = {0};
+    snprintf(number, sizeof(number), "%04u", index);
+    return GetSegmentName(filename, number);
+  }
+
+  // Payloads of strings and metadata chunks
+  static std::string PackStrings(
+      const std::map<uint32_t, std::string>& strings) {
+    std::string data;
+    for (const auto& item : strings) {
+      TraceStringRecord record{item.first,
+                               static_cast<uint32_t>(item.second.size())};
+      data.append(reinterpret_cast<const char*>(&record), sizeof(record));
+      data.append(item.second);
+    }
+    return data;
+  }
+
+  static std::string PackMetadata(
+      const std::map<std::string, std::string>& metadata) {
+    std::string data;
+    for (const auto& item : metadata) {
+      data.append(item.first.c_str(), item.first.size() + 1);
+      data.append(item.second.c_str(), item.second.size() + 1);
+    }
+    return data;
+  }
+
+  TraceWriter(const TraceWriter& copy) = delete;
+  TraceWriter& operator=(const TraceWriter& copy) = delete;
+
+  // Returns an empty calls chunk mapped into the file, it is expected to be
+  // handed back with CommitCallChunk() once filled
+  TraceCallChunk* AcquireCallChunk() {
+    TraceCallChunk* chunk = reinterpret_cast<TraceCallChunk*>(
+        AllocateChunk(TRACE_CHUNK_CALLS, sizeof(TraceCallChunk)));
+    if (chunk != nullptr) {
+      chunk->count = 0;
+      ++acquired_count_;
+    }
+    return chunk;
+  }
+
+  // A calls chunk being filled keeps the segment from rotating, so the
+  // holder is expected to commit it early once the time limit of the
+  // segment is reached at the given time (on the steady clock, in ns)
+  bool IsSegmentExpired(uint64_t timestamp) const {
+    return timestamp >= segment_end_.load(std::memory_order_relaxed);
+  }
+
+  void CommitCallChunk(TraceCallChunk* chunk) {
+    ASSERT(chunk != nullptr);
+    CommitChunk(chunk);
+    ASSERT(acquired_count_ > 0);
+    --acquired_count_;
+  }
+
+  void WriteStrings(const std::map<uint32_t, std::string>& strings) {
+    if (rotation_.IsEnabled()) {
+      for (const auto& item : strings) {
+        strings_[item.first] = item.second;
+      }
+    }
+    WriteChunk(TRACE_CHUNK_STRINGS, PackStrings(strings));
+  }
+
+  // Metadata values are expected to be valid JSON values
+  void WriteMetadata(const std::map<std::string, std::string>& metadata) {
+    if (rotation_.IsEnabled()) {
+      for (const auto& item : metadata) {
+        metadata_[item.first] = item.second;
+      }
+    }
+    WriteChunk(TRACE_CHUNK_METADATA, PackMetadata(metadata));
+  }
+
+  // Number of segments written so far, 1 without rotation
+  uint32_t GetSegmentCount() const { return segment_index_ + 1; }
+
+  // Packed sample records, each followed by its stack
+  void WriteSamples(const std::string& data) {
+    WriteChunk(TRACE_CHUNK_SAMPLES, data);
+  }
+
+  // Packed stack records, each followed by its stack
+  void WriteStacks(const std::string& data) {
+    WriteChunk(TRACE_CHUNK_STACKS, data);
+  }
+
+  // Packed module records, each followed by its path and build ID
+  void WriteModules(const std::string& data) {
+    WriteChunk(TRACE_CHUNK_MODULES, data);
+  }
+
+  // Packed memory records
+  void WriteMemory(const std::string& data) {
+    WriteChunk(TRACE_CHUNK_MEMORY, data);
+  }
+
+  // Packed clock records
+  void WriteClocks(const std::string& data) {
+    WriteChunk(TRACE_CHUNK_CLOCKS, data);
+  }
+
+  // Packed command records
+  void WriteCommands(const std::string& data) {
+    WriteChunk(TRACE_CHUNK_COMMANDS, data);
+  }
+
+  // Marks the trace as complete, all acquired chunks should be committed
+  void Close() {
+    if (header_ == nullptr) {
+      return;
+    }
+    Unregister();
+    CloseSegment();
+  }
+
+  // Called from fatal signal handlers, so only async-signal-safe operations
+  // are allowed here: mapped memory stays in the page cache after the
+  // process dies, it is enough to store the state
+  static void MarkCrashed(int signal) {
+    std::atomic<TraceWriter*>* registry = GetRegistry();
+    for (int i = 0; i < TRACE_WRITER_MAX_COUNT; ++i) {
+      TraceWriter* writer = registry[i].load(std::memory_order_acquire);
+      if (writer != nullptr && writer->header_ != nullptr) {
+        writer->header_->signal = static_cast<uint32_t>(signal);
+        writer->header_->state = TRACE_STATE_CRASHED;
+      }
+    }
+  }
+
+ private:
+  struct Segment {
+    std::string filename;
+    uint32_t stream;  // Ring stream of the segment under a collector
+  };
+
+  struct Region {
+    char* data;
+    uint64_t offset;  // In the file
+    uint64_t size;
+    uint32_t acquired;  // Slots not committed yet
+  };
+
+  struct Spare {
+    char* data = nullptr;  // Not mapped if reservation failed
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    bool pending = false;  // Being mapped by the reserver
+  };
+
+  TraceWriter(const std::string& filename, const TraceRotation& rotation)
+      : filename_(filename),
+        rotation_(rotation),
+        ring_(TraceRing::GetInstance()),
+        alignment_(static_cast<uint32_t>(sysconf(_SC_PAGESIZE))) {
+    ASSERT(alignment_ >= sizeof(TraceFileHeader));
+  }
+
+  // Creates the file of the current segment and maps its header
+  bool OpenSegment() {
+    std::string filename = rotation_.IsEnabled()
+                               ? GetSegmentName(filename_, segment_index_)
+                               : filename_;
+    if (ring_ != nullptr) {
+      return OpenRingSegment(filename);
+    }
+    int file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+      return false;
+    }
+    file_ = file;
+    size_ = alignment_;
+
+    TraceFileHeader* header =
+        reinterpret_cast<TraceFileHeader*>(Map(0, alignment_));
+    if (header == nullptr) {
+      close(file_);
+      file_ = -1;
+      return false;
+    }
+    *header = TraceFileHeader{TRACE_FILE_MAGIC, TRACE_FORMAT_VERSION,
+                              sizeof(TraceCallRecord), alignment_,
+                              TRACE_STATE_OPEN, 0, 0};
+    header_ = header;
+    StartSegmentClock();
+    segments_.push_back(Segment{filename, 0});
+    return true;
+  }
+
+  // The file is created by the collector once the first chunk of the
+  // segment reaches it, the header is kept in the ring until then
+  bool OpenRingSegment(const std::string& filename) {
+    uint32_t stream = 0;
+    if (!ring_->OpenStream(filename, stream)) {
+      return false;
+    }
+    stream_ = stream;
+    size_ = alignment_;
+
+    TraceFileHeader* header = ring_->GetFileHeader(stream);
+    *header = TraceFileHeader{TRACE_FILE_MAGIC, TRACE_FORMAT_VERSION,
+                              sizeof(TraceCallRecord), alignment_,
+                              TRACE_STATE_OPEN, 0, 0};
+    header_ = header;
+    StartSegmentClock();
+    segments_.push_back(Segment{filename, stream});
+    return true;
+  }
+
+  void StartSegmentClock() {
+    segment_start_ = std::chrono::steady_clock::now();
+    std::chrono::duration<uint64_t, std::nano> start =
+        segment_start_.time_since_epoch();
+    segment_end_.store((rotation_.max_duration > 0)
+                           ? start.count() + rotation_.max_duration
+                           : UINT64_MAX,
+                       std::memory_order_relaxed);
+  }
+
+  void CloseSegment() {
+    header_->state = TRACE_STATE_CLOSED;
+    if (ring_ != nullptr) {
+      ring_->CloseStream(stream_);
+      for (const Segment& segment : segments_) {
+        ring_->ReleaseStream(segment.stream);
+      }
+      segments_.clear();
+    } else {
+      CloseFile(header_, file_, size_);
+      file_ = -1;
+    }
+    header_ = nullptr;
+  }
+
+  // Space reserved past the last chunk is cut off, so a closed trace ends
+  // right after it
+  void CloseFile(TraceFileHeader* header, int file, uint64_t size) {
+    DropSpare();
+    for (const Region& region : regions_) {
+      munmap(region.data, region.size);
+    }
+    regions_.clear();
+    munmap(header, alignment_);
+    if (ftruncate(file, size) != 0) {
+      ReportFailure();
+    }
+    close(file);
+  }
+
+  // Segments are switched between chunks only, a chunk never spans two
+  // files. Returns false if the next segment can not be created, the
+  // current one is kept growing then
+  bool Rotate() {
+    TraceFileHeader* header = header_;
+    int file = file_;
+    uint32_t stream = stream_;
+    uint64_t size = size_;
+    ++segment_index_;
+    if (!OpenSegment()) {
+      --segment_index_;
+      header_ = header;
+      file_ = file;
+      stream_ = stream;
+      size_ = size;
+      std::cerr << "[WARNING] Unable to create trace segment, rotation "
+                << "of " << filename_ << " is stopped" << std::endl;
+      rotation_ = TraceRotation();
+      segment_end_.store(UINT64_MAX, std::memory_order_relaxed);
+      return false;
+    }
+    header->state = TRACE_STATE_CLOSED;
+    if (ring_ != nullptr) {
+      ring_->CloseStream(stream);
+    } else {
+      CloseFile(header, file, size);
+    }
+
+    if (rotation_.max_segments > 0) {
+      while (segments_.size() > rotation_.max_segments) {
+        // The collector may not have created the file yet
+        if (ring_ != nullptr) {
+          ring_->RemoveStream(segments_.front().stream);
+          ring_->ReleaseStream(segments_.front().stream);
+        } else {
+          unlink(segments_.front().filename.c_str());
+        }
+        segments_.pop_front();
+      }
+    } else {
+      // Closed segments are never removed, so their streams are released
+      while (segments_.size() > 1) {
+        if (ring_ != nullptr) {
+          ring_->ReleaseStream(segments_.front().stream);
+        }
+        segments_.pop_front();
+      }
+    }
+
+    // Repeated data always goes to the new segment, whatever its size
+    rotating_ = true;
+    WriteSegmentMetadata();
+    if (!strings_.empty()) {
+      WriteChunk(TRACE_CHUNK_STRINGS, PackStrings(strings_));
+    }
+    rotating_ = false;
+    return true;
+  }
+
+  void WriteSegmentMetadata() {
+    std::map<std::string, std::string> metadata = metadata_;
+    metadata["segment_index"] = std::to_string(segment_index_);
+    metadata["clock_anchor"] = GetClockAnchor();
+    WriteChunk(TRACE_CHUNK_METADATA, PackMetadata(metadata));
+  }
+
+  // Same instant on the trace clock and on the wall clock, both in ns
+  static std::string GetClockAnchor() {
+    std::chrono::duration<uint64_t, std::nano> steady =
+        std::chrono::steady_clock::now().time_since_epoch();
+    std::chrono::duration<uint64_t, std::nano> system =
+        std::chrono::system_clock::now().time_since_epoch();
+    return "{\"steady_ns\":" + std::to_string(steady.count()) +
+           ",\"realtime_ns\":" + std::to_string(system.count()) + "}";
+  }
+
+  bool IsRotationDue(uint64_t slot_size) const {
+    if (!rotation_.IsEnabled() || rotating_ || acquired_count_ > 0 ||
+        size_ == alignment_) {
+      return false;
+    }
+    if (rotation_.max_size > 0 && size_ + slot_size > rotation_.max_size) {
+      return true;
+    }
+    std::chrono::duration<uint64_t, std::nano> age =
+        std::chrono::steady_clock::now() - segment_start_;
+    return rotation_.max_duration > 0 && age.count() >= rotation_.max_duration;
+  }
+
+  static std::atomic<TraceWriter*>* GetRegistry() {
+    static std::atomic<TraceWriter*> registry[TRACE_WRITER_MAX_COUNT];
+    return registry;
+  }
+
+  void Register() {
+    std::atomic<TraceWriter*>* registry = GetRegistry();
+    for (int i = 0; i < TRACE_WRITER_MAX_COUNT; ++i) {
+      TraceWriter* expected = nullptr;
+      if (registry[i].compare_exchange_strong(expected, this)) {
+        return;
+      }
+    }
+    std::cerr << "[WARNING] Too many trace files, crash state will not be "
+              << "recorded for one of them" << std::endl;
+  }
+
+  void Unregister() {
+    std::atomic<TraceWriter*>* registry = GetRegistry();
+    for (int i = 0; i < TRACE_WRITER_MAX_COUNT; ++i) {
+      TraceWriter* expected = this;
+      if (registry[i].compare_exchange_strong(expected, nullptr)) {
+        return;
+      }
+    }
+  }
+
+  uint64_t GetSlotSize(uint64_t payload_size) const {
+    uint64_t size = sizeof(TraceChunkHeader) + payload_size;
+    return (size + alignment_ - 1) / alignment_ * alignment_;
+  }
+
+  void* Map(uint64_t offset, uint64_t size, bool prefault = false) {
+    void* data = MapFile(file_, offset, size, prefault);
+    if (data == nullptr) {
+      ReportFailure();
+    }
+    return data;
+  }
+
+  // The file is only extended here: a region reserved ahead may already
+  // reach beyond the one being mapped
+  static void* MapFile(int file, uint64_t offset, uint64_t size,
+                       bool prefault) {
+    struct stat status{};
+    if (fstat(file, &status) != 0) {
+      return nullptr;
+    }
+    if (static_cast<uint64_t>(status.st_size) < offset + size &&
+        ftruncate(file, offset + size) != 0) {
+      return nullptr;
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      file, offset);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    if (prefault) {
+      TraceArena::Prefault(data, size);
+    }
+    return data;
+  }
+
+  // Returns the next chunk slot from the current region, a new region
+  // starts at the slot if it does not fit. Regions may overlap in the
+  // file, but no slot is handed out twice
+  char* MapSlot(uint64_t slot_size) {
+    if (regions_.empty() ||
+        size_ + slot_size > regions_.back().offset + regions_.back().size) {
+      Region region{};
+      if (!TakeSpare(slot_size, region)) {
+        uint64_t size =
+            std::max<uint64_t>(TRACE_WRITER_REGION_SIZE, slot_size);
+        size = (size + alignment_ - 1) / alignment_ * alignment_;
+        char* data = reinterpret_cast<char*>(Map(size_, size, true));
+        if (data == nullptr) {
+          return nullptr;
+        }
+        region = Region{data, size_, size, 0};
+      }
+      regions_.push_back(region);
+      ReleaseRegions();
+    }
+    Region& region = regions_.back();
+    ++region.acquired;
+    if (!spare_requested_ &&
+        (size_ + slot_size - region.offset) * 2 >= region.size) {
+      ReserveSpare(size_ + slot_size);
+    }
+    return region.data + (size_ - region.offset);
+  }
+
+  // Maps and faults in the region starting at the offset on the reserver
+  // thread, the file offset only grows within a segment, so slots handed
+  // out later start in it
+  void ReserveSpare(uint64_t offset) {
+    {
+      const std::lock_guard<std::mutex> guard(spare_lock_);
+      spare_ = Spare{nullptr, offset, TRACE_WRITER_REGION_SIZE, true};
+    }
+    spare_requested_ = true;
+    int file = file_;
+    TraceRegionReserver::Run([this, file, offset]() {
+      char* data = reinterpret_cast<char*>(
+          MapFile(file, offset, TRACE_WRITER_REGION_SIZE, true));
+      {
+        const std::lock_guard<std::mutex> guard(spare_lock_);
+        spare_.data = data;
+        spare_.pending = false;
+      }
+      spare_done_.notify_all();
+    });
+  }
+
+  // Hands over the reserved region if it holds the next slot, waits for it
+  // if it is not ready yet. A region that does not fit is dropped, the
+  // slot is mapped right away then
+  bool TakeSpare(uint64_t slot_size, Region& region) {
+    if (!spare_requested_) {
+      return false;
+    }
+    Spare spare = WaitSpare();
+    if (spare.data == nullptr) {
+      return false;
+    }
+    if (spare.offset > size_ || size_ + slot_size > spare.offset + spare.size) {
+      munmap(spare.data, spare.size);
+      return false;
+    }
+    region = Region{spare.data, spare.offset, spare.size, 0};
+    return true;
+  }
+
+  // Called before the file is closed, the reserver may still be mapping it
+  void DropSpare() {
+    if (!spare_requested_) {
+      return;
+    }
+    Spare spare = WaitSpare();
+    if (spare.data != nullptr) {
+      munmap(spare.data, spare.size);
+    }
+  }
+
+  Spare WaitSpare() {
+    std::unique_lock<std::mutex> lock(spare_lock_);
+    spare_done_.wait(lock, [this] { return !spare_.pending; });
+    Spare spare = spare_;
+    spare_ = Spare();
+    spare_requested_ = false;
+    return spare;
+  }
+
+  void UnmapSlot(char* slot) {
+    for (auto it = regions_.rbegin(); it != regions_.rend(); ++it) {
+      if (slot >= it->data && slot < it->data + it->size) {
+        ASSERT(it->acquired > 0);
+        --it->acquired;
+        break;
+      }
+    }
+    ReleaseRegions();
+  }
+
+  // Only the oldest regions are unmapped, the current one is kept for the
+  // next slots. Tearing down a populated region takes as long as faulting
+  // it in, so it is left to the reserver
+  void ReleaseRegions() {
+    while (regions_.size() > 1 && regions_.front().acquired == 0) {
+      char* data = regions_.front().data;
+      uint64_t size = regions_.front().size;
+      TraceRegionReserver::Run([data, size]() { munmap(data, size); });
+      regions_.pop_front();
+    }
+  }
+
+  // Maps the next chunk slot and returns its payload, the chunk header is
+  // stored first, so a crash leaves a valid uncommitted chunk behind
+  void* AllocateChunk(uint32_t type, uint64_t payload_size) {
+    if (header_ == nullptr) {
+      return nullptr;
+    }
+
+    uint64_t slot_size = GetSlotSize(payload_size);
+    if (IsRotationDue(slot_size)) {
+      Rotate();
+    }
+    char* slot =
+        (ring_ != nullptr)
+            ? ring_->AcquireSlot(stream_, size_,
+                                 sizeof(TraceChunkHeader) + payload_size)
+            : MapSlot(slot_size);
+    if (slot == nullptr) {
+      return nullptr;
+    }
+    size_ += slot_size;
+
+    TraceChunkHeader* header = reinterpret_cast<TraceChunkHeader*>(slot);
+    *header = TraceChunkHeader{TRACE_CHUNK_MAGIC, type, payload_size, 0, 0};
+    return slot + sizeof(TraceChunkHeader);
+  }
+
+  void CommitChunk(void* payload) {
+    char* slot = reinterpret_cast<char*>(payload) - sizeof(TraceChunkHeader);
+    TraceChunkHeader* header = reinterpret_cast<TraceChunkHeader*>(slot);
+    ASSERT(header->magic == TRACE_CHUNK_MAGIC);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->commit = TRACE_CHUNK_COMMITTED;
+    if (ring_ != nullptr) {
+      ring_->PublishSlot(slot);
+    } else {
+      UnmapSlot(slot);
+    }
+  }
+
+  void WriteChunk(uint32_t type, const std::string& data) {
+    if (ring_ != nullptr &&
+        sizeof(TraceChunkHeader) + data.size() > TRACE_RING_SLOT_SIZE) {
+      WriteRingFragments(type, data);
+      return;
+    }
+    void* payload = AllocateChunk(type, data.size());
+    if (payload != nullptr) {
+      memcpy(payload, data.data(), data.size());
+      CommitChunk(payload);
+    }
+  }
+
+  // Chunk larger than a ring slot goes in slot sized pieces, its commit
+  // marker is sent last, once the whole chunk is in the file
+  void WriteRingFragments(uint32_t type, const std::string& data) {
+    if (header_ == nullptr) {
+      return;
+    }
+
+    uint64_t slot_size = GetSlotSize(data.size());
+    if (IsRotationDue(slot_size)) {
+      Rotate();
+    }
+    uint64_t offset = size_;
+    size_ += slot_size;
+
+    TraceChunkHeader header{TRACE_CHUNK_MAGIC, type, data.size(), 0, 0};
+    std::string chunk(reinterpret_cast<const char*>(&header), sizeof(header));
+    chunk.append(data);
+    for (uint64_t i = 0; i < chunk.size(); i += TRACE_RING_SLOT_SIZE) {
+      uint64_t size = std::min<uint64_t>(TRACE_RING_SLOT_SIZE,
+                                         chunk.size() - i);
+      char* slot = ring_->AcquireSlot(stream_, offset + i, size);
+      if (slot == nullptr) {
+        return;
+      }
+      memcpy(slot, chunk.data() + i, size);
+      ring_->PublishSlot(slot);
+    }
+
+    uint32_t commit = TRACE_CHUNK_COMMITTED;
+    char* slot =
+        ring_->AcquireSlot(stream_, offset + offsetof(TraceChunkHeader, commit),
+                           sizeof(commit));
+    if (slot != nullptr) {
+      memcpy(slot, &commit, sizeof(commit));
+      ring_->PublishSlot(slot);
+    }
+  }
+
+  void ReportFailure() {
+    if (!failed_) {
+      std::cerr << "[WARNING] Unable to extend trace file" << std::endl;
+      failed_ = true;
+    }
+  }
+
+  std::string filename_;
+  TraceRotation rotation_;
+  TraceRing* ring_ = nullptr;
+  uint32_t stream_ = 0;
+  int file_ = -1;
+  uint32_t alignment_ = 0;
+  uint64_t size_ = 0;
+  bool failed_ = false;
+  TraceFileHeader* header_ = nullptr;
+  std::deque<Region> regions_;  // Mapped, the last one is being handed out
+
+  // Region reserved ahead for the slots after the current one
+  Spare spare_;
+  bool spare_requested_ = false;  // Owned by the writing thread
+  std::mutex spare_lock_;
+  std::condition_variable spare_done_;
+
+  // Rotation state, strings and metadata are kept to be repeated in every
+  // segment
+  uint32_t segment_index_ = 0;
+  uint32_t acquired_count_ = 0;  // Call chunks not committed yet
+  bool rotating_ = false;
+  std::chrono::steady_clock::time_point segment_start_;
+  std::atomic<uint64_t> segment_end_{UINT64_MAX};  // Steady clock, in ns
+  std::deque<Segment> segments_;
+  std::map<uint32_t, std::string> strings_;
+  std::map<std::string, std::string> metadata_;
+};
+
+#endif  // PHPROF_TRACE_WRITER_H_
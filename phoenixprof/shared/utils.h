@@ -9,8 +9,10 @@
 #include <assert.h>
 #endif
 
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -43,6 +45,11 @@ inline void SetEnv(const char *name, const char *value) {
   ASSERT(status == 0);
 }
 
+inline uint32_t GetTid() {
+  static thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+  return tid;
+}
+
 inline std::string GetFilePath(const std::string &filename) {
   ASSERT(!filename.empty());
 
@@ -54,12 +61,49 @@ inline std::string GetFilePath(const std::string &filename) {
   return filename.substr(0, pos + 1);
 }
 
+// File in the given directory, the working one if it is empty
+inline std::string JoinPath(const std::string &directory,
+                            const std::string &filename) {
+  if (directory.empty()) {
+    return filename;
+  }
+  return (directory.back() == '/') ? directory + filename
+                                   : directory + "/" + filename;
+}
+
 inline std::string GetExecutablePath() {
   char buffer[MAX_STR_SIZE] = {0};
   ssize_t status = readlink("/proc/self/exe", buffer, MAX_STR_SIZE);
   ASSERT(status > 0);
   return GetFilePath(buffer);
 }
+
+// Appends the value as the contents of a JSON string, quotes, backslashes
+// and control characters are escaped
+inline void AppendJsonEscaped(const std::string &value, std::string &out) {
+  static const char digits[] = "0123456789abcdef";
+  for (char c : value) {
+    unsigned char code = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (code < 0x20) {
+      out += "\\u00";
+      out += digits[code >> 4];
+      out += digits[code & 0xF];
+    } else {
+      out += c;
+    }
+  }
+}
+
+// Quoted JSON string of the value
+inline std::string GetJsonString(const std::string &value) {
+  std::string out = "\"";
+  AppendJsonEscaped(value, out);
+  out += '"';
+  return out;
+}
 }  // namespace utils
 
 #endif  // PHPROF_UTILS_H_
\ No newline at end of file
@@ -13,6 +13,30 @@ namespace cl {
     return vendor;
   }
 
+  inline std::string GetDeviceName(cl_device_id device) {
+    char name[MAX_STR_SIZE] = { 0 };
+    cl_int status = clGetDeviceInfo(
+        device, CL_DEVICE_NAME, MAX_STR_SIZE, name, nullptr);
+    ASSERT(status == CL_SUCCESS);
+    return name;
+  }
+
+  inline cl_device_type GetDeviceType(cl_device_id device) {
+    cl_device_type type = CL_DEVICE_TYPE_DEFAULT;
+    cl_int status = clGetDeviceInfo(
+        device, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+    ASSERT(status == CL_SUCCESS);
+    return type;
+  }
+
+  inline cl_platform_id GetDevicePlatform(cl_device_id device) {
+    cl_platform_id platform = nullptr;
+    cl_int status = clGetDeviceInfo(
+        device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr);
+    ASSERT(status == CL_SUCCESS);
+    return platform;
+  }
+
   inline std::vector<cl_device_id> GetDeviceList(cl_device_type type) {
     cl_int status = CL_SUCCESS;
 
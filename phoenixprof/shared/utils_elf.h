@@ -0,0 +1,51 @@
+#ifndef PHPROF_UTILS_ELF_H_
+#define PHPROF_UTILS_ELF_H_
+
+#include <elf.h>
+#include <string.h>
+
+#include <string>
+
+#include "utils.h"
+
+namespace utils {
+namespace elf {
+  inline size_t AlignNote(size_t size) { return (size + 3) & ~size_t(3); }
+
+  // Returns GNU build ID bytes found in a block of ELF notes, empty if none
+  inline std::string GetBuildId(const char* notes, size_t size) {
+    ASSERT(notes != nullptr || size == 0);
+    size_t offset = 0;
+    while (offset + sizeof(Elf64_Nhdr) <= size) {
+      Elf64_Nhdr header{};
+      memcpy(&header, notes + offset, sizeof(header));
+      offset += sizeof(header);
+
+      size_t name_offset = offset;
+      size_t desc_offset = name_offset + AlignNote(header.n_namesz);
+      offset = desc_offset + AlignNote(header.n_descsz);
+      if (desc_offset + header.n_descsz > size) {
+        break;
+      }
+
+      if (header.n_type == NT_GNU_BUILD_ID && header.n_namesz == 4 &&
+          memcmp(notes + name_offset, "GNU", 4) == 0) {
+        return std::string(notes + desc_offset, header.n_descsz);
+      }
+    }
+    return std::string();
+  }
+
+  inline std::string GetHexString(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char byte : bytes) {
+      hex.push_back(digits[byte >> 4]);
+      hex.push_back(digits[byte & 0xF]);
+    }
+    return hex;
+  }
+}  // namespace elf
+}  // namespace utils
+
+#endif  // PHPROF_UTILS_ELF_H_
@@ -0,0 +1,110 @@
+#ifndef PHPROF_CL_CALL_SITE_PROFILE_H_
+#define PHPROF_CL_CALL_SITE_PROFILE_H_
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "trace_reader.h"
+
+// Number of costliest call sites reported per API function
+#define CALL_SITE_REPORT_TOP_COUNT 3
+// Number of innermost frames shown per call site
+#define CALL_SITE_REPORT_FRAME_COUNT 4
+
+// Splits the time of every API function by the application call sites
+// captured on enter, showing which code paths issue the expensive calls
+class ClCallSiteProfile {
+ public:
+  static void PrintReport(const std::vector<ClFunctionCall>& calls,
+                          const TraceStackMap& stacks,
+                          const std::string& title, std::ostream& out,
+                          const TraceSymbolMap& symbols = {}) {
+    struct CallSite {
+      uint64_t call_count = 0;
+      uint64_t total_time = 0;
+    };
+    struct FunctionProfile {
+      uint64_t total_time = 0;
+      std::map<uint32_t, CallSite> sites;
+    };
+    std::map<std::string, FunctionProfile> functions;
+    uint64_t captured_count = 0;
+    for (const auto& call : calls) {
+      if (IsAnnotation(call) || call.stack_id == 0) {
+        continue;
+      }
+      FunctionProfile& profile = functions[call.function_name];
+      CallSite& site = profile.sites[call.stack_id];
+      uint64_t duration = call.busy_time;
+      site.call_count += call.count;
+      site.total_time += duration;
+      profile.total_time += duration;
+      ++captured_count;
+    }
+
+    std::vector<std::pair<std::string, const FunctionProfile*>> sorted;
+    for (const auto& item : functions) {
+      sorted.emplace_back(item.first, &item.second);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                       return lhs.second->total_time > rhs.second->total_time;
+                     });
+
+    out << "== Call Sites (" << title << ") ==" << std::endl;
+    out << captured_count << " of " << calls.size()
+        << " calls have a captured call site" << std::endl;
+    if (sorted.empty()) {
+      return;
+    }
+
+    out << std::setw(16) << "Time (ns)" << std::setw(10) << "Calls"
+        << "  Function / Costliest Call Sites" << std::endl;
+    for (const auto& item : sorted) {
+      const FunctionProfile* profile = item.second;
+      uint64_t call_count = 0;
+      for (const auto& site : profile->sites) {
+        call_count += site.second.call_count;
+      }
+      out << std::setw(16) << profile->total_time << std::setw(10)
+          << call_count << "  " << item.first << std::endl;
+
+      std::vector<std::pair<uint32_t, CallSite>> sites(
+          profile->sites.begin(), profile->sites.end());
+      std::stable_sort(sites.begin(), sites.end(),
+                       [](const auto& lhs, const auto& rhs) {
+                         return lhs.second.total_time >
+                                rhs.second.total_time;
+                       });
+      if (sites.size() > CALL_SITE_REPORT_TOP_COUNT) {
+        sites.resize(CALL_SITE_REPORT_TOP_COUNT);
+      }
+      for (const auto& site : sites) {
+        out << std::setw(16) << site.second.total_time << std::setw(10)
+            << site.second.call_count << "    #" << site.first;
+        auto stack = stacks.find(site.first);
+        if (stack == stacks.end()) {
+          out << " (unknown stack)" << std::endl;
+          continue;
+        }
+        size_t count = std::min<size_t>(stack->second.size(),
+                                        CALL_SITE_REPORT_FRAME_COUNT);
+        for (size_t i = 0; i < count; ++i) {
+          out << (i == 0 ? " " : " < ")
+              << FormatAddress(stack->second[i], symbols);
+        }
+        if (stack->second.size() > count) {
+          out << " < ...";
+        }
+        out << std::endl;
+      }
+    }
+  }
+};
+
+#endif  // PHPROF_CL_CALL_SITE_PROFILE_H_
@@ -0,0 +1,153 @@
+#ifndef PHPROF_CL_CLOCK_CORRELATION_H_
+#define PHPROF_CL_CLOCK_CORRELATION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "cl_latency_histogram.h"
+#include "trace_format.h"
+
+// Samples read in a window this many times wider than the narrowest one
+// are preempted or delayed readings and do not take part in the fit
+#define CLOCK_WINDOW_LIMIT 2
+
+// Linear mapping of the device timer onto the host clock
+struct ClClockMapping {
+  double slope = 1.0;   // Host ns per device ns
+  double offset = 0.0;  // Host time of device time zero
+  double residual = 0.0;  // Largest distance of a used sample, ns
+  uint32_t sample_count = 0;
+
+  // Drift of the device timer against the host clock, ppm
+  double GetDrift() const { return (1.0 / slope - 1.0) * 1e6; }
+
+  uint64_t ToHost(uint64_t device_time) const {
+    double host_time = slope * static_cast<double>(device_time) + offset;
+    return (host_time > 0) ? static_cast<uint64_t>(std::llround(host_time))
+                           : 0;
+  }
+};
+
+// Places device records on the host time base. Device timers run from
+// their own oscillator, so a single offset is off by the drift times the
+// distance to the reading: the samples taken through the run are fitted
+// with least squares, which corrects both offset and drift
+class ClClockCorrelation {
+ public:
+  // A single sample gives the offset only, no samples give the identity
+  static ClClockMapping Fit(const std::vector<TraceClockRecord>& clocks) {
+    ClClockMapping mapping;
+    if (clocks.empty()) {
+      return mapping;
+    }
+
+    uint64_t min_window = clocks.front().window;
+    for (const TraceClockRecord& clock : clocks) {
+      min_window = std::min(min_window, clock.window);
+    }
+    std::vector<const TraceClockRecord*> used;
+    for (const TraceClockRecord& clock : clocks) {
+      if (clock.window <= std::max<uint64_t>(min_window, 1) *
+                              CLOCK_WINDOW_LIMIT) {
+        used.push_back(&clock);
+      }
+    }
+
+    // Centered on the first sample so the products keep double precision
+    double base_device = static_cast<double>(used.front()->device_time);
+    double base_host = static_cast<double>(used.front()->host_time);
+    double mean_device = 0, mean_host = 0;
+    for (const TraceClockRecord* clock : used) {
+      mean_device += static_cast<double>(clock->device_time) - base_device;
+      mean_host += static_cast<double>(clock->host_time) - base_host;
+    }
+    mean_device /= used.size();
+    mean_host /= used.size();
+
+    double covariance = 0, variance = 0;
+    for (const TraceClockRecord* clock : used) {
+      double device =
+          static_cast<double>(clock->device_time) - base_device - mean_device;
+      double host =
+          static_cast<double>(clock->host_time) - base_host - mean_host;
+      covariance += device * host;
+      variance += device * device;
+    }
+    if (variance > 0) {
+      mapping.slope = covariance / variance;
+    }
+    mapping.offset = base_host + mean_host -
+                     mapping.slope * (base_device + mean_device);
+
+    for (const TraceClockRecord* clock : used) {
+      double host_time = mapping.slope *
+                             static_cast<double>(clock->device_time) +
+                         mapping.offset;
+      mapping.residual =
+          std::max(mapping.residual,
+                   std::fabs(host_time -
+                             static_cast<double>(clock->host_time)));
+    }
+    mapping.sample_count = used.size();
+    return mapping;
+  }
+
+  static std::vector<ClDeviceCommand> Convert(
+      const std::vector<TraceCommandRecord>& commands,
+      const ClClockMapping& mapping,
+      const std::map<uint32_t, std::string>& strings) {
+    std::vector<ClDeviceCommand> result;
+    result.reserve(commands.size());
+    for (const TraceCommandRecord& command : commands) {
+      auto name = strings.find(command.function_id);
+      result.push_back(ClDeviceCommand{
+          (name != strings.end()) ? name->second : "<unknown>",
+          command.thread_id, mapping.ToHost(command.queued),
+          mapping.ToHost(command.submit), mapping.ToHost(command.start),
+          mapping.ToHost(command.end)});
+    }
+    std::sort(result.begin(), result.end(),
+              [](const ClDeviceCommand& lhs, const ClDeviceCommand& rhs) {
+                return lhs.start < rhs.start;
+              });
+    return result;
+  }
+
+  // Submit-to-start latency is the time a command waits for the device
+  // once the driver handed it over
+  static void PrintReport(const ClClockMapping& mapping,
+                          const std::vector<ClDeviceCommand>& commands,
+                          const std::string& filename, std::ostream& out) {
+    out << "== Device Timing: " << filename << " ==" << std::endl;
+    out << std::fixed << std::setprecision(3) << "Clock fit: "
+        << mapping.sample_count << " samples, drift "
+        << mapping.GetDrift() << " ppm, residual " << std::setprecision(0)
+        << mapping.residual << " ns" << std::endl;
+
+    std::map<std::string, ClLatencyHistogram> latencies;
+    for (const ClDeviceCommand& command : commands) {
+      uint64_t latency =
+          (command.start > command.submit) ? command.start - command.submit
+                                           : 0;
+      latencies[command.function_name].Add(latency);
+      latencies["<all>"].Add(latency);
+    }
+    out << std::setw(12) << "Commands" << std::setw(16) << "p50 (ns)"
+        << std::setw(16) << "p99 (ns)" << std::setw(16) << "Max (ns)"
+        << "  Submit to start" << std::endl;
+    for (const auto& item : latencies) {
+      out << std::setw(12) << item.second.GetCount() << std::setw(16)
+          << item.second.GetQuantile(0.5) << std::setw(16)
+          << item.second.GetQuantile(0.99) << std::setw(16)
+          << item.second.GetMax() << "  " << item.first << std::endl;
+    }
+  }
+};
+
+#endif  // PHPROF_CL_CLOCK_CORRELATION_H_
@@ -0,0 +1,150 @@
+#ifndef PHPROF_CL_COUNTER_TRACKS_H_
+#define PHPROF_CL_COUNTER_TRACKS_H_
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "trace_reader.h"
+
+// Width of the window call rates are measured over
+#define COUNTER_RATE_WINDOW_NS 10000000
+
+// Derives counter tracks from the recorded calls at export time, so they
+// cost nothing while the application runs:
+// - number of API calls executing at the same time across threads
+// - commands enqueued and not yet known to be completed. Queues are not
+//   recorded, so the depth is kept per submitting thread and drops to zero
+//   on its synchronization points (clFinish, clWaitForEvents, blocking
+//   transfers), which is exact for the usual in-order queue per thread
+// - calls per second of every function
+// Call starts and ends are merged into one time ordered stream and walked
+// once, a counter value is emitted only when it changes
+class ClCounterTracks {
+ public:
+  static std::vector<TraceCounter> Compute(
+      const std::vector<ClFunctionCall>& calls) {
+    std::vector<Edge> edges;
+    edges.reserve(calls.size() * 2);
+    for (const auto& call : calls) {
+      if (IsAnnotation(call)) {
+        continue;
+      }
+      edges.push_back(Edge{call.start_time, false, &call});
+      edges.push_back(Edge{call.end_time, true, &call});
+    }
+    // Ends go first at the same time, back to back calls do not overlap
+    std::sort(edges.begin(), edges.end(),
+              [](const Edge& lhs, const Edge& rhs) {
+                if (lhs.time != rhs.time) {
+                  return lhs.time < rhs.time;
+                }
+                return lhs.end > rhs.end;
+              });
+
+    std::vector<TraceCounter> counters;
+    Counter concurrency{"Concurrent API Calls"};
+    std::map<uint32_t, Counter> depths;  // Per thread
+    std::map<std::string, Rate> rates;   // Per function
+    std::vector<Counter*> changed_depths;
+
+    for (size_t i = 0; i < edges.size(); ++i) {
+      const Edge& edge = edges[i];
+      const ClFunctionCall* call = edge.call;
+      if (!edge.end) {
+        ++concurrency.value;
+        Rate& rate = rates[call->function_name];
+        uint64_t window = edge.time / COUNTER_RATE_WINDOW_NS;
+        if (rate.count > 0 && window != rate.window) {
+          rate.Flush(call->function_name, window, counters);
+        }
+        rate.window = window;
+        rate.count += call->count;
+      } else {
+        --concurrency.value;
+        if (IsEnqueue(call) || IsSync(call)) {
+          Counter& depth = depths[call->thread_id];
+          if (depth.name.empty()) {
+            depth.name =
+                "Queue Depth (thread " + std::to_string(call->thread_id) + ")";
+          }
+          depth.value = IsSync(call) ? 0 : depth.value + call->count;
+          depth.time = edge.time;
+          changed_depths.push_back(&depth);
+        }
+      }
+
+      // Values are emitted once all changes at the same time are applied
+      if (i + 1 < edges.size() && edges[i + 1].time == edge.time) {
+        continue;
+      }
+      concurrency.time = edge.time;
+      concurrency.Emit(counters);
+      for (Counter* depth : changed_depths) {
+        depth->Emit(counters);
+      }
+      changed_depths.clear();
+    }
+
+    for (auto& item : rates) {
+      if (item.second.count > 0) {
+        item.second.Flush(item.first, UINT64_MAX, counters);
+      }
+    }
+    return counters;
+  }
+
+ private:
+  struct Edge {
+    uint64_t time;
+    bool end;
+    const ClFunctionCall* call;
+  };
+
+  struct Counter {
+    std::string name;
+    uint64_t value = 0;
+    uint64_t time = 0;
+    uint64_t emitted_value = UINT64_MAX;
+
+    void Emit(std::vector<TraceCounter>& counters) {
+      if (value != emitted_value) {
+        counters.push_back(TraceCounter{name, time, value});
+        emitted_value = value;
+      }
+    }
+  };
+
+  // Calls started within the current window, the rate drops back to zero
+  // after the window unless the function is called in the next one
+  struct Rate {
+    uint64_t window = 0;
+    uint64_t count = 0;
+
+    void Flush(const std::string& function, uint64_t next_window,
+               std::vector<TraceCounter>& counters) {
+      std::string name = "Calls/sec " + function;
+      counters.push_back(TraceCounter{
+          name, window * COUNTER_RATE_WINDOW_NS,
+          count * 1000000000ull / COUNTER_RATE_WINDOW_NS});
+      if (next_window != window + 1) {
+        counters.push_back(
+            TraceCounter{name, (window + 1) * COUNTER_RATE_WINDOW_NS, 0});
+      }
+      count = 0;
+    }
+  };
+
+  static bool IsEnqueue(const ClFunctionCall* call) {
+    return call->function_name.compare(0, 9, "clEnqueue") == 0;
+  }
+
+  static bool IsSync(const ClFunctionCall* call) {
+    return call->function_id == CL_FUNCTION_clFinish ||
+           call->function_id == CL_FUNCTION_clWaitForEvents || call->blocking;
+  }
+};
+
+#endif  // PHPROF_CL_COUNTER_TRACKS_H_
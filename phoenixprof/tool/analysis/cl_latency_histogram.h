@@ -0,0 +1,133 @@
+#ifndef PHPROF_CL_LATENCY_HISTOGRAM_H_
+#define PHPROF_CL_LATENCY_HISTOGRAM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Sub-buckets per power of two, bounds the relative error of a quantile
+// to 1 / LATENCY_HISTOGRAM_SUB_COUNT
+#define LATENCY_HISTOGRAM_SUB_BITS 6
+#define LATENCY_HISTOGRAM_SUB_COUNT (1u << LATENCY_HISTOGRAM_SUB_BITS)
+#define LATENCY_HISTOGRAM_BUCKET_COUNT \
+  ((64 - LATENCY_HISTOGRAM_SUB_BITS + 1) * LATENCY_HISTOGRAM_SUB_COUNT)
+
+// Log-linear histogram of durations in ns: values below the sub-bucket
+// count are exact, every power of two above is split into equal
+// sub-buckets. Adding a value is a couple of instructions and histograms
+// of any number of values take the same space, so distributions of huge
+// traces are collected in one streaming pass
+class ClLatencyHistogram {
+ public:
+  // Value seen count times, e.g. the mean of a collapsed run of calls
+  void Add(uint64_t value, uint64_t count = 1) {
+    if (count == 0) {
+      return;
+    }
+    buckets_[GetBucket(value)] += count;
+    count_ += count;
+    total_ += value * count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  // Restores a bucket saved with GetBuckets(), totals are set separately
+  void AddBucket(uint32_t bucket, uint64_t count) {
+    if (bucket < LATENCY_HISTOGRAM_BUCKET_COUNT) {
+      buckets_[bucket] += count;
+    }
+  }
+
+  void Merge(const ClLatencyHistogram& other) {
+    for (uint32_t i = 0; i < buckets_.size(); ++i) {
+      buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    total_ += other.total_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  void SetTotals(uint64_t count, uint64_t total, uint64_t min, uint64_t max) {
+    count_ = count;
+    total_ = total;
+    min_ = min;
+    max_ = max;
+  }
+
+  uint64_t GetCount() const { return count_; }
+  uint64_t GetTotal() const { return total_; }
+  uint64_t GetMin() const { return (count_ > 0) ? min_ : 0; }
+  uint64_t GetMax() const { return max_; }
+
+  double GetMean() const {
+    return (count_ > 0) ? static_cast<double>(total_) / count_ : 0.0;
+  }
+
+  const std::vector<uint64_t>& GetBuckets() const { return buckets_; }
+
+  // Middle of the bucket holding the quantile, within the observed range
+  uint64_t GetQuantile(double quantile) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(quantile * count_));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i];
+      if (seen >= rank) {
+        uint64_t value = GetLowerBound(i) + GetWidth(i) / 2;
+        return std::min(std::max(value, GetMin()), max_);
+      }
+    }
+    return max_;
+  }
+
+  // Number of values in the buckets above the one holding the value
+  uint64_t GetCountAbove(uint64_t value) const {
+    uint64_t count = 0;
+    for (uint32_t i = GetBucket(value) + 1; i < buckets_.size(); ++i) {
+      count += buckets_[i];
+    }
+    return count;
+  }
+
+  static uint32_t GetBucket(uint64_t value) {
+    if (value < LATENCY_HISTOGRAM_SUB_COUNT) {
+      return static_cast<uint32_t>(value);
+    }
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    uint32_t shift = exponent - LATENCY_HISTOGRAM_SUB_BITS;
+    uint32_t sub = static_cast<uint32_t>(value >> shift) &
+                   (LATENCY_HISTOGRAM_SUB_COUNT - 1);
+    return (shift + 1) * LATENCY_HISTOGRAM_SUB_COUNT + sub;
+  }
+
+  static uint64_t GetLowerBound(uint32_t bucket) {
+    if (bucket < LATENCY_HISTOGRAM_SUB_COUNT) {
+      return bucket;
+    }
+    uint32_t shift = bucket / LATENCY_HISTOGRAM_SUB_COUNT - 1;
+    uint64_t sub = bucket % LATENCY_HISTOGRAM_SUB_COUNT;
+    return (LATENCY_HISTOGRAM_SUB_COUNT + sub) << shift;
+  }
+
+  static uint64_t GetWidth(uint32_t bucket) {
+    if (bucket < LATENCY_HISTOGRAM_SUB_COUNT) {
+      return 1;
+    }
+    return 1ull << (bucket / LATENCY_HISTOGRAM_SUB_COUNT - 1);
+  }
+
+ private:
+  std::vector<uint64_t> buckets_ =
+      std::vector<uint64_t>(LATENCY_HISTOGRAM_BUCKET_COUNT, 0);
+  uint64_t count_ = 0;
+  uint64_t total_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+};
+
+#endif  // PHPROF_CL_LATENCY_HISTOGRAM_H_
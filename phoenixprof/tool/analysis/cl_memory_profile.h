@@ -0,0 +1,193 @@
+#ifndef PHPROF_CL_MEMORY_PROFILE_H_
+#define PHPROF_CL_MEMORY_PROFILE_H_
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_format.h"
+#include "trace_reader.h"
+
+// Number of largest allocations reported as live at the peak
+#define MEMORY_REPORT_TOP_COUNT 10
+// Number of innermost frames shown per allocation call site
+#define MEMORY_REPORT_FRAME_COUNT 4
+
+// Replays allocation and release records of the memory tracker to get the
+// device memory in use over time and what was holding it at the peak.
+// Host USM is not device memory and is left out of the usage
+class ClMemoryProfile {
+ public:
+  // Records are ordered by time in place
+  static void Sort(std::vector<TraceMemoryRecord>& records) {
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceMemoryRecord& lhs,
+                        const TraceMemoryRecord& rhs) {
+                       return lhs.time < rhs.time;
+                     });
+  }
+
+  // Device memory in use after every change, records should be sorted
+  static std::vector<TraceCounter> GetUsage(
+      const std::vector<TraceMemoryRecord>& records) {
+    std::vector<TraceCounter> usage;
+    uint64_t current = 0;
+    for (const TraceMemoryRecord& record : records) {
+      if (!Update(record, current)) {
+        continue;
+      }
+      usage.push_back(TraceCounter{"Device Memory", record.time, current});
+    }
+    return usage;
+  }
+
+  static void PrintReport(const std::vector<TraceMemoryRecord>& records,
+                          const TraceStackMap& stacks,
+                          const std::string& title, std::ostream& out,
+                          const TraceSymbolMap& symbols = {}) {
+    // Peak is found first, live allocations are collected in a second pass
+    // up to it, so nothing is copied on every new maximum
+    uint64_t current = 0, peak = 0, peak_time = 0;
+    size_t peak_index = 0;
+    std::map<uint16_t, KindStats> kinds;
+    for (size_t i = 0; i < records.size(); ++i) {
+      const TraceMemoryRecord& record = records[i];
+      KindStats& stats = kinds[record.kind];
+      if (record.flags & TRACE_MEMORY_FLAG_RELEASE) {
+        ++stats.release_count;
+      } else {
+        ++stats.allocation_count;
+        stats.allocated_size += record.size;
+      }
+      if (Update(record, current) && current > peak) {
+        peak = current;
+        peak_time = record.time;
+        peak_index = i + 1;
+      }
+    }
+
+    std::unordered_map<uint64_t, const TraceMemoryRecord*> live;
+    for (size_t i = 0; i < peak_index; ++i) {
+      const TraceMemoryRecord& record = records[i];
+      if (record.kind == TRACE_MEMORY_USM_HOST) {
+        continue;
+      }
+      if (record.flags & TRACE_MEMORY_FLAG_RELEASE) {
+        live.erase(record.handle);
+      } else {
+        live[record.handle] = &record;
+      }
+    }
+
+    out << "== Device Memory (" << title << ") ==" << std::endl;
+    out << std::setw(12) << "Kind" << std::setw(14) << "Allocations"
+        << std::setw(12) << "Releases" << std::setw(20) << "Allocated (bytes)"
+        << std::endl;
+    for (const auto& item : kinds) {
+      out << std::setw(12) << GetKindName(item.first) << std::setw(14)
+          << item.second.allocation_count << std::setw(12)
+          << item.second.release_count << std::setw(20)
+          << item.second.allocated_size << std::endl;
+    }
+    out << "Peak usage: " << peak << " bytes at " << peak_time << " ns, "
+        << live.size() << " live allocations" << std::endl;
+    if (live.empty()) {
+      return;
+    }
+
+    // Allocations from the same call site are reported together
+    struct CallSite {
+      uint64_t count = 0;
+      uint64_t size = 0;
+      uint16_t kind = 0;
+    };
+    std::map<std::pair<uint32_t, uint16_t>, CallSite> sites;
+    for (const auto& item : live) {
+      const TraceMemoryRecord* record = item.second;
+      CallSite& site = sites[std::make_pair(record->stack_id, record->kind)];
+      ++site.count;
+      site.size += record->size;
+      site.kind = record->kind;
+    }
+
+    std::vector<std::pair<uint32_t, CallSite>> sorted;
+    for (const auto& item : sites) {
+      sorted.emplace_back(item.first.first, item.second);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                       return lhs.second.size > rhs.second.size;
+                     });
+    if (sorted.size() > MEMORY_REPORT_TOP_COUNT) {
+      sorted.resize(MEMORY_REPORT_TOP_COUNT);
+    }
+
+    out << std::setw(16) << "Size (bytes)" << std::setw(10) << "Count"
+        << std::setw(12) << "Kind" << "  Allocation Site" << std::endl;
+    for (const auto& item : sorted) {
+      out << std::setw(16) << item.second.size << std::setw(10)
+          << item.second.count << std::setw(12)
+          << GetKindName(item.second.kind) << "  ";
+      auto stack = stacks.find(item.first);
+      if (item.first == 0 || stack == stacks.end()) {
+        out << "(unknown call site)" << std::endl;
+        continue;
+      }
+      size_t count = std::min<size_t>(stack->second.size(),
+                                      MEMORY_REPORT_FRAME_COUNT);
+      for (size_t i = 0; i < count; ++i) {
+        out << (i == 0 ? "" : " < ")
+            << FormatAddress(stack->second[i], symbols);
+      }
+      if (stack->second.size() > count) {
+        out << " < ...";
+      }
+      out << std::endl;
+    }
+  }
+
+ private:
+  struct KindStats {
+    uint64_t allocation_count = 0;
+    uint64_t release_count = 0;
+    uint64_t allocated_size = 0;
+  };
+
+  // Returns false if the record does not change device memory usage
+  static bool Update(const TraceMemoryRecord& record, uint64_t& current) {
+    if (record.kind == TRACE_MEMORY_USM_HOST) {
+      return false;
+    }
+    if (record.flags & TRACE_MEMORY_FLAG_RELEASE) {
+      current -= std::min(current, record.size);
+    } else {
+      current += record.size;
+    }
+    return true;
+  }
+
+  static const char* GetKindName(uint16_t kind) {
+    switch (kind) {
+      case TRACE_MEMORY_BUFFER:
+        return "Buffer";
+      case TRACE_MEMORY_IMAGE:
+        return "Image";
+      case TRACE_MEMORY_SVM:
+        return "SVM";
+      case TRACE_MEMORY_USM_HOST:
+        return "USM Host";
+      case TRACE_MEMORY_USM_DEVICE:
+        return "USM Device";
+      case TRACE_MEMORY_USM_SHARED:
+        return "USM Shared";
+      default:
+        return "Unknown";
+    }
+  }
+};
+
+#endif  // PHPROF_CL_MEMORY_PROFILE_H_
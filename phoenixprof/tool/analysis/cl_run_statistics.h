@@ -0,0 +1,134 @@
+#ifndef PHPROF_CL_RUN_STATISTICS_H_
+#define PHPROF_CL_RUN_STATISTICS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cl_trace_diff.h"
+
+// Spread of a value over repeated runs
+struct ClRunSpread {
+  double mean = 0;
+  double stddev = 0;  // Sample standard deviation
+  double min = 0;
+  double max = 0;
+};
+
+// Summarizes repeated runs of the same workload: the wall time of every run
+// and per-function and per-kernel totals, so the run-to-run noise is known
+// before an optimization is judged by a single run
+class ClRunStatistics {
+ public:
+  static ClRunSpread GetSpread(const std::vector<double>& values) {
+    ClRunSpread spread;
+    if (values.empty()) {
+      return spread;
+    }
+    spread.min = *std::min_element(values.begin(), values.end());
+    spread.max = *std::max_element(values.begin(), values.end());
+    for (double value : values) {
+      spread.mean += value;
+    }
+    spread.mean /= values.size();
+    if (values.size() > 1) {
+      double sum = 0;
+      for (double value : values) {
+        sum += (value - spread.mean) * (value - spread.mean);
+      }
+      spread.stddev = std::sqrt(sum / (values.size() - 1));
+    }
+    return spread;
+  }
+
+  // Functions not called in some run count as zero there
+  static void PrintReport(const std::vector<ClLatencyProfile>& runs,
+                          const std::vector<double>& wall_times,
+                          uint32_t warmup_count, std::ostream& out) {
+    out << "== Repeated Runs (" << runs.size() << " runs after "
+        << warmup_count << " warmup) ==" << std::endl;
+    ClRunSpread wall = GetSpread(wall_times);
+    out << std::fixed << std::setprecision(0)
+        << "Wall time (ns): mean " << wall.mean << ", stddev " << wall.stddev
+        << " (" << std::setprecision(2) << GetVariation(wall)
+        << "%), min " << std::setprecision(0) << wall.min << ", max "
+        << wall.max << std::endl;
+
+    std::map<std::string, std::vector<const ClLatencyHistogram*>> functions;
+    for (size_t i = 0; i < runs.size(); ++i) {
+      for (const auto& item : runs[i]) {
+        std::vector<const ClLatencyHistogram*>& histograms =
+            functions[item.first];
+        histograms.resize(runs.size(), nullptr);
+        histograms[i] = &item.second;
+      }
+    }
+
+    std::vector<Row> rows, kernel_rows;
+    for (const auto& item : functions) {
+      std::vector<double> counts, totals, medians;
+      for (const ClLatencyHistogram* histogram : item.second) {
+        counts.push_back(histogram ? histogram->GetCount() : 0);
+        totals.push_back(histogram ? histogram->GetTotal() : 0);
+        medians.push_back(histogram ? histogram->GetQuantile(0.5) : 0);
+      }
+      Row row{item.first, GetSpread(counts), GetSpread(totals),
+              GetSpread(medians)};
+      if (ClTraceDiff::IsKernelKey(item.first)) {
+        kernel_rows.push_back(row);
+      } else {
+        rows.push_back(row);
+      }
+    }
+
+    PrintRows(rows, "Function", out);
+    // Enqueues of every kernel, clEnqueueNDRangeKernel above adds them up
+    if (!kernel_rows.empty()) {
+      out << "Per kernel:" << std::endl;
+      PrintRows(kernel_rows, "Kernel", out);
+    }
+  }
+
+ private:
+  struct Row {
+    std::string name;
+    ClRunSpread count;
+    ClRunSpread total;
+    ClRunSpread p50;
+  };
+
+  static void PrintRows(std::vector<Row>& rows, const char* title,
+                        std::ostream& out) {
+    std::stable_sort(rows.begin(), rows.end(),
+                     [](const Row& lhs, const Row& rhs) {
+                       return lhs.total.mean > rhs.total.mean;
+                     });
+
+    out << std::setw(14) << "Calls" << std::setw(16) << "Total (ns)"
+        << std::setw(14) << "Stddev" << std::setw(9) << "CV %"
+        << std::setw(16) << "Min" << std::setw(16) << "Max"
+        << std::setw(12) << "p50 (ns)" << std::setw(9) << "CV %"
+        << "  " << title << std::endl;
+    for (const Row& row : rows) {
+      out << std::setprecision(0) << std::setw(14) << row.count.mean
+          << std::setw(16) << row.total.mean << std::setw(14)
+          << row.total.stddev << std::setprecision(2) << std::setw(9)
+          << GetVariation(row.total) << std::setprecision(0)
+          << std::setw(16) << row.total.min << std::setw(16) << row.total.max
+          << std::setw(12) << row.p50.mean << std::setprecision(2)
+          << std::setw(9) << GetVariation(row.p50) << "  " << row.name
+          << std::endl;
+    }
+  }
+
+  // Coefficient of variation, %
+  static double GetVariation(const ClRunSpread& spread) {
+    return (spread.mean > 0) ? 100.0 * spread.stddev / spread.mean : 0.0;
+  }
+};
+
+#endif  // PHPROF_CL_RUN_STATISTICS_H_
@@ -0,0 +1,132 @@
+#ifndef PHPROF_CL_SAMPLE_PROFILE_H_
+#define PHPROF_CL_SAMPLE_PROFILE_H_
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "trace_reader.h"
+
+// Number of hottest locations reported per API function
+#define SAMPLE_REPORT_TOP_COUNT 5
+
+struct ClSampleAttribution {
+  const TraceSample* sample;
+  const ClFunctionCall* call;  // Enclosing API call
+};
+
+// Attributes host CPU samples to the OpenCL calls that were running on the
+// sampled thread at that time, showing where the host spends API time
+// (e.g. JIT compilation or locking inside the runtime)
+class ClSampleProfile {
+ public:
+  // Samples outside of any API call are left out
+  static std::vector<ClSampleAttribution> Attribute(
+      const std::vector<ClFunctionCall>& calls,
+      const std::vector<TraceSample>& samples) {
+    // API calls of one thread do not overlap, so the only candidate is
+    // the last call started before the sample
+    std::map<uint32_t, std::vector<const ClFunctionCall*>> threads;
+    for (const auto& call : calls) {
+      if (!IsAnnotation(call)) {
+        threads[call.thread_id].push_back(&call);
+      }
+    }
+    for (auto& item : threads) {
+      std::sort(item.second.begin(), item.second.end(),
+                [](const ClFunctionCall* lhs, const ClFunctionCall* rhs) {
+                  return lhs->start_time < rhs->start_time;
+                });
+    }
+
+    std::vector<ClSampleAttribution> result;
+    for (const auto& sample : samples) {
+      auto thread = threads.find(sample.thread_id);
+      if (thread == threads.end()) {
+        continue;
+      }
+      const std::vector<const ClFunctionCall*>& list = thread->second;
+      auto it = std::upper_bound(
+          list.begin(), list.end(), sample.time,
+          [](uint64_t time, const ClFunctionCall* call) {
+            return time < call->start_time;
+          });
+      if (it == list.begin()) {
+        continue;
+      }
+      --it;
+      if (sample.time <= (*it)->end_time) {
+        result.push_back(ClSampleAttribution{&sample, *it});
+      }
+    }
+    return result;
+  }
+
+  static void PrintReport(const std::vector<ClSampleAttribution>& attribution,
+                          uint64_t sample_count, uint64_t sampling_period,
+                          const std::string& title, std::ostream& out,
+                          const TraceSymbolMap& symbols = {}) {
+    struct FunctionProfile {
+      uint64_t sample_count = 0;
+      // Samples by innermost function, or address if not symbolized
+      std::map<std::string, uint64_t> addresses;
+    };
+    std::map<std::string, FunctionProfile> functions;
+    for (const auto& item : attribution) {
+      FunctionProfile& profile = functions[item.call->function_name];
+      ++profile.sample_count;
+      if (!item.sample->stack.empty()) {
+        ++profile.addresses[FormatAddress(item.sample->stack.front(),
+                                          symbols)];
+      }
+    }
+
+    std::vector<std::pair<std::string, const FunctionProfile*>> sorted;
+    for (const auto& item : functions) {
+      sorted.emplace_back(item.first, &item.second);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                       return lhs.second->sample_count >
+                              rhs.second->sample_count;
+                     });
+
+    out << "== Host CPU Samples (" << title << ") ==" << std::endl;
+    out << attribution.size() << " of " << sample_count
+        << " samples fall into API calls of this trace" << std::endl;
+    if (sorted.empty()) {
+      return;
+    }
+
+    out << std::setw(10) << "Samples" << std::setw(16) << "CPU Time (ns)"
+        << "  Function / Hottest Locations" << std::endl;
+    for (const auto& item : sorted) {
+      const FunctionProfile* profile = item.second;
+      out << std::setw(10) << profile->sample_count << std::setw(16)
+          << profile->sample_count * sampling_period << "  " << item.first
+          << std::endl;
+
+      std::vector<std::pair<std::string, uint64_t>> addresses(
+          profile->addresses.begin(), profile->addresses.end());
+      std::stable_sort(addresses.begin(), addresses.end(),
+                       [](const auto& lhs, const auto& rhs) {
+                         return lhs.second > rhs.second;
+                       });
+      if (addresses.size() > SAMPLE_REPORT_TOP_COUNT) {
+        addresses.resize(SAMPLE_REPORT_TOP_COUNT);
+      }
+      for (const auto& address : addresses) {
+        out << std::setw(26) << "" << std::setw(6) << std::fixed
+            << std::setprecision(1)
+            << 100.0 * address.second / profile->sample_count << "%  "
+            << address.first << std::endl;
+      }
+    }
+  }
+};
+
+#endif  // PHPROF_CL_SAMPLE_PROFILE_H_
@@ -0,0 +1,316 @@
+#ifndef PHPROF_CL_SYNC_ANALYZER_H_
+#define PHPROF_CL_SYNC_ANALYZER_H_
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cl_api_collector.h"
+
+// Device idle gaps shorter than this are considered to be noise
+#define SYNC_MIN_IDLE_GAP_NS 10000
+// clFinish waiting for this many commands or less is a batching candidate
+#define SYNC_DEFAULT_FINISH_BATCH 4
+
+struct ClSyncFinding {
+  std::string pattern;
+  std::string details;
+  uint64_t count;
+  uint64_t saved_time;  // Estimated time saved if the pattern is fixed, ns
+};
+
+// Detects synchronization anti-patterns in the recorded OpenCL call stream
+// and estimates how much host time each of them costs. All estimates are
+// upper bounds: they assume the blocked time could be fully overlapped.
+// Calls of all traces of a run are expected, as queue calls are split from
+// the host ones by device
+class ClSyncAnalyzer {
+ public:
+  // clFinish after up to finish_batch enqueues of its thread is reported
+  static std::vector<ClSyncFinding> Analyze(
+      const std::vector<ClFunctionCall>& calls,
+      uint64_t finish_batch = SYNC_DEFAULT_FINISH_BATCH) {
+    std::vector<const ClFunctionCall*> sorted;
+    sorted.reserve(calls.size());
+    for (const auto& call : calls) {
+      if (!IsAnnotation(call)) {
+        sorted.push_back(&call);
+      }
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const ClFunctionCall* lhs, const ClFunctionCall* rhs) {
+                return lhs->start_time < rhs->start_time;
+              });
+
+    std::vector<ClSyncFinding> findings;
+    findings.push_back(FindBlockingTransfers(sorted));
+    findings.push_back(FindFinishAfterEnqueue(sorted, finish_batch));
+    findings.push_back(FindFinishBeforeTransfer(sorted));
+    findings.push_back(FindBufferChurn(sorted));
+    findings.push_back(FindIdleGaps(sorted));
+
+    findings.erase(std::remove_if(findings.begin(), findings.end(),
+                                  [](const ClSyncFinding& finding) {
+                                    return finding.count == 0;
+                                  }),
+                   findings.end());
+    std::stable_sort(findings.begin(), findings.end(),
+                     [](const ClSyncFinding& lhs, const ClSyncFinding& rhs) {
+                       return lhs.saved_time > rhs.saved_time;
+                     });
+    return findings;
+  }
+
+  static void PrintReport(const std::vector<ClFunctionCall>& calls,
+                          const std::string& title, std::ostream& out,
+                          uint64_t finish_batch = SYNC_DEFAULT_FINISH_BATCH) {
+    std::vector<ClSyncFinding> findings = Analyze(calls, finish_batch);
+
+    uint64_t first_start = UINT64_MAX, last_end = 0;
+    for (const auto& call : calls) {
+      first_start = std::min(first_start, call.start_time);
+      last_end = std::max(last_end, call.end_time);
+    }
+    uint64_t total_time = (last_end > first_start) ? last_end - first_start : 0;
+
+    out << "== Synchronization Analysis (" << title << ") ==" << std::endl;
+    if (findings.empty()) {
+      out << "No synchronization issues found" << std::endl;
+      return;
+    }
+
+    out << std::setw(4) << "#" << std::setw(20) << "Est. Saving (ns)"
+        << std::setw(10) << "% Time" << std::setw(10) << "Count"
+        << "  Pattern" << std::endl;
+    for (size_t i = 0; i < findings.size(); ++i) {
+      const ClSyncFinding& finding = findings[i];
+      double percent = (total_time > 0)
+                           ? 100.0 * finding.saved_time / total_time
+                           : 0.0;
+      out << std::setw(4) << i + 1 << std::setw(20) << finding.saved_time
+          << std::setw(10) << std::fixed << std::setprecision(2) << percent
+          << std::setw(10) << finding.count << "  " << finding.pattern
+          << std::endl;
+      out << std::setw(46) << "" << finding.details << std::endl;
+    }
+  }
+
+ private:
+  static bool IsEnqueue(const ClFunctionCall* call) {
+    return call->function_name.compare(0, 9, "clEnqueue") == 0;
+  }
+
+  static bool IsSync(const ClFunctionCall* call) {
+    return call->function_id == CL_FUNCTION_clFinish ||
+           call->function_id == CL_FUNCTION_clWaitForEvents || call->blocking;
+  }
+
+  static bool IsBlockingTransfer(const ClFunctionCall* call) {
+    return IsEnqueue(call) && call->blocking;
+  }
+
+  // Blocking transfer is on the critical path if the same thread submits
+  // more work after it, i.e. the submission was delayed by the transfer
+  static ClSyncFinding FindBlockingTransfers(
+      const std::vector<const ClFunctionCall*>& calls) {
+    ClSyncFinding finding{"Blocking clEnqueueReadBuffer/WriteBuffer",
+                          "use non-blocking transfers and wait on events "
+                          "only where the data is consumed",
+                          0, 0};
+
+    std::map<uint32_t, const ClFunctionCall*> pending;  // Per thread
+    for (const ClFunctionCall* call : calls) {
+      if (!IsEnqueue(call)) {
+        continue;
+      }
+      auto it = pending.find(call->thread_id);
+      if (it != pending.end() && it->second != nullptr) {
+        ++finding.count;
+        finding.saved_time += it->second->busy_time;
+      }
+      pending[call->thread_id] = call->blocking ? call : nullptr;
+    }
+
+    return finding;
+  }
+
+  // clFinish is counted once the next enqueue or synchronization of its
+  // thread is seen, the ones followed by a blocking transfer are reported
+  // by FindFinishBeforeTransfer
+  static ClSyncFinding FindFinishAfterEnqueue(
+      const std::vector<const ClFunctionCall*>& calls, uint64_t finish_batch) {
+    ClSyncFinding finding{"clFinish after every few enqueues", "", 0, 0};
+
+    struct ThreadState {
+      uint64_t enqueue_count = 0;  // Since last synchronization
+      const ClFunctionCall* finish = nullptr;
+      uint64_t finish_enqueue_count = 0;
+    };
+    std::map<uint32_t, ThreadState> threads;
+
+    uint64_t finish_count = 0;
+    auto check_finish = [&finding, finish_batch](const ThreadState& state) {
+      // Only the first clFinish of a collapsed run follows the enqueues
+      if (state.finish_enqueue_count > 0 &&
+          state.finish_enqueue_count <= finish_batch) {
+        ++finding.count;
+        finding.saved_time += state.finish->busy_time / state.finish->count;
+      }
+    };
+
+    for (const ClFunctionCall* call : calls) {
+      if (!IsEnqueue(call) && !IsSync(call)) {
+        continue;
+      }
+      ThreadState& state = threads[call->thread_id];
+      if (state.finish != nullptr && !IsBlockingTransfer(call)) {
+        check_finish(state);
+      }
+      state.finish = nullptr;
+
+      if (call->function_id == CL_FUNCTION_clFinish) {
+        finish_count += call->count;
+        state.finish = call;
+        state.finish_enqueue_count = state.enqueue_count;
+        state.enqueue_count = 0;
+      } else if (IsSync(call)) {
+        state.enqueue_count = 0;
+      } else {
+        state.enqueue_count += call->count;
+      }
+    }
+    for (const auto& item : threads) {
+      if (item.second.finish != nullptr) {
+        check_finish(item.second);
+      }
+    }
+
+    // A single clFinish after a few enqueues is not a pattern
+    if (finding.count < 2) {
+      finding.count = 0;
+      return finding;
+    }
+
+    finding.details = std::to_string(finding.count) + " of " +
+                      std::to_string(finish_count) +
+                      " clFinish calls wait for " +
+                      std::to_string(finish_batch) +
+                      " commands or less; batch commands and synchronize "
+                      "once";
+    return finding;
+  }
+
+  // Blocking transfer waits for the commands before it in the queue anyway,
+  // so a clFinish right before it on the same thread (with no enqueue or
+  // synchronization in between) only adds a call. The wait moves into the
+  // transfer, the clFinish time is an upper bound
+  static ClSyncFinding FindFinishBeforeTransfer(
+      const std::vector<const ClFunctionCall*>& calls) {
+    ClSyncFinding finding{"clFinish before a blocking transfer",
+                          "drop the clFinish, the blocking transfer waits "
+                          "for the queue",
+                          0, 0};
+
+    std::map<uint32_t, const ClFunctionCall*> last_calls;  // Per thread
+    for (const ClFunctionCall* call : calls) {
+      if (!IsEnqueue(call) && !IsSync(call)) {
+        continue;
+      }
+      const ClFunctionCall*& last = last_calls[call->thread_id];
+      if (last != nullptr && last->function_id == CL_FUNCTION_clFinish &&
+          IsBlockingTransfer(call)) {
+        ++finding.count;
+        finding.saved_time += last->busy_time / last->count;
+      }
+      last = call;
+    }
+
+    return finding;
+  }
+
+  // Buffers created beyond the peak number of simultaneously live objects
+  // could be served from a pool instead of being created and released again
+  static ClSyncFinding FindBufferChurn(
+      const std::vector<const ClFunctionCall*>& calls) {
+    ClSyncFinding finding{"clCreateBuffer/clReleaseMemObject churn", "", 0,
+                          0};
+
+    uint64_t create_count = 0, create_time = 0;
+    uint64_t release_count = 0, release_time = 0;
+    int64_t live = 0, peak_live = 0;
+    for (const ClFunctionCall* call : calls) {
+      if (call->function_id == CL_FUNCTION_clCreateBuffer) {
+        create_count += call->count;
+        create_time += call->busy_time;
+        live += call->count;
+        peak_live = std::max(peak_live, live);
+      } else if (call->function_id == CL_FUNCTION_clReleaseMemObject) {
+        release_count += call->count;
+        release_time += call->busy_time;
+        live = std::max<int64_t>(live - call->count, 0);
+      }
+    }
+
+    if (create_count <= static_cast<uint64_t>(peak_live)) {
+      return finding;
+    }
+
+    finding.count = create_count - peak_live;
+    finding.saved_time = finding.count * (create_time / create_count);
+    if (release_count > 0) {
+      finding.saved_time +=
+          std::min(finding.count, release_count) * (release_time / release_count);
+    }
+    finding.details = std::to_string(create_count) +
+                      " buffers created while at most " +
+                      std::to_string(peak_live) +
+                      " were alive; reuse buffers across iterations";
+    return finding;
+  }
+
+  // After a synchronization point the queue is drained, so the device stays
+  // idle until the host submits the next command. With several submitting
+  // threads the device is idle only once every thread that has enqueued work
+  // is past a synchronization point, so the state is tracked per thread
+  static ClSyncFinding FindIdleGaps(
+      const std::vector<const ClFunctionCall*>& calls) {
+    ClSyncFinding finding{"Idle device gaps between host submits", "", 0, 0};
+
+    std::set<uint32_t> busy_threads;
+    bool idle = false;
+    uint64_t idle_since = 0, max_gap = 0;
+    for (const ClFunctionCall* call : calls) {
+      if (IsEnqueue(call)) {
+        if (idle && call->start_time > idle_since) {
+          uint64_t gap = call->start_time - idle_since;
+          if (gap >= SYNC_MIN_IDLE_GAP_NS) {
+            ++finding.count;
+            finding.saved_time += gap;
+            max_gap = std::max(max_gap, gap);
+          }
+        }
+        idle = false;
+        busy_threads.insert(call->thread_id);
+      }
+      if (IsSync(call)) {
+        busy_threads.erase(call->thread_id);
+        if (busy_threads.empty()) {
+          idle_since = idle ? std::max(idle_since, call->end_time)
+                            : call->end_time;
+          idle = true;
+        }
+      }
+    }
+
+    finding.details = "longest gap is " + std::to_string(max_gap) +
+                      " ns; prepare the next submission before "
+                      "synchronizing";
+    return finding;
+  }
+};
+
+#endif  // PHPROF_CL_SYNC_ANALYZER_H_
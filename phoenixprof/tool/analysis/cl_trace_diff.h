@@ -0,0 +1,487 @@
+#ifndef PHPROF_CL_TRACE_DIFF_H_
+#define PHPROF_CL_TRACE_DIFF_H_
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cl_latency_histogram.h"
+#include "trace_columns.h"
+#include "trace_reader.h"
+
+#define LATENCY_SUMMARY_HEADER "# phoenixprof latency summary v1"
+
+// Enqueues of one kernel are named by the function and the kernel
+#define DIFF_KERNEL_KEY_PREFIX "clEnqueueNDRangeKernel("
+
+// Statistical tests are not run on fewer calls than this on either side
+#define DIFF_MIN_CALL_COUNT 20
+
+struct ClDiffThreshold {
+  double relative;     // Smallest p50 or p99 change, 0.05 is 5%
+  uint64_t absolute;   // Smallest p50 or p99 change, ns
+  double alpha;        // Significance level
+};
+
+// Latency distributions of calls by function name
+typedef std::map<std::string, ClLatencyHistogram> ClLatencyProfile;
+
+enum ClLatencyVerdict {
+  LATENCY_UNCHANGED = 0,
+  LATENCY_REGRESSION,
+  LATENCY_IMPROVEMENT,
+  LATENCY_NEW,       // Not called in the baseline
+  LATENCY_REMOVED,   // Not called any more
+  LATENCY_UNTESTED,  // Too few calls to tell
+};
+
+struct ClLatencyChange {
+  std::string function_name;
+  const ClLatencyHistogram* baseline;  // nullptr if not called
+  const ClLatencyHistogram* current;   // nullptr if not called
+  double p50_change;   // Relative, 0.05 is 5% slower
+  double p99_change;
+  double shift_p_value;  // Mann-Whitney U, whole distribution
+  double tail_p_value;   // Share of calls above the baseline p99
+  int64_t impact;        // Time added to the current run, ns
+  ClLatencyVerdict verdict;
+};
+
+// Compares per-function latency distributions of two runs. Inputs are
+// binary traces, read chunk by chunk into histograms so their size does not
+// matter, column stores, of which only the columns latencies need are read,
+// or summaries saved from them before. A function regresses if its
+// median or its p99 grows above the threshold and the growth is
+// significant: a Mann-Whitney U test on the histograms for the median and
+// a two-proportion test on the share of calls above the baseline p99 for
+// the tail. Calls of a few hundred ns vary between runs by more than the
+// tests assume, so a change should also exceed an absolute threshold.
+// Enqueues of every kernel are compared on their own as well, under the
+// name GetKernelKey() gives
+class ClTraceDiff {
+ public:
+  static std::string GetKernelKey(const std::string& kernel_name) {
+    return DIFF_KERNEL_KEY_PREFIX + kernel_name + ")";
+  }
+
+  static bool IsKernelKey(const std::string& name) {
+    const size_t prefix_size = sizeof(DIFF_KERNEL_KEY_PREFIX) - 1;
+    return name.size() > prefix_size + 1 &&
+           name.compare(0, prefix_size, DIFF_KERNEL_KEY_PREFIX) == 0 &&
+           name.back() == ')';
+  }
+
+  // Adds calls of the trace or summary to the profile, returns false if the
+  // file can not be read
+  static bool Load(const std::string& filename, ClLatencyProfile& profile) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+      return false;
+    }
+    std::string header(sizeof(LATENCY_SUMMARY_HEADER) - 1, '\0');
+    file.read(&header[0], header.size());
+    if (file && header == LATENCY_SUMMARY_HEADER) {
+      std::string line;
+      std::getline(file, line);
+      return LoadSummary(file, profile);
+    }
+    file.close();
+    if (TraceColumnStore::IsColumnStore(filename)) {
+      return LoadColumnStore(filename, profile);
+    }
+    return LoadTrace(filename, profile);
+  }
+
+  // Text summary: one function per line, its totals and non-empty buckets
+  static bool SaveSummary(const std::string& filename,
+                          const ClLatencyProfile& profile) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+      return false;
+    }
+    file << LATENCY_SUMMARY_HEADER << std::endl;
+    for (const auto& item : profile) {
+      const ClLatencyHistogram& histogram = item.second;
+      file << item.first << "\t" << histogram.GetCount() << "\t"
+           << histogram.GetTotal() << "\t" << histogram.GetMin() << "\t"
+           << histogram.GetMax() << "\t";
+      const std::vector<uint64_t>& buckets = histogram.GetBuckets();
+      for (uint32_t i = 0; i < buckets.size(); ++i) {
+        if (buckets[i] > 0) {
+          file << " " << i << ":" << buckets[i];
+        }
+      }
+      file << std::endl;
+    }
+    return static_cast<bool>(file);
+  }
+
+  // Changes are ranked: regressions by the time they add, then the rest by
+  // the absolute time they add or save
+  static std::vector<ClLatencyChange> Compare(
+      const ClLatencyProfile& baseline, const ClLatencyProfile& current,
+      const ClDiffThreshold& threshold) {
+    std::map<std::string, std::pair<const ClLatencyHistogram*,
+                                    const ClLatencyHistogram*>> functions;
+    for (const auto& item : baseline) {
+      functions[item.first].first = &item.second;
+    }
+    for (const auto& item : current) {
+      functions[item.first].second = &item.second;
+    }
+
+    std::vector<ClLatencyChange> changes;
+    for (const auto& item : functions) {
+      changes.push_back(GetChange(item.first, item.second.first,
+                                  item.second.second, threshold));
+    }
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const ClLatencyChange& lhs,
+                        const ClLatencyChange& rhs) {
+                       bool lhs_regression =
+                           lhs.verdict == LATENCY_REGRESSION;
+                       bool rhs_regression =
+                           rhs.verdict == LATENCY_REGRESSION;
+                       if (lhs_regression != rhs_regression) {
+                         return lhs_regression;
+                       }
+                       return std::llabs(lhs.impact) > std::llabs(rhs.impact);
+                     });
+    return changes;
+  }
+
+  static void PrintReport(const std::vector<ClLatencyChange>& changes,
+                          const std::string& title,
+                          const ClDiffThreshold& threshold,
+                          std::ostream& out) {
+    uint64_t regression_count = 0;
+    for (const ClLatencyChange& change : changes) {
+      if (change.verdict == LATENCY_REGRESSION) {
+        ++regression_count;
+      }
+    }
+
+    out << "== Latency Diff (" << title << ") ==" << std::endl;
+    out << regression_count << " regressions above " << std::fixed
+        << std::setprecision(2) << threshold.relative * 100 << "% and "
+        << threshold.absolute << " ns at significance level "
+        << threshold.alpha << std::endl;
+    out << std::setw(4) << "#" << std::setw(12) << "Verdict" << std::setw(16)
+        << "Impact (ns)" << std::setw(22) << "Calls" << std::setw(22)
+        << "p50 (ns)" << std::setw(9) << "p50 %" << std::setw(22)
+        << "p99 (ns)" << std::setw(9) << "p99 %" << std::setw(10)
+        << "p-value" << "  Function" << std::endl;
+    for (size_t i = 0; i < changes.size(); ++i) {
+      const ClLatencyChange& change = changes[i];
+      out << std::setw(4) << i + 1 << std::setw(12)
+          << GetVerdictName(change.verdict) << std::setw(16) << change.impact
+          << std::setw(22)
+          << FormatPair(GetCount(change.baseline), GetCount(change.current))
+          << std::setw(22)
+          << FormatPair(GetQuantile(change.baseline, 0.5),
+                        GetQuantile(change.current, 0.5))
+          << std::setw(9) << FormatPercent(change, change.p50_change)
+          << std::setw(22)
+          << FormatPair(GetQuantile(change.baseline, 0.99),
+                        GetQuantile(change.current, 0.99))
+          << std::setw(9) << FormatPercent(change, change.p99_change)
+          << std::setw(10) << FormatPValue(change) << "  "
+          << change.function_name << std::endl;
+    }
+  }
+
+ private:
+  static bool LoadSummary(std::istream& file, ClLatencyProfile& profile) {
+    std::string line;
+    while (std::getline(file, line)) {
+      std::stringstream stream(line);
+      std::string name;
+      uint64_t count = 0, total = 0, min = 0, max = 0;
+      if (!std::getline(stream, name, '\t') ||
+          !(stream >> count >> total >> min >> max)) {
+        std::cerr << "[WARNING] Damaged summary line: " << line << std::endl;
+        continue;
+      }
+
+      ClLatencyHistogram histogram;
+      std::string bucket;
+      while (stream >> bucket) {
+        size_t colon = bucket.find(':');
+        if (colon == std::string::npos) {
+          continue;
+        }
+        histogram.AddBucket(std::stoul(bucket.substr(0, colon)),
+                            std::stoull(bucket.substr(colon + 1)));
+      }
+      histogram.SetTotals(count, total, min, max);
+      profile[name].Merge(histogram);
+    }
+    return true;
+  }
+
+  // Strings may come after the calls they name, histograms are kept by
+  // function id until the end of the trace
+  static bool LoadTrace(const std::string& filename,
+                        ClLatencyProfile& profile) {
+    TraceReader* reader = TraceReader::Create(filename);
+    if (reader == nullptr) {
+      return false;
+    }
+
+    std::unordered_map<uint32_t, ClLatencyHistogram> histograms;
+    std::map<uint32_t, std::string> strings;
+    std::vector<TraceCallRecord> records;
+    TraceChunkHeader header{};
+    std::vector<char> payload;
+    while (reader->ReadChunk(header, payload)) {
+      if (header.type == TRACE_CHUNK_CALLS) {
+        records.clear();
+        reader->ParseCalls(payload, header.commit == TRACE_CHUNK_COMMITTED,
+                           records);
+        for (const TraceCallRecord& record : records) {
+          if (record.flags & TRACE_CALL_FLAG_COLLAPSED) {
+            histograms[record.function_id].Add(record.collapsed_mean,
+                                               record.collapsed_count);
+          } else {
+            histograms[record.function_id].Add(
+                record.end_time - record.start_time);
+          }
+        }
+      } else if (header.type == TRACE_CHUNK_STRINGS) {
+        TraceReader::ParseStrings(payload, strings);
+      }
+    }
+    if (!reader->IsComplete()) {
+      std::cerr << "[WARNING] Trace " << filename << " is incomplete, "
+                << reader->GetRecoveredCount() << " calls recovered"
+                << std::endl;
+    }
+    delete reader;
+
+    AddHistograms(histograms, strings, profile);
+    return true;
+  }
+
+  // Start times, threads and call sites are not needed, their columns are
+  // never read
+  static bool LoadColumnStore(const std::string& filename,
+                              ClLatencyProfile& profile) {
+    TraceColumnStore* store = TraceColumnStore::Open(filename);
+    if (store == nullptr) {
+      return false;
+    }
+
+    std::unordered_map<uint32_t, ClLatencyHistogram> histograms;
+    for (uint64_t block = 0; block < store->GetBlockCount(); ++block) {
+      uint32_t count = store->GetBlock(block).count;
+      const uint64_t* duration =
+          store->GetColumn<uint64_t>(block, TRACE_COLUMN_DURATION);
+      const uint16_t* function =
+          store->GetColumn<uint16_t>(block, TRACE_COLUMN_FUNCTION_ID);
+      const uint16_t* flags =
+          store->GetColumn<uint16_t>(block, TRACE_COLUMN_FLAGS);
+      const uint16_t* collapsed_count =
+          store->GetColumn<uint16_t>(block, TRACE_COLUMN_COLLAPSED_COUNT);
+      const uint16_t* collapsed_mean =
+          store->GetColumn<uint16_t>(block, TRACE_COLUMN_COLLAPSED_MEAN);
+      for (uint32_t i = 0; i < count; ++i) {
+        if (flags[i] & TRACE_CALL_FLAG_COLLAPSED) {
+          histograms[function[i]].Add(collapsed_mean[i], collapsed_count[i]);
+        } else {
+          histograms[function[i]].Add(duration[i]);
+        }
+      }
+    }
+
+    std::map<uint32_t, std::string> strings;
+    store->GetStrings(strings);
+    delete store;
+    AddHistograms(histograms, strings, profile);
+    return true;
+  }
+
+  static void AddHistograms(
+      const std::unordered_map<uint32_t, ClLatencyHistogram>& histograms,
+      const std::map<uint32_t, std::string>& strings,
+      ClLatencyProfile& profile) {
+    for (const auto& item : histograms) {
+      auto it = strings.find(item.first);
+      std::string name = (it != strings.end())
+                             ? it->second
+                             : "function #" + std::to_string(item.first);
+      if (item.first >= TRACE_KERNEL_ID_BASE) {
+        name = GetKernelKey(name);
+      }
+      profile[name].Merge(item.second);
+    }
+  }
+
+  static ClLatencyChange GetChange(const std::string& name,
+                                   const ClLatencyHistogram* baseline,
+                                   const ClLatencyHistogram* current,
+                                   const ClDiffThreshold& threshold) {
+    ClLatencyChange change{name, baseline, current, 0, 0, 1, 1, 0,
+                           LATENCY_UNCHANGED};
+    if (baseline == nullptr || current == nullptr) {
+      change.verdict = (baseline == nullptr) ? LATENCY_NEW : LATENCY_REMOVED;
+      change.impact = (baseline == nullptr)
+                          ? static_cast<int64_t>(current->GetTotal())
+                          : -static_cast<int64_t>(baseline->GetTotal());
+      return change;
+    }
+
+    change.p50_change = GetRelativeChange(baseline->GetQuantile(0.5),
+                                          current->GetQuantile(0.5));
+    change.p99_change = GetRelativeChange(baseline->GetQuantile(0.99),
+                                          current->GetQuantile(0.99));
+    change.impact = static_cast<int64_t>(
+        (current->GetMean() - baseline->GetMean()) * current->GetCount());
+    if (baseline->GetCount() < DIFF_MIN_CALL_COUNT ||
+        current->GetCount() < DIFF_MIN_CALL_COUNT) {
+      change.verdict = LATENCY_UNTESTED;
+      return change;
+    }
+
+    change.shift_p_value = GetShiftPValue(*baseline, *current);
+    change.tail_p_value = GetTailPValue(*baseline, *current);
+    int p50_direction = GetDirection(baseline->GetQuantile(0.5),
+                                     current->GetQuantile(0.5), threshold);
+    int p99_direction = GetDirection(baseline->GetQuantile(0.99),
+                                     current->GetQuantile(0.99), threshold);
+    bool shifted = change.shift_p_value < threshold.alpha;
+    bool tail_moved = change.tail_p_value < threshold.alpha;
+    if ((shifted && p50_direction > 0) || (tail_moved && p99_direction > 0)) {
+      change.verdict = LATENCY_REGRESSION;
+    } else if ((shifted && p50_direction < 0) ||
+               (tail_moved && p99_direction < 0)) {
+      change.verdict = LATENCY_IMPROVEMENT;
+    }
+    return change;
+  }
+
+  // 1 if the value grew above both thresholds, -1 if it dropped below them
+  static int GetDirection(uint64_t baseline, uint64_t current,
+                          const ClDiffThreshold& threshold) {
+    uint64_t delta = (current > baseline) ? current - baseline
+                                          : baseline - current;
+    double change = GetRelativeChange(baseline, current);
+    if (delta < threshold.absolute ||
+        std::fabs(change) <= threshold.relative) {
+      return 0;
+    }
+    return (current > baseline) ? 1 : -1;
+  }
+
+  static double GetRelativeChange(uint64_t baseline, uint64_t current) {
+    if (baseline == 0) {
+      return (current == 0) ? 0.0 : 1.0;
+    }
+    return (static_cast<double>(current) - baseline) / baseline;
+  }
+
+  // Two-sided p-value of the Mann-Whitney U test with the normal
+  // approximation, values of one bucket count as ties
+  static double GetShiftPValue(const ClLatencyHistogram& baseline,
+                               const ClLatencyHistogram& current) {
+    const std::vector<uint64_t>& base = baseline.GetBuckets();
+    const std::vector<uint64_t>& cur = current.GetBuckets();
+    double n1 = current.GetCount(), n2 = baseline.GetCount();
+    double n = n1 + n2;
+
+    double u = 0, ties = 0, base_below = 0;
+    for (size_t i = 0; i < base.size(); ++i) {
+      if (base[i] == 0 && cur[i] == 0) {
+        continue;
+      }
+      u += cur[i] * (base_below + 0.5 * base[i]);
+      base_below += base[i];
+      double t = static_cast<double>(base[i]) + cur[i];
+      ties += t * t * t - t;
+    }
+
+    double variance = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1)));
+    if (variance <= 0) {
+      return 1.0;
+    }
+    double z = (u - n1 * n2 / 2.0) / std::sqrt(variance);
+    return std::erfc(std::fabs(z) / std::sqrt(2.0));
+  }
+
+  // Two-sided p-value of the change in the share of calls above the
+  // baseline p99
+  static double GetTailPValue(const ClLatencyHistogram& baseline,
+                              const ClLatencyHistogram& current) {
+    uint64_t limit = baseline.GetQuantile(0.99);
+    double n1 = baseline.GetCount(), n2 = current.GetCount();
+    double k1 = baseline.GetCountAbove(limit);
+    double k2 = current.GetCountAbove(limit);
+    double pooled = (k1 + k2) / (n1 + n2);
+    double variance = pooled * (1 - pooled) * (1 / n1 + 1 / n2);
+    if (variance <= 0) {
+      return (k1 / n1 == k2 / n2) ? 1.0 : 0.0;
+    }
+    double z = (k2 / n2 - k1 / n1) / std::sqrt(variance);
+    return std::erfc(std::fabs(z) / std::sqrt(2.0));
+  }
+
+  static uint64_t GetCount(const ClLatencyHistogram* histogram) {
+    return (histogram != nullptr) ? histogram->GetCount() : 0;
+  }
+
+  static uint64_t GetQuantile(const ClLatencyHistogram* histogram,
+                              double quantile) {
+    return (histogram != nullptr) ? histogram->GetQuantile(quantile) : 0;
+  }
+
+  static std::string FormatPair(uint64_t baseline, uint64_t current) {
+    return std::to_string(baseline) + " -> " + std::to_string(current);
+  }
+
+  static std::string FormatPercent(const ClLatencyChange& change,
+                                   double value) {
+    if (change.baseline == nullptr || change.current == nullptr) {
+      return "-";
+    }
+    std::stringstream stream;
+    stream << std::showpos << std::fixed << std::setprecision(1)
+           << value * 100;
+    return stream.str();
+  }
+
+  static std::string FormatPValue(const ClLatencyChange& change) {
+    if (change.verdict == LATENCY_NEW || change.verdict == LATENCY_REMOVED ||
+        change.verdict == LATENCY_UNTESTED) {
+      return "-";
+    }
+    std::stringstream stream;
+    stream << std::setprecision(2)
+           << std::min(change.shift_p_value, change.tail_p_value);
+    return stream.str();
+  }
+
+  static const char* GetVerdictName(ClLatencyVerdict verdict) {
+    switch (verdict) {
+      case LATENCY_REGRESSION:
+        return "SLOWER";
+      case LATENCY_IMPROVEMENT:
+        return "faster";
+      case LATENCY_NEW:
+        return "new";
+      case LATENCY_REMOVED:
+        return "removed";
+      case LATENCY_UNTESTED:
+        return "few calls";
+      default:
+        return "same";
+    }
+  }
+};
+
+#endif  // PHPROF_CL_TRACE_DIFF_H_
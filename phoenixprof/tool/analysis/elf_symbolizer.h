@@ -0,0 +1,305 @@
+#ifndef PHPROF_ELF_SYMBOLIZER_H_
+#define PHPROF_ELF_SYMBOLIZER_H_
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "trace_reader.h"
+#include "utils.h"
+#include "utils_elf.h"
+
+// Symbols of one ELF file, the file stays mapped while the module is cached
+// so symbol names are not copied
+class ElfModule {
+ public:
+  // Returns nullptr if the file can not be read as a 64-bit ELF
+  static ElfModule* Open(const std::string& path) {
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+      return nullptr;
+    }
+    struct stat info{};
+    if (fstat(file, &info) != 0 ||
+        static_cast<size_t>(info.st_size) < sizeof(Elf64_Ehdr)) {
+      close(file);
+      return nullptr;
+    }
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+
+    ElfModule* module = new ElfModule(reinterpret_cast<const char*>(data),
+                                      static_cast<size_t>(info.st_size));
+    ASSERT(module != nullptr);
+    if (!module->Parse()) {
+      delete module;
+      return nullptr;
+    }
+    return module;
+  }
+
+  ~ElfModule() { munmap(const_cast<char*>(data_), size_); }
+
+  ElfModule(const ElfModule& copy) = delete;
+  ElfModule& operator=(const ElfModule& copy) = delete;
+
+  const std::string& GetBuildId() const { return build_id_; }
+
+  // Maps an offset in the file to the link time virtual address
+  bool GetAddress(uint64_t file_offset, uint64_t& address) const {
+    for (const Segment& segment : segments_) {
+      if (file_offset >= segment.offset &&
+          file_offset < segment.offset + segment.size) {
+        address = segment.address + (file_offset - segment.offset);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns the name of the function containing the link time address,
+  // nullptr if there is none
+  const char* Lookup(uint64_t address) const {
+    auto it = std::upper_bound(
+        symbols_.begin(), symbols_.end(), address,
+        [](uint64_t value, const Symbol& symbol) {
+          return value < symbol.address;
+        });
+    if (it == symbols_.begin()) {
+      return nullptr;
+    }
+    --it;
+    // Symbols without size extend up to the next one
+    if (it->size > 0 && address >= it->address + it->size) {
+      return nullptr;
+    }
+    return it->name;
+  }
+
+ private:
+  struct Segment {
+    uint64_t offset;
+    uint64_t address;
+    uint64_t size;
+  };
+
+  struct Symbol {
+    uint64_t address;
+    uint64_t size;
+    const char* name;
+  };
+
+  ElfModule(const char* data, size_t size) : data_(data), size_(size) {}
+
+  template <typename T>
+  const T* Get(uint64_t offset, uint64_t count = 1) const {
+    if (offset > size_ || count > (size_ - offset) / sizeof(T)) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T*>(data_ + offset);
+  }
+
+  bool Parse() {
+    const Elf64_Ehdr* header = Get<Elf64_Ehdr>(0);
+    if (header == nullptr || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+        header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_ident[EI_DATA] != ELFDATA2LSB) {
+      return false;
+    }
+
+    const Elf64_Phdr* programs =
+        Get<Elf64_Phdr>(header->e_phoff, header->e_phnum);
+    for (int i = 0; programs != nullptr && i < header->e_phnum; ++i) {
+      const Elf64_Phdr& program = programs[i];
+      if (program.p_type == PT_LOAD) {
+        segments_.push_back(
+            Segment{program.p_offset, program.p_vaddr, program.p_filesz});
+      } else if (program.p_type == PT_NOTE && build_id_.empty()) {
+        const char* notes = Get<char>(program.p_offset, program.p_filesz);
+        if (notes != nullptr) {
+          build_id_ = utils::elf::GetBuildId(notes, program.p_filesz);
+        }
+      }
+    }
+
+    const Elf64_Shdr* sections =
+        Get<Elf64_Shdr>(header->e_shoff, header->e_shnum);
+    for (int i = 0; sections != nullptr && i < header->e_shnum; ++i) {
+      const Elf64_Shdr& section = sections[i];
+      if ((section.sh_type == SHT_SYMTAB || section.sh_type == SHT_DYNSYM) &&
+          section.sh_link < header->e_shnum) {
+        AddSymbols(section, sections[section.sh_link]);
+      }
+    }
+
+    // Same function may come from both tables, the first name is kept
+    std::stable_sort(symbols_.begin(), symbols_.end(),
+                     [](const Symbol& lhs, const Symbol& rhs) {
+                       return lhs.address < rhs.address;
+                     });
+    symbols_.erase(std::unique(symbols_.begin(), symbols_.end(),
+                               [](const Symbol& lhs, const Symbol& rhs) {
+                                 return lhs.address == rhs.address;
+                               }),
+                   symbols_.end());
+    return !segments_.empty();
+  }
+
+  void AddSymbols(const Elf64_Shdr& table, const Elf64_Shdr& strings) {
+    const Elf64_Sym* entries = Get<Elf64_Sym>(
+        table.sh_offset, table.sh_size / sizeof(Elf64_Sym));
+    const char* names = Get<char>(strings.sh_offset, strings.sh_size);
+    if (entries == nullptr || names == nullptr) {
+      return;
+    }
+
+    uint64_t count = table.sh_size / sizeof(Elf64_Sym);
+    for (uint64_t i = 0; i < count; ++i) {
+      const Elf64_Sym& entry = entries[i];
+      int type = ELF64_ST_TYPE(entry.st_info);
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+          entry.st_shndx == SHN_UNDEF || entry.st_value == 0 ||
+          entry.st_name >= strings.sh_size) {
+        continue;
+      }
+      const char* name = names + entry.st_name;
+      if (memchr(name, '\0', strings.sh_size - entry.st_name) == nullptr) {
+        continue;
+      }
+      symbols_.push_back(Symbol{entry.st_value, entry.st_size, name});
+    }
+  }
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  std::string build_id_;
+  std::vector<Segment> segments_;
+  std::vector<Symbol> symbols_;
+};
+
+// Resolves addresses recorded in the target process after the run, using
+// the module snapshots stored with them. Each module file is parsed once,
+// addresses are resolved in batch: they are sorted and matched against the
+// sorted mappings in one pass, then looked up in the sorted symbols.
+// Modules rebuilt since the run (build ID mismatch) are not used
+class ElfSymbolizer {
+ public:
+  explicit ElfSymbolizer(const std::vector<TraceModule>& modules) {
+    // Later snapshots win for the same mapping
+    std::map<uint64_t, TraceModule> mappings;
+    for (const TraceModule& module : modules) {
+      mappings[module.begin] = module;
+    }
+    for (const auto& item : mappings) {
+      mappings_.push_back(item.second);
+    }
+  }
+
+  ElfSymbolizer(const ElfSymbolizer& copy) = delete;
+  ElfSymbolizer& operator=(const ElfSymbolizer& copy) = delete;
+
+  // Adds names of the given addresses to the symbol map, addresses that
+  // can not be resolved keep at least their module name
+  void Symbolize(std::vector<uint64_t> addresses, TraceSymbolMap& symbols) {
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()),
+                    addresses.end());
+
+    size_t mapping = 0;
+    for (uint64_t address : addresses) {
+      if (symbols.count(address) > 0) {
+        continue;
+      }
+      while (mapping < mappings_.size() &&
+             mappings_[mapping].end <= address) {
+        ++mapping;
+      }
+      if (mapping == mappings_.size()) {
+        break;
+      }
+      const TraceModule& module = mappings_[mapping];
+      if (address < module.begin) {
+        continue;
+      }
+
+      std::string name = GetFunctionName(module, address);
+      symbols[address] = name + " (" + GetFileName(module.path) + ")";
+    }
+  }
+
+ private:
+  std::string GetFunctionName(const TraceModule& mapping, uint64_t address) {
+    std::stringstream hex;
+    hex << "0x" << std::hex << address;
+
+    ElfModule* module = GetModule(mapping);
+    uint64_t link_address = 0;
+    if (module == nullptr ||
+        !module->GetAddress(address - mapping.begin + mapping.offset,
+                            link_address)) {
+      return hex.str();
+    }
+    const char* name = module->Lookup(link_address);
+    return (name != nullptr) ? Demangle(name) : hex.str();
+  }
+
+  ElfModule* GetModule(const TraceModule& mapping) {
+    auto it = modules_.find(mapping.path);
+    if (it != modules_.end()) {
+      return it->second.get();
+    }
+
+    ElfModule* module = ElfModule::Open(mapping.path);
+    if (module == nullptr) {
+      std::cerr << "[WARNING] Unable to read symbols of " << mapping.path
+                << std::endl;
+    } else if (!mapping.build_id.empty() &&
+               module->GetBuildId() != mapping.build_id) {
+      std::cerr << "[WARNING] " << mapping.path << " was changed after "
+                << "the run (build ID "
+                << utils::elf::GetHexString(mapping.build_id)
+                << " expected), its symbols are not used" << std::endl;
+      delete module;
+      module = nullptr;
+    }
+    modules_[mapping.path].reset(module);
+    return module;
+  }
+
+  static std::string Demangle(const char* name) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status != 0 || demangled == nullptr) {
+      return name;
+    }
+    std::string result = demangled;
+    free(demangled);
+    return result;
+  }
+
+  static std::string GetFileName(const std::string& path) {
+    size_t pos = path.find_last_of('/');
+    return (pos == std::string::npos) ? path : path.substr(pos + 1);
+  }
+
+  std::vector<TraceModule> mappings_;  // Sorted by address
+  std::map<std::string, std::unique_ptr<ElfModule>> modules_;
+};
+
+#endif  // PHPROF_ELF_SYMBOLIZER_H_
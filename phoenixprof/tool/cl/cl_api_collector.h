@@ -1,90 +1,596 @@
 #ifndef PHPROF_CL_API_COLLECTOR_H_
 #define PHPROF_CL_API_COLLECTOR_H_
 
+#include <string.h>
+
+#include <algorithm>
 #include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <set>
+#include <string>
+#include <vector>
+
+#include <CL/tracing_api.h>
 
-#include "cl_api_tracer.h"
+#include "call_stack_table.h"
+#include "trace_arena.h"
+#include "trace_format.h"
+#include "trace_writer.h"
 #include "utils.h"
 
+#define CALIBRATION_ITERATION_COUNT 10000
+#define DEVICE_RECORD_FLUSH_SIZE 4096  // Bytes of device records per write
+
 struct ClFunctionCall {
   std::string function_name;
+  cl_function_id function_id;
+  uint32_t thread_id;
   uint64_t start_time;
   uint64_t end_time;
+  bool blocking;  // Blocking transfer (clEnqueueReadBuffer/WriteBuffer)
+  uint32_t stack_id;  // Call site, 0 if not captured
+  uint32_t count;      // Calls collapsed into this one, 1 for a single call
+  uint64_t busy_time;  // Time spent inside the calls
+};
+
+// Number of calls a record stands for
+inline uint32_t GetCallCount(const TraceCallRecord& record) {
+  return (record.flags & TRACE_CALL_FLAG_COLLAPSED) ? record.collapsed_count
+                                                    : 1;
+}
+
+// Time spent inside the calls of a record, a collapsed run does not
+// include the time between its calls
+inline uint64_t GetBusyTime(const TraceCallRecord& record) {
+  if (record.flags & TRACE_CALL_FLAG_COLLAPSED) {
+    return static_cast<uint64_t>(record.collapsed_count) *
+           record.collapsed_mean;
+  }
+  return record.end_time - record.start_time;
+}
+
+inline ClFunctionCall DecodeFunctionCall(const TraceCallRecord& record,
+                                         const std::string& name) {
+  return ClFunctionCall{name,
+                        static_cast<cl_function_id>(record.function_id),
+                        record.thread_id,
+                        record.start_time,
+                        record.end_time,
+                        (record.flags & TRACE_CALL_FLAG_BLOCKING) != 0,
+                        record.stack_id,
+                        GetCallCount(record),
+                        GetBusyTime(record)};
+}
+
+// Device execution of an enqueued command, times are on the host time base
+struct ClDeviceCommand {
+  std::string function_name;
+  uint32_t thread_id;  // Thread that enqueued the command
+  uint64_t queued;
+  uint64_t submit;
+  uint64_t start;
+  uint64_t end;
+};
+
+inline bool IsAnnotation(const ClFunctionCall& call) {
+  return call.function_id >= TRACE_ANNOTATION_ID_BASE;
+}
+
+// Kernel name annotation of a clEnqueueNDRangeKernel call
+inline bool IsKernel(const ClFunctionCall& call) {
+  return call.function_id >= TRACE_KERNEL_ID_BASE;
+}
+
+struct ClCallbackOverhead {
+  uint64_t event_cost;     // Enter and exit callbacks cost per call, ns
+  uint64_t duration_bias;  // Part of the cost included into call duration, ns
 };
 
 class ClApiCollector {
  public:  // User Interface
-  static ClApiCollector* Create(cl_device_id device) {
-    ASSERT(device != nullptr);
+  // Takes ownership of the writer, recorded calls are streamed into it.
+  // Collector is fed by the callback of a tracer it is registered with,
+  // track metadata (JSON values) describes where the calls come from
+  static ClApiCollector* Create(
+      TraceWriter* writer, bool compensate_overhead = false,
+      const std::map<std::string, std::string>& track = {}) {
+    ASSERT(writer != nullptr);
 
     ClApiCollector* collector = new ClApiCollector();
     ASSERT(collector != nullptr);
 
-    ClApiTracer* tracer = new ClApiTracer(device, Callback, collector);
-    if (tracer == nullptr || !tracer->IsValid()) {
-      std::cerr << "[WARNING] Unable to create OpenCL tracer "
-                << "for target device" << std::endl;
-      if (tracer != nullptr) {
-        delete tracer;
-      }
-      delete collector;
-      return nullptr;
-    }
-
-    collector->EnableTracing(tracer);
+    collector->writer_ = writer;
+    collector->overhead_ = Calibrate();
+    collector->compensate_overhead_ = compensate_overhead;
+    collector->track_ = track;
+    writer->WriteMetadata(collector->GetMetadata());
     return collector;
   }
 
   ~ClApiCollector() {
-    if (tracer_ != nullptr) {
-      delete tracer_;
+    DropRuns();
+    if (writer_ != nullptr) {
+      if (chunk_ != nullptr) {
+        writer_->CommitCallChunk(chunk_);
+      }
+      delete writer_;
     }
   }
 
-  void DisableTracing() {
-    ASSERT(tracer_ != nullptr);
-    bool disabled = tracer_->Disable();
-    ASSERT(disabled);
-  }
-
   ClApiCollector(const ClApiCollector& copy) = delete;
   ClApiCollector& operator=(const ClApiCollector& copy) = delete;
 
+  // Commits the last chunk and closes the trace, function names and
+  // metadata are already in the file, tracing should be disabled
+  void Finalize() {
+    DropRuns();
+    const std::lock_guard<std::mutex> lock(lock_);
+    if (writer_ == nullptr) {
+      return;
+    }
+
+    if (chunk_ != nullptr) {
+      writer_->CommitCallChunk(chunk_);
+      chunk_ = nullptr;
+    }
+    FlushDeviceRecords();
+    writer_->Close();
+  }
+
+  // Calls are kept in memory only by detached collectors
   std::vector<ClFunctionCall> GetFunctionCalls() {
-    return function_calls_;
+    const std::lock_guard<std::mutex> lock(lock_);
+    std::vector<ClFunctionCall> calls;
+    calls.reserve(event_count_);
+    for (size_t i = 0; i < arena_.GetChunkCount(); ++i) {
+      DecodeChunk(reinterpret_cast<const TraceCallChunk*>(arena_.GetChunk(i)),
+                  calls);
+    }
+    return calls;
   }
 
- private:  // Implementation Details
-  ClApiCollector() {}
+  std::map<std::string, std::string> GetMetadata() const {
+    std::map<std::string, std::string> metadata = track_;
+    metadata["callback_overhead_ns"] = std::to_string(overhead_.event_cost);
+    metadata["duration_bias_ns"] = std::to_string(overhead_.duration_bias);
+    metadata["overhead_compensated"] =
+        compensate_overhead_ ? "true" : "false";
+    return metadata;
+  }
 
-  void EnableTracing(ClApiTracer* tracer) {
-    ASSERT(tracer != nullptr);
-    tracer_ = tracer;
+  const ClCallbackOverhead& GetOverhead() const { return overhead_; }
 
-    for (int id = 0; id < CL_FUNCTION_COUNT; ++id) {
-      bool set = tracer_->SetTracingFunction(static_cast<cl_function_id>(id));
-      ASSERT(set);
-    }
+  bool IsOverheadCompensated() const { return compensate_overhead_; }
 
-    bool enabled = tracer_->Enable();
-    ASSERT(enabled);
+  uint64_t GetEventCount() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return event_count_;
   }
 
-  uint64_t GetTimestamp() const {
+  // Tracer callback, expects the collector to record into as user data
+  static cl_tracing_callback GetCallback() { return Callback; }
+
+  // Time base of all records of the tool, so calls, tasks, memory records
+  // and device commands line up
+  static uint64_t GetTimestamp() {
     std::chrono::duration<uint64_t, std::nano> timestamp =
-        std::chrono::steady_clock::now() - base_time_;
+        std::chrono::steady_clock::now().time_since_epoch();
     return timestamp.count();
   }
 
-  void AddFunctionCallItem(const std::string& name, uint64_t start_time,
-                           uint64_t end_time) {
+  // Records a user annotated region (e.g. ITT task) measured with
+  // GetTimestamp(), name_id is expected to be TRACE_ANNOTATION_ID_BASE or
+  // above and to always come with the same name
+  void AddAnnotation(uint32_t name_id, const char* name, uint32_t thread_id,
+                     uint64_t start_time, uint64_t end_time) {
+    ASSERT(name_id >= TRACE_ANNOTATION_ID_BASE);
+    ASSERT(name_id <= TRACE_ANNOTATION_ID_MAX);
+    ASSERT(name != nullptr);
+
+    const std::lock_guard<std::mutex> lock(lock_);
+    if (annotation_names_.count(name_id) == 0) {
+      annotation_names_[name_id] = name;
+      if (writer_ != nullptr) {
+        writer_->WriteStrings({{name_id, name}});
+      }
+    }
+    AddRecord(TraceCallRecord{start_time, end_time, thread_id,
+                              static_cast<uint16_t>(name_id),
+                              TRACE_CALL_FLAG_ANNOTATION, 0, 0, 0});
+  }
+
+  // Records a reading of the device timer for the device of the collector,
+  // the host time is expected to be on the GetTimestamp() base
+  void AddClockSample(const TraceClockRecord& record) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    clocks_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    if (clocks_.size() >= DEVICE_RECORD_FLUSH_SIZE) {
+      FlushDeviceRecords();
+    }
+  }
+
+  // Records execution of a command on the device of the collector, the
+  // function of the command is expected to be already recorded as a call
+  void AddCommand(const TraceCommandRecord& record) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    commands_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    if (commands_.size() >= DEVICE_RECORD_FLUSH_SIZE) {
+      FlushDeviceRecords();
+    }
+  }
+
+  // Call sites are captured on enter into the given table, expected to be
+  // set before tracing is enabled and to outlive the collector
+  void SetStackTable(CallStackTable* stack_table) {
+    stack_table_ = stack_table;
+  }
+
+  // Consecutive calls of a thread to the same function from the same call
+  // site that are shorter than the threshold (ns) are merged into one
+  // collapsed record, expected to be set before tracing is enabled
+  void SetCollapseThreshold(uint64_t threshold) {
+    collapse_threshold_ =
+        std::min<uint64_t>(threshold, TRACE_COLLAPSE_MAX_DURATION);
+  }
+
+  // Collapsed records written so far and the calls merged into them
+  uint64_t GetCollapsedCount() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return collapsed_count_;
+  }
+
+  uint64_t GetCollapsedCallCount() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return collapsed_call_count_;
+  }
+
+ public:  // Benchmarking Interface
+  // Collector that is not attached to any device, its callback is expected
+  // to be driven directly with synthetic data. Calls are kept in an arena,
+  // optionally backed by huge pages
+  static ClApiCollector* CreateDetached(bool compensate_overhead = false,
+                                        bool huge_pages = false) {
+    ClApiCollector* collector =
+        new ClApiCollector(TRACE_ARENA_REGION_SIZE, huge_pages);
+    ASSERT(collector != nullptr);
+    collector->overhead_ = Calibrate();
+    collector->compensate_overhead_ = compensate_overhead;
+    return collector;
+  }
+
+ private:  // Implementation Details
+  // Arena is only used by detached collectors, it reserves memory once the
+  // first call comes
+  explicit ClApiCollector(size_t arena_size = TRACE_ARENA_REGION_SIZE,
+                          bool huge_pages = false)
+      : arena_(sizeof(TraceCallChunk), huge_pages, arena_size) {}
+
+  // Runs the real callback path for an empty call on a scratch collector:
+  // the wall time per iteration is the full callback cost, and the recorded
+  // duration of the empty call is the bias added to every measured duration
+  static ClCallbackOverhead Calibrate() {
+    ClApiCollector collector(
+        sizeof(TraceCallChunk) *
+        ((CALIBRATION_ITERATION_COUNT - 1) / TRACE_CHUNK_CAPACITY + 1));
+
+    uint64_t correlation_data = 0;
+    cl_callback_data callback_data{};
+    callback_data.correlationData =
+        reinterpret_cast<decltype(callback_data.correlationData)>(
+            &correlation_data);
+    callback_data.functionName = "clGetPlatformIDs";
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (int i = 0; i < CALIBRATION_ITERATION_COUNT; ++i) {
+      callback_data.site = CL_CALLBACK_SITE_ENTER;
+      Callback(CL_FUNCTION_clGetPlatformIDs, &callback_data, &collector);
+      callback_data.site = CL_CALLBACK_SITE_EXIT;
+      Callback(CL_FUNCTION_clGetPlatformIDs, &callback_data, &collector);
+    }
+    std::chrono::duration<uint64_t, std::nano> time =
+        std::chrono::steady_clock::now() - start;
+
+    std::vector<uint64_t> durations;
+    for (const auto& call : collector.GetFunctionCalls()) {
+      durations.push_back(call.end_time - call.start_time);
+    }
+    ASSERT(!durations.empty());
+    std::nth_element(durations.begin(),
+                     durations.begin() + durations.size() / 2,
+                     durations.end());
+
+    return ClCallbackOverhead{time.count() / CALIBRATION_ITERATION_COUNT,
+                              durations[durations.size() / 2]};
+  }
+
+  // Run of short calls a thread keeps to itself until a different call
+  // comes, so extending it takes no lock. Runs of all threads are listed
+  // for the collector to write them out at the end
+  struct CollapsedRun {
+    ClApiCollector* collector = nullptr;
+    const char* name = nullptr;
+    TraceCallRecord record{};  // First start and last end
+    uint64_t count = 0;
+    uint64_t busy_time = 0;
+
+    CollapsedRun() {
+      const std::lock_guard<std::mutex> lock(GetRunLock());
+      GetRuns().insert(this);
+    }
+
+    // Thread is gone, its run can not be continued
+    ~CollapsedRun() {
+      const std::lock_guard<std::mutex> lock(GetRunLock());
+      Flush();
+      GetRuns().erase(this);
+    }
+
+    bool Extend(const ClApiCollector* target, uint16_t function,
+                uint16_t flags, uint32_t stack_id, uint64_t start_time,
+                uint64_t end_time) {
+      if (collector != target || record.function_id != function ||
+          record.flags != flags || record.stack_id != stack_id ||
+          count >= TRACE_COLLAPSE_MAX_COUNT) {
+        return false;
+      }
+      record.end_time = end_time;
+      busy_time += end_time - start_time;
+      ++count;
+      return true;
+    }
+
+    // A run of a single call is written as is
+    void Flush() {
+      if (collector == nullptr) {
+        return;
+      }
+      if (count > 1) {
+        record.flags |= TRACE_CALL_FLAG_COLLAPSED;
+        record.collapsed_count = static_cast<uint16_t>(count);
+        record.collapsed_mean =
+            static_cast<uint16_t>((busy_time + count / 2) / count);
+      }
+      collector->AddRecordLocked(name, record);
+      if (count > 1) {
+        collector->AddCollapsed(count);
+      }
+      collector = nullptr;
+    }
+  };
+
+  // Never destroyed, runs of threads still alive are written out from the
+  // library destructor
+  static std::mutex& GetRunLock() {
+    static std::mutex* lock = new std::mutex;
+    return *lock;
+  }
+
+  static std::set<CollapsedRun*>& GetRuns() {
+    static std::set<CollapsedRun*>* runs = new std::set<CollapsedRun*>;
+    return *runs;
+  }
+
+  static CollapsedRun& GetCollapsedRun() {
+    static thread_local CollapsedRun run;
+    return run;
+  }
+
+  // Writes out runs of the collector left by threads, tracing is expected
+  // to be disabled so the threads do not extend them any more
+  void DropRuns() {
+    if (collapse_threshold_ == 0) {
+      return;
+    }
+    const std::lock_guard<std::mutex> lock(GetRunLock());
+    for (CollapsedRun* run : GetRuns()) {
+      if (run->collector == this) {
+        run->Flush();
+      }
+    }
+  }
+
+  void AddCollapsed(uint64_t call_count) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    ++collapsed_count_;
+    collapsed_call_count_ += call_count;
+  }
+
+  void AddFunctionCallItem(const char* name, cl_function_id function,
+                           uint64_t start_time, uint64_t end_time,
+                           uint16_t flags, uint32_t stack_id) {
+    uint32_t thread_id = utils::GetTid();
+    if (compensate_overhead_) {
+      end_time = std::max(start_time, end_time - overhead_.duration_bias);
+    }
+    TraceCallRecord record{start_time, end_time, thread_id,
+                           static_cast<uint16_t>(function), flags, stack_id,
+                           0, 0};
+
+    if (collapse_threshold_ == 0) {
+      AddRecordLocked(name, record);
+      return;
+    }
+
+    // Short calls go to the run of the thread, the run is written once a
+    // call breaks it
+    bool is_short = (end_time - start_time < collapse_threshold_);
+    CollapsedRun& run = GetCollapsedRun();
+    if (is_short && run.Extend(this, record.function_id, flags, stack_id,
+                               start_time, end_time)) {
+      return;
+    }
+    run.Flush();
+    if (is_short) {
+      run.collector = this;
+      run.name = name;
+      run.record = record;
+      run.count = 1;
+      run.busy_time = end_time - start_time;
+      return;
+    }
+    AddRecordLocked(name, record);
+  }
+
+  void AddRecordLocked(const char* name, const TraceCallRecord& record) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    if (function_names_[record.function_id] == nullptr) {
+      function_names_[record.function_id] = name;
+      // Names are written as they appear to keep a crashed trace readable
+      if (writer_ != nullptr) {
+        writer_->WriteStrings({{record.function_id, name}});
+      }
+    }
+    AddRecord(record);
+  }
+
+  // Kernel of a clEnqueueNDRangeKernel call is recorded right after the
+  // call as an annotation spanning it, named by the kernel function, so
+  // calls can be told apart by kernel
+  void AddKernelItem(const cl_callback_data* callback_data,
+                     uint64_t start_time, uint64_t end_time,
+                     uint32_t stack_id) {
+    const cl_params_clEnqueueNDRangeKernel* params =
+        reinterpret_cast<const cl_params_clEnqueueNDRangeKernel*>(
+            callback_data->functionParams);
+    cl_kernel kernel = *(params->kernel);
+    size_t size = 0;
+    if (kernel == nullptr ||
+        clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr,
+                        &size) != CL_SUCCESS ||
+        size <= 1) {
+      return;
+    }
+    std::string name(size, '\0');
+    if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, size, &name[0],
+                        nullptr) != CL_SUCCESS) {
+      return;
+    }
+    name.resize(strlen(name.c_str()));
+
+    uint32_t thread_id = utils::GetTid();
+    if (compensate_overhead_) {
+      end_time = std::max(start_time, end_time - overhead_.duration_bias);
+    }
+
     const std::lock_guard<std::mutex> lock(lock_);
-    function_calls_.push_back(ClFunctionCall{name, start_time, end_time});
+    uint32_t name_id = 0;
+    auto it = kernel_ids_.find(name);
+    if (it != kernel_ids_.end()) {
+      name_id = it->second;
+    } else {
+      name_id = TRACE_KERNEL_ID_BASE + kernel_ids_.size();
+      if (name_id > TRACE_ANNOTATION_ID_MAX) {
+        if (!kernel_overflow_reported_) {
+          std::cerr << "[WARNING] Too many kernel names, kernels with new "
+                    << "names are not recorded" << std::endl;
+          kernel_overflow_reported_ = true;
+        }
+        return;
+      }
+      kernel_ids_[name] = name_id;
+      annotation_names_[name_id] = name;
+      if (writer_ != nullptr) {
+        writer_->WriteStrings({{name_id, name}});
+      }
+    }
+    AddRecord(TraceCallRecord{start_time, end_time, thread_id,
+                              static_cast<uint16_t>(name_id),
+                              TRACE_CALL_FLAG_ANNOTATION, stack_id, 0, 0});
+  }
+
+  // Should be called under the lock
+  void AddRecord(const TraceCallRecord& record) {
+    if (chunk_ != nullptr && writer_ != nullptr &&
+        writer_->IsSegmentExpired(record.start_time)) {
+      // Partial chunk is committed, so the segment rotates on the next one
+      writer_->CommitCallChunk(chunk_);
+      chunk_ = nullptr;
+    }
+    if (chunk_ == nullptr) {
+      if (writer_ != nullptr) {
+        chunk_ = writer_->AcquireCallChunk();
+        if (chunk_ == nullptr) {
+          return;  // Trace file can not grow, the call is dropped
+        }
+      } else {
+        chunk_ = reinterpret_cast<TraceCallChunk*>(arena_.Allocate());
+        if (chunk_ == nullptr) {
+          return;
+        }
+        chunk_->count = 0;
+      }
+    }
+    // Record is stored before the count, so a crash never exposes
+    // a partially written record
+    chunk_->records[chunk_->count] = record;
+    ++chunk_->count;
+    ++event_count_;
+
+    if (chunk_->count == TRACE_CHUNK_CAPACITY) {
+      if (writer_ != nullptr) {
+        writer_->CommitCallChunk(chunk_);
+      }
+      chunk_ = nullptr;
+    }
+  }
+
+  // Should be called under the lock
+  void FlushDeviceRecords() {
+    if (writer_ == nullptr) {
+      return;
+    }
+    if (!clocks_.empty()) {
+      writer_->WriteClocks(clocks_);
+      clocks_.clear();
+    }
+    if (!commands_.empty()) {
+      writer_->WriteCommands(commands_);
+      commands_.clear();
+    }
+  }
+
+  void DecodeChunk(const TraceCallChunk* chunk,
+                   std::vector<ClFunctionCall>& calls) const {
+    ASSERT(chunk != nullptr);
+    for (uint32_t i = 0; i < chunk->count; ++i) {
+      const TraceCallRecord& record = chunk->records[i];
+      if (record.function_id >= TRACE_ANNOTATION_ID_BASE) {
+        calls.push_back(DecodeFunctionCall(
+            record, annotation_names_.at(record.function_id)));
+      } else {
+        calls.push_back(
+            DecodeFunctionCall(record, function_names_[record.function_id]));
+      }
+    }
+  }
+
+  static bool IsBlockingCall(cl_function_id function,
+                             const cl_callback_data* callback_data) {
+    ASSERT(callback_data != nullptr);
+    if (function == CL_FUNCTION_clEnqueueReadBuffer) {
+      const cl_params_clEnqueueReadBuffer* params =
+          reinterpret_cast<const cl_params_clEnqueueReadBuffer*>(
+              callback_data->functionParams);
+      return *(params->blockingRead) == CL_TRUE;
+    }
+    if (function == CL_FUNCTION_clEnqueueWriteBuffer) {
+      const cl_params_clEnqueueWriteBuffer* params =
+          reinterpret_cast<const cl_params_clEnqueueWriteBuffer*>(
+              callback_data->functionParams);
+      return *(params->blockingWrite) == CL_TRUE;
+    }
+    return false;
+  }
+
+  // Call site ids of the calls in flight on this thread, calls issued from
+  // inside an API call (e.g. by a callback) nest
+  static std::vector<uint32_t>& GetPendingStacks() {
+    static thread_local std::vector<uint32_t> stacks;
+    return stacks;
   }
 
  private:  // Callbacks
@@ -98,20 +604,53 @@ class ClApiCollector {
     if (callback_data->site == CL_CALLBACK_SITE_ENTER) {
       uint64_t& start_time =
           *reinterpret_cast<uint64_t*>(callback_data->correlationData);
+      if (collector->stack_table_ != nullptr) {
+        GetPendingStacks().push_back(collector->stack_table_->Capture());
+      }
       start_time = collector->GetTimestamp();
     } else {
       uint64_t end_time = collector->GetTimestamp();
       uint64_t& start_time =
           *reinterpret_cast<uint64_t*>(callback_data->correlationData);
-      collector->AddFunctionCallItem(callback_data->functionName, start_time,
-                                     end_time);
+      uint16_t flags = IsBlockingCall(function, callback_data)
+                           ? TRACE_CALL_FLAG_BLOCKING
+                           : 0;
+      uint32_t stack_id = 0;
+      if (collector->stack_table_ != nullptr) {
+        std::vector<uint32_t>& stacks = GetPendingStacks();
+        if (!stacks.empty()) {
+          stack_id = stacks.back();
+          stacks.pop_back();
+        }
+      }
+      collector->AddFunctionCallItem(callback_data->functionName, function,
+                                     start_time, end_time, flags, stack_id);
+      if (function == CL_FUNCTION_clEnqueueNDRangeKernel) {
+        collector->AddKernelItem(callback_data, start_time, end_time,
+                                 stack_id);
+      }
     }
   }
 
  private:  // Data
-  ClApiTracer* tracer_ = nullptr;
-  std::chrono::time_point<std::chrono::steady_clock> base_time_;
-  std::vector<ClFunctionCall> function_calls_;
+  TraceWriter* writer_ = nullptr;
+  TraceCallChunk* chunk_ = nullptr;
+  TraceArena arena_;  // Chunks of detached collectors
+  uint64_t event_count_ = 0;
+  const char* function_names_[CL_FUNCTION_COUNT] = {nullptr};
+  std::map<uint32_t, std::string> annotation_names_;
+  std::map<std::string, uint32_t> kernel_ids_;
+  bool kernel_overflow_reported_ = false;
+  std::string clocks_;    // Device records not written yet
+  std::string commands_;
+
+  ClCallbackOverhead overhead_{0, 0};
+  bool compensate_overhead_ = false;
+  std::map<std::string, std::string> track_;
+  CallStackTable* stack_table_ = nullptr;
+  uint64_t collapse_threshold_ = 0;  // ns, 0 if calls are not collapsed
+  uint64_t collapsed_count_ = 0;
+  uint64_t collapsed_call_count_ = 0;
 
   std::mutex lock_;
 };
@@ -0,0 +1,428 @@
+#ifndef PHPROF_CL_COLLECTOR_REGISTRY_H_
+#define PHPROF_CL_COLLECTOR_REGISTRY_H_
+
+#include <string.h>
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cl_api_collector.h"
+#include "cl_api_tracer.h"
+#include "cl_device_timer.h"
+#include "cl_memory_tracker.h"
+#include "trace_writer.h"
+#include "utils_cl.h"
+
+#define HOST_TRACK_ID 1
+#define QUEUE_CACHE_SIZE 16  // Power of two
+
+struct ClTrack {
+  std::string name;
+  std::string filename;
+  ClApiCollector* collector;
+};
+
+// Owns one collector per Intel device plus a host collector for calls that
+// are not bound to a single device (contexts, programs, kernels, events).
+// Tracing callbacks are global for a platform, so there is one tracer per
+// platform and each call is dispatched to its device collector with a hash
+// lookup of the command queue or device, whatever the number of devices
+class ClCollectorRegistry {
+ public:  // User Interface
+  // Call sites are captured into the stack table if one is given,
+  // it should outlive the registry. Trace files of all tracks are split
+  // into segments by the given rotation limits. Repeated calls shorter than
+  // the collapse threshold (ns) are merged, 0 keeps every call. Trace files
+  // are created in the given directory, the working one if it is empty
+  static ClCollectorRegistry* Create(
+      const std::vector<cl_device_id>& devices,
+      bool compensate_overhead = false, CallStackTable* stack_table = nullptr,
+      const TraceRotation& rotation = TraceRotation(),
+      uint64_t collapse_threshold = 0, const std::string& directory = "") {
+    ClCollectorRegistry* registry = new ClCollectorRegistry();
+    ASSERT(registry != nullptr);
+    registry->stack_table_ = stack_table;
+    registry->rotation_ = rotation;
+    registry->collapse_threshold_ = collapse_threshold;
+    registry->directory_ = directory;
+
+    registry->host_collector_ = registry->AddTrack(
+        "Host", "host_trace.bin", HOST_TRACK_ID, compensate_overhead);
+    if (registry->host_collector_ == nullptr) {
+      delete registry;
+      return nullptr;
+    }
+
+    std::map<cl_device_type, int> type_counts;
+    for (cl_device_id device : devices) {
+      cl_device_type type = utils::cl::GetDeviceType(device);
+      std::string prefix = (type == CL_DEVICE_TYPE_CPU)   ? "cpu"
+                           : (type == CL_DEVICE_TYPE_GPU) ? "gpu"
+                                                          : "acc";
+      std::string filename =
+          prefix + std::to_string(type_counts[type]++) + "_trace.bin";
+
+      ClApiCollector* collector = registry->AddTrack(
+          utils::cl::GetDeviceName(device), filename,
+          HOST_TRACK_ID + 1 + registry->device_collectors_.size(),
+          compensate_overhead);
+      if (collector != nullptr) {
+        registry->device_collectors_[device] = collector;
+      }
+    }
+
+    if (!registry->EnableTracing(devices)) {
+      delete registry;
+      return nullptr;
+    }
+    return registry;
+  }
+
+  ~ClCollectorRegistry() {
+    for (ClApiTracer* tracer : tracers_) {
+      delete tracer;
+    }
+    for (ClTrack& track : tracks_) {
+      delete track.collector;
+    }
+  }
+
+  ClCollectorRegistry(const ClCollectorRegistry& copy) = delete;
+  ClCollectorRegistry& operator=(const ClCollectorRegistry& copy) = delete;
+
+  void DisableTracing() {
+    for (ClApiTracer* tracer : tracers_) {
+      bool disabled = tracer->Disable();
+      ASSERT(disabled);
+    }
+  }
+
+  // Tracing should be disabled
+  void Finalize() {
+    for (ClTrack& track : tracks_) {
+      track.collector->Finalize();
+    }
+  }
+
+  const std::vector<ClTrack>& GetTracks() const { return tracks_; }
+
+  // Collector of the calls that are not bound to a single device
+  ClApiCollector* GetHostCollector() const { return host_collector_; }
+
+  // Callback is called on every thread before its first traced call after
+  // it is set, threads already running included
+  void SetThreadCallback(void (*callback)()) {
+    thread_callback_ = callback;
+    generation_ = GetNextGeneration();
+  }
+
+  // Tracker is fed with every traced call, it should outlive tracing
+  void SetMemoryTracker(ClMemoryTracker* tracker) { memory_tracker_ = tracker; }
+
+  // Timer is fed with every traced call, it should outlive tracing
+  void SetDeviceTimer(ClDeviceTimer* timer) { device_timer_ = timer; }
+
+  std::map<cl_device_id, ClApiCollector*> GetDeviceCollectors() const {
+    return std::map<cl_device_id, ClApiCollector*>(device_collectors_.begin(),
+                                                   device_collectors_.end());
+  }
+
+ private:  // Implementation Details
+  static uint64_t GetNextGeneration() {
+    static std::atomic<uint64_t> generation{0};
+    return ++generation;
+  }
+
+  enum FunctionTarget : uint8_t {
+    TARGET_UNKNOWN = 0,
+    TARGET_HOST,
+    TARGET_QUEUE,       // First argument is a command queue
+    TARGET_DEVICE,      // First argument is a device
+    TARGET_NEW_QUEUE,   // Queue creation, second argument is a device
+  };
+
+  ClCollectorRegistry() {
+    for (int id = 0; id < CL_FUNCTION_COUNT; ++id) {
+      targets_[id] = TARGET_UNKNOWN;
+    }
+  }
+
+  ClApiCollector* AddTrack(const std::string& name,
+                           const std::string& basename, uint64_t track_id,
+                           bool compensate_overhead) {
+    std::string filename = utils::JoinPath(directory_, basename);
+    TraceWriter* writer = TraceWriter::Create(filename, rotation_);
+    if (writer == nullptr) {
+      std::cerr << "[WARNING] Unable to create trace file " << filename
+                << std::endl;
+      return nullptr;
+    }
+
+    std::map<std::string, std::string> track{
+        {"track_id", std::to_string(track_id)},
+        {"track_name", utils::GetJsonString(name)}};
+    ClApiCollector* collector =
+        ClApiCollector::Create(writer, compensate_overhead, track);
+    collector->SetStackTable(stack_table_);
+    collector->SetCollapseThreshold(collapse_threshold_);
+    tracks_.push_back(ClTrack{
+        name,
+        rotation_.IsEnabled() ? TraceWriter::GetSegmentName(filename, "*")
+                              : filename,
+        collector});
+    return collector;
+  }
+
+  // Creates one tracer per platform of the given devices
+  bool EnableTracing(const std::vector<cl_device_id>& devices) {
+    std::map<cl_platform_id, cl_device_id> platforms;
+    for (cl_device_id device : devices) {
+      platforms.emplace(utils::cl::GetDevicePlatform(device), device);
+    }
+
+    for (const auto& item : platforms) {
+      ClApiTracer* tracer = new ClApiTracer(item.second, Callback, this);
+      if (tracer == nullptr || !tracer->IsValid()) {
+        std::cerr << "[WARNING] Unable to create OpenCL tracer for platform "
+                  << "of device " << utils::cl::GetDeviceName(item.second)
+                  << std::endl;
+        if (tracer != nullptr) {
+          delete tracer;
+        }
+        continue;
+      }
+
+      for (int id = 0; id < CL_FUNCTION_COUNT; ++id) {
+        bool set =
+            tracer->SetTracingFunction(static_cast<cl_function_id>(id));
+        ASSERT(set);
+      }
+      bool enabled = tracer->Enable();
+      ASSERT(enabled);
+      tracers_.push_back(tracer);
+    }
+
+    return !tracers_.empty();
+  }
+
+  static FunctionTarget GetTarget(const char* name) {
+    ASSERT(name != nullptr);
+    if (strncmp(name, "clEnqueue", strlen("clEnqueue")) == 0 ||
+        strcmp(name, "clFinish") == 0 || strcmp(name, "clFlush") == 0 ||
+        strcmp(name, "clRetainCommandQueue") == 0 ||
+        strcmp(name, "clReleaseCommandQueue") == 0 ||
+        strcmp(name, "clGetCommandQueueInfo") == 0) {
+      return TARGET_QUEUE;
+    }
+    if (strcmp(name, "clGetDeviceInfo") == 0 ||
+        strcmp(name, "clCreateSubDevices") == 0 ||
+        strcmp(name, "clRetainDevice") == 0 ||
+        strcmp(name, "clReleaseDevice") == 0) {
+      return TARGET_DEVICE;
+    }
+    if (strcmp(name, "clCreateCommandQueue") == 0 ||
+        strcmp(name, "clCreateCommandQueueWithProperties") == 0) {
+      return TARGET_NEW_QUEUE;
+    }
+    return TARGET_HOST;
+  }
+
+  // Parameter structures hold pointers to the arguments in declaration order
+  template <typename T>
+  static T GetArgument(const cl_callback_data* callback_data, int index) {
+    const void* const* params =
+        reinterpret_cast<const void* const*>(callback_data->functionParams);
+    return *reinterpret_cast<const T*>(params[index]);
+  }
+
+  ClApiCollector* GetDeviceCollector(cl_device_id device) const {
+    auto it = device_collectors_.find(device);
+    return (it != device_collectors_.end()) ? it->second : host_collector_;
+  }
+
+  // Queue lookups of every thread go through its own small cache first, so
+  // threads enqueueing at a high rate do not share the lock. The cache is
+  // dropped whenever the queue generation changes, i.e. on a queue release
+  // or with another registry
+  struct QueueCache {
+    uint64_t generation = 0;
+    cl_command_queue queues[QUEUE_CACHE_SIZE] = {};
+    ClApiCollector* collectors[QUEUE_CACHE_SIZE] = {};
+  };
+
+  static size_t GetQueueSlot(cl_command_queue queue) {
+    return (reinterpret_cast<uintptr_t>(queue) >> 4) & (QUEUE_CACHE_SIZE - 1);
+  }
+
+  ClApiCollector* GetQueueCollector(cl_function_id function,
+                                    cl_command_queue queue) {
+    static thread_local QueueCache cache;
+    uint64_t generation =
+        queue_generation_.load(std::memory_order_acquire);
+    if (cache.generation != generation) {
+      cache = QueueCache();
+      cache.generation = generation;
+    }
+
+    size_t slot = GetQueueSlot(queue);
+    if (queue != nullptr && cache.queues[slot] == queue) {
+      return cache.collectors[slot];
+    }
+    ClApiCollector* collector = LookupQueueCollector(function, queue);
+    if (queue != nullptr && collector != host_collector_) {
+      cache.queues[slot] = queue;
+      cache.collectors[slot] = collector;
+    }
+    return collector;
+  }
+
+  // Queues created before tracing started (e.g. in a process the tool was
+  // attached to) are resolved through their device once. A queue being
+  // released may already be gone, it is not queried
+  ClApiCollector* LookupQueueCollector(cl_function_id function,
+                                       cl_command_queue queue) {
+    {
+      std::shared_lock<std::shared_mutex> lock(queue_lock_);
+      auto it = queue_collectors_.find(queue);
+      if (it != queue_collectors_.end()) {
+        return it->second;
+      }
+    }
+    cl_device_id device = nullptr;
+    if (queue == nullptr || function == CL_FUNCTION_clReleaseCommandQueue ||
+        clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(device), &device,
+                              nullptr) != CL_SUCCESS) {
+      return host_collector_;
+    }
+    ClApiCollector* collector = GetDeviceCollector(device);
+    std::unique_lock<std::shared_mutex> lock(queue_lock_);
+    queue_collectors_[queue] = collector;
+    return collector;
+  }
+
+  // Handle of a destroyed queue may be reused by the next one created, so
+  // the queue is forgotten on every release. If it is still referenced,
+  // it is resolved again on the next call
+  void ForgetQueue(cl_command_queue queue) {
+    std::unique_lock<std::shared_mutex> lock(queue_lock_);
+    queue_collectors_.erase(queue);
+    queue_generation_.store(GetNextGeneration(), std::memory_order_release);
+  }
+
+  ClApiCollector* GetCollector(cl_function_id function,
+                               const cl_callback_data* callback_data) {
+    // Function kind is resolved by name once, then cached by id
+    uint8_t target = targets_[function].load(std::memory_order_relaxed);
+    if (target == TARGET_UNKNOWN) {
+      target = GetTarget(callback_data->functionName);
+      targets_[function].store(target, std::memory_order_relaxed);
+    }
+
+    switch (target) {
+      case TARGET_QUEUE: {
+        cl_command_queue queue =
+            GetArgument<cl_command_queue>(callback_data, 0);
+        ClApiCollector* collector = GetQueueCollector(function, queue);
+        if (function == CL_FUNCTION_clReleaseCommandQueue &&
+            *reinterpret_cast<cl_int*>(callback_data->functionReturnValue) ==
+                CL_SUCCESS) {
+          ForgetQueue(queue);
+        }
+        return collector;
+      }
+      case TARGET_DEVICE:
+        return GetDeviceCollector(GetArgument<cl_device_id>(callback_data, 0));
+      case TARGET_NEW_QUEUE: {
+        ClApiCollector* collector =
+            GetDeviceCollector(GetArgument<cl_device_id>(callback_data, 1));
+        cl_command_queue queue = *reinterpret_cast<cl_command_queue*>(
+            callback_data->functionReturnValue);
+        if (queue != nullptr) {
+          std::unique_lock<std::shared_mutex> lock(queue_lock_);
+          queue_collectors_[queue] = collector;
+        }
+        return collector;
+      }
+      default:
+        return host_collector_;
+    }
+  }
+
+ private:  // Callbacks
+  static void Callback(cl_function_id function, cl_callback_data* callback_data,
+                       void* user_data) {
+    ClCollectorRegistry* registry =
+        reinterpret_cast<ClCollectorRegistry*>(user_data);
+    ASSERT(registry != nullptr);
+    ASSERT(callback_data != nullptr);
+
+    if (ClDeviceTimer::IsToolCall()) {
+      return;
+    }
+
+    // Threads are met again by a new thread callback or registry
+    static thread_local uint64_t known_generation = 0;
+    uint64_t generation =
+        registry->generation_.load(std::memory_order_acquire);
+    if (known_generation != generation) {
+      known_generation = generation;
+      void (*thread_callback)() = registry->thread_callback_.load();
+      if (thread_callback != nullptr) {
+        thread_callback();
+      }
+    }
+
+    // Enter callback only saves the start time, which does not depend on
+    // the collector, so the target is resolved on exit with the result known
+    ClApiCollector* collector = registry->host_collector_;
+    ClMemoryTracker* memory_tracker =
+        registry->memory_tracker_.load(std::memory_order_acquire);
+    ClDeviceTimer* device_timer =
+        registry->device_timer_.load(std::memory_order_acquire);
+    if (callback_data->site == CL_CALLBACK_SITE_EXIT) {
+      collector = registry->GetCollector(function, callback_data);
+      if (memory_tracker != nullptr) {
+        memory_tracker->OnFunctionExit(function, callback_data);
+      }
+      if (device_timer != nullptr) {
+        device_timer->OnFunctionExit(function, callback_data, collector);
+      }
+    } else {
+      if (memory_tracker != nullptr) {
+        memory_tracker->OnFunctionEnter(function, callback_data);
+      }
+      if (device_timer != nullptr) {
+        device_timer->OnFunctionEnter(function, callback_data);
+      }
+    }
+    ClApiCollector::GetCallback()(function, callback_data, collector);
+  }
+
+ private:  // Data
+  std::vector<ClApiTracer*> tracers_;
+  std::vector<ClTrack> tracks_;
+  ClApiCollector* host_collector_ = nullptr;
+  CallStackTable* stack_table_ = nullptr;
+  TraceRotation rotation_;
+  uint64_t collapse_threshold_ = 0;
+  std::string directory_;
+  std::unordered_map<cl_device_id, ClApiCollector*> device_collectors_;
+
+  std::unordered_map<cl_command_queue, ClApiCollector*> queue_collectors_;
+  std::shared_mutex queue_lock_;
+  std::atomic<uint64_t> queue_generation_{GetNextGeneration()};
+
+  std::atomic<uint8_t> targets_[CL_FUNCTION_COUNT];
+  std::atomic<void (*)()> thread_callback_{nullptr};
+  std::atomic<uint64_t> generation_{GetNextGeneration()};
+  std::atomic<ClMemoryTracker*> memory_tracker_{nullptr};
+  std::atomic<ClDeviceTimer*> device_timer_{nullptr};
+};
+
+#endif  // PHPROF_CL_COLLECTOR_REGISTRY_H_
@@ -0,0 +1,332 @@
+#ifndef PHPROF_CL_DEVICE_TIMER_H_
+#define PHPROF_CL_DEVICE_TIMER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <CL/tracing_api.h>
+
+#include "cl_api_collector.h"
+#include "trace_format.h"
+#include "utils.h"
+
+#define DEVICE_CLOCK_PERIOD_MS 100
+
+// Puts device activity next to the API calls: commands enqueued with an
+// event get their profiling times on the device timer, and the timer of
+// every device is read together with the host clock periodically, so the
+// converter can fit a drift-corrected mapping from device to host time.
+// Both are written into the trace of the device the command was enqueued
+// to. Profiling times are only available for queues created with
+// CL_QUEUE_PROFILING_ENABLE and commands the application asked an event for
+class ClDeviceTimer {
+ public:  // User Interface
+  // Clock samples of each device go to its collector, which should outlive
+  // the timer
+  static ClDeviceTimer* Create(
+      const std::map<cl_device_id, ClApiCollector*>& devices) {
+    ClDeviceTimer* timer = new ClDeviceTimer(devices);
+    ASSERT(timer != nullptr);
+    return timer;
+  }
+
+  ~ClDeviceTimer() { Stop(); }
+
+  ClDeviceTimer(const ClDeviceTimer& copy) = delete;
+  ClDeviceTimer& operator=(const ClDeviceTimer& copy) = delete;
+
+  // OpenCL calls the timer makes itself are not expected to be recorded
+  static bool IsToolCall() { return GetToolCall(); }
+
+  // Expected to be called on enter of every traced call: the event is still
+  // valid when the application releases it
+  void OnFunctionEnter(cl_function_id function,
+                       const cl_callback_data* callback_data) {
+    if (function != CL_FUNCTION_clReleaseEvent) {
+      return;
+    }
+    cl_event event =
+        *reinterpret_cast<const cl_params_clReleaseEvent*>(
+             callback_data->functionParams)->event;
+
+    Command command{};
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      auto it = events_.find(event);
+      if (it == events_.end()) {
+        return;
+      }
+      command = it->second;
+      events_.erase(it);
+    }
+    if (!Resolve(event, command)) {
+      // Still running, kept by the timer until it completes
+      ToolCall scope;
+      if (clRetainEvent(event) == CL_SUCCESS) {
+        const std::lock_guard<std::mutex> lock(lock_);
+        running_.push_back(std::make_pair(event, command));
+      }
+    }
+  }
+
+  // Expected to be called on exit of every traced call with the collector
+  // the call was recorded into
+  void OnFunctionExit(cl_function_id function,
+                      const cl_callback_data* callback_data,
+                      ClApiCollector* collector) {
+    if (collectors_.count(collector) == 0) {
+      return;
+    }
+    cl_event* event = GetEvent(function, callback_data->functionParams);
+    if (event == nullptr || *event == nullptr ||
+        !IsSucceeded(function, callback_data->functionReturnValue)) {
+      return;
+    }
+
+    const std::lock_guard<std::mutex> lock(lock_);
+    events_[*event] = Command{collector, utils::GetTid(),
+                              static_cast<uint16_t>(function)};
+  }
+
+  // Takes the last clock samples and records commands that completed,
+  // tracing should be disabled. Commands whose events the application still
+  // holds are recorded too, their events stay valid until it releases them
+  void Stop() {
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      if (stopped_) {
+        return;
+      }
+      stopped_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+
+    SampleClocks();
+    ResolveHeld();
+    ResolveRunning(true);
+
+    if (unavailable_count_ > 0) {
+      std::cerr << "[WARNING] No profiling info for " << unavailable_count_
+                << " device commands, their queues should be created with "
+                << "CL_QUEUE_PROFILING_ENABLE" << std::endl;
+    }
+    if (failed_devices_ > 0) {
+      std::cerr << "[WARNING] " << failed_devices_ << " devices do not "
+                << "support clGetDeviceAndHostTimer, their commands can not "
+                << "be placed on the host time base" << std::endl;
+    }
+  }
+
+  uint64_t GetCommandCount() const { return command_count_; }
+
+  uint64_t GetSampleCount() const { return sample_count_; }
+
+ private:  // Implementation Details
+  struct Command {
+    ClApiCollector* collector;
+    uint32_t thread_id;
+    uint16_t function_id;
+  };
+
+  // Marks OpenCL calls made by the timer on the current thread
+  static bool& GetToolCall() {
+    static thread_local bool tool_call = false;
+    return tool_call;
+  }
+
+  struct ToolCall {
+    ToolCall() { GetToolCall() = true; }
+    ~ToolCall() { GetToolCall() = false; }
+  };
+
+  explicit ClDeviceTimer(
+      const std::map<cl_device_id, ClApiCollector*>& devices)
+      : devices_(devices) {
+    for (const auto& item : devices) {
+      collectors_[item.second] = item.first;
+    }
+    SampleClocks();
+    thread_ = std::thread(&ClDeviceTimer::Run, this);
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stopped_) {
+      wakeup_.wait_for(lock,
+                       std::chrono::milliseconds(DEVICE_CLOCK_PERIOD_MS));
+      if (stopped_) {
+        break;
+      }
+      lock.unlock();
+      SampleClocks();
+      ResolveRunning(false);
+      lock.lock();
+    }
+  }
+
+  // Host time is read around the device timer, the reading is placed in
+  // the middle of the window
+  void SampleClocks() {
+    ToolCall scope;
+    for (const auto& item : devices_) {
+      uint64_t before = ClApiCollector::GetTimestamp();
+      cl_ulong device_time = 0, host_time = 0;
+      cl_int status =
+          clGetDeviceAndHostTimer(item.first, &device_time, &host_time);
+      uint64_t after = ClApiCollector::GetTimestamp();
+      if (status != CL_SUCCESS) {
+        const std::lock_guard<std::mutex> lock(lock_);
+        if (unsupported_.insert(item.first).second) {
+          ++failed_devices_;
+        }
+        continue;
+      }
+      item.second->AddClockSample(TraceClockRecord{
+          before + (after - before) / 2, device_time, after - before});
+      ++sample_count_;
+    }
+  }
+
+  // Returns false if the command has not completed yet
+  bool Resolve(cl_event event, const Command& command) {
+    ToolCall scope;
+    cl_int status = CL_COMPLETE;
+    if (clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                       sizeof(status), &status, nullptr) != CL_SUCCESS) {
+      return true;  // Event is not valid, nothing to wait for
+    }
+    if (status > CL_COMPLETE) {
+      return false;
+    }
+
+    static const cl_profiling_info params[] = {
+        CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    cl_ulong times[4] = {0};
+    for (int i = 0; i < 4; ++i) {
+      if (clGetEventProfilingInfo(event, params[i], sizeof(cl_ulong),
+                                  &times[i], nullptr) != CL_SUCCESS) {
+        if (status == CL_COMPLETE) {
+          ++unavailable_count_;
+        }
+        return true;
+      }
+    }
+    command.collector->AddCommand(
+        TraceCommandRecord{times[0], times[1], times[2], times[3],
+                           command.thread_id, command.function_id, 0});
+    ++command_count_;
+    return true;
+  }
+
+  // Commands not released by the application, those still running are
+  // left out: the timer does not wait for the device at stop
+  void ResolveHeld() {
+    std::unordered_map<cl_event, Command> events;
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      events.swap(events_);
+    }
+    for (const auto& item : events) {
+      Resolve(item.first, item.second);
+    }
+  }
+
+  // Commands released by the application before they completed, the
+  // references taken by the timer are dropped once they are recorded
+  void ResolveRunning(bool final) {
+    std::vector<std::pair<cl_event, Command>> running;
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      running.swap(running_);
+    }
+
+    std::vector<std::pair<cl_event, Command>> left;
+    for (const auto& item : running) {
+      if (Resolve(item.first, item.second) || final) {
+        ToolCall scope;
+        clReleaseEvent(item.first);
+      } else {
+        left.push_back(item);
+      }
+    }
+
+    const std::lock_guard<std::mutex> lock(lock_);
+    running_.insert(running_.end(), left.begin(), left.end());
+  }
+
+  // Map functions return the mapped pointer instead of the status
+  static bool IsSucceeded(cl_function_id function, const void* result) {
+    if (function == CL_FUNCTION_clEnqueueMapBuffer ||
+        function == CL_FUNCTION_clEnqueueMapImage) {
+      return *reinterpret_cast<void* const*>(result) != nullptr;
+    }
+    return *reinterpret_cast<const cl_int*>(result) == CL_SUCCESS;
+  }
+
+  // Event output argument of the enqueue functions, nullptr for others
+  static cl_event* GetEvent(cl_function_id function, const void* params) {
+#define PHPROF_ENQUEUE_EVENT(name) \
+  case CL_FUNCTION_##name:         \
+    return *reinterpret_cast<const cl_params_##name*>(params)->event;
+
+    switch (function) {
+      PHPROF_ENQUEUE_EVENT(clEnqueueNDRangeKernel)
+      PHPROF_ENQUEUE_EVENT(clEnqueueTask)
+      PHPROF_ENQUEUE_EVENT(clEnqueueReadBuffer)
+      PHPROF_ENQUEUE_EVENT(clEnqueueWriteBuffer)
+      PHPROF_ENQUEUE_EVENT(clEnqueueReadBufferRect)
+      PHPROF_ENQUEUE_EVENT(clEnqueueWriteBufferRect)
+      PHPROF_ENQUEUE_EVENT(clEnqueueCopyBuffer)
+      PHPROF_ENQUEUE_EVENT(clEnqueueCopyBufferRect)
+      PHPROF_ENQUEUE_EVENT(clEnqueueFillBuffer)
+      PHPROF_ENQUEUE_EVENT(clEnqueueReadImage)
+      PHPROF_ENQUEUE_EVENT(clEnqueueWriteImage)
+      PHPROF_ENQUEUE_EVENT(clEnqueueCopyImage)
+      PHPROF_ENQUEUE_EVENT(clEnqueueFillImage)
+      PHPROF_ENQUEUE_EVENT(clEnqueueCopyImageToBuffer)
+      PHPROF_ENQUEUE_EVENT(clEnqueueCopyBufferToImage)
+      PHPROF_ENQUEUE_EVENT(clEnqueueMapBuffer)
+      PHPROF_ENQUEUE_EVENT(clEnqueueMapImage)
+      PHPROF_ENQUEUE_EVENT(clEnqueueUnmapMemObject)
+      PHPROF_ENQUEUE_EVENT(clEnqueueMigrateMemObjects)
+      PHPROF_ENQUEUE_EVENT(clEnqueueSVMMemcpy)
+      PHPROF_ENQUEUE_EVENT(clEnqueueSVMMemFill)
+      PHPROF_ENQUEUE_EVENT(clEnqueueSVMMap)
+      PHPROF_ENQUEUE_EVENT(clEnqueueSVMUnmap)
+      PHPROF_ENQUEUE_EVENT(clEnqueueMarkerWithWaitList)
+      PHPROF_ENQUEUE_EVENT(clEnqueueBarrierWithWaitList)
+      default:
+        return nullptr;
+    }
+#undef PHPROF_ENQUEUE_EVENT
+  }
+
+ private:  // Data
+  std::map<cl_device_id, ClApiCollector*> devices_;
+  std::map<ClApiCollector*, cl_device_id> collectors_;
+  std::unordered_map<cl_event, Command> events_;  // Enqueued, not released
+  std::vector<std::pair<cl_event, Command>> running_;
+  std::set<cl_device_id> unsupported_;
+  uint32_t failed_devices_ = 0;
+  std::atomic<uint64_t> command_count_{0};
+  std::atomic<uint64_t> sample_count_{0};
+  std::atomic<uint64_t> unavailable_count_{0};
+
+  bool stopped_ = false;
+  std::thread thread_;
+  std::mutex lock_;
+  std::condition_variable wakeup_;
+};
+
+#endif  // PHPROF_CL_DEVICE_TIMER_H_
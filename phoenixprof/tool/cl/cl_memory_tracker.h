@@ -0,0 +1,334 @@
+#ifndef PHPROF_CL_MEMORY_TRACKER_H_
+#define PHPROF_CL_MEMORY_TRACKER_H_
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <CL/tracing_api.h>
+
+#include "call_stack_table.h"
+#include "cl_api_collector.h"
+#include "trace_format.h"
+#include "trace_writer.h"
+#include "utils.h"
+
+#define MEMORY_FLUSH_SIZE 4096  // Bytes of memory records buffered per write
+
+// Follows memory objects, SVM and USM allocations of the application from
+// the parameters of the calls that create and release them. Live
+// allocations are kept by handle with their reference count, so a release
+// record carries the size it frees and the memory in use over time is a
+// running sum of the records
+class ClMemoryTracker {
+ public:  // User Interface
+  // Takes ownership of the writer, call sites of allocations are captured
+  // if a stack table is given
+  static ClMemoryTracker* Create(TraceWriter* writer,
+                                 CallStackTable* stack_table = nullptr) {
+    ASSERT(writer != nullptr);
+    ClMemoryTracker* tracker = new ClMemoryTracker(writer, stack_table);
+    ASSERT(tracker != nullptr);
+    return tracker;
+  }
+
+  ~ClMemoryTracker() {
+    Finalize();
+    delete writer_;
+  }
+
+  ClMemoryTracker(const ClMemoryTracker& copy) = delete;
+  ClMemoryTracker& operator=(const ClMemoryTracker& copy) = delete;
+
+  // Expected to be called on enter of every traced call. Releases are
+  // taken into account before the memory is actually freed, as its address
+  // may be reused by another thread right after
+  void OnFunctionEnter(cl_function_id function,
+                       const cl_callback_data* callback_data) {
+    switch (function) {
+      case CL_FUNCTION_clSVMFree:
+        Release(GetArgument<void*>(callback_data, 1), true);
+        break;
+      case CL_FUNCTION_clReleaseMemObject:
+        Release(GetArgument<cl_mem>(callback_data, 0), false);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Expected to be called on exit of every traced call, once the result of
+  // the call is known
+  void OnFunctionExit(cl_function_id function,
+                      const cl_callback_data* callback_data) {
+    switch (function) {
+      case CL_FUNCTION_clCreateBuffer:
+        AddAllocation(TRACE_MEMORY_BUFFER,
+                      GetResult<cl_mem>(callback_data),
+                      GetArgument<size_t>(callback_data, 2));
+        break;
+      case CL_FUNCTION_clCreateImage:
+        AddAllocation(
+            TRACE_MEMORY_IMAGE, GetResult<cl_mem>(callback_data),
+            GetImageSize(
+                GetArgument<const cl_image_format*>(callback_data, 2),
+                GetArgument<const cl_image_desc*>(callback_data, 3)));
+        break;
+      case CL_FUNCTION_clCreateImage2D:
+        AddAllocation(
+            TRACE_MEMORY_IMAGE, GetResult<cl_mem>(callback_data),
+            GetPixelSize(
+                GetArgument<const cl_image_format*>(callback_data, 2)) *
+                GetArgument<size_t>(callback_data, 3) *
+                GetArgument<size_t>(callback_data, 4));
+        break;
+      case CL_FUNCTION_clCreateImage3D:
+        AddAllocation(
+            TRACE_MEMORY_IMAGE, GetResult<cl_mem>(callback_data),
+            GetPixelSize(
+                GetArgument<const cl_image_format*>(callback_data, 2)) *
+                GetArgument<size_t>(callback_data, 3) *
+                GetArgument<size_t>(callback_data, 4) *
+                GetArgument<size_t>(callback_data, 5));
+        break;
+      case CL_FUNCTION_clSVMAlloc:
+        AddAllocation(TRACE_MEMORY_SVM, GetResult<void*>(callback_data),
+                      GetArgument<size_t>(callback_data, 2));
+        break;
+      case CL_FUNCTION_clRetainMemObject:
+        if (GetResult<cl_int>(callback_data) == CL_SUCCESS) {
+          Retain(GetArgument<cl_mem>(callback_data, 0));
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Allocations made outside of the traced calls (e.g. USM), ignored if
+  // the handle is null
+  void AddAllocation(TraceMemoryKind kind, const void* handle, uint64_t size) {
+    if (handle == nullptr) {
+      return;
+    }
+    uint32_t stack_id =
+        (stack_table_ != nullptr) ? stack_table_->Capture() : 0;
+    uint64_t time = ClApiCollector::GetTimestamp();
+
+    const std::lock_guard<std::mutex> lock(lock_);
+    uint64_t key = reinterpret_cast<uint64_t>(handle);
+    auto it = allocations_.find(key);
+    if (it != allocations_.end()) {
+      // Handle reused without a release seen, e.g. created before tracing
+      AddRecord(key, it->second, TRACE_MEMORY_FLAG_RELEASE, time, 0);
+    }
+    Allocation& allocation = allocations_[key];
+    allocation = Allocation{kind, size, 1};
+    AddRecord(key, allocation, 0, time, stack_id);
+  }
+
+  // Drops the allocation once its last reference is released, forced
+  // releases (e.g. SVM and USM free) ignore the reference count
+  void Release(const void* handle, bool force) {
+    if (handle == nullptr) {
+      return;
+    }
+    uint64_t time = ClApiCollector::GetTimestamp();
+
+    const std::lock_guard<std::mutex> lock(lock_);
+    auto it = allocations_.find(reinterpret_cast<uint64_t>(handle));
+    if (it == allocations_.end()) {
+      return;  // Not tracked, e.g. a sub-buffer
+    }
+    if (!force && --it->second.reference_count > 0) {
+      return;
+    }
+    AddRecord(it->first, it->second, TRACE_MEMORY_FLAG_RELEASE, time, 0);
+    allocations_.erase(it);
+  }
+
+  // Writes records that are still buffered and closes the trace
+  void Finalize() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    if (closed_) {
+      return;
+    }
+    Flush();
+    writer_->Close();
+    closed_ = true;
+  }
+
+  // Device memory, host USM is not counted
+  uint64_t GetPeakUsage() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return peak_usage_;
+  }
+
+  uint64_t GetLiveCount() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return allocations_.size();
+  }
+
+ private:  // Implementation Details
+  struct Allocation {
+    TraceMemoryKind kind;
+    uint64_t size;
+    uint32_t reference_count;
+  };
+
+  ClMemoryTracker(TraceWriter* writer, CallStackTable* stack_table)
+      : writer_(writer), stack_table_(stack_table) {}
+
+  // Parameter structures hold pointers to the arguments in declaration order
+  template <typename T>
+  static T GetArgument(const cl_callback_data* callback_data, int index) {
+    const void* const* params =
+        reinterpret_cast<const void* const*>(callback_data->functionParams);
+    return *reinterpret_cast<const T*>(params[index]);
+  }
+
+  template <typename T>
+  static T GetResult(const cl_callback_data* callback_data) {
+    return *reinterpret_cast<const T*>(callback_data->functionReturnValue);
+  }
+
+  static uint64_t GetPixelSize(const cl_image_format* format) {
+    if (format == nullptr) {
+      return 0;
+    }
+
+    switch (format->image_channel_data_type) {
+      case CL_UNORM_SHORT_565:
+      case CL_UNORM_SHORT_555:
+        return 2;
+      case CL_UNORM_INT_101010:
+      case CL_UNORM_INT_101010_2:
+        return 4;
+      default:
+        break;
+    }
+
+    uint64_t channel_size = 4;
+    switch (format->image_channel_data_type) {
+      case CL_SNORM_INT8:
+      case CL_UNORM_INT8:
+      case CL_SIGNED_INT8:
+      case CL_UNSIGNED_INT8:
+        channel_size = 1;
+        break;
+      case CL_SNORM_INT16:
+      case CL_UNORM_INT16:
+      case CL_SIGNED_INT16:
+      case CL_UNSIGNED_INT16:
+      case CL_HALF_FLOAT:
+        channel_size = 2;
+        break;
+      default:
+        break;
+    }
+
+    uint64_t channel_count = 4;
+    switch (format->image_channel_order) {
+      case CL_R:
+      case CL_A:
+      case CL_Rx:
+      case CL_INTENSITY:
+      case CL_LUMINANCE:
+      case CL_DEPTH:
+        channel_count = 1;
+        break;
+      case CL_RG:
+      case CL_RA:
+      case CL_RGx:
+        channel_count = 2;
+        break;
+      case CL_RGB:
+      case CL_RGBx:
+      case CL_sRGB:
+      case CL_sRGBx:
+        channel_count = 3;
+        break;
+      default:
+        break;
+    }
+    return channel_size * channel_count;
+  }
+
+  // Images created from a buffer share its memory and take no space
+  static uint64_t GetImageSize(const cl_image_format* format,
+                               const cl_image_desc* desc) {
+    if (desc == nullptr) {
+      return 0;
+    }
+    uint64_t size = GetPixelSize(format) * desc->image_width;
+    switch (desc->image_type) {
+      case CL_MEM_OBJECT_IMAGE1D_BUFFER:
+        return 0;
+      case CL_MEM_OBJECT_IMAGE1D_ARRAY:
+        return size * desc->image_array_size;
+      case CL_MEM_OBJECT_IMAGE2D:
+        return (desc->buffer != nullptr) ? 0 : size * desc->image_height;
+      case CL_MEM_OBJECT_IMAGE2D_ARRAY:
+        return size * desc->image_height * desc->image_array_size;
+      case CL_MEM_OBJECT_IMAGE3D:
+        return size * desc->image_height * desc->image_depth;
+      default:
+        return size;
+    }
+  }
+
+  void Retain(const void* handle) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    auto it = allocations_.find(reinterpret_cast<uint64_t>(handle));
+    if (it != allocations_.end()) {
+      ++it->second.reference_count;
+    }
+  }
+
+  // Should be called under the lock
+  void AddRecord(uint64_t handle, const Allocation& allocation,
+                 uint16_t flags, uint64_t time, uint32_t stack_id) {
+    if (allocation.kind != TRACE_MEMORY_USM_HOST) {
+      if (flags & TRACE_MEMORY_FLAG_RELEASE) {
+        current_usage_ -= allocation.size;
+      } else {
+        current_usage_ += allocation.size;
+        peak_usage_ = std::max(peak_usage_, current_usage_);
+      }
+    }
+
+    TraceMemoryRecord record{time,
+                             handle,
+                             allocation.size,
+                             utils::GetTid(),
+                             stack_id,
+                             static_cast<uint16_t>(allocation.kind),
+                             flags,
+                             0};
+    buffer_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    if (buffer_.size() >= MEMORY_FLUSH_SIZE) {
+      Flush();
+    }
+  }
+
+  // Should be called under the lock
+  void Flush() {
+    if (!buffer_.empty() && !closed_) {
+      writer_->WriteMemory(buffer_);
+      buffer_.clear();
+    }
+  }
+
+ private:  // Data
+  TraceWriter* writer_ = nullptr;
+  CallStackTable* stack_table_ = nullptr;
+  std::unordered_map<uint64_t, Allocation> allocations_;
+  uint64_t current_usage_ = 0;
+  uint64_t peak_usage_ = 0;
+  std::string buffer_;
+  bool closed_ = false;
+  std::mutex lock_;
+};
+
+#endif  // PHPROF_CL_MEMORY_TRACKER_H_
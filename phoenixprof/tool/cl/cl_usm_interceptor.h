@@ -0,0 +1,164 @@
+#ifndef PHPROF_CL_USM_INTERCEPTOR_H_
+#define PHPROF_CL_USM_INTERCEPTOR_H_
+
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include <CL/cl.h>
+
+#include "cl_memory_tracker.h"
+#include "trace_format.h"
+#include "utils.h"
+
+// Intel unified shared memory functions are extension functions, they are
+// not covered by the tracing callbacks. The application gets them with
+// clGetExtensionFunctionAddressForPlatform(), which the tool library
+// interposes to hand out wrappers that report allocations to the sink.
+// Signatures follow cl_ext.h (cl_mem_properties_intel is a cl_ulong)
+class ClUsmInterceptor {
+ public:
+  static ClUsmInterceptor* GetInstance() {
+    static ClUsmInterceptor* instance = new ClUsmInterceptor();
+    return instance;
+  }
+
+  ClUsmInterceptor(const ClUsmInterceptor& copy) = delete;
+  ClUsmInterceptor& operator=(const ClUsmInterceptor& copy) = delete;
+
+  // Functions are only wrapped while the sink is set. Wrappers stay in the
+  // application after the sink is reset, so the calls still reporting to
+  // the previous sink are waited for and it can be destroyed right after
+  void SetSink(ClMemoryTracker* tracker) {
+    sink_.store(tracker);
+    if (tracker == nullptr) {
+      while (active_count_.load() > 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Returns the wrapper of a USM function or the given address as is,
+  // functions of one platform only are wrapped
+  void* Intercept(const char* name, void* address) {
+    if (name == nullptr || address == nullptr || sink_.load() == nullptr) {
+      return address;
+    }
+    if (strcmp(name, "clHostMemAllocINTEL") == 0) {
+      return Wrap(host_mem_alloc_, address, HostMemAlloc);
+    }
+    if (strcmp(name, "clDeviceMemAllocINTEL") == 0) {
+      return Wrap(device_mem_alloc_, address, DeviceMemAlloc);
+    }
+    if (strcmp(name, "clSharedMemAllocINTEL") == 0) {
+      return Wrap(shared_mem_alloc_, address, SharedMemAlloc);
+    }
+    if (strcmp(name, "clMemFreeINTEL") == 0) {
+      return Wrap(mem_free_, address, MemFree);
+    }
+    if (strcmp(name, "clMemBlockingFreeINTEL") == 0) {
+      return Wrap(mem_blocking_free_, address, MemBlockingFree);
+    }
+    return address;
+  }
+
+ private:
+  typedef void*(CL_API_CALL* HostMemAllocFunction)(cl_context,
+                                                   const cl_ulong*, size_t,
+                                                   cl_uint, cl_int*);
+  typedef void*(CL_API_CALL* DeviceMemAllocFunction)(cl_context, cl_device_id,
+                                                     const cl_ulong*, size_t,
+                                                     cl_uint, cl_int*);
+  typedef cl_int(CL_API_CALL* MemFreeFunction)(cl_context, void*);
+
+  ClUsmInterceptor() {}
+
+  template <typename F>
+  static void* Wrap(std::atomic<F>& original, void* address, F wrapper) {
+    F expected = nullptr;
+    F function = reinterpret_cast<F>(address);
+    if (!original.compare_exchange_strong(expected, function) &&
+        expected != function) {
+      return address;  // Another platform
+    }
+    return reinterpret_cast<void*>(wrapper);
+  }
+
+  // Counted before the sink is loaded, pairs with the wait in SetSink()
+  static void Allocate(TraceMemoryKind kind, const void* pointer,
+                       size_t size) {
+    ClUsmInterceptor* instance = GetInstance();
+    instance->active_count_.fetch_add(1);
+    ClMemoryTracker* sink = instance->sink_.load();
+    if (sink != nullptr) {
+      sink->AddAllocation(kind, pointer, size);
+    }
+    instance->active_count_.fetch_sub(1, std::memory_order_release);
+  }
+
+  static void Free(const void* pointer) {
+    ClUsmInterceptor* instance = GetInstance();
+    instance->active_count_.fetch_add(1);
+    ClMemoryTracker* sink = instance->sink_.load();
+    if (sink != nullptr) {
+      sink->Release(pointer, true);
+    }
+    instance->active_count_.fetch_sub(1, std::memory_order_release);
+  }
+
+  static void* CL_API_CALL HostMemAlloc(cl_context context,
+                                        const cl_ulong* properties,
+                                        size_t size, cl_uint alignment,
+                                        cl_int* errcode_ret) {
+    void* pointer = GetInstance()->host_mem_alloc_.load()(
+        context, properties, size, alignment, errcode_ret);
+    Allocate(TRACE_MEMORY_USM_HOST, pointer, size);
+    return pointer;
+  }
+
+  static void* CL_API_CALL DeviceMemAlloc(cl_context context,
+                                          cl_device_id device,
+                                          const cl_ulong* properties,
+                                          size_t size, cl_uint alignment,
+                                          cl_int* errcode_ret) {
+    void* pointer = GetInstance()->device_mem_alloc_.load()(
+        context, device, properties, size, alignment, errcode_ret);
+    Allocate(TRACE_MEMORY_USM_DEVICE, pointer, size);
+    return pointer;
+  }
+
+  static void* CL_API_CALL SharedMemAlloc(cl_context context,
+                                          cl_device_id device,
+                                          const cl_ulong* properties,
+                                          size_t size, cl_uint alignment,
+                                          cl_int* errcode_ret) {
+    void* pointer = GetInstance()->shared_mem_alloc_.load()(
+        context, device, properties, size, alignment, errcode_ret);
+    Allocate(TRACE_MEMORY_USM_SHARED, pointer, size);
+    return pointer;
+  }
+
+  static cl_int CL_API_CALL MemFree(cl_context context, void* pointer) {
+    // Released first, the address may be handed out again right after
+    Free(pointer);
+    return GetInstance()->mem_free_.load()(context, pointer);
+  }
+
+  static cl_int CL_API_CALL MemBlockingFree(cl_context context,
+                                            void* pointer) {
+    // Released first, the address may be handed out again right after
+    Free(pointer);
+    return GetInstance()->mem_blocking_free_.load()(context, pointer);
+  }
+
+  std::atomic<ClMemoryTracker*> sink_{nullptr};
+  std::atomic<uint32_t> active_count_{0};  // Wrapper calls using the sink
+  std::atomic<HostMemAllocFunction> host_mem_alloc_{nullptr};
+  std::atomic<DeviceMemAllocFunction> device_mem_alloc_{nullptr};
+  std::atomic<DeviceMemAllocFunction> shared_mem_alloc_{nullptr};
+  std::atomic<MemFreeFunction> mem_free_{nullptr};
+  std::atomic<MemFreeFunction> mem_blocking_free_{nullptr};
+};
+
+#endif  // PHPROF_CL_USM_INTERCEPTOR_H_
@@ -1,43 +1,362 @@
+#include <algorithm>
+#include <charconv>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "cl_api_collector.h"
+#include "trace_reader.h"
+
+// Lane of the device commands, thread ids of the host are never zero
+#define DEVICE_LANE_TID 0
+
+// Events formatted by an export thread at a time
+#define CHROME_EXPORT_SLICE_SIZE 16384
+// Slices formatted ahead of the output per export thread
+#define CHROME_EXPORT_WINDOW_PER_THREAD 4
 
 class ChromeTracingGenerator {
  public:
-  static void ExportToFile(const std::vector<ClFunctionCall>& calls,
-                           const std::string& filename) {
+  // Metadata values are written as is, so they should be valid JSON values.
+  // Samples are shown as instant events on the thread they were taken on,
+  // call sites of calls with a known stack are linked as stack frames.
+  // Counters are shown as counter tracks of the process, one per name.
+  // Device commands get a lane of their own under the process.
+  // Events are formatted in slices on the given number of threads (0 for
+  // all cores) and written in order, so the file does not depend on it
+  static void ExportToFile(
+      const std::vector<ClFunctionCall>& calls, const std::string& filename,
+      const std::map<std::string, std::string>& metadata = {},
+      const std::vector<const TraceSample*>& samples = {},
+      const TraceStackMap& stacks = {}, const TraceSymbolMap& symbols = {},
+      const std::vector<TraceCounter>& counters = {},
+      const std::vector<ClDeviceCommand>& commands = {},
+      unsigned thread_count = 0) {
     std::ofstream output_file(filename);
     if (!output_file.is_open()) {
       std::cerr << "Error: Could not open file: " << filename << std::endl;
       return;
     }
 
-    output_file << "{\"traceEvents\":[";
-    bool first_entry = true;
+    // Every trace file is a separate track (host or device), tracks of
+    // several files line up when they are loaded together
+    std::string track_id = "1";
+    auto track = metadata.find("track_id");
+    if (track != metadata.end()) {
+      track_id = track->second;
+    }
 
-    for (const auto& call : calls) {
-      if (!first_entry) {
-        output_file << ",";
+    std::string header;
+    auto track_name = metadata.find("track_name");
+    if (track_name != metadata.end()) {
+      header = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" +
+               track_id + ",\"args\":{\"name\":" + track_name->second + "}}";
+    }
+
+    std::map<uint32_t, uint32_t> stack_frames;  // Stack id to innermost frame
+    std::vector<StackFrame> frames;
+    BuildStackFrames(calls, stacks, stack_frames, frames);
+
+    // Events of all kinds are numbered in the order they are written, every
+    // event is formatted with a leading comma
+    uint64_t sample_base = calls.size();
+    uint64_t counter_base = sample_base + samples.size();
+    uint64_t command_base = counter_base + counters.size();
+    uint64_t event_count =
+        command_base + (commands.empty() ? 0 : commands.size() + 1);
+    auto format = [&](uint64_t index, std::string& out) {
+      if (index < sample_base) {
+        FormatCall(calls[index], track_id, stack_frames, out);
+      } else if (index < counter_base) {
+        FormatSample(*samples[index - sample_base], track_id, symbols, out);
+      } else if (index < command_base) {
+        FormatCounter(counters[index - counter_base], track_id, out);
+      } else if (index == command_base) {
+        out += ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":";
+        out += track_id;
+        out += ",\"tid\":";
+        AppendNumber(DEVICE_LANE_TID, out);
+        out += ",\"args\":{\"name\":\"Device\"}}";
+      } else {
+        FormatCommand(commands[index - command_base - 1], track_id, out);
       }
-      first_entry = false;
+    };
 
-      uint64_t duration = call.end_time - call.start_time;
+    output_file << "{\"traceEvents\":[" << header;
+    WriteEvents(output_file, event_count, format, header.empty(),
+                thread_count);
 
-      output_file << "{"
-                  << "\"name\":\"" << call.function_name << "\","
-                  << "\"ph\":\"X\","
-                  << "\"ts\":" << call.start_time << ","
-                  << "\"dur\":" << duration << ","
-                  << "\"pid\":1,"
-                  << "\"tid\":1"
-                  << "}";
+    output_file << "]";
+    if (!frames.empty()) {
+      output_file << ",\"stackFrames\":{";
+      for (size_t i = 0; i < frames.size(); ++i) {
+        if (i > 0) {
+          output_file << ",";
+        }
+        output_file << "\"" << i + 1 << "\":{\"category\":\"call site\","
+                    << "\"name\":"
+                    << utils::GetJsonString(
+                           FormatAddress(frames[i].address, symbols));
+        if (frames[i].parent != 0) {
+          output_file << ",\"parent\":\"" << frames[i].parent << "\"";
+        }
+        output_file << "}";
+      }
+      output_file << "}";
     }
-
-    output_file << "]}" << std::endl;
+    if (!metadata.empty()) {
+      output_file << ",\"otherData\":{";
+      bool first_item = true;
+      for (const auto& item : metadata) {
+        if (!first_item) {
+          output_file << ",";
+        }
+        first_item = false;
+        output_file << "\"" << item.first << "\":" << item.second;
+      }
+      output_file << "}";
+    }
+    output_file << "}" << std::endl;
     output_file.close();
     std::cout << "Trace saved to: " << filename << std::endl;
   }
+
+ private:
+  static uint64_t GetDistance(uint64_t from, uint64_t to) {
+    return (to > from) ? to - from : 0;
+  }
+
+  static void AppendNumber(uint64_t value, std::string& out) {
+    char buffer[24];
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+    out.append(buffer, end - buffer);
+  }
+
+  static void FormatCall(const ClFunctionCall& call,
+                         const std::string& track_id,
+                         const std::map<uint32_t, uint32_t>& stack_frames,
+                         std::string& out) {
+    // Collapsed run spans its calls and the time between them
+    out += ",{\"name\":\"";
+    if (call.count > 1) {
+      AppendNumber(call.count, out);
+      out += "x ";
+    }
+    utils::AppendJsonEscaped(call.function_name, out);
+    if (IsKernel(call)) {
+      out += "\",\"cat\":\"kernel\"";
+    } else if (IsAnnotation(call)) {
+      out += "\",\"cat\":\"itt\"";
+    } else {
+      out += "\",\"cat\":\"cl\"";
+    }
+    out += ",\"ph\":\"X\",\"ts\":";
+    AppendNumber(call.start_time, out);
+    out += ",\"dur\":";
+    AppendNumber(call.end_time - call.start_time, out);
+    out += ",\"pid\":";
+    out += track_id;
+    out += ",\"tid\":";
+    AppendNumber(call.thread_id, out);
+    auto frame = stack_frames.find(call.stack_id);
+    if (frame != stack_frames.end()) {
+      out += ",\"sf\":";
+      AppendNumber(frame->second, out);
+    }
+    // Blocking transfers are marked, so imported traces are analyzed
+    // like the original ones
+    if (call.count > 1 || call.blocking) {
+      out += ",\"args\":{";
+      if (call.count > 1) {
+        out += "\"count\":";
+        AppendNumber(call.count, out);
+        out += ",\"busy_time_ns\":";
+        AppendNumber(call.busy_time, out);
+        out += call.blocking ? "," : "";
+      }
+      if (call.blocking) {
+        out += "\"blocking\":true";
+      }
+      out += "}";
+    }
+    out += "}";
+  }
+
+  static void FormatSample(const TraceSample& sample,
+                           const std::string& track_id,
+                           const TraceSymbolMap& symbols, std::string& out) {
+    out += ",{\"name\":\"CPU Sample\",\"cat\":\"sample\",\"ph\":\"i\","
+           "\"s\":\"t\",\"ts\":";
+    AppendNumber(sample.time, out);
+    out += ",\"pid\":";
+    out += track_id;
+    out += ",\"tid\":";
+    AppendNumber(sample.thread_id, out);
+    out += ",\"args\":{\"address\":\"";
+    utils::AppendJsonEscaped(
+        FormatAddress(sample.stack.empty() ? 0 : sample.stack.front(),
+                      symbols),
+        out);
+    out += "\"}}";
+  }
+
+  static void FormatCounter(const TraceCounter& counter,
+                            const std::string& track_id, std::string& out) {
+    out += ",{\"name\":\"";
+    utils::AppendJsonEscaped(counter.name, out);
+    out += "\",\"ph\":\"C\",\"ts\":";
+    AppendNumber(counter.time, out);
+    out += ",\"pid\":";
+    out += track_id;
+    out += ",\"args\":{\"value\":";
+    AppendNumber(counter.value, out);
+    out += "}}";
+  }
+
+  static void FormatCommand(const ClDeviceCommand& command,
+                            const std::string& track_id, std::string& out) {
+    out += ",{\"name\":\"";
+    utils::AppendJsonEscaped(command.function_name, out);
+    out += "\",\"cat\":\"device\",\"ph\":\"X\",\"ts\":";
+    AppendNumber(command.start, out);
+    out += ",\"dur\":";
+    AppendNumber(command.end - command.start, out);
+    out += ",\"pid\":";
+    out += track_id;
+    out += ",\"tid\":";
+    AppendNumber(DEVICE_LANE_TID, out);
+    out += ",\"args\":{\"thread_id\":";
+    AppendNumber(command.thread_id, out);
+    out += ",\"queued_to_submit_ns\":";
+    AppendNumber(GetDistance(command.queued, command.submit), out);
+    out += ",\"submit_to_start_ns\":";
+    AppendNumber(GetDistance(command.submit, command.start), out);
+    out += "}}";
+  }
+
+  // Slices are taken by the threads in turn and written by the calling
+  // thread as soon as all slices before them are written. A thread does not
+  // run more than a window of slices ahead of the output, which bounds the
+  // memory taken by the formatted text
+  static void WriteEvents(
+      std::ostream& out, uint64_t event_count,
+      const std::function<void(uint64_t, std::string&)>& format,
+      bool first_entry, unsigned thread_count) {
+    if (thread_count == 0) {
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    uint64_t slice_count =
+        (event_count + CHROME_EXPORT_SLICE_SIZE - 1) / CHROME_EXPORT_SLICE_SIZE;
+    thread_count = static_cast<unsigned>(
+        std::min<uint64_t>(thread_count, slice_count));
+
+    auto format_slice = [&](uint64_t slice, std::string& text) {
+      text.clear();
+      uint64_t end =
+          std::min(event_count, (slice + 1) * CHROME_EXPORT_SLICE_SIZE);
+      for (uint64_t i = slice * CHROME_EXPORT_SLICE_SIZE; i < end; ++i) {
+        format(i, text);
+      }
+    };
+    auto write_slice = [&](uint64_t slice, const std::string& text) {
+      // Comma of the very first event is dropped
+      size_t skip = (slice == 0 && first_entry && !text.empty()) ? 1 : 0;
+      out.write(text.data() + skip, text.size() - skip);
+    };
+
+    if (thread_count <= 1) {
+      std::string text;
+      for (uint64_t slice = 0; slice < slice_count; ++slice) {
+        format_slice(slice, text);
+        write_slice(slice, text);
+      }
+      return;
+    }
+
+    uint64_t window = CHROME_EXPORT_WINDOW_PER_THREAD * thread_count;
+    std::vector<std::string> texts(window);
+    std::vector<bool> ready(window, false);
+    uint64_t next_slice = 0, written = 0;
+    std::mutex lock;
+    std::condition_variable formatted, consumed;
+
+    auto worker = [&]() {
+      std::string text;
+      std::unique_lock<std::mutex> guard(lock);
+      while (next_slice < slice_count) {
+        uint64_t slice = next_slice++;
+        consumed.wait(guard, [&]() { return slice < written + window; });
+        guard.unlock();
+        format_slice(slice, text);
+        guard.lock();
+        texts[slice % window].swap(text);
+        ready[slice % window] = true;
+        formatted.notify_all();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < thread_count; ++i) {
+      threads.push_back(std::thread(worker));
+    }
+    std::string text;
+    for (uint64_t slice = 0; slice < slice_count; ++slice) {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        formatted.wait(guard, [&]() { return ready[slice % window]; });
+        texts[slice % window].swap(text);
+        ready[slice % window] = false;
+      }
+      write_slice(slice, text);
+      {
+        const std::lock_guard<std::mutex> guard(lock);
+        ++written;
+      }
+      consumed.notify_all();
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  struct StackFrame {
+    uint64_t address;
+    uint32_t parent;  // Caller frame id, 0 for the outermost frame
+  };
+
+  // Stacks share their common outer frames, frame ids start from 1
+  static void BuildStackFrames(const std::vector<ClFunctionCall>& calls,
+                               const TraceStackMap& stacks,
+                               std::map<uint32_t, uint32_t>& stack_frames,
+                               std::vector<StackFrame>& frames) {
+    std::map<std::pair<uint32_t, uint64_t>, uint32_t> frame_ids;
+    for (const auto& call : calls) {
+      if (call.stack_id == 0 || stack_frames.count(call.stack_id) > 0) {
+        continue;
+      }
+      auto stack = stacks.find(call.stack_id);
+      if (stack == stacks.end() || stack->second.empty()) {
+        continue;
+      }
+
+      uint32_t parent = 0;
+      for (auto it = stack->second.rbegin(); it != stack->second.rend();
+           ++it) {
+        auto key = std::make_pair(parent, *it);
+        auto frame = frame_ids.find(key);
+        if (frame == frame_ids.end()) {
+          frames.push_back(StackFrame{*it, parent});
+          frame = frame_ids.emplace(key, frames.size()).first;
+        }
+        parent = frame->second;
+      }
+      stack_frames[call.stack_id] = parent;
+    }
+  }
 };
\ No newline at end of file
@@ -1,7 +1,143 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <CL/cl.h>
+
 #include "tool.h"
+#include "tool_control.h"
+
+extern char** environ;
+
+static std::once_flag attach_flag;
+static std::atomic<bool> attached(false);
+static thread_local bool attaching = false;
+static std::mutex control_lock;  // Attach and detach of a running process
+static std::string session_directory;  // Traces of the current attach
+
+// Tracing is attached on the first platform query instead of library load,
+// so processes that never use OpenCL do not enumerate devices at all
+extern "C" PHPROF_EXPORT cl_int CL_API_CALL
+clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms,
+                 cl_uint* num_platforms) {
+  static decltype(clGetPlatformIDs)* get_platform_ids =
+      reinterpret_cast<decltype(clGetPlatformIDs)*>(
+          dlsym(RTLD_NEXT, "clGetPlatformIDs"));
+  ASSERT(get_platform_ids != nullptr);
+
+  // Device enumeration inside StartProfiling calls back here
+  if (!attaching) {
+    std::call_once(attach_flag, []() {
+      attaching = true;
+      attached = StartProfiling();
+      attaching = false;
+    });
+  }
+
+  return get_platform_ids(num_entries, platforms, num_platforms);
+}
+
+// Options of the previous attach are dropped, so every attach runs with
+// the options given to it only
+static void SetOptions(const std::vector<std::string>& options) {
+  std::vector<std::string> names;
+  for (char** variable = environ; *variable != nullptr; ++variable) {
+    std::string entry(*variable);
+    if (entry.compare(0, 7, "PHPROF_") == 0) {
+      names.push_back(entry.substr(0, entry.find('=')));
+    }
+  }
+  for (const std::string& name : names) {
+    unsetenv(name.c_str());
+  }
+
+  for (const std::string& option : options) {
+    size_t pos = option.find('=');
+    if (pos != std::string::npos && option.compare(0, 7, "PHPROF_") == 0) {
+      utils::SetEnv(option.substr(0, pos).c_str(),
+                    option.substr(pos + 1).c_str());
+    }
+  }
+}
+
+// Traces of every attach go to a new directory in the working one of the
+// process (phoenixprof_<pid>_<index>), so traces of earlier attaches of
+// this or a previous process with the same id are never overwritten
+static std::string CreateSessionDirectory() {
+  std::string prefix = "phoenixprof_" + std::to_string(getpid()) + "_";
+  for (int index = 0;; ++index) {
+    std::string name = prefix + std::to_string(index);
+    if (mkdir(name.c_str(), 0755) == 0) {
+      char directory[MAX_STR_SIZE] = {0};
+      if (getcwd(directory, sizeof(directory)) == nullptr) {
+        return name;
+      }
+      return utils::JoinPath(directory, name);
+    }
+    if (errno != EEXIST) {
+      return std::string();
+    }
+  }
+}
+
+static bool HandleControlRequest(const ToolControlRequest& request,
+                                 std::vector<std::string>& messages) {
+  const std::lock_guard<std::mutex> lock(control_lock);
+  if (request.command == TOOL_CONTROL_START) {
+    if (attached) {
+      messages.push_back("tracing is already enabled");
+      return false;
+    }
+    SetOptions(request.options);
+    session_directory = CreateSessionDirectory();
+    if (session_directory.empty()) {
+      messages.push_back("unable to create trace directory: " +
+                         std::string(strerror(errno)));
+      return false;
+    }
+    utils::SetEnv("PHPROF_TraceDirectory", session_directory.c_str());
+    if (!StartProfiling()) {
+      rmdir(session_directory.c_str());
+      messages.push_back("unable to enable tracing, see the output of the "
+                         "process");
+      return false;
+    }
+    attached = true;
+  } else if (request.command == TOOL_CONTROL_STOP) {
+    if (!attached) {
+      messages.push_back("tracing is not enabled");
+      return false;
+    }
+    StopProfiling();
+    attached = false;
+  } else {
+    messages.push_back("unknown command " + request.command);
+    return false;
+  }
+
+  messages.push_back(session_directory);
+  return true;
+}
 
-// Calls automatically when the tool library is was loaded
-void __attribute__((constructor)) Load() { StartProfiling(); }
+// Called in a running process once the loader has injected the library
+// into it, tracing is started and stopped through the control channel then
+extern "C" PHPROF_EXPORT void StartControl() {
+  ToolControl::Listen(HandleControlRequest);
+}
 
 // Calls automatically before the tool library is being unloaded
-void __attribute__((destructor)) Unload() { StopProfiling(); }
+void __attribute__((destructor)) Unload() {
+  const std::lock_guard<std::mutex> lock(control_lock);
+  if (attached) {
+    StopProfiling();
+    attached = false;
+  }
+  ToolControl::Remove();
+}
@@ -0,0 +1,32 @@
+#include "itt_collector.h"
+
+// ITT collector entry points: the ITT static part linked into the
+// application loads the library named by INTEL_LIBITTNOTIFY64 and looks
+// these functions up by name
+
+ITT_EXTERN_C PHPROF_EXPORT __itt_domain* ITTAPI
+__itt_domain_create(const char* name) {
+  if (name == nullptr) {
+    return nullptr;
+  }
+  return IttCollector::GetInstance()->CreateDomain(name);
+}
+
+ITT_EXTERN_C PHPROF_EXPORT __itt_string_handle* ITTAPI
+__itt_string_handle_create(const char* name) {
+  if (name == nullptr) {
+    return nullptr;
+  }
+  return IttCollector::GetInstance()->CreateStringHandle(name);
+}
+
+ITT_EXTERN_C PHPROF_EXPORT void ITTAPI
+__itt_task_begin(const __itt_domain* /* domain */, __itt_id /* taskid */,
+                 __itt_id /* parentid */, __itt_string_handle* name) {
+  IttCollector::GetInstance()->BeginTask(name);
+}
+
+ITT_EXTERN_C PHPROF_EXPORT void ITTAPI
+__itt_task_end(const __itt_domain* /* domain */) {
+  IttCollector::GetInstance()->EndTask();
+}
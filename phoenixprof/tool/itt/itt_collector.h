@@ -0,0 +1,147 @@
+#ifndef PHPROF_ITT_COLLECTOR_H_
+#define PHPROF_ITT_COLLECTOR_H_
+
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define INTEL_NO_MACRO_BODY
+#define INTEL_ITTNOTIFY_API_PRIVATE
+#include <ITT/ittnotify.h>
+
+#include "cl_api_collector.h"
+#include "trace_format.h"
+#include "utils.h"
+
+// Backs the ITT collector entry points exported by the tool library: keeps
+// domains and string handles alive for the process lifetime, tracks open
+// tasks per thread and records completed ones as annotations into the sink
+// collector, so they nest with the OpenCL calls of the same thread
+class IttCollector {
+ public:
+  static IttCollector* GetInstance() {
+    static IttCollector* instance = new IttCollector();
+    return instance;
+  }
+
+  IttCollector(const IttCollector& copy) = delete;
+  IttCollector& operator=(const IttCollector& copy) = delete;
+
+  // Tasks are only recorded while the sink is set. Once the sink is reset,
+  // the tasks still being recorded into the previous one are waited for,
+  // so it can be destroyed right after
+  void SetSink(ClApiCollector* collector) {
+    sink_.store(collector);
+    if (collector == nullptr) {
+      while (active_count_.load() > 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Null names are not valid, nullptr is returned as the ITT API does
+  __itt_domain* CreateDomain(const char* name) {
+    if (name == nullptr) {
+      return nullptr;
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    for (__itt_domain& domain : domains_) {
+      if (std::string(domain.nameA) == name) {
+        return &domain;
+      }
+    }
+
+    names_.push_back(name);
+    domains_.push_back(__itt_domain{});
+    __itt_domain& domain = domains_.back();
+    domain.flags = 1;  // Enabled, checked by the ITT static part before calls
+    domain.nameA = names_.back().c_str();
+    return &domain;
+  }
+
+  __itt_string_handle* CreateStringHandle(const char* name) {
+    if (name == nullptr) {
+      return nullptr;
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    for (__itt_string_handle& handle : handles_) {
+      if (std::string(handle.strA) == name) {
+        return &handle;
+      }
+    }
+
+    uint32_t name_id = TRACE_ANNOTATION_ID_BASE + handles_.size();
+    if (name_id >= TRACE_KERNEL_ID_BASE) {
+      if (!overflow_reported_) {
+        std::cerr << "[WARNING] Too many ITT task names, "
+                  << "tasks with new names are not recorded" << std::endl;
+        overflow_reported_ = true;
+      }
+      name_id = 0;
+    }
+
+    names_.push_back(name);
+    handles_.push_back(__itt_string_handle{});
+    __itt_string_handle& handle = handles_.back();
+    handle.strA = names_.back().c_str();
+    handle.extra1 = static_cast<int>(name_id);
+    return &handle;
+  }
+
+  void BeginTask(const __itt_string_handle* name) {
+    uint64_t start_time = ClApiCollector::GetTimestamp();
+    GetTaskStack().push_back(Task{name, start_time});
+  }
+
+  void EndTask() {
+    uint64_t end_time = ClApiCollector::GetTimestamp();
+    std::vector<Task>& stack = GetTaskStack();
+    if (stack.empty()) {
+      return;  // Task began before the tool was loaded
+    }
+    Task task = stack.back();
+    stack.pop_back();
+
+    if (task.name == nullptr || task.name->extra1 == 0) {
+      return;
+    }
+    // Counted before the sink is loaded, pairs with the wait in SetSink()
+    active_count_.fetch_add(1);
+    ClApiCollector* sink = sink_.load();
+    if (sink != nullptr) {
+      sink->AddAnnotation(static_cast<uint32_t>(task.name->extra1),
+                          task.name->strA, utils::GetTid(), task.start_time,
+                          end_time);
+    }
+    active_count_.fetch_sub(1, std::memory_order_release);
+  }
+
+ private:
+  struct Task {
+    const __itt_string_handle* name;
+    uint64_t start_time;
+  };
+
+  IttCollector() {}
+
+  static std::vector<Task>& GetTaskStack() {
+    static thread_local std::vector<Task> stack;
+    return stack;
+  }
+
+  std::atomic<ClApiCollector*> sink_{nullptr};
+  std::atomic<uint32_t> active_count_{0};  // Threads using the sink
+
+  // Lists keep element addresses stable, ITT hands them out as handles
+  std::list<std::string> names_;
+  std::list<__itt_domain> domains_;
+  std::list<__itt_string_handle> handles_;
+  bool overflow_reported_ = false;
+  std::mutex lock_;
+};
+
+#endif  // PHPROF_ITT_COLLECTOR_H_
@@ -0,0 +1,294 @@
+#ifndef PHPROF_PERF_SAMPLER_H_
+#define PHPROF_PERF_SAMPLER_H_
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "module_snapshot.h"
+#include "trace_format.h"
+#include "trace_writer.h"
+#include "utils.h"
+
+#define PERF_SAMPLING_PERIOD_NS 100000  // 10 kHz of thread CPU time
+#define PERF_RING_PAGE_COUNT 64         // Data pages per thread, power of two
+#define PERF_SAMPLE_STACK_DEPTH 64
+#define PERF_DRAIN_INTERVAL_MS 10
+
+// Samples host CPU of traced threads with the software CPU clock event, so
+// no hardware PMU access is needed. The kernel walks user frame pointers
+// into a ring buffer per thread, a background thread drains the rings into
+// the samples trace. Sample times use CLOCK_MONOTONIC like the collectors,
+// so samples are attributed to the enclosing API calls at conversion time.
+// Module snapshots at start and stop allow to symbolize the stacks offline
+class PerfSampler {
+ public:
+  // Takes ownership of the writer
+  static PerfSampler* Create(TraceWriter* writer) {
+    ASSERT(writer != nullptr);
+    writer->WriteMetadata(
+        {{"sampling_period_ns", std::to_string(PERF_SAMPLING_PERIOD_NS)},
+         {"sampling_event", "\"task-clock\""}});
+    writer->WriteModules(ModuleSnapshot::Capture());
+    PerfSampler* sampler = new PerfSampler(writer);
+    ASSERT(sampler != nullptr);
+    return sampler;
+  }
+
+  ~PerfSampler() {
+    Stop();
+    delete writer_;
+  }
+
+  PerfSampler(const PerfSampler& copy) = delete;
+  PerfSampler& operator=(const PerfSampler& copy) = delete;
+
+  // Starts sampling of the calling thread, expected to be called once
+  // per thread
+  void AttachCurrentThread() {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = PERF_SAMPLING_PERIOD_NS;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                       PERF_SAMPLE_CALLCHAIN;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.sample_max_stack = PERF_SAMPLE_STACK_DEPTH;
+    attr.use_clockid = 1;
+    attr.clockid = CLOCK_MONOTONIC;
+    attr.disabled = 1;
+
+    int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                      PERF_FLAG_FD_CLOEXEC));
+    if (fd < 0) {
+      ReportFailure("Unable to open perf event");
+      return;
+    }
+
+    size_t size = (PERF_RING_PAGE_COUNT + 1) * page_size_;
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      ReportFailure("Unable to map perf ring buffer");
+      close(fd);
+      return;
+    }
+
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      if (stopped_) {
+        munmap(data, size);
+        close(fd);
+        return;
+      }
+      rings_.push_back(Ring{fd, reinterpret_cast<perf_event_mmap_page*>(data),
+                            size, static_cast<pid_t>(utils::GetTid())});
+    }
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  // Disables all events, drains what is left and closes the trace
+  void Stop() {
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      if (stopped_) {
+        return;
+      }
+      stopped_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+
+    for (Ring& ring : rings_) {
+      ioctl(ring.fd, PERF_EVENT_IOC_DISABLE, 0);
+      Drain(ring);
+      Release(ring);
+    }
+    rings_.clear();
+    Flush();
+    writer_->WriteModules(ModuleSnapshot::Capture());
+    writer_->Close();
+
+    if (lost_count_ > 0) {
+      std::cerr << "[WARNING] " << lost_count_ << " CPU samples were lost, "
+                << "ring buffers overflowed" << std::endl;
+    }
+  }
+
+  uint64_t GetSampleCount() const { return sample_count_; }
+
+ private:
+  struct Ring {
+    int fd;
+    perf_event_mmap_page* header;
+    size_t size;
+    pid_t tid;
+  };
+
+  PerfSampler(TraceWriter* writer)
+      : writer_(writer), page_size_(sysconf(_SC_PAGESIZE)) {
+    thread_ = std::thread(&PerfSampler::Run, this);
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stopped_) {
+      wakeup_.wait_for(lock,
+                       std::chrono::milliseconds(PERF_DRAIN_INTERVAL_MS));
+      DrainAll();
+      Flush();
+    }
+  }
+
+  // Rings of threads that have exited are released once drained, so
+  // applications starting a thread per request do not run out of files.
+  // The thread is checked before the drain, so no samples are left behind
+  void DrainAll() {
+    pid_t pid = getpid();
+    size_t count = 0;
+    for (Ring& ring : rings_) {
+      bool exited =
+          syscall(SYS_tgkill, pid, ring.tid, 0) != 0 && errno == ESRCH;
+      Drain(ring);
+      if (exited) {
+        Release(ring);
+      } else {
+        rings_[count++] = ring;
+      }
+    }
+    rings_.resize(count);
+  }
+
+  static void Release(Ring& ring) {
+    munmap(ring.header, ring.size);
+    close(ring.fd);
+  }
+
+  // Copies complete records out of the ring, records may wrap around
+  // the end of the data area
+  void Drain(Ring& ring) {
+    perf_event_mmap_page* header = ring.header;
+    const char* data = reinterpret_cast<const char*>(header) + page_size_;
+    uint64_t data_size = PERF_RING_PAGE_COUNT * page_size_;
+
+    uint64_t head = __atomic_load_n(&header->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = header->data_tail;
+    std::vector<char> record;
+    while (tail < head) {
+      perf_event_header event{};
+      Copy(data, data_size, tail, &event, sizeof(event));
+      if (event.size < sizeof(event) || tail + event.size > head) {
+        break;
+      }
+      record.resize(event.size);
+      Copy(data, data_size, tail, record.data(), event.size);
+      tail += event.size;
+
+      if (event.type == PERF_RECORD_SAMPLE) {
+        AddSample(record);
+      } else if (event.type == PERF_RECORD_LOST) {
+        uint64_t lost = 0;
+        memcpy(&lost, record.data() + sizeof(event) + sizeof(uint64_t),
+               sizeof(lost));
+        lost_count_ += lost;
+      }
+    }
+    __atomic_store_n(&header->data_tail, tail, __ATOMIC_RELEASE);
+  }
+
+  static void Copy(const char* data, uint64_t data_size, uint64_t position,
+                   void* target, size_t size) {
+    uint64_t offset = position & (data_size - 1);
+    size_t first = std::min<uint64_t>(size, data_size - offset);
+    memcpy(target, data + offset, first);
+    memcpy(reinterpret_cast<char*>(target) + first, data, size - first);
+  }
+
+  // Layout follows sample_type: ip, pid/tid, time, callchain
+  void AddSample(const std::vector<char>& record) {
+    struct SampleHead {
+      perf_event_header header;
+      uint64_t ip;
+      uint32_t pid;
+      uint32_t tid;
+      uint64_t time;
+      uint64_t nr;
+    };
+    if (record.size() < sizeof(SampleHead)) {
+      return;
+    }
+    SampleHead head{};
+    memcpy(&head, record.data(), sizeof(head));
+
+    uint64_t available =
+        (record.size() - sizeof(SampleHead)) / sizeof(uint64_t);
+    const char* ips = record.data() + sizeof(SampleHead);
+
+    std::vector<uint64_t> stack;
+    for (uint64_t i = 0; i < std::min(head.nr, available); ++i) {
+      uint64_t ip = 0;
+      memcpy(&ip, ips + i * sizeof(uint64_t), sizeof(ip));
+      if (ip >= PERF_CONTEXT_MAX) {
+        continue;  // Context marker, not an address
+      }
+      stack.push_back(ip);
+    }
+    if (stack.empty()) {
+      stack.push_back(head.ip);
+    }
+
+    TraceSampleRecord sample{head.time, head.tid,
+                             static_cast<uint32_t>(stack.size())};
+    buffer_.append(reinterpret_cast<const char*>(&sample), sizeof(sample));
+    buffer_.append(reinterpret_cast<const char*>(stack.data()),
+                   stack.size() * sizeof(uint64_t));
+    ++sample_count_;
+  }
+
+  void Flush() {
+    if (!buffer_.empty()) {
+      writer_->WriteSamples(buffer_);
+      buffer_.clear();
+    }
+  }
+
+  void ReportFailure(const char* message) {
+    if (!failure_reported_.exchange(true)) {
+      std::cerr << "[WARNING] " << message << " (" << strerror(errno)
+                << "), CPU sampling is not available" << std::endl;
+    }
+  }
+
+  TraceWriter* writer_ = nullptr;
+  uint64_t page_size_ = 0;
+  std::vector<Ring> rings_;
+  std::string buffer_;
+  std::atomic<uint64_t> sample_count_{0};
+  uint64_t lost_count_ = 0;
+  std::atomic<bool> failure_reported_{false};
+
+  bool stopped_ = false;
+  std::thread thread_;
+  std::mutex lock_;
+  std::condition_variable wakeup_;
+};
+
+#endif  // PHPROF_PERF_SAMPLER_H_
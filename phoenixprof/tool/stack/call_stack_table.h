@@ -0,0 +1,257 @@
+#ifndef PHPROF_CALL_STACK_TABLE_H_
+#define PHPROF_CALL_STACK_TABLE_H_
+
+#include <link.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "module_snapshot.h"
+#include "trace_format.h"
+#include "trace_writer.h"
+#include "utils.h"
+
+#define CALL_STACK_MAX_DEPTH 32
+#define CALL_STACK_FLUSH_SIZE 4096  // Bytes of new stacks buffered per write
+
+// Captures application call stacks with a frame pointer walk and gives each
+// distinct stack a 32-bit id. Lookups go to a per-thread table without any
+// locking, only stacks never seen by the thread take the global lock, so the
+// cost per call is the walk and one hash lookup. Stack definitions are
+// written into their own trace, ids are referenced by call records, along
+// with module snapshots taken at start and at exit to symbolize them.
+// The walk follows saved frame pointers: frames of code built without them
+// are skipped (the caller frame pointer stays in place), the walk stops as
+// soon as a frame leaves the thread stack or does not grow towards its base
+class CallStackTable {
+ public:
+  // Takes ownership of the writer
+  static CallStackTable* Create(TraceWriter* writer) {
+    ASSERT(writer != nullptr);
+    writer->WriteMetadata(
+        {{"stack_max_depth", std::to_string(CALL_STACK_MAX_DEPTH)}});
+    writer->WriteModules(ModuleSnapshot::Capture());
+    CallStackTable* table = new CallStackTable(writer);
+    ASSERT(table != nullptr);
+    return table;
+  }
+
+  ~CallStackTable() {
+    Finalize();
+    delete writer_;
+  }
+
+  CallStackTable(const CallStackTable& copy) = delete;
+  CallStackTable& operator=(const CallStackTable& copy) = delete;
+
+  // Returns the id of the calling thread stack above the tool frames,
+  // 0 if nothing could be captured
+  uint32_t Capture() {
+    uint64_t stack[CALL_STACK_MAX_DEPTH];
+    uint32_t depth = Walk(stack, CALL_STACK_MAX_DEPTH);
+    if (depth == 0) {
+      return 0;
+    }
+
+    uint64_t hash = Hash(stack, depth);
+    ThreadTable& table = GetThreadTable();
+    if (table.generation != generation_) {
+      table.ids.clear();
+      table.generation = generation_;
+    }
+    auto it = table.ids.find(hash);
+    if (it != table.ids.end()) {
+      return it->second;
+    }
+
+    uint32_t id = AddStack(hash, stack, depth);
+    table.ids.emplace(hash, id);
+    return id;
+  }
+
+  // Writes stacks that are still buffered, modules loaded since the start
+  // and closes the trace
+  void Finalize() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    if (writer_ == nullptr || closed_) {
+      return;
+    }
+    Flush();
+    writer_->WriteModules(ModuleSnapshot::Capture());
+    writer_->Close();
+    closed_ = true;
+  }
+
+  uint32_t GetStackCount() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    return static_cast<uint32_t>(ids_.size());
+  }
+
+ private:
+  // Ids cached by a thread belong to the table of the given generation: a
+  // table created on a later attach may get the address of a deleted one
+  struct ThreadTable {
+    uint64_t generation = 0;
+    std::unordered_map<uint64_t, uint32_t> ids;
+  };
+
+  struct AddressRange {
+    uintptr_t begin = 0;
+    uintptr_t end = 0;
+  };
+
+  CallStackTable(TraceWriter* writer)
+      : writer_(writer),
+        generation_(GetNextGeneration()),
+        tool_range_(GetToolRange()) {}
+
+  static uint64_t GetNextGeneration() {
+    static std::atomic<uint64_t> generation(0);
+    return ++generation;
+  }
+
+  static ThreadTable& GetThreadTable() {
+    static thread_local ThreadTable table;
+    return table;
+  }
+
+  // Leading frames inside the tool library are left out, so stacks start
+  // at the runtime or application code that issued the call
+  __attribute__((noinline)) uint32_t Walk(uint64_t* stack,
+                                          uint32_t max_depth) const {
+    const AddressRange& bounds = GetThreadStackRange();
+    const uintptr_t* frame =
+        reinterpret_cast<const uintptr_t*>(__builtin_frame_address(0));
+
+    uint32_t depth = 0;
+    bool inside_tool = true;
+    while (depth < max_depth) {
+      uintptr_t address = reinterpret_cast<uintptr_t>(frame);
+      if (address < bounds.begin ||
+          address + 2 * sizeof(uintptr_t) > bounds.end ||
+          address % sizeof(uintptr_t) != 0) {
+        break;
+      }
+
+      uintptr_t next = frame[0];
+      uintptr_t return_address = frame[1];
+      if (return_address == 0) {
+        break;
+      }
+      if (inside_tool && (return_address < tool_range_.begin ||
+                          return_address >= tool_range_.end)) {
+        inside_tool = false;
+      }
+      if (!inside_tool) {
+        stack[depth++] = return_address;
+      }
+
+      if (next <= address) {
+        break;
+      }
+      frame = reinterpret_cast<const uintptr_t*>(next);
+    }
+    return depth;
+  }
+
+  // Bounds are queried once per thread
+  static const AddressRange& GetThreadStackRange() {
+    static thread_local AddressRange range;
+    static thread_local bool known = false;
+    if (!known) {
+      known = true;
+      pthread_attr_t attr;
+      if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void* address = nullptr;
+        size_t size = 0;
+        if (pthread_attr_getstack(&attr, &address, &size) == 0) {
+          range.begin = reinterpret_cast<uintptr_t>(address);
+          range.end = range.begin + size;
+        }
+        pthread_attr_destroy(&attr);
+      }
+    }
+    return range;
+  }
+
+  // Loaded segments of the object this code belongs to
+  static AddressRange GetToolRange() {
+    AddressRange range{UINTPTR_MAX, 0};
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, size_t, void* data) -> int {
+          AddressRange* range = reinterpret_cast<AddressRange*>(data);
+          uintptr_t self = reinterpret_cast<uintptr_t>(&GetToolRange);
+          AddressRange object{UINTPTR_MAX, 0};
+          for (int i = 0; i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr)& header = info->dlpi_phdr[i];
+            if (header.p_type != PT_LOAD) {
+              continue;
+            }
+            uintptr_t begin = info->dlpi_addr + header.p_vaddr;
+            object.begin = std::min(object.begin, begin);
+            object.end = std::max<uintptr_t>(object.end,
+                                             begin + header.p_memsz);
+          }
+          if (self >= object.begin && self < object.end) {
+            *range = object;
+            return 1;
+          }
+          return 0;
+        },
+        &range);
+    return range;
+  }
+
+  // FNV-1a over the return addresses
+  static uint64_t Hash(const uint64_t* stack, uint32_t depth) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < depth; ++i) {
+      hash = (hash ^ stack[i]) * 0x100000001b3ull;
+    }
+    return hash ^ depth;
+  }
+
+  // Stack may already be known from another thread
+  uint32_t AddStack(uint64_t hash, const uint64_t* stack, uint32_t depth) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    auto it = ids_.find(hash);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+
+    uint32_t id = static_cast<uint32_t>(ids_.size()) + 1;
+    ids_.emplace(hash, id);
+
+    TraceStackRecord record{id, depth};
+    buffer_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    buffer_.append(reinterpret_cast<const char*>(stack),
+                   depth * sizeof(uint64_t));
+    if (buffer_.size() >= CALL_STACK_FLUSH_SIZE) {
+      Flush();
+    }
+    return id;
+  }
+
+  // Should be called under the lock
+  void Flush() {
+    if (!buffer_.empty() && !closed_) {
+      writer_->WriteStacks(buffer_);
+      buffer_.clear();
+    }
+  }
+
+  TraceWriter* writer_ = nullptr;
+  const uint64_t generation_ = 0;
+  AddressRange tool_range_;
+  std::unordered_map<uint64_t, uint32_t> ids_;
+  std::string buffer_;
+  bool closed_ = false;
+  std::mutex lock_;
+};
+
+#endif  // PHPROF_CALL_STACK_TABLE_H_
@@ -0,0 +1,99 @@
+#ifndef PHPROF_MODULE_SNAPSHOT_H_
+#define PHPROF_MODULE_SNAPSHOT_H_
+
+#include <limits.h>
+#include <link.h>
+#include <stdlib.h>
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "trace_format.h"
+#include "utils.h"
+#include "utils_elf.h"
+
+// Captures executable mappings of the process from /proc/self/maps together
+// with module build IDs, so addresses recorded in the trace are symbolized
+// after the run against the very same binaries. Build IDs come from the
+// notes of the loaded images, no module file is opened in the process
+class ModuleSnapshot {
+ public:
+  // Returns packed module records for WriteModules()
+  static std::string Capture() {
+    std::map<std::string, std::string> build_ids = GetBuildIds();
+
+    std::ifstream maps("/proc/self/maps");
+    std::string data, line;
+    while (std::getline(maps, line)) {
+      unsigned long long begin = 0, end = 0, offset = 0;
+      char permissions[8] = {0};
+      int path_position = 0;
+      if (sscanf(line.c_str(), "%llx-%llx %7s %llx %*s %*s %n", &begin, &end,
+                 permissions, &offset, &path_position) < 4 ||
+          permissions[2] != 'x' || path_position == 0 ||
+          line[path_position] != '/') {
+        continue;  // Only file backed code is symbolized
+      }
+
+      std::string path = line.substr(path_position);
+      std::string build_id;
+      auto it = build_ids.find(path);
+      if (it != build_ids.end()) {
+        build_id = it->second;
+      }
+
+      TraceModuleRecord record{begin, end, offset,
+                               static_cast<uint32_t>(path.size()),
+                               static_cast<uint32_t>(build_id.size())};
+      data.append(reinterpret_cast<const char*>(&record), sizeof(record));
+      data.append(path);
+      data.append(build_id);
+    }
+    return data;
+  }
+
+ private:
+  // Build IDs of the loaded images by canonical path, as /proc/self/maps
+  // shows them
+  static std::map<std::string, std::string> GetBuildIds() {
+    std::map<std::string, std::string> build_ids;
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, size_t, void* data) -> int {
+          std::map<std::string, std::string>* build_ids =
+              reinterpret_cast<std::map<std::string, std::string>*>(data);
+
+          std::string name = (info->dlpi_name != nullptr)
+                                 ? info->dlpi_name
+                                 : std::string();
+          if (name.empty()) {
+            name = "/proc/self/exe";  // Main executable
+          }
+          char path[PATH_MAX] = {0};
+          if (realpath(name.c_str(), path) == nullptr) {
+            return 0;
+          }
+
+          for (int i = 0; i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr)& header = info->dlpi_phdr[i];
+            if (header.p_type != PT_NOTE) {
+              continue;
+            }
+            std::string build_id = utils::elf::GetBuildId(
+                reinterpret_cast<const char*>(info->dlpi_addr +
+                                              header.p_vaddr),
+                header.p_memsz);
+            if (!build_id.empty()) {
+              (*build_ids)[path] = build_id;
+              break;
+            }
+          }
+          return 0;
+        },
+        &build_ids);
+    return build_ids;
+  }
+};
+
+#endif  // PHPROF_MODULE_SNAPSHOT_H_
@@ -1,82 +1,521 @@
+#include <dlfcn.h>
+#include <glob.h>
+#include <signal.h>
+#include <string.h>
+
 #include <iostream>
 
-#include "cl_api_collector.h"
+#include "call_stack_table.h"
+#include "cl_collector_registry.h"
+#include "cl_device_timer.h"
+#include "cl_memory_tracker.h"
+#include "cl_trace_diff.h"
+#include "cl_usm_interceptor.h"
+#include "itt_collector.h"
+#include "perf_sampler.h"
+#include "trace_writer.h"
 #include "utils_cl.h"
-#include "chrome_tracing_generator.h"
 using namespace std;
 
-static ClApiCollector* cpu_collector = nullptr;
-static ClApiCollector* gpu_collector = nullptr;
+static ClCollectorRegistry* registry = nullptr;
+static PerfSampler* sampler = nullptr;
+static CallStackTable* stack_table = nullptr;
+static ClMemoryTracker* memory_tracker = nullptr;
+static ClDeviceTimer* device_timer = nullptr;
 static std::chrono::steady_clock::time_point start;
+static std::string trace_directory;  // Working one if empty
+
+// Termination requests (SIGINT, SIGTERM) are often handled by applications
+// to shut down gracefully and are not treated as crashes
+static const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+                                    SIGABRT};
+static struct sigaction previous_actions[NSIG];
 
 // External Tool Interface
 
 extern "C" PHPROF_EXPORT void ShowHelp() {
-  std::cout << "Usage: ./phoenixprof <target application> <args>" << std::endl;
+  std::cout << "Usage: ./phoenixprof [options] <target application> <args>"
+            << std::endl;
+  std::cout << "       ./phoenixprof --attach <pid> [options]" << std::endl;
+  std::cout << "       ./phoenixprof --detach <pid>" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "--compensate-overhead    "
+            << "Subtract calibrated tool overhead from call durations"
+            << std::endl;
+  std::cout << "--itt                    "
+            << "Record ITT tasks of the application as nested slices"
+            << std::endl;
+  std::cout << "--sampling               "
+            << "Sample host CPU call stacks of threads issuing OpenCL calls"
+            << std::endl;
+  std::cout << "--call-stacks            "
+            << "Capture the application call stack of every OpenCL call"
+            << std::endl;
+  std::cout << "--memory-usage           "
+            << "Track device memory allocations and their peak usage"
+            << std::endl;
+  std::cout << "--device-timing          "
+            << "Record device execution of commands enqueued with an event "
+            << "on the host time base" << std::endl;
+  std::cout << "--collapse-calls <ns>    "
+            << "Merge repeated calls shorter than the time (up to 65535) "
+            << "into one record" << std::endl;
+  std::cout << "--collector              "
+            << "Write traces from the loader process while the application "
+            << "runs" << std::endl;
+  std::cout << "--rotate-size <MB>       "
+            << "Start a new trace segment once the current one reaches "
+            << "the size" << std::endl;
+  std::cout << "--rotate-time <sec>      "
+            << "Start a new trace segment once the current one covers "
+            << "the time" << std::endl;
+  std::cout << "--max-segments <count>   "
+            << "Keep only the given number of newest trace segments"
+            << std::endl;
+  std::cout << "--repeat <count>         "
+            << "Run the application the given number of times and report "
+            << "the spread (must come first)" << std::endl;
+  std::cout << "--warmup <count>         "
+            << "Run the application the given number of times before "
+            << "--repeat runs, not reported" << std::endl;
+  std::cout << "--attach <pid>           "
+            << "Start tracing in a running process instead of launching "
+            << "one (must come first)" << std::endl;
+  std::cout << "--detach <pid>           "
+            << "Stop tracing in a process attached to and save its traces"
+            << std::endl;
+}
+
+// The tool library itself is the ITT collector for the application
+static void SetIttCollectorEnv() {
+  if (!utils::GetEnv("INTEL_LIBITTNOTIFY64").empty()) {
+    std::cerr << "[WARNING] INTEL_LIBITTNOTIFY64 is already set, "
+              << "ITT tasks will not be recorded" << std::endl;
+    return;
+  }
+
+  Dl_info info{};
+  if (dladdr(reinterpret_cast<void*>(SetIttCollectorEnv), &info) == 0 ||
+      info.dli_fname == nullptr) {
+    std::cerr << "[WARNING] Unable to locate tool library, "
+              << "ITT tasks will not be recorded" << std::endl;
+    return;
+  }
+  utils::SetEnv("INTEL_LIBITTNOTIFY64", info.dli_fname);
+}
+
+// Stores a positive integer option value, returns false if there is none
+static bool SetNumericEnv(const char* name, const char* value) {
+  if (value == nullptr) {
+    return false;
+  }
+  char* end = nullptr;
+  unsigned long long number = strtoull(value, &end, 10);
+  if (end == value || *end != '\0' || number == 0) {
+    return false;
+  }
+  utils::SetEnv(name, std::to_string(number).c_str());
+  return true;
 }
 
-extern "C" PHPROF_EXPORT int ProcessArgs(int argc, char* argv[]) { return 1; }
+extern "C" PHPROF_EXPORT int ProcessArgs(int argc, char* argv[]) {
+  int app_index = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--compensate-overhead") == 0) {
+      utils::SetEnv("PHPROF_CompensateOverhead", "1");
+      ++app_index;
+    } else if (strcmp(argv[i], "--itt") == 0) {
+      utils::SetEnv("PHPROF_Itt", "1");
+      SetIttCollectorEnv();
+      ++app_index;
+    } else if (strcmp(argv[i], "--sampling") == 0) {
+      utils::SetEnv("PHPROF_Sampling", "1");
+      ++app_index;
+    } else if (strcmp(argv[i], "--call-stacks") == 0) {
+      utils::SetEnv("PHPROF_CallStacks", "1");
+      ++app_index;
+    } else if (strcmp(argv[i], "--memory-usage") == 0) {
+      utils::SetEnv("PHPROF_MemoryUsage", "1");
+      ++app_index;
+    } else if (strcmp(argv[i], "--device-timing") == 0) {
+      utils::SetEnv("PHPROF_DeviceTiming", "1");
+      ++app_index;
+    } else if (strcmp(argv[i], "--collector") == 0) {
+      utils::SetEnv("PHPROF_Collector", "1");
+      ++app_index;
+    } else if (strcmp(argv[i], "--collapse-calls") == 0) {
+      if (!SetNumericEnv("PHPROF_CollapseCalls", argv[++i])) {
+        return -1;
+      }
+      app_index += 2;
+    } else if (strcmp(argv[i], "--rotate-size") == 0) {
+      if (!SetNumericEnv("PHPROF_RotateSize", argv[++i])) {
+        return -1;
+      }
+      app_index += 2;
+    } else if (strcmp(argv[i], "--rotate-time") == 0) {
+      if (!SetNumericEnv("PHPROF_RotateTime", argv[++i])) {
+        return -1;
+      }
+      app_index += 2;
+    } else if (strcmp(argv[i], "--max-segments") == 0) {
+      if (!SetNumericEnv("PHPROF_MaxSegments", argv[++i])) {
+        return -1;
+      }
+      app_index += 2;
+    } else if (argv[i][0] == '-') {
+      return -1;
+    } else {
+      break;
+    }
+  }
+  return app_index;
+}
 
 extern "C" PHPROF_EXPORT void PrepareEnv() {}
 
+// Overhead Reporting
+
+static void PrintOverheadSummary(uint64_t wall_time) {
+  std::cout << "== PhoenixProf Overhead ==" << std::endl;
+
+  uint64_t event_count = 0, callback_time = 0;
+  uint64_t collapsed_count = 0, collapsed_call_count = 0;
+  for (const ClTrack& track : registry->GetTracks()) {
+    ClApiCollector* collector = track.collector;
+    const ClCallbackOverhead& overhead = collector->GetOverhead();
+    uint64_t count = collector->GetEventCount();
+    event_count += count;
+    collapsed_count += collector->GetCollapsedCount();
+    collapsed_call_count += collector->GetCollapsedCallCount();
+    // Every collapsed call went through the callbacks as well
+    callback_time += (count + collector->GetCollapsedCallCount() -
+                      collector->GetCollapsedCount()) *
+                     overhead.event_cost;
+    std::cout << track.name << " callback cost: " << overhead.event_cost
+              << " ns per event, " << overhead.duration_bias
+              << " ns per duration"
+              << (collector->IsOverheadCompensated() ? " (compensated)" : "")
+              << std::endl;
+  }
+
+  double percent =
+      (wall_time > 0) ? 100.0 * callback_time / wall_time : 0.0;
+  std::cout << "Events recorded: " << event_count << std::endl;
+  if (collapsed_count > 0) {
+    std::cout << "Collapsed calls: " << collapsed_call_count << " into "
+              << collapsed_count << " records" << std::endl;
+  }
+  std::cout << "Total callback time: " << callback_time << " ns ("
+            << std::fixed << std::setprecision(2) << percent
+            << "% of wall time " << wall_time << " ns)" << std::endl;
+}
+
+// Crash Handling
+
+// Passes the signal on to the handler that was installed before with the
+// original signal information, so the application behaves as without the
+// tool. Traces are marked as crashed only if the signal is about to
+// terminate the process: its disposition is the default one, either from
+// the start or set by the application handler to re-raise the signal
+static void FatalSignalHandler(int signal, siginfo_t* info, void* context) {
+  const struct sigaction& previous = previous_actions[signal];
+  if (previous.sa_handler == SIG_DFL) {
+    TraceWriter::MarkCrashed(signal);
+    sigaction(signal, &previous, nullptr);
+    raise(signal);  // Delivered as the handler returns
+    return;
+  }
+
+  if (previous.sa_flags & SA_RESETHAND) {
+    struct sigaction reset{};
+    reset.sa_handler = SIG_DFL;
+    sigemptyset(&reset.sa_mask);
+    sigaction(signal, &reset, nullptr);
+  }
+
+  sigset_t mask;
+  pthread_sigmask(SIG_BLOCK, &previous.sa_mask, &mask);
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(signal, info, context);
+  } else {
+    previous.sa_handler(signal);
+  }
+  pthread_sigmask(SIG_SETMASK, &mask, nullptr);
+
+  struct sigaction current{};
+  if (sigaction(signal, nullptr, &current) == 0 &&
+      !(current.sa_flags & SA_SIGINFO) && current.sa_handler == SIG_DFL) {
+    TraceWriter::MarkCrashed(signal);
+  }
+}
+
+// Handlers of the application are put back once tracing stops, unless it
+// has replaced the tool handler since
+static void RestoreSignalHandlers() {
+  for (int signal : fatal_signals) {
+    struct sigaction current{};
+    if (sigaction(signal, nullptr, &current) == 0 &&
+        (current.sa_flags & SA_SIGINFO) &&
+        current.sa_sigaction == FatalSignalHandler) {
+      sigaction(signal, &previous_actions[signal], nullptr);
+    }
+  }
+}
+
+static void InstallSignalHandlers() {
+  for (int signal : fatal_signals) {
+    // Signals ignored by the application are not fatal
+    if (sigaction(signal, nullptr, &previous_actions[signal]) != 0 ||
+        previous_actions[signal].sa_handler == SIG_IGN) {
+      continue;
+    }
+    // Runs on the alternate stack if there is one, so stack overflows are
+    // handled too; the signal stays blocked while the handler runs
+    struct sigaction action{};
+    action.sa_sigaction = FatalSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK |
+                      (previous_actions[signal].sa_flags & SA_RESTART);
+    if (sigaction(signal, &action, nullptr) != 0) {
+      std::cerr << "[WARNING] Unable to install handler for signal "
+                << signal << std::endl;
+    }
+  }
+}
+
+// CPU Sampling
+
+static void AttachSamplerThread() {
+  if (sampler != nullptr) {
+    sampler->AttachCurrentThread();
+  }
+}
+
+static void StartSampling() {
+  std::string filename = utils::JoinPath(trace_directory, "samples.bin");
+  TraceWriter* writer = TraceWriter::Create(filename);
+  if (writer == nullptr) {
+    std::cerr << "[WARNING] Unable to create trace file " << filename
+              << std::endl;
+    return;
+  }
+  sampler = PerfSampler::Create(writer);
+  registry->SetThreadCallback(AttachSamplerThread);
+}
+
+// Call Site Capture
+
+static void CreateStackTable() {
+  std::string filename = utils::JoinPath(trace_directory, "stacks.bin");
+  TraceWriter* writer = TraceWriter::Create(filename);
+  if (writer == nullptr) {
+    std::cerr << "[WARNING] Unable to create trace file " << filename
+              << std::endl;
+    return;
+  }
+  stack_table = CallStackTable::Create(writer);
+}
+
+// Memory Tracking
+
+static void StartMemoryTracking() {
+  std::string filename = utils::JoinPath(trace_directory, "memory.bin");
+  TraceWriter* writer = TraceWriter::Create(filename);
+  if (writer == nullptr) {
+    std::cerr << "[WARNING] Unable to create trace file " << filename
+              << std::endl;
+    return;
+  }
+  memory_tracker = ClMemoryTracker::Create(writer, stack_table);
+  registry->SetMemoryTracker(memory_tracker);
+  ClUsmInterceptor::GetInstance()->SetSink(memory_tracker);
+}
+
+// Device Timing
+
+static void StartDeviceTiming() {
+  std::map<cl_device_id, ClApiCollector*> devices =
+      registry->GetDeviceCollectors();
+  if (devices.empty()) {
+    std::cerr << "[WARNING] No device tracks for device timing" << std::endl;
+    return;
+  }
+  device_timer = ClDeviceTimer::Create(devices);
+  registry->SetDeviceTimer(device_timer);
+}
+
+// Trace Rotation
+
+static TraceRotation GetRotation() {
+  TraceRotation rotation;
+  std::string value = utils::GetEnv("PHPROF_RotateSize");
+  if (!value.empty()) {
+    rotation.max_size = std::stoull(value) * 1024 * 1024;
+  }
+  value = utils::GetEnv("PHPROF_RotateTime");
+  if (!value.empty()) {
+    rotation.max_duration = std::stoull(value) * 1000000000ull;
+  }
+  value = utils::GetEnv("PHPROF_MaxSegments");
+  if (!value.empty()) {
+    rotation.max_segments = std::stoul(value);
+  }
+  return rotation;
+}
+
 // Internal Tool Interface
 
-void StartProfiling() {
+bool StartProfiling() {
   // std::cout << "StartProfiling called!\n";
-  cl_device_id cpu_device = utils::cl::GetIntelDevice(CL_DEVICE_TYPE_CPU);
-  cl_device_id gpu_device = utils::cl::GetIntelDevice(CL_DEVICE_TYPE_GPU);
-  if (cpu_device == nullptr && gpu_device == nullptr) {
+  std::vector<cl_device_id> devices =
+      utils::cl::GetDeviceList(CL_DEVICE_TYPE_ALL);
+  if (devices.empty()) {
     std::cerr << "[WARNING] Unable to find device for tracing" << std::endl;
-    return;
+    return false;
   }
 
-  if (gpu_device == nullptr) {
-    std::cerr << "[WARNING] Unable to find GPU device for tracing" << std::endl;
+  // Every attach to a running process gets its own directory
+  trace_directory = utils::GetEnv("PHPROF_TraceDirectory");
+  bool compensate_overhead =
+      (utils::GetEnv("PHPROF_CompensateOverhead") == "1");
+  if (utils::GetEnv("PHPROF_CallStacks") == "1") {
+    CreateStackTable();
   }
-  if (cpu_device == nullptr) {
-    std::cerr << "[WARNING] Unable to find CPU device for tracing" << std::endl;
+  TraceRotation rotation = GetRotation();
+  if (rotation.max_segments > 0 && !rotation.IsEnabled()) {
+    std::cerr << "[WARNING] --max-segments has no effect without "
+              << "--rotate-size or --rotate-time" << std::endl;
   }
-
-  if (cpu_device != nullptr) {
-    cpu_collector = ClApiCollector::Create(cpu_device);
+  uint64_t collapse_threshold = 0;
+  std::string collapse = utils::GetEnv("PHPROF_CollapseCalls");
+  if (!collapse.empty()) {
+    collapse_threshold = std::stoull(collapse);
+    if (collapse_threshold > TRACE_COLLAPSE_MAX_DURATION) {
+      std::cerr << "[WARNING] --collapse-calls is limited to "
+                << TRACE_COLLAPSE_MAX_DURATION << " ns" << std::endl;
+    }
+  }
+  registry = ClCollectorRegistry::Create(devices, compensate_overhead,
+                                         stack_table, rotation,
+                                         collapse_threshold, trace_directory);
+  if (registry == nullptr) {
+    std::cerr << "[WARNING] Unable to enable tracing" << std::endl;
+    if (stack_table != nullptr) {
+      delete stack_table;
+      stack_table = nullptr;
+    }
+    return false;
+  }
+  if (utils::GetEnv("PHPROF_Itt") == "1") {
+    IttCollector::GetInstance()->SetSink(registry->GetHostCollector());
   }
-  if (gpu_device != nullptr) {
-    gpu_collector = ClApiCollector::Create(gpu_device);
+  if (utils::GetEnv("PHPROF_Sampling") == "1") {
+    StartSampling();
   }
+  if (utils::GetEnv("PHPROF_MemoryUsage") == "1") {
+    StartMemoryTracking();
+  }
+  if (utils::GetEnv("PHPROF_DeviceTiming") == "1") {
+    StartDeviceTiming();
+  }
+  InstallSignalHandlers();
 
   start = std::chrono::steady_clock::now();
+  return true;
+}
+
+// Latency summary of the finished traces for the loader, which compares
+// repeated runs of the application
+static void SaveRunSummary(const std::string& filename) {
+  ClLatencyProfile profile;
+  for (const ClTrack& track : registry->GetTracks()) {
+    glob_t paths{};
+    if (glob(track.filename.c_str(), 0, nullptr, &paths) == 0) {
+      for (size_t i = 0; i < paths.gl_pathc; ++i) {
+        ClTraceDiff::Load(paths.gl_pathv[i], profile);
+      }
+    }
+    globfree(&paths);
+  }
+  if (!ClTraceDiff::SaveSummary(filename, profile)) {
+    std::cerr << "[WARNING] Unable to write run summary: " << filename
+              << std::endl;
+  }
 }
 
 void StopProfiling() {
-  if (cpu_collector != nullptr) {
-    cpu_collector->DisableTracing();
+  std::chrono::duration<uint64_t, std::nano> wall_time =
+      std::chrono::steady_clock::now() - start;
+
+  if (registry == nullptr) {
+    return;
+  }
+
+  // Only partially filled chunks are left to write at this point, the rest
+  // of the trace has been written while the application was running
+  IttCollector::GetInstance()->SetSink(nullptr);
+  ClUsmInterceptor::GetInstance()->SetSink(nullptr);
+  registry->DisableTracing();
+  RestoreSignalHandlers();
+  if (device_timer != nullptr) {
+    device_timer->Stop();
+    std::cout << "Device timing saved to device traces ("
+              << device_timer->GetCommandCount() << " commands, "
+              << device_timer->GetSampleCount() << " clock samples)"
+              << std::endl;
   }
-  if (gpu_collector != nullptr) {
-    gpu_collector->DisableTracing();
+  registry->Finalize();
+  for (const ClTrack& track : registry->GetTracks()) {
+    std::cout << "Trace saved to: " << track.filename << std::endl;
   }
 
-  auto cpu_function_calls = cpu_collector->GetFunctionCalls();
-  auto gpu_function_calls = gpu_collector->GetFunctionCalls();
+  std::string run_summary = utils::GetEnv("PHPROF_RunSummary");
+  if (!run_summary.empty()) {
+    SaveRunSummary(run_summary);
+  }
+
+  if (stack_table != nullptr) {
+    stack_table->Finalize();
+    std::cout << "Call stacks saved to: "
+              << utils::JoinPath(trace_directory, "stacks.bin") << " ("
+              << stack_table->GetStackCount() << " stacks)" << std::endl;
+  }
 
-  std::cout << "!!! CPU Function Calls:" << std::endl;
-  for (auto elem : cpu_function_calls) {
-    std::cout << elem.function_name << " " << elem.start_time << " "
-              << elem.end_time << endl;
+  if (memory_tracker != nullptr) {
+    memory_tracker->Finalize();
+    std::cout << "Memory usage saved to: "
+              << utils::JoinPath(trace_directory, "memory.bin") << " (peak "
+              << memory_tracker->GetPeakUsage() << " bytes, "
+              << memory_tracker->GetLiveCount() << " allocations not released)"
+              << std::endl;
   }
 
-  std::cout << "!!! GPU Function Calls:" << std::endl;
-  for (auto elem : gpu_function_calls) {
-    std::cout << elem.function_name << " " << elem.start_time << " "
-              << elem.end_time << endl;
+  if (sampler != nullptr) {
+    sampler->Stop();
+    std::cout << "Samples saved to: "
+              << utils::JoinPath(trace_directory, "samples.bin") << " ("
+              << sampler->GetSampleCount() << " samples)" << std::endl;
   }
 
-  ChromeTracingGenerator::ExportToFile(cpu_function_calls, "cpu_trace.json");
-  ChromeTracingGenerator::ExportToFile(gpu_function_calls, "gpu_trace.json");
+  PrintOverheadSummary(wall_time.count());
 
-  if (cpu_collector != nullptr) {
-    delete cpu_collector;
+  delete registry;
+  registry = nullptr;
+  if (device_timer != nullptr) {
+    delete device_timer;
+    device_timer = nullptr;
+  }
+  if (memory_tracker != nullptr) {
+    delete memory_tracker;
+    memory_tracker = nullptr;
+  }
+  if (stack_table != nullptr) {
+    delete stack_table;
+    stack_table = nullptr;
   }
-  if (gpu_collector != nullptr) {
-    delete gpu_collector;
+  if (sampler != nullptr) {
+    delete sampler;
+    sampler = nullptr;
   }
 }
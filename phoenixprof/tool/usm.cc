@@ -0,0 +1,19 @@
+#include <dlfcn.h>
+
+#include <CL/cl.h>
+
+#include "cl_usm_interceptor.h"
+
+// Extension function lookup of the application, USM functions are replaced
+// with wrappers that report allocations to the memory tracker
+extern "C" PHPROF_EXPORT void* CL_API_CALL
+clGetExtensionFunctionAddressForPlatform(cl_platform_id platform,
+                                         const char* func_name) {
+  static decltype(clGetExtensionFunctionAddressForPlatform)* get_address =
+      reinterpret_cast<decltype(clGetExtensionFunctionAddressForPlatform)*>(
+          dlsym(RTLD_NEXT, "clGetExtensionFunctionAddressForPlatform"));
+  ASSERT(get_address != nullptr);
+
+  void* address = get_address(platform, func_name);
+  return ClUsmInterceptor::GetInstance()->Intercept(func_name, address);
+}